@@ -0,0 +1,246 @@
+/*
+ * eBPF socket filter benchmark
+ *
+ * This runs the different variants of the eBPF socket filter through
+ * BPF_PROG_TEST_RUN on a set of representative packets, and prints the
+ * average runtime per packet as measured by the kernel. Furthermore, the
+ * different address lookup strategies are compared for several sizes of the
+ * address set.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/bpf.h>
+#include <net/ethernet.h>
+#include <netinet/if_ether.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+#define BENCH_BPF_REPEAT (UINT32_C(1000000))
+
+typedef struct BenchBpfFrame {
+        struct ether_header eth;
+        struct ether_arp arp;
+} _c_packed_ BenchBpfFrame;
+
+static int bench_bpf_run(int progfd, BenchBpfFrame *frame, uint32_t *retvalp, uint32_t *durationp) {
+        union bpf_attr attr;
+        int r;
+
+        /*
+         * BPF_PROG_TEST_RUN expects a full ethernet frame for socket filters,
+         * and strips the link-layer header before running the program, just
+         * like the packet socket does.
+         */
+        memset(&attr, 0, sizeof(attr));
+        attr.test.prog_fd = progfd;
+        attr.test.data_in = (uint64_t)(unsigned long)frame;
+        attr.test.data_size_in = sizeof(*frame);
+        attr.test.repeat = BENCH_BPF_REPEAT;
+
+        r = (int)syscall(__NR_bpf, BPF_PROG_TEST_RUN, &attr, sizeof(attr));
+        if (r < 0)
+                return -errno;
+
+        *retvalp = attr.test.retval;
+        *durationp = attr.test.duration;
+        return 0;
+}
+
+static void bench_bpf_frame(BenchBpfFrame *frame,
+                            uint16_t op,
+                            const struct ether_addr *sha,
+                            const struct in_addr *spa,
+                            const struct in_addr *tpa) {
+        *frame = (BenchBpfFrame){
+                .eth = {
+                        .ether_dhost = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+                        .ether_type = htobe16(ETHERTYPE_ARP),
+                },
+                .arp = {
+                        .ea_hdr = {
+                                .ar_hrd = htobe16(ARPHRD_ETHER),
+                                .ar_pro = htobe16(ETHERTYPE_IP),
+                                .ar_hln = ETH_ALEN,
+                                .ar_pln = sizeof(struct in_addr),
+                                .ar_op = htobe16(op),
+                        },
+                },
+        };
+
+        memcpy(frame->eth.ether_shost, sha->ether_addr_octet, ETH_ALEN);
+        memcpy(frame->arp.arp_sha, sha->ether_addr_octet, ETH_ALEN);
+        memcpy(frame->arp.arp_spa, &spa->s_addr, sizeof(spa->s_addr));
+        memcpy(frame->arp.arp_tpa, &tpa->s_addr, sizeof(tpa->s_addr));
+}
+
+static void bench_bpf(void) {
+        struct ether_addr mac_own = { { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 } };
+        struct ether_addr mac_peer = { { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 } };
+        struct in_addr ip_any = { INADDR_ANY };
+        struct in_addr ip_watched = { htobe32((10 << 24) | 1) };
+        struct in_addr ip_other = { htobe32((10 << 24) | 2) };
+        struct {
+                const char *name;
+                uint16_t op;
+                const struct ether_addr *sha;
+                const struct in_addr *spa;
+                const struct in_addr *tpa;
+                bool corrupt;
+        } cases[] = {
+                { "conflict",           ARPOP_REPLY,    &mac_peer,      &ip_watched,    &ip_other },
+                { "probe",              ARPOP_REQUEST,  &mac_peer,      &ip_any,        &ip_watched },
+                { "unwatched address",  ARPOP_REQUEST,  &mac_peer,      &ip_other,      &ip_watched },
+                { "own mac",            ARPOP_REQUEST,  &mac_own,       &ip_watched,    &ip_other },
+                { "bad header",         ARPOP_REQUEST,  &mac_peer,      &ip_watched,    &ip_other,      true },
+        };
+        int r, mapfd, progfd[2];
+        BenchBpfFrame frame;
+
+        r = n_acd_bpf_map_create(&mapfd, 8);
+        c_assert(!r);
+
+        r = n_acd_bpf_map_add(mapfd, &ip_watched);
+        c_assert(!r);
+
+        r = n_acd_bpf_compile_legacy(&progfd[0], mapfd, &mac_own);
+        c_assert(!r);
+
+        r = n_acd_bpf_compile(&progfd[1], mapfd, -1, NULL, 0, &mac_own, 0);
+        c_assert(!r);
+
+        printf("%-20s %16s %16s\n", "packet", "legacy [ns/pkt]", "direct [ns/pkt]");
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(cases); ++i) {
+                uint32_t retval[2], duration[2];
+
+                bench_bpf_frame(&frame, cases[i].op, cases[i].sha, cases[i].spa, cases[i].tpa);
+                if (cases[i].corrupt)
+                        frame.arp.arp_pln = 0;
+
+                for (size_t j = 0; j < 2; ++j) {
+                        r = bench_bpf_run(progfd[j], &frame, &retval[j], &duration[j]);
+                        if (r) {
+                                /* older kernels cannot test-run socket filters */
+                                fprintf(stderr, "BPF_PROG_TEST_RUN failed, skipping: %s\n", strerror(-r));
+                                goto exit;
+                        }
+                }
+
+                c_assert(retval[0] == retval[1]);
+
+                printf("%-20s %16" PRIu32 " %16" PRIu32 "\n", cases[i].name, duration[0], duration[1]);
+        }
+
+exit:
+        close(progfd[1]);
+        close(progfd[0]);
+        close(mapfd);
+}
+
+static void bench_bpf_sets(void) {
+        struct ether_addr mac_own = { { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 } };
+        struct ether_addr mac_peer = { { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 } };
+        struct in_addr ip_other = { htobe32((192 << 24) | (168 << 16) | 1) };
+        struct in_addr addrs[N_ACD_BPF_INLINE_MAX];
+        size_t sizes[] = { 1, 4, 8, 64, 1024, 16384, 131072 };
+        BenchBpfFrame frame_hit, frame_miss;
+        int r;
+
+        /*
+         * Measure the address lookup for different sizes of the address set,
+         * both for a packet that hits the set and one that misses it. Tiny
+         * sets can be compiled inline, large sets can use a bloom filter.
+         */
+        printf("\n%-10s %-8s %16s %16s\n", "set size", "lookup", "hit [ns/pkt]", "miss [ns/pkt]");
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(sizes); ++i) {
+                int mapfd, bloomfd = -1, progfd[3] = { -1, -1, -1 };
+                const char *names[] = { "inline", "hash", "bloom" };
+                struct in_addr ip;
+
+                r = n_acd_bpf_map_create(&mapfd, sizes[i]);
+                c_assert(!r);
+
+                r = n_acd_bpf_bloom_create(&bloomfd, sizes[i]);
+                c_assert(!r || r == -EINVAL);
+
+                for (size_t j = 0; j < sizes[i]; ++j) {
+                        ip.s_addr = htobe32((10 << 24) | j);
+
+                        r = n_acd_bpf_map_add(mapfd, &ip);
+                        c_assert(!r);
+
+                        if (bloomfd >= 0) {
+                                r = n_acd_bpf_bloom_add(bloomfd, &ip);
+                                c_assert(!r);
+                        }
+
+                        if (j < N_ACD_BPF_INLINE_MAX)
+                                addrs[j] = ip;
+                }
+
+                /* the last address is the worst-case for inline compares */
+                bench_bpf_frame(&frame_hit, ARPOP_REPLY, &mac_peer, &ip, &ip_other);
+                bench_bpf_frame(&frame_miss, ARPOP_REPLY, &mac_peer, &ip_other, &ip);
+
+                if (sizes[i] <= N_ACD_BPF_INLINE_MAX) {
+                        r = n_acd_bpf_compile(&progfd[0], mapfd, -1, addrs, sizes[i], &mac_own, 0);
+                        c_assert(!r);
+                }
+
+                r = n_acd_bpf_compile(&progfd[1], mapfd, -1, NULL, 0, &mac_own, 0);
+                c_assert(!r);
+
+                if (bloomfd >= 0) {
+                        r = n_acd_bpf_compile(&progfd[2], mapfd, bloomfd, NULL, 0, &mac_own, 0);
+                        c_assert(!r);
+                }
+
+                for (size_t j = 0; j < C_ARRAY_SIZE(progfd); ++j) {
+                        uint32_t retval_hit, retval_miss, duration_hit, duration_miss;
+
+                        if (progfd[j] < 0)
+                                continue;
+
+                        r = bench_bpf_run(progfd[j], &frame_hit, &retval_hit, &duration_hit);
+                        if (!r)
+                                r = bench_bpf_run(progfd[j], &frame_miss, &retval_miss, &duration_miss);
+                        if (r) {
+                                fprintf(stderr, "BPF_PROG_TEST_RUN failed, skipping: %s\n", strerror(-r));
+                                break;
+                        }
+
+                        c_assert(retval_hit == sizeof(struct ether_arp));
+                        c_assert(retval_miss == 0);
+
+                        printf("%-10zu %-8s %16" PRIu32 " %16" PRIu32 "\n",
+                               sizes[i], names[j], duration_hit, duration_miss);
+                }
+
+                for (size_t j = 0; j < C_ARRAY_SIZE(progfd); ++j)
+                        if (progfd[j] >= 0)
+                                close(progfd[j]);
+                if (bloomfd >= 0)
+                        close(bloomfd);
+                close(mapfd);
+        }
+}
+
+int main(int argc, char **argv) {
+        test_setup();
+
+        bench_bpf();
+        bench_bpf_sets();
+
+        return 0;
+}
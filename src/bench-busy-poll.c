@@ -0,0 +1,138 @@
+/*
+ * Low-latency mode benchmark
+ *
+ * This runs an ACD context on one end of a veth link, and repeatedly probes
+ * with a timeout of 1ms. It probes for a free address, until it is ready, and
+ * for an address configured on the other end, until the conflict is detected.
+ * The average wall-clock time from starting the probe to the event is
+ * printed, both for a context that sleeps in poll(2) between dispatches, and
+ * for a context in low-latency mode, which busy-polls and spins instead.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "n-acd.h"
+#include "test.h"
+
+#define BENCH_BUSY_POLL_N (100)
+#define BENCH_BUSY_POLL_TIMEOUT (1)
+#define BENCH_BUSY_POLL_USECS (50)
+#define BENCH_BUSY_POLL_SPIN_USECS (1000)
+
+static uint64_t bench_busy_poll_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        c_assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static uint64_t bench_busy_poll_probe(NAcd *acd, struct in_addr ip, bool spin, unsigned int expected) {
+        NAcdProbeConfig *probe_config;
+        NAcdProbe *probe;
+        NAcdEvent *event = NULL;
+        uint64_t ts;
+        int r, fd;
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, BENCH_BUSY_POLL_TIMEOUT);
+
+        n_acd_get_fd(acd, &fd);
+        ts = bench_busy_poll_now();
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        while (!event) {
+                if (spin) {
+                        r = n_acd_dispatch_spin(acd, BENCH_BUSY_POLL_SPIN_USECS);
+                } else {
+                        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+                        r = poll(&pfd, 1, -1);
+                        c_assert(r >= 0);
+
+                        r = n_acd_dispatch(acd);
+                }
+                c_assert(!r || r == N_ACD_E_PREEMPTED);
+
+                r = n_acd_pop_event(acd, &event);
+                c_assert(!r);
+        }
+
+        ts = bench_busy_poll_now() - ts;
+
+        c_assert(event->event == expected);
+
+        n_acd_probe_free(probe);
+        n_acd_probe_config_free(probe_config);
+
+        return ts;
+}
+
+static void bench_busy_poll(const char *name, int ifindex, struct ether_addr *mac, bool low_latency) {
+        struct in_addr ip_free = { htobe32((10 << 24) | (4 << 8) | 1) };
+        struct in_addr ip_used = { htobe32((10 << 24) | (4 << 8) | 2) };
+        uint64_t ts_ready = 0, ts_used = 0;
+        NAcdConfig *config;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+        /* conflicts are part of the benchmark, do not rate-limit them */
+        n_acd_config_set_rate_limit(config, 0);
+        if (low_latency)
+                n_acd_config_set_busy_poll(config, BENCH_BUSY_POLL_USECS);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        for (size_t i = 0; i < BENCH_BUSY_POLL_N; ++i) {
+                ts_ready += bench_busy_poll_probe(acd, ip_free, low_latency, N_ACD_EVENT_READY);
+                ts_used += bench_busy_poll_probe(acd, ip_used, low_latency, N_ACD_EVENT_USED);
+        }
+
+        printf("%-16s %16" PRIu64 " %16" PRIu64 "\n",
+               name,
+               ts_ready / BENCH_BUSY_POLL_N / 1000,
+               ts_used / BENCH_BUSY_POLL_N / 1000);
+
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct in_addr ip_used = { htobe32((10 << 24) | (4 << 8) | 2) };
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+        test_add_child_ip(&ip_used);
+
+        printf("%d probes, %dms timeout\n", BENCH_BUSY_POLL_N, BENCH_BUSY_POLL_TIMEOUT);
+        printf("%-16s %16s %16s\n", "mode", "ready [us]", "used [us]");
+
+        bench_busy_poll("poll", ifindex1, &mac1, false);
+        bench_busy_poll("busy-poll+spin", ifindex1, &mac1, true);
+
+        test_del_child_ip(&ip_used);
+
+        return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Context startup benchmark
+ *
+ * This creates a large number of contexts on the loopback device, as a daemon
+ * managing many interfaces would do on startup, and prints the time it takes
+ * as well as the number of file-descriptors used. This is done for eager
+ * contexts, for eager contexts using a shared filter, and for lazy contexts.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "n-acd.h"
+#include "test.h"
+
+#define BENCH_CONTEXT_N (1000)
+
+static uint64_t bench_context_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        c_assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static size_t bench_context_n_fds(void) {
+        struct dirent *de;
+        size_t n = 0;
+        DIR *dir;
+
+        dir = opendir("/proc/self/fd");
+        c_assert(dir);
+
+        while ((de = readdir(dir)))
+                if (de->d_name[0] != '.')
+                        ++n;
+
+        closedir(dir);
+        return n;
+}
+
+static void bench_context_raise_nofile(void) {
+        struct rlimit rl;
+        int r;
+
+        /* eager contexts use several file-descriptors each */
+        r = getrlimit(RLIMIT_NOFILE, &rl);
+        c_assert(!r);
+
+        rl.rlim_cur = rl.rlim_max;
+        r = setrlimit(RLIMIT_NOFILE, &rl);
+        c_assert(!r);
+}
+
+static void bench_context(const char *name, int ifindex, struct ether_addr *mac, bool lazy, bool shared) {
+        static NAcd *acds[BENCH_CONTEXT_N];
+        NAcdFilter *filter = NULL;
+        NAcdConfig *config;
+        uint64_t ts_start, ts_new, ts_free;
+        size_t n_fds;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+        n_acd_config_set_lazy(config, lazy);
+
+        n_fds = bench_context_n_fds();
+        ts_start = bench_context_now();
+
+        if (shared) {
+                r = n_acd_filter_new(&filter, NULL);
+                c_assert(!r);
+                n_acd_config_set_filter(config, filter);
+        }
+
+        for (size_t i = 0; i < BENCH_CONTEXT_N; ++i) {
+                r = n_acd_new(&acds[i], config);
+                if (r) {
+                        fprintf(stderr, "%s: creating context %zu failed, skipping: %d\n", name, i, r);
+                        while (i > 0)
+                                n_acd_unref(acds[--i]);
+                        goto exit;
+                }
+        }
+
+        ts_new = bench_context_now();
+        n_fds = bench_context_n_fds() - n_fds;
+
+        for (size_t i = 0; i < BENCH_CONTEXT_N; ++i)
+                n_acd_unref(acds[i]);
+
+        ts_free = bench_context_now();
+
+        printf("%-16s %12" PRIu64 " %12" PRIu64 " %8zu\n",
+               name,
+               (ts_new - ts_start) / UINT64_C(1000000),
+               (ts_free - ts_new) / UINT64_C(1000000),
+               n_fds);
+
+exit:
+        n_acd_filter_unref(filter);
+        n_acd_config_free(config);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac;
+        int ifindex;
+
+        test_setup();
+        bench_context_raise_nofile();
+
+        test_loopback_up(&ifindex, &mac);
+
+        printf("%d contexts\n", BENCH_CONTEXT_N);
+        printf("%-16s %12s %12s %8s\n", "mode", "new [ms]", "free [ms]", "fds");
+
+        bench_context("eager", ifindex, &mac, false, false);
+        bench_context("eager, shared", ifindex, &mac, false, true);
+        bench_context("lazy", ifindex, &mac, true, false);
+
+        return 0;
+}
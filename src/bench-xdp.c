@@ -0,0 +1,204 @@
+/*
+ * AF_XDP receive benchmark
+ *
+ * This runs an ACD context on one end of a veth link, and floods it with ARP
+ * probes for its announced address from the other end. Those pass the packet
+ * filter, and are dispatched by the context. The CPU time consumed per packet
+ * is printed, both for the packet socket and for the AF_XDP socket. Note that
+ * the veth link delivers packets in the context of the sender, so this
+ * includes the kernel receive path.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <inttypes.h>
+#include <linux/if_packet.h>
+#include <netinet/if_ether.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+#define BENCH_XDP_N (UINT64_C(100000))
+#define BENCH_XDP_BATCH (16)
+
+typedef struct BenchXdpFrame {
+        struct ether_header eth;
+        struct ether_arp arp;
+} _c_packed_ BenchXdpFrame;
+
+static uint64_t bench_xdp_now(clockid_t clock) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(clock, &ts);
+        c_assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void bench_xdp_drain(NAcd *acd, int timeout) {
+        NAcdEvent *event;
+        struct pollfd pfd;
+        int r;
+
+        n_acd_get_fd(acd, &pfd.fd);
+        pfd.events = POLLIN;
+
+        while (poll(&pfd, 1, timeout) > 0) {
+                do {
+                        r = n_acd_dispatch(acd);
+                        c_assert(!r || r == N_ACD_E_PREEMPTED);
+                } while (r == N_ACD_E_PREEMPTED);
+
+                do {
+                        r = n_acd_pop_event(acd, &event);
+                        c_assert(!r);
+                } while (event);
+        }
+}
+
+static void bench_xdp(const char *name,
+                      int ifindex1,
+                      struct ether_addr *mac1,
+                      int ifindex2,
+                      struct ether_addr *mac2,
+                      bool xdp_socket) {
+        struct in_addr ip = { htobe32((10 << 24) | 1) };
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        NAcdProbe *probe;
+        NAcdEvent *event;
+        BenchXdpFrame frame;
+        uint64_t ts_cpu, ts_wall;
+        int r, fd;
+        NAcd *acd;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex1);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac1->ether_addr_octet, sizeof(mac1->ether_addr_octet));
+        if (xdp_socket) {
+                n_acd_config_set_xdp(config, N_ACD_XDP_GENERIC);
+                n_acd_config_set_xdp_socket(config, true);
+        }
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        if (xdp_socket && acd->xsk.fd < 0) {
+                fprintf(stderr, "%s: not supported, skipping\n", name);
+                n_acd_unref(acd);
+                return;
+        }
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, 0);
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        /* announce the address, so probes for it are ignored */
+        do {
+                struct pollfd pfd = { .events = POLLIN };
+
+                n_acd_get_fd(acd, &pfd.fd);
+                r = poll(&pfd, 1, -1);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+
+                r = n_acd_pop_event(acd, &event);
+                c_assert(!r);
+        } while (!event);
+        c_assert(event->event == N_ACD_EVENT_READY);
+
+        r = n_acd_probe_announce(probe, N_ACD_DEFEND_NEVER);
+        c_assert(!r);
+        bench_xdp_drain(acd, 100);
+
+        fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htobe16(ETH_P_ARP));
+        c_assert(fd >= 0);
+
+        r = bind(fd,
+                 (struct sockaddr *)&(struct sockaddr_ll){
+                        .sll_family = AF_PACKET,
+                        .sll_protocol = htobe16(ETH_P_ARP),
+                        .sll_ifindex = ifindex2,
+                 },
+                 sizeof(struct sockaddr_ll));
+        c_assert(!r);
+
+        frame = (BenchXdpFrame){
+                .eth = {
+                        .ether_dhost = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+                        .ether_type = htobe16(ETHERTYPE_ARP),
+                },
+                .arp = {
+                        .ea_hdr = {
+                                .ar_hrd = htobe16(ARPHRD_ETHER),
+                                .ar_pro = htobe16(ETHERTYPE_IP),
+                                .ar_hln = ETH_ALEN,
+                                .ar_pln = sizeof(struct in_addr),
+                                .ar_op = htobe16(ARPOP_REQUEST),
+                        },
+                },
+        };
+        memcpy(frame.eth.ether_shost, mac2->ether_addr_octet, ETH_ALEN);
+        memcpy(frame.arp.arp_sha, mac2->ether_addr_octet, ETH_ALEN);
+        memcpy(frame.arp.arp_tpa, &ip, sizeof(ip));
+
+        ts_cpu = bench_xdp_now(CLOCK_PROCESS_CPUTIME_ID);
+        ts_wall = bench_xdp_now(CLOCK_MONOTONIC);
+
+        for (uint64_t i = 0; i < BENCH_XDP_N; i += BENCH_XDP_BATCH) {
+                for (size_t j = 0; j < BENCH_XDP_BATCH; ++j) {
+                        r = send(fd, &frame, sizeof(frame), 0);
+                        c_assert(r == (ssize_t)sizeof(frame));
+                }
+
+                bench_xdp_drain(acd, 0);
+        }
+
+        ts_cpu = bench_xdp_now(CLOCK_PROCESS_CPUTIME_ID) - ts_cpu;
+        ts_wall = bench_xdp_now(CLOCK_MONOTONIC) - ts_wall;
+
+        printf("%-16s %16" PRIu64 " %16" PRIu64 "\n",
+               name,
+               ts_cpu / BENCH_XDP_N,
+               ts_wall / BENCH_XDP_N);
+
+        close(fd);
+        n_acd_probe_free(probe);
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        printf("%" PRIu64 " packets\n", BENCH_XDP_N);
+        printf("%-16s %16s %16s\n", "receive path", "cpu [ns/pkt]", "wall [ns/pkt]");
+
+        bench_xdp("packet socket", ifindex1, &mac1, ifindex2, &mac2, false);
+        bench_xdp("AF_XDP", ifindex1, &mac1, ifindex2, &mac2, true);
+
+        return 0;
+}
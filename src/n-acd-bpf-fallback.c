@@ -24,7 +24,141 @@ int n_acd_bpf_map_remove(int mapfd, struct in_addr *addrp) {
         return 0;
 }
 
-int n_acd_bpf_compile(int *progfdp, int mapfd, struct ether_addr *macp) {
+int n_acd_bpf_bloom_create(int *bloomfdp, size_t max_entries) {
+        *bloomfdp = -1;
+        return 0;
+}
+
+int n_acd_bpf_bloom_add(int bloomfd, struct in_addr *addrp) {
+        return 0;
+}
+
+int n_acd_bpf_probe_load_bytes(bool *supportedp) {
+        *supportedp = false;
+        return 0;
+}
+
+int n_acd_bpf_compile(int *progfdp,
+                      int mapfd,
+                      int bloomfd,
+                      const struct in_addr *addrs,
+                      size_t n_addrs,
+                      struct ether_addr *macp,
+                      unsigned int sample) {
         *progfdp = -1;
         return 0;
 }
+
+int n_acd_bpf_compile_legacy(int *progfdp, int mapfd, struct ether_addr *macp) {
+        *progfdp = -1;
+        return 0;
+}
+
+int n_acd_bpf_shared_map_create(int *mapfdp, size_t max_entries) {
+        *mapfdp = -1;
+        return 0;
+}
+
+int n_acd_bpf_shared_map_ref(int mapfd, int ifindex, struct in_addr *addrp) {
+        return 0;
+}
+
+int n_acd_bpf_shared_map_unref(int mapfd, int ifindex, struct in_addr *addrp) {
+        return 0;
+}
+
+int n_acd_bpf_mac_map_create(int *mapfdp, size_t max_entries) {
+        *mapfdp = -1;
+        return 0;
+}
+
+int n_acd_bpf_mac_map_set(int mapfd, int ifindex, struct ether_addr *macp) {
+        return 0;
+}
+
+int n_acd_bpf_mac_map_unset(int mapfd, int ifindex) {
+        return 0;
+}
+
+int n_acd_bpf_map_copy(int to_mapfd, int from_mapfd) {
+        return 0;
+}
+
+int n_acd_bpf_map_flush(int mapfd) {
+        return 0;
+}
+
+int n_acd_bpf_map_get_max_entries(int mapfd, size_t *max_entriesp) {
+        *max_entriesp = 0;
+        return 0;
+}
+
+int n_acd_bpf_obj_pin(int fd, const char *path) {
+        return 0;
+}
+
+int n_acd_bpf_obj_get(int *fdp, const char *path) {
+        return -ENOENT;
+}
+
+int n_acd_bpf_compile_shared(int *progfdp, int mapfd, int macfd) {
+        *progfdp = -1;
+        return 0;
+}
+
+int n_acd_bpf_xdp_map_create(int *mapfdp, size_t max_entries) {
+        return -EOPNOTSUPP;
+}
+
+int n_acd_bpf_xdp_map_set(int mapfd, struct in_addr *addrp, uint64_t last_defend) {
+        return 0;
+}
+
+int n_acd_bpf_xdp_map_unset(int mapfd, struct in_addr *addrp) {
+        return 0;
+}
+
+int n_acd_bpf_ring_init(NAcdBpfRing *ring, size_t size) {
+        return -EOPNOTSUPP;
+}
+
+void n_acd_bpf_ring_deinit(NAcdBpfRing *ring) {
+}
+
+int n_acd_bpf_ring_pop(NAcdBpfRing *ring, void *data, size_t *n_datap) {
+        *n_datap = 0;
+        return 0;
+}
+
+int n_acd_bpf_compile_xdp(int *progfdp,
+                          int defendfd,
+                          int ringfd,
+                          int mapfd,
+                          int xskfd,
+                          struct ether_addr *macp) {
+        return -EOPNOTSUPP;
+}
+
+int n_acd_bpf_xdp_attach(int *linkfdp, int progfd, int ifindex, bool generic) {
+        return -EOPNOTSUPP;
+}
+
+int n_acd_bpf_xdp_update(int linkfd, int progfd) {
+        return -EOPNOTSUPP;
+}
+
+int n_acd_bpf_xsk_init(NAcdBpfXsk *xsk, int ifindex) {
+        return -EOPNOTSUPP;
+}
+
+void n_acd_bpf_xsk_deinit(NAcdBpfXsk *xsk) {
+}
+
+int n_acd_bpf_xsk_pop(NAcdBpfXsk *xsk, void *data, size_t *n_datap) {
+        *n_datap = 0;
+        return 0;
+}
+
+int n_acd_bpf_xsk_map_create(int *mapfdp, NAcdBpfXsk *xsk) {
+        return -EOPNOTSUPP;
+}
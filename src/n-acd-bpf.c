@@ -6,21 +6,66 @@
  * filters out all packets except exactly the packets relevant to the ACD
  * protocol on the addresses currently in the map.
  *
+ * Two variants of the program exist. The default one copies the entire ARP
+ * header onto the eBPF stack with a single bpf_skb_load_bytes() call, which
+ * is the only bounds-check performed, and then operates on the stack copy via
+ * plain memory loads. The legacy variant uses BPF_LD_ABS for every field,
+ * which is slower as every single load is bounds-checked separately, but it
+ * does not require bpf_skb_load_bytes() (linux-4.5) and hence is used as
+ * fallback on older kernels.
+ *
+ * Both variants use the same map layout: keys are IPv4 addresses in network
+ * byte-order, exactly as they appear on the wire.
+ *
+ * Furthermore, the default variant specializes the address lookup on the size
+ * of the address set. Tiny sets are compiled into the program as immediate
+ * compares, avoiding the map lookup entirely. Large sets get a bloom filter in
+ * front of the hash map, so the common case of a packet for an unrelated
+ * address only pays for the bloom filter check. The hash map is always
+ * maintained, regardless of the mode, so the caller can switch modes at any
+ * time by recompiling the program.
+ * Optionally, the default variant also passes a random sample of the claims
+ * of any other address, so userspace can observe which hosts use which
+ * addresses.
+ *
+ * Lastly, a shared variant of the program exists, which can be attached to
+ * the sockets of many contexts at once. It keys its address map by interface
+ * index and address, and looks up the hardware address to suppress in a
+ * second map, keyed by interface index. The address map counts references,
+ * so multiple contexts on the same interface can watch the same address.
+ *
+ * Independent of the socket filters, an XDP program can be attached to the
+ * interface to defend announced addresses right in the driver. Its map is
+ * keyed by address and holds the time of the last defense, which implements
+ * the defense rate-limit. For every conflicting packet it handles, the program
+ * either turns the packet into an announcement of the address and sends it
+ * back out (XDP_TX), or drops it if rate-limited. Either way, it notifies
+ * userspace via a ring buffer, so the DEFENDED event is still raised.
+ * Optionally, the XDP program also redirects all other packets the socket
+ * filter would accept into an AF_XDP socket, so the kernel never allocates
+ * socket buffers for them.
+ *
  * Note that userspace still has to filter the incoming packets, as filter
  * are applied when packets are queued on the socket, not when userspace
  * receives them. It is therefore possible to receive packets about addresses
  * that have already been removed.
  */
 
+#include <assert.h>
 #include <c-stdaux.h>
+#include <endian.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
 #include <netinet/if_ether.h>
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 #include "n-acd-private.h"
@@ -59,6 +104,22 @@
                 .imm            = ((__u64) (MAP_FD)) >> 32,                     \
         })
 
+#define BPF_LD_IMM64(DST, IMM)                                                  \
+        ((struct bpf_insn) {                                                    \
+                .code           = BPF_LD | BPF_DW | BPF_IMM,                    \
+                .dst_reg        = DST,                                          \
+                .src_reg        = 0,                                            \
+                .off            = 0,                                            \
+                .imm            = (__u32) (IMM),                                \
+        }),                                                                     \
+        ((struct bpf_insn) {                                                    \
+                .code           = 0, /* zero is reserved opcode */              \
+                .dst_reg        = 0,                                            \
+                .src_reg        = 0,                                            \
+                .off            = 0,                                            \
+                .imm            = ((__u64) (IMM)) >> 32,                        \
+        })
+
 #define BPF_ALU_REG(OP, DST, SRC)                                               \
         ((struct bpf_insn) {                                                    \
                 .code           = BPF_ALU64 | BPF_OP(OP) | BPF_X,               \
@@ -77,6 +138,15 @@
                 .imm            = IMM,                                          \
         })
 
+#define BPF_ALU32_IMM(OP, DST, IMM)                                             \
+        ((struct bpf_insn) {                                                    \
+                .code           = BPF_ALU | BPF_OP(OP) | BPF_K,                 \
+                .dst_reg        = DST,                                          \
+                .src_reg        = 0,                                            \
+                .off            = 0,                                            \
+                .imm            = IMM,                                          \
+        })
+
 #define BPF_MOV_REG(DST, SRC)                                                   \
         ((struct bpf_insn) {                                                    \
                 .code           = BPF_ALU64 | BPF_MOV | BPF_X,                  \
@@ -86,6 +156,24 @@
                 .imm            = 0,                                            \
         })
 
+#define BPF_MOV32_IMM(DST, IMM)                                                 \
+        ((struct bpf_insn) {                                                    \
+                .code           = BPF_ALU | BPF_MOV | BPF_K,                    \
+                .dst_reg        = DST,                                          \
+                .src_reg        = 0,                                            \
+                .off            = 0,                                            \
+                .imm            = IMM,                                          \
+        })
+
+#define BPF_ENDIAN(TYPE, DST, LEN)                                              \
+        ((struct bpf_insn) {                                                    \
+                .code           = BPF_ALU | BPF_END | BPF_SRC(TYPE),            \
+                .dst_reg        = DST,                                          \
+                .src_reg        = 0,                                            \
+                .off            = 0,                                            \
+                .imm            = LEN,                                          \
+        })
+
 #define BPF_MOV_IMM(DST, IMM)                                                   \
         ((struct bpf_insn) {                                                    \
                 .code           = BPF_ALU64 | BPF_MOV | BPF_K,                  \
@@ -166,7 +254,7 @@ int n_acd_bpf_map_create(int *mapfdp, size_t max_entries) {
 
 int n_acd_bpf_map_add(int mapfd, struct in_addr *addrp) {
         union bpf_attr attr;
-        uint32_t addr = be32toh(addrp->s_addr);
+        uint32_t addr = addrp->s_addr;
         uint8_t _dummy = 0;
         int r;
 
@@ -186,7 +274,7 @@ int n_acd_bpf_map_add(int mapfd, struct in_addr *addrp) {
 }
 
 int n_acd_bpf_map_remove(int mapfd, struct in_addr *addrp) {
-        uint32_t addr = be32toh(addrp->s_addr);
+        uint32_t addr = addrp->s_addr;
         union bpf_attr attr;
         int r;
 
@@ -203,7 +291,347 @@ int n_acd_bpf_map_remove(int mapfd, struct in_addr *addrp) {
         return 0;
 }
 
-int n_acd_bpf_compile(int *progfdp, int mapfd, struct ether_addr *macp) {
+int n_acd_bpf_bloom_create(int *bloomfdp, size_t max_entries) {
+        union bpf_attr attr;
+        int bloomfd;
+
+        memset(&attr, 0, sizeof(attr));
+        attr = (union bpf_attr){
+                .map_type    = BPF_MAP_TYPE_BLOOM_FILTER,
+                .key_size    = 0,
+                .value_size  = sizeof(uint32_t),
+                .max_entries = max_entries,
+        };
+
+        bloomfd = n_acd_syscall_bpf(BPF_MAP_CREATE, &attr, sizeof(attr));
+        if (bloomfd < 0)
+                return -errno;
+
+        *bloomfdp = bloomfd;
+        return 0;
+}
+
+int n_acd_bpf_bloom_add(int bloomfd, struct in_addr *addrp) {
+        union bpf_attr attr;
+        uint32_t addr = addrp->s_addr;
+        int r;
+
+        /*
+         * Bloom filters do not support removal. Stale entries merely cause
+         * false positives, which are then resolved by the hash map lookup.
+         * It is up to the caller to rebuild the filter eventually.
+         */
+        memset(&attr, 0, sizeof(attr));
+        attr = (union bpf_attr){
+                .map_fd = bloomfd,
+                .value  = (uint64_t)(unsigned long)&addr,
+                .flags  = BPF_ANY,
+        };
+
+        r = n_acd_syscall_bpf(BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr));
+        if (r < 0)
+                return -errno;
+
+        return 0;
+}
+
+typedef struct NAcdBpfSharedKey {
+        uint32_t ifindex;
+        uint32_t addr;
+} NAcdBpfSharedKey;
+
+typedef struct NAcdBpfMac {
+        uint8_t mac[ETH_ALEN];
+        uint8_t padding[2];
+} NAcdBpfMac;
+
+static int n_acd_bpf_map_create_sized(int *mapfdp, size_t max_entries, size_t key_size, size_t value_size) {
+        union bpf_attr attr;
+        int mapfd;
+
+        memset(&attr, 0, sizeof(attr));
+        attr = (union bpf_attr){
+                .map_type    = BPF_MAP_TYPE_HASH,
+                .key_size    = key_size,
+                .value_size  = value_size,
+                .max_entries = max_entries,
+        };
+
+        mapfd = n_acd_syscall_bpf(BPF_MAP_CREATE, &attr, sizeof(attr));
+        if (mapfd < 0)
+                return -errno;
+
+        *mapfdp = mapfd;
+        return 0;
+}
+
+static int n_acd_bpf_map_lookup(int mapfd, const void *key, void *value) {
+        union bpf_attr attr;
+        int r;
+
+        memset(&attr, 0, sizeof(attr));
+        attr = (union bpf_attr){
+                .map_fd = mapfd,
+                .key    = (uint64_t)(unsigned long)key,
+                .value  = (uint64_t)(unsigned long)value,
+        };
+
+        r = n_acd_syscall_bpf(BPF_MAP_LOOKUP_ELEM, &attr, sizeof(attr));
+        if (r < 0)
+                return -errno;
+
+        return 0;
+}
+
+static int n_acd_bpf_map_update(int mapfd, const void *key, const void *value, uint64_t flags) {
+        union bpf_attr attr;
+        int r;
+
+        memset(&attr, 0, sizeof(attr));
+        attr = (union bpf_attr){
+                .map_fd = mapfd,
+                .key    = (uint64_t)(unsigned long)key,
+                .value  = (uint64_t)(unsigned long)value,
+                .flags  = flags,
+        };
+
+        r = n_acd_syscall_bpf(BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr));
+        if (r < 0)
+                return -errno;
+
+        return 0;
+}
+
+static int n_acd_bpf_map_delete(int mapfd, const void *key) {
+        union bpf_attr attr;
+        int r;
+
+        memset(&attr, 0, sizeof(attr));
+        attr = (union bpf_attr){
+                .map_fd = mapfd,
+                .key    = (uint64_t)(unsigned long)key,
+        };
+
+        r = n_acd_syscall_bpf(BPF_MAP_DELETE_ELEM, &attr, sizeof(attr));
+        if (r < 0)
+                return -errno;
+
+        return 0;
+}
+
+static int n_acd_bpf_map_next_key(int mapfd, const void *key, void *next_key) {
+        union bpf_attr attr;
+        int r;
+
+        memset(&attr, 0, sizeof(attr));
+        attr = (union bpf_attr){
+                .map_fd   = mapfd,
+                .key      = (uint64_t)(unsigned long)key,
+                .next_key = (uint64_t)(unsigned long)next_key,
+        };
+
+        r = n_acd_syscall_bpf(BPF_MAP_GET_NEXT_KEY, &attr, sizeof(attr));
+        if (r < 0)
+                return -errno;
+
+        return 0;
+}
+
+int n_acd_bpf_shared_map_create(int *mapfdp, size_t max_entries) {
+        return n_acd_bpf_map_create_sized(mapfdp, max_entries, sizeof(NAcdBpfSharedKey), sizeof(uint32_t));
+}
+
+/*
+ * Take a reference to the address @addrp on interface @ifindex. Returns 0 if
+ * the entry already existed, or N_ACD_BPF_E_NEW if it was newly added.
+ */
+int n_acd_bpf_shared_map_ref(int mapfd, int ifindex, struct in_addr *addrp) {
+        NAcdBpfSharedKey key = { .ifindex = ifindex, .addr = addrp->s_addr };
+        uint32_t n_refs = 0;
+        int r;
+
+        r = n_acd_bpf_map_lookup(mapfd, &key, &n_refs);
+        if (r && r != -ENOENT)
+                return r;
+
+        ++n_refs;
+
+        r = n_acd_bpf_map_update(mapfd, &key, &n_refs, BPF_ANY);
+        if (r)
+                return r;
+
+        return n_refs == 1 ? N_ACD_BPF_E_NEW : 0;
+}
+
+/*
+ * Drop a reference to the address @addrp on interface @ifindex. Returns 0 if
+ * the entry is still referenced, or N_ACD_BPF_E_DELETED if it was removed.
+ */
+int n_acd_bpf_shared_map_unref(int mapfd, int ifindex, struct in_addr *addrp) {
+        NAcdBpfSharedKey key = { .ifindex = ifindex, .addr = addrp->s_addr };
+        uint32_t n_refs;
+        int r;
+
+        r = n_acd_bpf_map_lookup(mapfd, &key, &n_refs);
+        if (r)
+                return r;
+
+        if (n_refs > 1) {
+                --n_refs;
+                return n_acd_bpf_map_update(mapfd, &key, &n_refs, BPF_EXIST);
+        }
+
+        r = n_acd_bpf_map_delete(mapfd, &key);
+        if (r)
+                return r;
+
+        return N_ACD_BPF_E_DELETED;
+}
+
+int n_acd_bpf_mac_map_create(int *mapfdp, size_t max_entries) {
+        return n_acd_bpf_map_create_sized(mapfdp, max_entries, sizeof(uint32_t), sizeof(NAcdBpfMac));
+}
+
+int n_acd_bpf_mac_map_set(int mapfd, int ifindex, struct ether_addr *macp) {
+        uint32_t key = ifindex;
+        NAcdBpfMac value = {};
+
+        memcpy(value.mac, macp->ether_addr_octet, ETH_ALEN);
+
+        return n_acd_bpf_map_update(mapfd, &key, &value, BPF_ANY);
+}
+
+int n_acd_bpf_mac_map_unset(int mapfd, int ifindex) {
+        uint32_t key = ifindex;
+
+        return n_acd_bpf_map_delete(mapfd, &key);
+}
+
+/*
+ * Copy all entries of @from_mapfd into @to_mapfd. Both maps must have the
+ * same layout, and keys and values must not exceed 8 bytes.
+ */
+int n_acd_bpf_map_copy(int to_mapfd, int from_mapfd) {
+        uint64_t key, next_key, value;
+        void *prev = NULL;
+        int r;
+
+        for (;;) {
+                r = n_acd_bpf_map_next_key(from_mapfd, prev, &next_key);
+                if (r == -ENOENT)
+                        return 0;
+                else if (r)
+                        return r;
+
+                key = next_key;
+                prev = &key;
+
+                r = n_acd_bpf_map_lookup(from_mapfd, &key, &value);
+                if (r == -ENOENT)
+                        continue;
+                else if (r)
+                        return r;
+
+                r = n_acd_bpf_map_update(to_mapfd, &key, &value, BPF_NOEXIST);
+                if (r)
+                        return r;
+        }
+}
+
+/*
+ * Delete all entries of @mapfd. Keys must not exceed 8 bytes.
+ */
+int n_acd_bpf_map_flush(int mapfd) {
+        uint64_t key;
+        int r;
+
+        /*
+         * Always restart from the first key, since we delete the key we
+         * would otherwise continue from.
+         */
+        for (;;) {
+                r = n_acd_bpf_map_next_key(mapfd, NULL, &key);
+                if (r == -ENOENT)
+                        return 0;
+                else if (r)
+                        return r;
+
+                r = n_acd_bpf_map_delete(mapfd, &key);
+                if (r && r != -ENOENT)
+                        return r;
+        }
+}
+
+int n_acd_bpf_map_get_max_entries(int mapfd, size_t *max_entriesp) {
+        struct bpf_map_info info;
+        union bpf_attr attr;
+        int r;
+
+        memset(&info, 0, sizeof(info));
+        memset(&attr, 0, sizeof(attr));
+        attr.info.bpf_fd = mapfd;
+        attr.info.info_len = sizeof(info);
+        attr.info.info = (uint64_t)(unsigned long)&info;
+
+        r = n_acd_syscall_bpf(BPF_OBJ_GET_INFO_BY_FD, &attr, sizeof(attr));
+        if (r < 0)
+                return -errno;
+
+        *max_entriesp = info.max_entries;
+        return 0;
+}
+
+int n_acd_bpf_obj_pin(int fd, const char *path) {
+        union bpf_attr attr;
+        int r;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.pathname = (uint64_t)(unsigned long)path;
+        attr.bpf_fd = fd;
+
+        r = n_acd_syscall_bpf(BPF_OBJ_PIN, &attr, sizeof(attr));
+        if (r < 0)
+                return -errno;
+
+        return 0;
+}
+
+int n_acd_bpf_obj_get(int *fdp, const char *path) {
+        union bpf_attr attr;
+        int fd;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.pathname = (uint64_t)(unsigned long)path;
+
+        fd = n_acd_syscall_bpf(BPF_OBJ_GET, &attr, sizeof(attr));
+        if (fd < 0)
+                return -errno;
+
+        *fdp = fd;
+        return 0;
+}
+
+static int n_acd_bpf_load(int *progfdp, unsigned int type, struct bpf_insn *prog, size_t n_prog) {
+        union bpf_attr attr;
+        int progfd;
+
+        memset(&attr, 0, sizeof(attr));
+        attr = (union bpf_attr){
+                .prog_type = type,
+                .insns     = (uint64_t)(unsigned long)prog,
+                .insn_cnt  = n_prog,
+                .license   = (uint64_t)(unsigned long)"ASL",
+        };
+
+        progfd = n_acd_syscall_bpf(BPF_PROG_LOAD, &attr, sizeof(attr));
+        if (progfd < 0)
+                return -errno;
+
+        *progfdp = progfd;
+        return 0;
+}
+
+int n_acd_bpf_compile_legacy(int *progfdp, int mapfd, struct ether_addr *macp) {
         const union {
                 uint8_t u8[6];
                 uint16_t u16[3];
@@ -251,7 +679,8 @@ int n_acd_bpf_compile(int *progfdp, int mapfd, struct ether_addr *macp) {
 
                 /* drop packets from our own mac address */
                 BPF_LD_ABS(BPF_W, offsetof(struct ether_arp, arp_sha)),         /* r0 = first four bytes of packet mac address */
-                BPF_JMP_IMM(BPF_JNE, 0, be32toh(mac.u32[0]), 4),                /* if (r0 != first four bytes of our mac address) skip 4 */
+                BPF_MOV32_IMM(1, be32toh(mac.u32[0])),                          /* r1 = first four bytes of our mac address */
+                BPF_JMP_REG(BPF_JNE, 0, 1, 4),                                  /* if (r0 != r1) skip 4 */
                 BPF_LD_ABS(BPF_H, offsetof(struct ether_arp, arp_sha) + 4),     /* r0 = last two bytes of packet mac address */
                 BPF_JMP_IMM(BPF_JNE, 0, be16toh(mac.u16[2]), 2),                /* if (r0 != last two bytes of our mac address) skip 2 */
                 BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
@@ -268,15 +697,17 @@ int n_acd_bpf_compile(int *progfdp, int mapfd, struct ether_addr *macp) {
                  *  Any other packets are dropped.
                  */
                 BPF_LD_ABS(BPF_W, offsetof(struct ether_arp, arp_spa)),         /* r0 = sender ip address */
-                BPF_JMP_IMM(BPF_JEQ, 0, 0, 7),                                  /* if (r0 == 0) skip 7 */
+                BPF_JMP_IMM(BPF_JEQ, 0, 0, 8),                                  /* if (r0 == 0) skip 8 */
+                BPF_ENDIAN(BPF_TO_BE, 0, 32),                                   /* r0 = htobe32(r0) */
                 BPF_MOV_REG(7, 0),                                              /* r7 = r0 */
                 BPF_LD_ABS(BPF_H, offsetof(struct ether_arp, arp_op)),          /* r0 = operation */
                 BPF_JMP_IMM(BPF_JEQ, 0, ARPOP_REQUEST, 3),                      /* if (r0 == request) skip 3 */
                 BPF_JMP_IMM(BPF_JEQ, 0, ARPOP_REPLY, 2),                        /* if (r0 == reply) skip 2 */
                 BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
                 BPF_EXIT_INSN(),                                                /* return */
-                BPF_JMP_IMM(BPF_JA, 0, 0, 6),                                   /* skip 6 */
+                BPF_JMP_IMM(BPF_JA, 0, 0, 7),                                   /* skip 7 */
                 BPF_LD_ABS(BPF_W, offsetof(struct ether_arp, arp_tpa)),         /* r0 = target ip address */
+                BPF_ENDIAN(BPF_TO_BE, 0, 32),                                   /* r0 = htobe32(r0) */
                 BPF_MOV_REG(7, 0),                                              /* r7 = r0 */
                 BPF_LD_ABS(BPF_H, offsetof(struct ether_arp, arp_op)),          /* r0 = operation */
                 BPF_JMP_IMM(BPF_JEQ, 0, ARPOP_REQUEST, 2),                      /* if (r0 == request) skip 2 */
@@ -297,21 +728,993 @@ int n_acd_bpf_compile(int *progfdp, int mapfd, struct ether_addr *macp) {
                 BPF_MOV_IMM(0, sizeof(struct ether_arp)),                       /* r0 = sizeof(struct ether_arp) */
                 BPF_EXIT_INSN(),                                                /* return */
         };
-        union bpf_attr attr;
-        int progfd;
 
-        memset(&attr, 0, sizeof(attr));
-        attr = (union bpf_attr){
-                .prog_type = BPF_PROG_TYPE_SOCKET_FILTER,
-                .insns     = (uint64_t)(unsigned long)prog,
-                .insn_cnt  = sizeof(prog) / sizeof(*prog),
-                .license   = (uint64_t)(unsigned long)"ASL",
+        return n_acd_bpf_load(progfdp, BPF_PROG_TYPE_SOCKET_FILTER, prog, sizeof(prog) / sizeof(*prog));
+}
+
+/*
+ * The direct-load program keeps a copy of the ARP header on its stack. The
+ * copy starts at an 8-byte aligned offset, so all fields we access are
+ * naturally aligned (the verifier enforces strict alignment on the stack).
+ * The sender protocol address is the only exception, it is only 2-byte
+ * aligned and thus accessed as two 16-bit halves.
+ */
+#define N_ACD_BPF_STACK_ARP (-32)
+#define N_ACD_BPF_STACK_OFF(_field) (N_ACD_BPF_STACK_ARP + (int)offsetof(struct ether_arp, _field))
+
+static_assert(sizeof(struct ether_arp) <= -N_ACD_BPF_STACK_ARP,
+              "ARP header does not fit into the reserved eBPF stack");
+
+/**
+ * n_acd_bpf_probe_load_bytes() - check whether socket filters can load bytes
+ * @supportedp:                 output argument for the result
+ *
+ * Socket filters can call bpf_skb_load_bytes() since linux-4.5. This loads a
+ * trivial program calling it, and caches the result, so the kernel is only
+ * asked once. Probing for the helper explicitly, rather than guessing from the
+ * verifier rejecting the full program, makes sure a bug in the generated
+ * program is reported, rather than hidden behind the legacy fallback.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_acd_bpf_probe_load_bytes(bool *supportedp) {
+        static atomic_int supported = 0;
+        struct bpf_insn prog[] = {
+                BPF_MOV_IMM(2, 0),                                              /* r2 = 0 */
+                BPF_MOV_REG(3, 10),                                             /* r3 = fp */
+                BPF_ALU_IMM(BPF_ADD, 3, -8),                                    /* r3 += -8 */
+                BPF_MOV_IMM(4, 1),                                              /* r4 = 1 */
+                BPF_EMIT_CALL(BPF_FUNC_skb_load_bytes),                         /* r0 = skb_load_bytes(r1, r2, r3, r4) */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
         };
+        int r, progfd;
 
-        progfd = n_acd_syscall_bpf(BPF_PROG_LOAD, &attr, sizeof(attr));
-        if (progfd < 0)
-                return -errno;
+        if (!atomic_load(&supported)) {
+                r = n_acd_bpf_load(&progfd, BPF_PROG_TYPE_SOCKET_FILTER, prog, C_ARRAY_SIZE(prog));
+                if (r == -EINVAL) {
+                        atomic_store(&supported, -1);
+                } else if (r) {
+                        return r;
+                } else {
+                        close(progfd);
+                        atomic_store(&supported, 1);
+                }
+        }
 
-        *progfdp = progfd;
+        *supportedp = atomic_load(&supported) > 0;
+        return 0;
+}
+
+/**
+ * n_acd_bpf_compile() - compile and load the socket filter
+ * @progfdp:                    output argument for the program
+ * @mapfd:                      hash map of all addresses
+ * @bloomfd:                    bloom filter of all addresses, or -1
+ * @addrs:                      addresses to compile inline, or NULL
+ * @n_addrs:                    number of addresses in @addrs
+ * @macp:                       our own hardware address
+ * @sample:                     sampling rate of unrelated claims, or 0
+ *
+ * If @addrs is non-NULL, the addresses are compiled into the program as
+ * immediate compares and @mapfd is not consulted. At most
+ * N_ACD_BPF_INLINE_MAX addresses can be inlined. Otherwise, the hash map
+ * @mapfd is looked up, optionally prefiltered by the bloom filter @bloomfd.
+ *
+ * If the kernel does not support bpf_skb_load_bytes(), this falls back to the
+ * legacy program, which always uses @mapfd. Hence, @mapfd must be valid and
+ * kept up to date in any case. Any other failure to load the program is
+ * returned to the caller.
+ *
+ * If @sample is non-zero, claims of any address, rather than just the ones
+ * in the set, pass the filter with a probability of 1 / @sample, so userspace
+ * can observe them. The legacy program does not support this, and never
+ * passes claims of unrelated addresses.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_acd_bpf_compile(int *progfdp,
+                      int mapfd,
+                      int bloomfd,
+                      const struct in_addr *addrs,
+                      size_t n_addrs,
+                      struct ether_addr *macp,
+                      unsigned int sample) {
+        /*
+         * All loads are performed on the raw packet data, so all constants
+         * are provided in network byte-order and re-interpreted in host
+         * layout, rather than converting the packet data.
+         */
+        const union {
+                struct arphdr hdr;
+                uint16_t u16[4];
+                uint32_t u32[2];
+        } hdr = {
+                .hdr = {
+                        .ar_hrd = htobe16(ARPHRD_ETHER),
+                        .ar_pro = htobe16(ETHERTYPE_IP),
+                        .ar_hln = sizeof(struct ether_addr),
+                        .ar_pln = sizeof(struct in_addr),
+                },
+        };
+        const union {
+                uint8_t u8[6];
+                uint16_t u16[3];
+                uint32_t u32[1];
+        } mac = {
+                .u8 = {
+                        macp->ether_addr_octet[0],
+                        macp->ether_addr_octet[1],
+                        macp->ether_addr_octet[2],
+                        macp->ether_addr_octet[3],
+                        macp->ether_addr_octet[4],
+                        macp->ether_addr_octet[5],
+                },
+        };
+        struct bpf_insn prog[] = {
+                /*
+                 * Copy the ARP header onto the stack. This is the only
+                 * bounds-check we perform. If the packet is too short, the
+                 * helper fails and we drop the packet.
+                 */
+                BPF_MOV_IMM(2, 0),                                              /* r2 = 0 */
+                BPF_MOV_REG(3, 10),                                             /* r3 = fp */
+                BPF_ALU_IMM(BPF_ADD, 3, N_ACD_BPF_STACK_ARP),                   /* r3 += N_ACD_BPF_STACK_ARP */
+                BPF_MOV_IMM(4, sizeof(struct ether_arp)),                       /* r4 = sizeof(struct ether_arp) */
+                BPF_EMIT_CALL(BPF_FUNC_skb_load_bytes),                         /* r0 = skb_load_bytes(r1, r2, r3, r4) */
+                BPF_JMP_IMM(BPF_JEQ, 0, 0, 2),                                  /* if (r0 == 0) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /* drop the packet if the header is not as expected */
+                BPF_LDX_MEM(BPF_W, 0, 10, N_ACD_BPF_STACK_OFF(arp_hrd)),        /* r0 = header type and protocol */
+                BPF_MOV32_IMM(1, hdr.u32[0]),                                   /* r1 = ethernet and IP */
+                BPF_JMP_REG(BPF_JEQ, 0, 1, 2),                                  /* if (r0 == r1) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                BPF_LDX_MEM(BPF_H, 0, 10, N_ACD_BPF_STACK_OFF(arp_hln)),        /* r0 = hw and protocol addr length */
+                BPF_JMP_IMM(BPF_JEQ, 0, hdr.u16[2], 2),                         /* if (r0 == ether_addr and in_addr lengths) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /* drop packets from our own mac address */
+                BPF_LDX_MEM(BPF_W, 0, 10, N_ACD_BPF_STACK_OFF(arp_sha)),        /* r0 = first four bytes of packet mac address */
+                BPF_MOV32_IMM(1, mac.u32[0]),                                   /* r1 = first four bytes of our mac address */
+                BPF_JMP_REG(BPF_JNE, 0, 1, 4),                                  /* if (r0 != r1) skip 4 */
+                BPF_LDX_MEM(BPF_H, 0, 10, N_ACD_BPF_STACK_OFF(arp_sha) + 4),    /* r0 = last two bytes of packet mac address */
+                BPF_JMP_IMM(BPF_JNE, 0, mac.u16[2], 2),                         /* if (r0 != last two bytes of our mac address) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /*
+                 * We listen for two kinds of packets:
+                 *  Conflicts)
+                 *    These are requests or replies with the sender address not set to INADDR_ANY. The
+                 *    conflicted address is the sender address, point r2 at it, and load its two
+                 *    halves into r3 and r4.
+                 *  Probes)
+                 *    These are requests with the sender address set to INADDR_ANY. The probed address
+                 *    is the target address, point r2 at it, and load its two halves into r3 and r4.
+                 *  Any other packets are dropped.
+                 */
+                BPF_LDX_MEM(BPF_H, 7, 10, N_ACD_BPF_STACK_OFF(ea_hdr.ar_op)),   /* r7 = operation */
+                BPF_LDX_MEM(BPF_H, 3, 10, N_ACD_BPF_STACK_OFF(arp_spa)),        /* r3 = first half of sender ip address */
+                BPF_LDX_MEM(BPF_H, 4, 10, N_ACD_BPF_STACK_OFF(arp_spa) + 2),    /* r4 = second half of sender ip address */
+                BPF_MOV_REG(0, 3),                                              /* r0 = r3 */
+                BPF_ALU_REG(BPF_OR, 0, 4),                                      /* r0 |= r4 */
+                BPF_JMP_IMM(BPF_JEQ, 0, 0, 7),                                  /* if (r0 == 0) skip 7 */
+                BPF_MOV_REG(2, 10),                                             /* r2 = fp */
+                BPF_ALU_IMM(BPF_ADD, 2, N_ACD_BPF_STACK_OFF(arp_spa)),          /* r2 = &sender ip address */
+                BPF_JMP_IMM(BPF_JEQ, 7, htobe16(ARPOP_REQUEST), 3),             /* if (r7 == request) skip 3 */
+                BPF_JMP_IMM(BPF_JEQ, 7, htobe16(ARPOP_REPLY), 2),               /* if (r7 == reply) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+                BPF_JMP_IMM(BPF_JA, 0, 0, 7),                                   /* skip 7 */
+                BPF_MOV_REG(2, 10),                                             /* r2 = fp */
+                BPF_ALU_IMM(BPF_ADD, 2, N_ACD_BPF_STACK_OFF(arp_tpa)),          /* r2 = &target ip address */
+                BPF_LDX_MEM(BPF_H, 3, 10, N_ACD_BPF_STACK_OFF(arp_tpa)),        /* r3 = first half of target ip address */
+                BPF_LDX_MEM(BPF_H, 4, 10, N_ACD_BPF_STACK_OFF(arp_tpa) + 2),    /* r4 = second half of target ip address */
+                BPF_JMP_IMM(BPF_JEQ, 7, htobe16(ARPOP_REQUEST), 2),             /* if (r7 == request) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+        };
+        struct bpf_insn observe[] = {
+                /* accept a random sample of all claims, preserve r2, r3 and r4 in r6, r8 and r9 */
+                BPF_LDX_MEM(BPF_H, 0, 10, N_ACD_BPF_STACK_OFF(arp_spa)),        /* r0 = first half of sender ip address */
+                BPF_LDX_MEM(BPF_H, 1, 10, N_ACD_BPF_STACK_OFF(arp_spa) + 2),    /* r1 = second half of sender ip address */
+                BPF_ALU_REG(BPF_OR, 0, 1),                                      /* r0 |= r1 */
+                BPF_JMP_IMM(BPF_JEQ, 0, 0, 11),                                 /* if (r0 == 0) skip 11 */
+                BPF_MOV_REG(6, 2),                                              /* r6 = r2 */
+                BPF_MOV_REG(8, 3),                                              /* r8 = r3 */
+                BPF_MOV_REG(9, 4),                                              /* r9 = r4 */
+                BPF_EMIT_CALL(BPF_FUNC_get_prandom_u32),                        /* r0 = get_prandom_u32() */
+                BPF_ALU32_IMM(BPF_MOD, 0, sample),                              /* r0 %= sample */
+                BPF_JMP_IMM(BPF_JNE, 0, 0, 2),                                  /* if (r0 != 0) skip 2 */
+                BPF_MOV_IMM(0, sizeof(struct ether_arp)),                       /* r0 = sizeof(struct ether_arp) */
+                BPF_EXIT_INSN(),                                                /* return */
+                BPF_MOV_REG(2, 6),                                              /* r2 = r6 */
+                BPF_MOV_REG(3, 8),                                              /* r3 = r8 */
+                BPF_MOV_REG(4, 9),                                              /* r4 = r9 */
+        };
+        struct bpf_insn bloom[] = {
+                /* check whether the address might be in the bloom filter, preserve r2 in r6 */
+                BPF_MOV_REG(6, 2),                                              /* r6 = r2 */
+                BPF_LD_MAP_FD(1, bloomfd),                                      /* r1 = bloomfd */
+                BPF_EMIT_CALL(BPF_FUNC_map_peek_elem),                          /* r0 = map_peek_elem(r1, r2) */
+                BPF_JMP_IMM(BPF_JEQ, 0, 0, 2),                                  /* if (r0 == 0) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+                BPF_MOV_REG(2, 6),                                              /* r2 = r6 */
+        };
+        struct bpf_insn lookup[] = {
+                /* check if the probe or conflict is for an address we are monitoring */
+                BPF_LD_MAP_FD(1, mapfd),                                        /* r1 = mapfd */
+                BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem),                        /* r0 = map_lookup_elem(r1, r2) */
+                BPF_JMP_IMM(BPF_JNE, 0, 0, 2),                                  /* if (r0 != NULL) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+        };
+        struct bpf_insn accept[] = {
+                /* return exactly the packet length*/
+                BPF_MOV_IMM(0, sizeof(struct ether_arp)),                       /* r0 = sizeof(struct ether_arp) */
+                BPF_EXIT_INSN(),                                                /* return */
+        };
+        struct bpf_insn code[C_ARRAY_SIZE(prog) +
+                             C_ARRAY_SIZE(observe) +
+                             C_ARRAY_SIZE(bloom) +
+                             C_ARRAY_SIZE(lookup) +
+                             2 * N_ACD_BPF_INLINE_MAX + 2 +
+                             C_ARRAY_SIZE(accept)];
+        size_t n_code = 0;
+        bool supported;
+        int r;
+
+        c_assert(!addrs || n_addrs <= N_ACD_BPF_INLINE_MAX);
+
+        r = n_acd_bpf_probe_load_bytes(&supported);
+        if (r)
+                return r;
+        if (!supported)
+                return n_acd_bpf_compile_legacy(progfdp, mapfd, macp);
+
+        memcpy(code + n_code, prog, sizeof(prog));
+        n_code += C_ARRAY_SIZE(prog);
+
+        if (sample) {
+                memcpy(code + n_code, observe, sizeof(observe));
+                n_code += C_ARRAY_SIZE(observe);
+        }
+
+        if (addrs) {
+                /*
+                 * Compare both halves of the address against each of the
+                 * inlined addresses, and jump to the accept-block on the
+                 * first match. If nothing matches, drop the packet.
+                 */
+                for (size_t i = 0; i < n_addrs; ++i) {
+                        const union {
+                                uint32_t u32;
+                                uint16_t u16[2];
+                        } addr = {
+                                .u32 = addrs[i].s_addr,
+                        };
+
+                        code[n_code++] = BPF_JMP_IMM(BPF_JNE, 3, addr.u16[0], 1);                       /* if (r3 != first half) skip 1 */
+                        code[n_code++] = BPF_JMP_IMM(BPF_JEQ, 4, addr.u16[1], 2 * (n_addrs - i));       /* if (r4 == second half) skip to accept */
+                }
+
+                code[n_code++] = BPF_MOV_IMM(0, 0);                                                     /* r0 = 0 */
+                code[n_code++] = BPF_EXIT_INSN();                                                       /* return */
+        } else {
+                if (bloomfd >= 0) {
+                        memcpy(code + n_code, bloom, sizeof(bloom));
+                        n_code += C_ARRAY_SIZE(bloom);
+                }
+
+                memcpy(code + n_code, lookup, sizeof(lookup));
+                n_code += C_ARRAY_SIZE(lookup);
+        }
+
+        /*
+         * Without any inlined address, nothing jumps to the accept-block, and
+         * the verifier rejects unreachable code.
+         */
+        if (!addrs || n_addrs) {
+                memcpy(code + n_code, accept, sizeof(accept));
+                n_code += C_ARRAY_SIZE(accept);
+        }
+
+        return n_acd_bpf_load(progfdp, BPF_PROG_TYPE_SOCKET_FILTER, code, n_code);
+}
+
+/*
+ * The shared program additionally keeps the key for the address map on its
+ * stack, right below the copy of the ARP header.
+ */
+#define N_ACD_BPF_STACK_KEY (N_ACD_BPF_STACK_ARP - (int)sizeof(NAcdBpfSharedKey))
+
+int n_acd_bpf_compile_shared(int *progfdp, int mapfd, int macfd) {
+        const union {
+                struct arphdr hdr;
+                uint16_t u16[4];
+                uint32_t u32[2];
+        } hdr = {
+                .hdr = {
+                        .ar_hrd = htobe16(ARPHRD_ETHER),
+                        .ar_pro = htobe16(ETHERTYPE_IP),
+                        .ar_hln = sizeof(struct ether_addr),
+                        .ar_pln = sizeof(struct in_addr),
+                },
+        };
+        struct bpf_insn prog[] = {
+                /* remember the interface index as first half of the map key */
+                BPF_LDX_MEM(BPF_W, 0, 1, offsetof(struct __sk_buff, ifindex)),  /* r0 = skb->ifindex */
+                BPF_STX_MEM(BPF_W, 10, 0, N_ACD_BPF_STACK_KEY),                 /* key.ifindex = r0 */
+
+                /* copy the ARP header onto the stack, see n_acd_bpf_compile() */
+                BPF_MOV_IMM(2, 0),                                              /* r2 = 0 */
+                BPF_MOV_REG(3, 10),                                             /* r3 = fp */
+                BPF_ALU_IMM(BPF_ADD, 3, N_ACD_BPF_STACK_ARP),                   /* r3 += N_ACD_BPF_STACK_ARP */
+                BPF_MOV_IMM(4, sizeof(struct ether_arp)),                       /* r4 = sizeof(struct ether_arp) */
+                BPF_EMIT_CALL(BPF_FUNC_skb_load_bytes),                         /* r0 = skb_load_bytes(r1, r2, r3, r4) */
+                BPF_JMP_IMM(BPF_JEQ, 0, 0, 2),                                  /* if (r0 == 0) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /* drop the packet if the header is not as expected */
+                BPF_LDX_MEM(BPF_W, 0, 10, N_ACD_BPF_STACK_OFF(arp_hrd)),        /* r0 = header type and protocol */
+                BPF_MOV32_IMM(1, hdr.u32[0]),                                   /* r1 = ethernet and IP */
+                BPF_JMP_REG(BPF_JEQ, 0, 1, 2),                                  /* if (r0 == r1) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                BPF_LDX_MEM(BPF_H, 0, 10, N_ACD_BPF_STACK_OFF(arp_hln)),        /* r0 = hw and protocol addr length */
+                BPF_JMP_IMM(BPF_JEQ, 0, hdr.u16[2], 2),                         /* if (r0 == ether_addr and in_addr lengths) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /* look up our own mac address of this interface, drop the packet if there is none */
+                BPF_MOV_REG(2, 10),                                             /* r2 = fp */
+                BPF_ALU_IMM(BPF_ADD, 2, N_ACD_BPF_STACK_KEY),                   /* r2 = &key.ifindex */
+                BPF_LD_MAP_FD(1, macfd),                                        /* r1 = macfd */
+                BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem),                        /* r0 = map_lookup_elem(r1, r2) */
+                BPF_JMP_IMM(BPF_JNE, 0, 0, 2),                                  /* if (r0 != NULL) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /* drop packets from our own mac address */
+                BPF_LDX_MEM(BPF_W, 1, 0, 0),                                    /* r1 = first four bytes of our mac address */
+                BPF_LDX_MEM(BPF_W, 2, 10, N_ACD_BPF_STACK_OFF(arp_sha)),        /* r2 = first four bytes of packet mac address */
+                BPF_JMP_REG(BPF_JNE, 1, 2, 5),                                  /* if (r1 != r2) skip 5 */
+                BPF_LDX_MEM(BPF_H, 1, 0, 4),                                    /* r1 = last two bytes of our mac address */
+                BPF_LDX_MEM(BPF_H, 2, 10, N_ACD_BPF_STACK_OFF(arp_sha) + 4),    /* r2 = last two bytes of packet mac address */
+                BPF_JMP_REG(BPF_JNE, 1, 2, 2),                                  /* if (r1 != r2) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /*
+                 * Classify the packet as conflict or probe, see
+                 * n_acd_bpf_compile(). The halves of the relevant address
+                 * end up in r3 and r4.
+                 */
+                BPF_LDX_MEM(BPF_H, 7, 10, N_ACD_BPF_STACK_OFF(ea_hdr.ar_op)),   /* r7 = operation */
+                BPF_LDX_MEM(BPF_H, 3, 10, N_ACD_BPF_STACK_OFF(arp_spa)),        /* r3 = first half of sender ip address */
+                BPF_LDX_MEM(BPF_H, 4, 10, N_ACD_BPF_STACK_OFF(arp_spa) + 2),    /* r4 = second half of sender ip address */
+                BPF_MOV_REG(0, 3),                                              /* r0 = r3 */
+                BPF_ALU_REG(BPF_OR, 0, 4),                                      /* r0 |= r4 */
+                BPF_JMP_IMM(BPF_JEQ, 0, 0, 5),                                  /* if (r0 == 0) skip 5 */
+                BPF_JMP_IMM(BPF_JEQ, 7, htobe16(ARPOP_REQUEST), 3),             /* if (r7 == request) skip 3 */
+                BPF_JMP_IMM(BPF_JEQ, 7, htobe16(ARPOP_REPLY), 2),               /* if (r7 == reply) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+                BPF_JMP_IMM(BPF_JA, 0, 0, 5),                                   /* skip 5 */
+                BPF_LDX_MEM(BPF_H, 3, 10, N_ACD_BPF_STACK_OFF(arp_tpa)),        /* r3 = first half of target ip address */
+                BPF_LDX_MEM(BPF_H, 4, 10, N_ACD_BPF_STACK_OFF(arp_tpa) + 2),    /* r4 = second half of target ip address */
+                BPF_JMP_IMM(BPF_JEQ, 7, htobe16(ARPOP_REQUEST), 2),             /* if (r7 == request) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /* check if the probe or conflict is for an address we are monitoring on this interface */
+                BPF_STX_MEM(BPF_H, 10, 3, N_ACD_BPF_STACK_KEY + 4),             /* first half of key.addr = r3 */
+                BPF_STX_MEM(BPF_H, 10, 4, N_ACD_BPF_STACK_KEY + 6),             /* second half of key.addr = r4 */
+                BPF_MOV_REG(2, 10),                                             /* r2 = fp */
+                BPF_ALU_IMM(BPF_ADD, 2, N_ACD_BPF_STACK_KEY),                   /* r2 = &key */
+                BPF_LD_MAP_FD(1, mapfd),                                        /* r1 = mapfd */
+                BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem),                        /* r0 = map_lookup_elem(r1, r2) */
+                BPF_JMP_IMM(BPF_JNE, 0, 0, 2),                                  /* if (r0 != NULL) skip 2 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /* return exactly the packet length*/
+                BPF_MOV_IMM(0, sizeof(struct ether_arp)),                       /* r0 = sizeof(struct ether_arp) */
+                BPF_EXIT_INSN(),                                                /* return */
+        };
+
+        return n_acd_bpf_load(progfdp, BPF_PROG_TYPE_SOCKET_FILTER, prog, sizeof(prog) / sizeof(*prog));
+}
+
+int n_acd_bpf_xdp_map_create(int *mapfdp, size_t max_entries) {
+        return n_acd_bpf_map_create_sized(mapfdp, max_entries, sizeof(uint32_t), sizeof(uint64_t));
+}
+
+/*
+ * Let the XDP program defend @addrp. @last_defend is the CLOCK_MONOTONIC
+ * time of the last defense, or 0 if there was none.
+ */
+int n_acd_bpf_xdp_map_set(int mapfd, struct in_addr *addrp, uint64_t last_defend) {
+        return n_acd_bpf_map_update(mapfd, &addrp->s_addr, &last_defend, BPF_ANY);
+}
+
+int n_acd_bpf_xdp_map_unset(int mapfd, struct in_addr *addrp) {
+        return n_acd_bpf_map_delete(mapfd, &addrp->s_addr);
+}
+
+int n_acd_bpf_ring_init(NAcdBpfRing *ring, size_t size) {
+        _c_cleanup_(c_closep) int fd = -1;
+        size_t n_page = sysconf(_SC_PAGESIZE);
+        void *consumer, *producer;
+        union bpf_attr attr;
+
+        /* the size must be a power of two, and a multiple of the page size */
+        c_assert(size >= n_page && !(size & (size - 1)));
+
+        memset(&attr, 0, sizeof(attr));
+        attr = (union bpf_attr){
+                .map_type    = BPF_MAP_TYPE_RINGBUF,
+                .max_entries = size,
+        };
+
+        fd = n_acd_syscall_bpf(BPF_MAP_CREATE, &attr, sizeof(attr));
+        if (fd < 0)
+                return -errno;
+
+        /*
+         * The consumer position is on the first page, and is the only part
+         * writable by userspace. The producer position follows on the second
+         * page, followed by the data area, which is mapped twice in a row, so
+         * records never wrap around.
+         */
+        consumer = mmap(NULL, n_page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (consumer == MAP_FAILED)
+                return -errno;
+
+        producer = mmap(NULL, n_page + 2 * size, PROT_READ, MAP_SHARED, fd, n_page);
+        if (producer == MAP_FAILED) {
+                munmap(consumer, n_page);
+                return -errno;
+        }
+
+        ring->fd = fd;
+        ring->size = size;
+        ring->consumer = consumer;
+        ring->producer = producer;
+        fd = -1;
+        return 0;
+}
+
+void n_acd_bpf_ring_deinit(NAcdBpfRing *ring) {
+        size_t n_page = sysconf(_SC_PAGESIZE);
+
+        if (ring->producer)
+                munmap(ring->producer, n_page + 2 * ring->size);
+        if (ring->consumer)
+                munmap(ring->consumer, n_page);
+        c_close(ring->fd);
+        *ring = (NAcdBpfRing)N_ACD_BPF_RING_NULL(*ring);
+}
+
+/*
+ * Copy the next record of @ring into @data, which can hold @n_datap bytes,
+ * and return its size in @n_datap. If the ring is empty, 0 is returned in
+ * @n_datap.
+ */
+int n_acd_bpf_ring_pop(NAcdBpfRing *ring, void *data, size_t *n_datap) {
+        size_t n_page = sysconf(_SC_PAGESIZE);
+        unsigned long consumer, producer;
+        uint8_t *area = (uint8_t *)ring->producer + n_page;
+        uint32_t len;
+
+        consumer = __atomic_load_n((unsigned long *)ring->consumer, __ATOMIC_ACQUIRE);
+        producer = __atomic_load_n((unsigned long *)ring->producer, __ATOMIC_ACQUIRE);
+
+        while (consumer < producer) {
+                uint8_t *record = area + (consumer & (ring->size - 1));
+                size_t n;
+
+                len = __atomic_load_n((uint32_t *)record, __ATOMIC_ACQUIRE);
+                if (len & BPF_RINGBUF_BUSY_BIT)
+                        break;
+
+                n = len & ~(BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT);
+                consumer += (n + BPF_RINGBUF_HDR_SZ + 7) & ~7UL;
+
+                if (!(len & BPF_RINGBUF_DISCARD_BIT)) {
+                        memcpy(data, record + BPF_RINGBUF_HDR_SZ, n < *n_datap ? n : *n_datap);
+                        *n_datap = n;
+                        __atomic_store_n((unsigned long *)ring->consumer, consumer, __ATOMIC_RELEASE);
+                        return 0;
+                }
+
+                __atomic_store_n((unsigned long *)ring->consumer, consumer, __ATOMIC_RELEASE);
+        }
+
+        *n_datap = 0;
+        return 0;
+}
+
+/*
+ * The XDP program keeps the map key, the event it sends to userspace, and the
+ * context pointer on its stack.
+ */
+#define N_ACD_BPF_XDP_STACK_EVENT (-(int)sizeof(NAcdBpfXdpEvent))
+#define N_ACD_BPF_XDP_STACK_KEY (N_ACD_BPF_XDP_STACK_EVENT - (int)sizeof(uint32_t))
+#define N_ACD_BPF_XDP_STACK_CTX (N_ACD_BPF_XDP_STACK_KEY - (int)sizeof(uint64_t))
+#define N_ACD_BPF_XDP_STACK_OFF(_field) (N_ACD_BPF_XDP_STACK_EVENT + (int)offsetof(NAcdBpfXdpEvent, _field))
+#define N_ACD_BPF_XDP_OFF(_field) ((int)(sizeof(struct ether_header) + offsetof(struct ether_arp, _field)))
+
+static_assert(sizeof(NAcdBpfXdpEvent) == 12,
+              "The XDP program clears the event in three words");
+
+/**
+ * n_acd_bpf_compile_xdp() - compile and load the XDP program
+ * @progfdp:                    output argument for the program
+ * @defendfd:                   map of addresses to defend, or -1
+ * @ringfd:                     ring buffer to report defenses to
+ * @mapfd:                      hash map of all addresses, or -1
+ * @xskfd:                      AF_XDP socket map to steer packets to, or -1
+ * @macp:                       our own hardware address
+ *
+ * The program consists of up to two parts. If @defendfd is valid, conflicts
+ * for the addresses in it are answered right away, see above. If @xskfd is
+ * valid, all other packets that the socket filter would accept, according to
+ * @mapfd, are redirected to the AF_XDP socket of the receive queue, if any.
+ * Anything else is passed on to the network stack.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_acd_bpf_compile_xdp(int *progfdp,
+                          int defendfd,
+                          int ringfd,
+                          int mapfd,
+                          int xskfd,
+                          struct ether_addr *macp) {
+        const union {
+                uint8_t u8[6];
+                uint16_t u16[3];
+                uint32_t u32[1];
+        } mac = {
+                .u8 = {
+                        macp->ether_addr_octet[0],
+                        macp->ether_addr_octet[1],
+                        macp->ether_addr_octet[2],
+                        macp->ether_addr_octet[3],
+                        macp->ether_addr_octet[4],
+                        macp->ether_addr_octet[5],
+                },
+        };
+        const union {
+                struct arphdr hdr;
+                uint16_t u16[4];
+                uint32_t u32[2];
+        } hdr = {
+                .hdr = {
+                        .ar_hrd = htobe16(ARPHRD_ETHER),
+                        .ar_pro = htobe16(ETHERTYPE_IP),
+                        .ar_hln = sizeof(struct ether_addr),
+                        .ar_pln = sizeof(struct in_addr),
+                },
+        };
+        struct bpf_insn prog[] = {
+                BPF_STX_MEM(BPF_DW, 10, 1, N_ACD_BPF_XDP_STACK_CTX),            /* ctx = r1 */
+
+                /* pass anything that is not a complete ARP packet */
+                BPF_LDX_MEM(BPF_W, 2, 1, offsetof(struct xdp_md, data)),        /* r2 = xdp->data */
+                BPF_LDX_MEM(BPF_W, 3, 1, offsetof(struct xdp_md, data_end)),    /* r3 = xdp->data_end */
+                BPF_MOV_REG(4, 2),                                              /* r4 = r2 */
+                BPF_ALU_IMM(BPF_ADD, 4, N_ACD_BPF_XDP_OFF(arp_tpa) + 4),        /* r4 += sizeof(ethernet and ARP header) */
+                BPF_JMP_REG(BPF_JLE, 4, 3, 2),                                  /* if (r4 <= r3) skip 2 */
+                BPF_MOV_IMM(0, XDP_PASS),                                       /* r0 = XDP_PASS */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                BPF_LDX_MEM(BPF_H, 0, 2, offsetof(struct ether_header, ether_type)), /* r0 = ether type */
+                BPF_MOV32_IMM(1, htobe16(ETHERTYPE_ARP)),                       /* r1 = ARP */
+                BPF_JMP_REG(BPF_JEQ, 0, 1, 2),                                  /* if (r0 == r1) skip 2 */
+                BPF_MOV_IMM(0, XDP_PASS),                                       /* r0 = XDP_PASS */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                BPF_LDX_MEM(BPF_W, 0, 2, N_ACD_BPF_XDP_OFF(arp_hrd)),           /* r0 = header type and protocol */
+                BPF_MOV32_IMM(1, hdr.u32[0]),                                   /* r1 = ethernet and IP */
+                BPF_JMP_REG(BPF_JEQ, 0, 1, 2),                                  /* if (r0 == r1) skip 2 */
+                BPF_MOV_IMM(0, XDP_PASS),                                       /* r0 = XDP_PASS */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                BPF_LDX_MEM(BPF_H, 0, 2, N_ACD_BPF_XDP_OFF(arp_hln)),           /* r0 = hw and protocol addr length */
+                BPF_MOV32_IMM(1, hdr.u16[2]),                                   /* r1 = ether_addr and in_addr lengths */
+                BPF_JMP_REG(BPF_JEQ, 0, 1, 2),                                  /* if (r0 == r1) skip 2 */
+                BPF_MOV_IMM(0, XDP_PASS),                                       /* r0 = XDP_PASS */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /* pass packets from our own mac address */
+                BPF_LDX_MEM(BPF_W, 0, 2, N_ACD_BPF_XDP_OFF(arp_sha)),           /* r0 = first four bytes of packet mac address */
+                BPF_MOV32_IMM(1, mac.u32[0]),                                   /* r1 = first four bytes of our mac address */
+                BPF_JMP_REG(BPF_JNE, 0, 1, 5),                                  /* if (r0 != r1) skip 5 */
+                BPF_LDX_MEM(BPF_H, 0, 2, N_ACD_BPF_XDP_OFF(arp_sha) + 4),       /* r0 = last two bytes of packet mac address */
+                BPF_MOV32_IMM(1, mac.u16[2]),                                   /* r1 = last two bytes of our mac address */
+                BPF_JMP_REG(BPF_JNE, 0, 1, 2),                                  /* if (r0 != r1) skip 2 */
+                BPF_MOV_IMM(0, XDP_PASS),                                       /* r0 = XDP_PASS */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /* only requests and replies are of interest */
+                BPF_LDX_MEM(BPF_H, 0, 2, N_ACD_BPF_XDP_OFF(ea_hdr.ar_op)),      /* r0 = operation */
+                BPF_JMP_IMM(BPF_JEQ, 0, htobe16(ARPOP_REQUEST), 3),             /* if (r0 == request) skip 3 */
+                BPF_JMP_IMM(BPF_JEQ, 0, htobe16(ARPOP_REPLY), 2),               /* if (r0 == reply) skip 2 */
+                BPF_MOV_IMM(0, XDP_PASS),                                       /* r0 = XDP_PASS */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /* the key is the sender address, keep the packet in r7 */
+                BPF_LDX_MEM(BPF_H, 3, 2, N_ACD_BPF_XDP_OFF(arp_spa)),           /* r3 = first half of sender ip address */
+                BPF_LDX_MEM(BPF_H, 4, 2, N_ACD_BPF_XDP_OFF(arp_spa) + 2),       /* r4 = second half of sender ip address */
+                BPF_STX_MEM(BPF_H, 10, 3, N_ACD_BPF_XDP_STACK_KEY),             /* first half of key = r3 */
+                BPF_STX_MEM(BPF_H, 10, 4, N_ACD_BPF_XDP_STACK_KEY + 2),         /* second half of key = r4 */
+                BPF_MOV_REG(7, 2),                                              /* r7 = r2 */
+        };
+        struct bpf_insn defend[] = {
+                /* look up the sender address, continue below if we do not defend it */
+                BPF_MOV_REG(2, 10),                                             /* r2 = fp */
+                BPF_ALU_IMM(BPF_ADD, 2, N_ACD_BPF_XDP_STACK_KEY),               /* r2 = &key */
+                BPF_LD_MAP_FD(1, defendfd),                                     /* r1 = defendfd */
+                BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem),                        /* r0 = map_lookup_elem(r1, r2) */
+                BPF_JMP_IMM(BPF_JEQ, 0, 0, 50),                                 /* if (r0 == NULL) skip 50 */
+
+                /* r1 = time until which further defenses are rate-limited */
+                BPF_MOV_REG(8, 0),                                              /* r8 = &last_defend */
+                BPF_EMIT_CALL(BPF_FUNC_ktime_get_ns),                           /* r0 = ktime_get_ns() */
+                BPF_MOV_REG(9, 0),                                              /* r9 = r0 */
+                BPF_LDX_MEM(BPF_DW, 1, 8, 0),                                   /* r1 = last_defend */
+                BPF_LD_IMM64(2, N_ACD_RFC_DEFEND_INTERVAL_NSEC),                /* r2 = DEFEND_INTERVAL */
+                BPF_ALU_REG(BPF_ADD, 1, 2),                                     /* r1 += r2 */
+
+                /* prepare the event for userspace */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_STX_MEM(BPF_W, 10, 0, N_ACD_BPF_XDP_STACK_EVENT),           /* clear first third of event */
+                BPF_STX_MEM(BPF_W, 10, 0, N_ACD_BPF_XDP_STACK_EVENT + 4),       /* clear second third of event */
+                BPF_STX_MEM(BPF_W, 10, 0, N_ACD_BPF_XDP_STACK_EVENT + 8),       /* clear last third of event */
+                BPF_LDX_MEM(BPF_W, 0, 10, N_ACD_BPF_XDP_STACK_KEY),             /* r0 = key */
+                BPF_STX_MEM(BPF_W, 10, 0, N_ACD_BPF_XDP_STACK_OFF(addr)),       /* event.addr = r0 */
+                BPF_LDX_MEM(BPF_W, 0, 7, N_ACD_BPF_XDP_OFF(arp_sha)),           /* r0 = first four bytes of packet mac address */
+                BPF_STX_MEM(BPF_W, 10, 0, N_ACD_BPF_XDP_STACK_OFF(sender)),     /* store in event.sender */
+                BPF_LDX_MEM(BPF_H, 0, 7, N_ACD_BPF_XDP_OFF(arp_sha) + 4),       /* r0 = last two bytes of packet mac address */
+                BPF_STX_MEM(BPF_H, 10, 0, N_ACD_BPF_XDP_STACK_OFF(sender) + 4), /* store in event.sender */
+
+                /* drop the packet if rate-limited, otherwise turn it into an announcement */
+                BPF_MOV_IMM(6, XDP_DROP),                                       /* r6 = XDP_DROP */
+                BPF_JMP_REG(BPF_JGT, 1, 9, 22),                                 /* if (r1 > r9) skip 22 */
+                BPF_STX_MEM(BPF_DW, 8, 9, 0),                                   /* last_defend = r9 */
+                BPF_MOV_IMM(0, 1),                                              /* r0 = 1 */
+                BPF_STX_MEM(BPF_B, 10, 0, N_ACD_BPF_XDP_STACK_OFF(defended)),   /* event.defended = r0 */
+                BPF_MOV32_IMM(0, -1),                                           /* r0 = broadcast */
+                BPF_STX_MEM(BPF_W, 7, 0, 0),                                    /* first four bytes of destination = r0 */
+                BPF_STX_MEM(BPF_H, 7, 0, 4),                                    /* last two bytes of destination = r0 */
+                BPF_MOV32_IMM(0, mac.u32[0]),                                   /* r0 = first four bytes of our mac address */
+                BPF_STX_MEM(BPF_W, 7, 0, offsetof(struct ether_header, ether_shost)), /* first four bytes of source = r0 */
+                BPF_STX_MEM(BPF_W, 7, 0, N_ACD_BPF_XDP_OFF(arp_sha)),           /* first four bytes of sender mac address = r0 */
+                BPF_MOV32_IMM(0, mac.u16[2]),                                   /* r0 = last two bytes of our mac address */
+                BPF_STX_MEM(BPF_H, 7, 0, offsetof(struct ether_header, ether_shost) + 4), /* last two bytes of source = r0 */
+                BPF_STX_MEM(BPF_H, 7, 0, N_ACD_BPF_XDP_OFF(arp_sha) + 4),       /* last two bytes of sender mac address = r0 */
+                BPF_MOV32_IMM(0, htobe16(ARPOP_REQUEST)),                       /* r0 = request */
+                BPF_STX_MEM(BPF_H, 7, 0, N_ACD_BPF_XDP_OFF(ea_hdr.ar_op)),      /* operation = r0 */
+                BPF_MOV_IMM(0, 0),                                              /* r0 = 0 */
+                BPF_STX_MEM(BPF_H, 7, 0, N_ACD_BPF_XDP_OFF(arp_tha)),           /* first two bytes of target mac address = r0 */
+                BPF_STX_MEM(BPF_W, 7, 0, N_ACD_BPF_XDP_OFF(arp_tha) + 2),       /* last four bytes of target mac address = r0 */
+                BPF_LDX_MEM(BPF_H, 0, 10, N_ACD_BPF_XDP_STACK_KEY),             /* r0 = first half of key */
+                BPF_STX_MEM(BPF_H, 7, 0, N_ACD_BPF_XDP_OFF(arp_tpa)),           /* first half of target ip address = r0 */
+                BPF_LDX_MEM(BPF_H, 0, 10, N_ACD_BPF_XDP_STACK_KEY + 2),         /* r0 = second half of key */
+                BPF_STX_MEM(BPF_H, 7, 0, N_ACD_BPF_XDP_OFF(arp_tpa) + 2),       /* second half of target ip address = r0 */
+                BPF_MOV_IMM(6, XDP_TX),                                         /* r6 = XDP_TX */
+
+                /* notify userspace, and return the verdict */
+                BPF_LD_MAP_FD(1, ringfd),                                       /* r1 = ringfd */
+                BPF_MOV_REG(2, 10),                                             /* r2 = fp */
+                BPF_ALU_IMM(BPF_ADD, 2, N_ACD_BPF_XDP_STACK_EVENT),             /* r2 = &event */
+                BPF_MOV_IMM(3, sizeof(NAcdBpfXdpEvent)),                        /* r3 = sizeof(event) */
+                BPF_MOV_IMM(4, 0),                                              /* r4 = 0 */
+                BPF_EMIT_CALL(BPF_FUNC_ringbuf_output),                         /* r0 = ringbuf_output(r1, r2, r3, r4) */
+                BPF_MOV_REG(0, 6),                                              /* r0 = r6 */
+                BPF_EXIT_INSN(),                                                /* return */
+        };
+        struct bpf_insn steer[] = {
+                /*
+                 * Like the socket filter, we are interested in conflicts for
+                 * the sender address, and probes for the target address. The
+                 * key is the sender address so far, replace it for probes.
+                 */
+                BPF_LDX_MEM(BPF_W, 0, 10, N_ACD_BPF_XDP_STACK_KEY),             /* r0 = key */
+                BPF_JMP_IMM(BPF_JNE, 0, 0, 8),                                  /* if (r0 != 0) skip 8 */
+                BPF_LDX_MEM(BPF_H, 0, 7, N_ACD_BPF_XDP_OFF(ea_hdr.ar_op)),      /* r0 = operation */
+                BPF_JMP_IMM(BPF_JEQ, 0, htobe16(ARPOP_REQUEST), 2),             /* if (r0 == request) skip 2 */
+                BPF_MOV_IMM(0, XDP_PASS),                                       /* r0 = XDP_PASS */
+                BPF_EXIT_INSN(),                                                /* return */
+                BPF_LDX_MEM(BPF_H, 3, 7, N_ACD_BPF_XDP_OFF(arp_tpa)),           /* r3 = first half of target ip address */
+                BPF_LDX_MEM(BPF_H, 4, 7, N_ACD_BPF_XDP_OFF(arp_tpa) + 2),       /* r4 = second half of target ip address */
+                BPF_STX_MEM(BPF_H, 10, 3, N_ACD_BPF_XDP_STACK_KEY),             /* first half of key = r3 */
+                BPF_STX_MEM(BPF_H, 10, 4, N_ACD_BPF_XDP_STACK_KEY + 2),         /* second half of key = r4 */
+
+                /* pass the packet if the address is not monitored */
+                BPF_MOV_REG(2, 10),                                             /* r2 = fp */
+                BPF_ALU_IMM(BPF_ADD, 2, N_ACD_BPF_XDP_STACK_KEY),               /* r2 = &key */
+                BPF_LD_MAP_FD(1, mapfd),                                        /* r1 = mapfd */
+                BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem),                        /* r0 = map_lookup_elem(r1, r2) */
+                BPF_JMP_IMM(BPF_JNE, 0, 0, 2),                                  /* if (r0 != NULL) skip 2 */
+                BPF_MOV_IMM(0, XDP_PASS),                                       /* r0 = XDP_PASS */
+                BPF_EXIT_INSN(),                                                /* return */
+
+                /* redirect to the socket of this queue, or pass the packet if there is none */
+                BPF_LDX_MEM(BPF_DW, 1, 10, N_ACD_BPF_XDP_STACK_CTX),            /* r1 = ctx */
+                BPF_LDX_MEM(BPF_W, 2, 1, offsetof(struct xdp_md, rx_queue_index)), /* r2 = xdp->rx_queue_index */
+                BPF_LD_MAP_FD(1, xskfd),                                        /* r1 = xskfd */
+                BPF_MOV_IMM(3, XDP_PASS),                                       /* r3 = XDP_PASS */
+                BPF_EMIT_CALL(BPF_FUNC_redirect_map),                           /* r0 = redirect_map(r1, r2, r3) */
+                BPF_EXIT_INSN(),                                                /* return */
+        };
+        struct bpf_insn pass[] = {
+                BPF_MOV_IMM(0, XDP_PASS),                                       /* r0 = XDP_PASS */
+                BPF_EXIT_INSN(),                                                /* return */
+        };
+        struct bpf_insn code[C_ARRAY_SIZE(prog) +
+                             C_ARRAY_SIZE(defend) +
+                             C_ARRAY_SIZE(steer) +
+                             C_ARRAY_SIZE(pass)];
+        size_t n_code = 0;
+
+        memcpy(code + n_code, prog, sizeof(prog));
+        n_code += C_ARRAY_SIZE(prog);
+
+        if (defendfd >= 0) {
+                memcpy(code + n_code, defend, sizeof(defend));
+                n_code += C_ARRAY_SIZE(defend);
+        }
+
+        if (xskfd >= 0) {
+                memcpy(code + n_code, steer, sizeof(steer));
+                n_code += C_ARRAY_SIZE(steer);
+        } else {
+                memcpy(code + n_code, pass, sizeof(pass));
+                n_code += C_ARRAY_SIZE(pass);
+        }
+
+        return n_acd_bpf_load(progfdp, BPF_PROG_TYPE_XDP, code, n_code);
+}
+
+int n_acd_bpf_xdp_attach(int *linkfdp, int progfd, int ifindex, bool generic) {
+        union bpf_attr attr;
+        int linkfd;
+
+        /*
+         * A BPF link detaches the program automatically when the last file
+         * descriptor to it is closed, so it cannot be leaked on the
+         * interface.
+         */
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = progfd;
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = generic ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE;
+
+        linkfd = n_acd_syscall_bpf(BPF_LINK_CREATE, &attr, sizeof(attr));
+        if (linkfd < 0)
+                return -errno;
+
+        *linkfdp = linkfd;
+        return 0;
+}
+
+int n_acd_bpf_xdp_update(int linkfd, int progfd) {
+        union bpf_attr attr;
+        int r;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.link_update.link_fd = linkfd;
+        attr.link_update.new_prog_fd = progfd;
+
+        r = n_acd_syscall_bpf(BPF_LINK_UPDATE, &attr, sizeof(attr));
+        if (r < 0)
+                return -errno;
+
+        return 0;
+}
+
+/*
+ * The AF_XDP socket only ever receives, so it needs few and small frames. The
+ * completion ring is required by the kernel, but never used.
+ */
+#define N_ACD_BPF_XSK_N_FRAMES (32)
+#define N_ACD_BPF_XSK_FRAME_SIZE (2048)
+
+static int n_acd_bpf_xsk_map_ring(int fd,
+                                  size_t size,
+                                  uint64_t pgoff,
+                                  const struct xdp_ring_offset *off,
+                                  NAcdBpfXskRing *ring) {
+        void *map;
+
+        ring->n_map = off->desc + N_ACD_BPF_XSK_N_FRAMES * size;
+        map = mmap(NULL, ring->n_map, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+        if (map == MAP_FAILED)
+                return -errno;
+
+        ring->map = map;
+        ring->producer = (uint32_t *)((uint8_t *)map + off->producer);
+        ring->consumer = (uint32_t *)((uint8_t *)map + off->consumer);
+        ring->desc = (uint8_t *)map + off->desc;
+        return 0;
+}
+
+/**
+ * n_acd_bpf_xsk_init() - create AF_XDP socket
+ * @xsk:                        socket to initialize
+ * @ifindex:                    interface to bind to
+ *
+ * This creates an AF_XDP socket with its own UMEM, and binds it to the first
+ * receive queue of @ifindex. All frames are handed to the kernel via the fill
+ * ring right away, and each received frame is handed back once consumed.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_acd_bpf_xsk_init(NAcdBpfXsk *xsk, int ifindex) {
+        struct xdp_umem_reg umem_reg;
+        struct xdp_mmap_offsets off;
+        struct sockaddr_xdp address;
+        unsigned int n_ring = N_ACD_BPF_XSK_N_FRAMES;
+        socklen_t n_off = sizeof(off);
+        uint64_t *fill;
+        void *umem;
+        int r;
+
+        *xsk = (NAcdBpfXsk)N_ACD_BPF_XSK_NULL(*xsk);
+
+        xsk->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+        if (xsk->fd < 0) {
+                r = -errno;
+                goto error;
+        }
+
+        xsk->n_umem = N_ACD_BPF_XSK_N_FRAMES * N_ACD_BPF_XSK_FRAME_SIZE;
+        umem = mmap(NULL, xsk->n_umem, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (umem == MAP_FAILED) {
+                r = -errno;
+                goto error;
+        }
+        xsk->umem = umem;
+
+        umem_reg = (struct xdp_umem_reg){
+                .addr = (uint64_t)(unsigned long)umem,
+                .len = xsk->n_umem,
+                .chunk_size = N_ACD_BPF_XSK_FRAME_SIZE,
+        };
+        r = setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg));
+        if (r < 0) {
+                r = -errno;
+                goto error;
+        }
+
+        r = setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &n_ring, sizeof(n_ring));
+        if (r >= 0)
+                r = setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &n_ring, sizeof(n_ring));
+        if (r >= 0)
+                r = setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &n_ring, sizeof(n_ring));
+        if (r >= 0)
+                r = getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &n_off);
+        if (r < 0) {
+                r = -errno;
+                goto error;
+        }
+
+        r = n_acd_bpf_xsk_map_ring(xsk->fd, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING, &off.fr, &xsk->fill);
+        if (r)
+                goto error;
+
+        r = n_acd_bpf_xsk_map_ring(xsk->fd, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING, &off.rx, &xsk->rx);
+        if (r)
+                goto error;
+
+        fill = xsk->fill.desc;
+        for (size_t i = 0; i < N_ACD_BPF_XSK_N_FRAMES; ++i)
+                fill[i] = i * N_ACD_BPF_XSK_FRAME_SIZE;
+        __atomic_store_n(xsk->fill.producer, N_ACD_BPF_XSK_N_FRAMES, __ATOMIC_RELEASE);
+
+        /* let the kernel pick zero-copy mode if the driver supports it */
+        address = (struct sockaddr_xdp){
+                .sxdp_family = AF_XDP,
+                .sxdp_ifindex = ifindex,
+                .sxdp_queue_id = 0,
+        };
+        r = bind(xsk->fd, (struct sockaddr *)&address, sizeof(address));
+        if (r < 0) {
+                r = -errno;
+                goto error;
+        }
+
+        return 0;
+
+error:
+        n_acd_bpf_xsk_deinit(xsk);
+        return r;
+}
+
+void n_acd_bpf_xsk_deinit(NAcdBpfXsk *xsk) {
+        if (xsk->rx.map)
+                munmap(xsk->rx.map, xsk->rx.n_map);
+        if (xsk->fill.map)
+                munmap(xsk->fill.map, xsk->fill.n_map);
+        c_close(xsk->fd);
+        if (xsk->umem)
+                munmap(xsk->umem, xsk->n_umem);
+        *xsk = (NAcdBpfXsk)N_ACD_BPF_XSK_NULL(*xsk);
+}
+
+/*
+ * Copy the ARP payload of the next frame received on @xsk into @data, which
+ * can hold @n_datap bytes, and return its size in @n_datap, truncated to the
+ * size of @data. If nothing was received, 0 is returned in @n_datap.
+ */
+int n_acd_bpf_xsk_pop(NAcdBpfXsk *xsk, void *data, size_t *n_datap) {
+        const size_t n_ring = N_ACD_BPF_XSK_N_FRAMES;
+        uint32_t consumer, producer, fill;
+        struct xdp_desc *desc;
+        size_t n;
+
+        consumer = *xsk->rx.consumer;
+        producer = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE);
+
+        if (consumer == producer) {
+                *n_datap = 0;
+                return 0;
+        }
+
+        desc = (struct xdp_desc *)xsk->rx.desc + (consumer & (n_ring - 1));
+
+        /* the XDP program only redirects complete ARP packets */
+        c_assert(desc->len >= sizeof(struct ether_header));
+        n = desc->len - sizeof(struct ether_header);
+        if (n > *n_datap)
+                n = *n_datap;
+        memcpy(data, (uint8_t *)xsk->umem + desc->addr + sizeof(struct ether_header), n);
+        *n_datap = n;
+
+        /* hand the frame back to the kernel */
+        fill = *xsk->fill.producer;
+        ((uint64_t *)xsk->fill.desc)[fill & (n_ring - 1)] = desc->addr;
+        __atomic_store_n(xsk->fill.producer, fill + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(xsk->rx.consumer, consumer + 1, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+int n_acd_bpf_xsk_map_create(int *mapfdp, NAcdBpfXsk *xsk) {
+        _c_cleanup_(c_closep) int mapfd = -1;
+        uint32_t key = 0, value = xsk->fd;
+        union bpf_attr attr;
+        int r;
+
+        /* the socket is bound to the first queue only */
+        memset(&attr, 0, sizeof(attr));
+        attr = (union bpf_attr){
+                .map_type    = BPF_MAP_TYPE_XSKMAP,
+                .key_size    = sizeof(key),
+                .value_size  = sizeof(value),
+                .max_entries = 1,
+        };
+
+        mapfd = n_acd_syscall_bpf(BPF_MAP_CREATE, &attr, sizeof(attr));
+        if (mapfd < 0)
+                return -errno;
+
+        r = n_acd_bpf_map_update(mapfd, &key, &value, BPF_ANY);
+        if (r)
+                return r;
+
+        *mapfdp = mapfd;
+        mapfd = -1;
         return 0;
 }
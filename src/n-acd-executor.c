@@ -0,0 +1,428 @@
+/*
+ * IPv4 Address Conflict Detection
+ *
+ * This file implements the executor object. An executor dispatches many
+ * contexts on a pool of worker threads. The epoll-fd of each context is
+ * registered one-shot on the epoll-fd of the executor, so a ready context is
+ * reported to exactly one worker, and not again until it was dispatched and
+ * re-armed. Ready contexts are queued on the worker that polled them, and idle
+ * workers steal from the queues of busy ones.
+ */
+
+#include <assert.h>
+#include <c-list.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+
+#define N_ACD_EXECUTOR_BATCH (16)
+
+/* the context the current thread is dispatching, if it is a worker */
+static _Thread_local NAcd *n_acd_executor_current;
+
+static int n_acd_executor_arm(NAcdExecutor *executor, NAcd *acd, int op) {
+        int r;
+
+        r = epoll_ctl(executor->fd_epoll,
+                      op,
+                      acd->fd_epoll,
+                      &(struct epoll_event){
+                              .events = EPOLLIN | EPOLLONESHOT,
+                              .data.ptr = acd,
+                      });
+        if (r < 0)
+                return -c_errno();
+
+        return 0;
+}
+
+static void n_acd_executor_detach(NAcdExecutor *executor, NAcd *acd) {
+        c_list_unlink(&acd->executor_link);
+        acd->executor = NULL;
+        acd->executor_fn = NULL;
+        acd->executor_userdata = NULL;
+        acd->executor_state = N_ACD_EXECUTOR_STATE_IDLE;
+        acd->executor_removed = false;
+        acd->executor_release = false;
+}
+
+static NAcd *n_acd_executor_pop(NAcdExecutor *executor, NAcdExecutorWorker *worker) {
+        NAcdExecutorWorker *victim;
+        size_t self = worker - executor->workers;
+        NAcd *acd;
+
+        /* newest entry of our own queue first, it is most likely cache-hot */
+        acd = c_list_last_entry(&worker->queue, NAcd, executor_queue_link);
+        if (acd)
+                return acd;
+
+        /* otherwise, steal the oldest entry of the next busy worker */
+        for (size_t i = 1; i < executor->n_workers; ++i) {
+                victim = &executor->workers[(self + i) % executor->n_workers];
+                acd = c_list_first_entry(&victim->queue, NAcd, executor_queue_link);
+                if (acd)
+                        return acd;
+        }
+
+        return NULL;
+}
+
+static void n_acd_executor_poll(NAcdExecutor *executor, NAcdExecutorWorker *worker) {
+        struct epoll_event events[N_ACD_EXECUTOR_BATCH];
+        eventfd_t value;
+        NAcd *acd;
+        int n;
+
+        /*
+         * Only one worker polls at a time, all others sleep on the condition
+         * until it queued what it found. A context reported here may have
+         * been removed in the meantime, but its remover waits for this poll
+         * to finish before it lets go of the context.
+         */
+        executor->polling = true;
+        pthread_mutex_unlock(&executor->lock);
+
+        n = epoll_wait(executor->fd_epoll, events, C_ARRAY_SIZE(events), -1);
+        c_assert(n >= 0 || errno == EINTR);
+
+        pthread_mutex_lock(&executor->lock);
+        executor->polling = false;
+        ++executor->poll_epoch;
+
+        for (int i = 0; i < n; ++i) {
+                acd = events[i].data.ptr;
+
+                if (!acd) {
+                        /* keep the wakeup pending on shutdown, for all workers */
+                        if (!executor->stop)
+                                eventfd_read(executor->fd_wake, &value);
+                        continue;
+                }
+
+                if (acd->executor_removed)
+                        continue;
+
+                c_assert(acd->executor_state == N_ACD_EXECUTOR_STATE_ARMED);
+                acd->executor_state = N_ACD_EXECUTOR_STATE_QUEUED;
+                c_list_link_tail(&worker->queue, &acd->executor_queue_link);
+        }
+
+        pthread_cond_broadcast(&executor->cond);
+}
+
+static bool n_acd_executor_requeue(NAcdExecutor *executor, NAcdExecutorWorker *worker, NAcd *acd, int r) {
+        if (acd->executor_release) {
+                /* removed by its own callback, so nothing waits for it */
+                epoll_ctl(executor->fd_epoll, EPOLL_CTL_DEL, acd->fd_epoll, NULL);
+                n_acd_executor_detach(executor, acd);
+                return true;
+        }
+
+        if (acd->executor_removed) {
+                acd->executor_state = N_ACD_EXECUTOR_STATE_IDLE;
+                pthread_cond_broadcast(&executor->cond);
+                return false;
+        }
+
+        if (r == N_ACD_E_PREEMPTED) {
+                /*
+                 * The context is still ready. Queue it behind everything else
+                 * we have, where it is also the first to be stolen.
+                 */
+                acd->executor_state = N_ACD_EXECUTOR_STATE_QUEUED;
+                c_list_link_front(&worker->queue, &acd->executor_queue_link);
+                pthread_cond_signal(&executor->cond);
+        } else if (r) {
+                /* the callback saw the error, leave the context alone */
+                acd->executor_state = N_ACD_EXECUTOR_STATE_IDLE;
+        } else {
+                acd->executor_state = N_ACD_EXECUTOR_STATE_ARMED;
+                r = n_acd_executor_arm(executor, acd, EPOLL_CTL_MOD);
+                c_assert(!r);
+        }
+
+        return false;
+}
+
+static void *n_acd_executor_thread(void *userdata) {
+        NAcdExecutorWorker *worker = userdata;
+        NAcdExecutor *executor = worker->executor;
+        bool release;
+        NAcd *acd;
+        int r;
+
+        pthread_mutex_lock(&executor->lock);
+
+        while (!executor->stop) {
+                acd = n_acd_executor_pop(executor, worker);
+                if (acd) {
+                        /*
+                         * The context is exclusively ours until it is
+                         * re-queued or re-armed. The lock hands it over
+                         * between workers, along with all its state.
+                         */
+                        c_list_unlink(&acd->executor_queue_link);
+                        acd->executor_state = N_ACD_EXECUTOR_STATE_RUNNING;
+                        pthread_mutex_unlock(&executor->lock);
+
+                        n_acd_executor_current = acd;
+                        r = n_acd_dispatch(acd);
+                        acd->executor_fn(acd, r, acd->executor_userdata);
+                        n_acd_executor_current = NULL;
+
+                        pthread_mutex_lock(&executor->lock);
+                        release = n_acd_executor_requeue(executor, worker, acd, r);
+
+                        if (release) {
+                                pthread_mutex_unlock(&executor->lock);
+                                n_acd_unref(acd);
+                                pthread_mutex_lock(&executor->lock);
+                        }
+                } else if (!executor->polling) {
+                        n_acd_executor_poll(executor, worker);
+                } else {
+                        pthread_cond_wait(&executor->cond, &executor->lock);
+                }
+        }
+
+        pthread_mutex_unlock(&executor->lock);
+        return NULL;
+}
+
+/**
+ * n_acd_executor_new() - create a new executor
+ * @executorp:                  output argument for new executor object
+ * @n_threads:                  number of worker threads
+ *
+ * This creates a new executor with @n_threads worker threads, and returns it
+ * in @executorp. Contexts added to the executor via n_acd_executor_add() are
+ * dispatched by the workers whenever they are ready, instead of by the
+ * caller.
+ *
+ * The worker threads are started right away, with all signals blocked. They
+ * run until the executor is freed.
+ *
+ * Return: 0 on success, N_ACD_E_INVALID_ARGUMENT if the number of threads is
+ *         invalid, negative error code on failure.
+ */
+_c_public_ int n_acd_executor_new(NAcdExecutor **executorp, unsigned int n_threads) {
+        _c_cleanup_(n_acd_executor_freep) NAcdExecutor *executor = NULL;
+        NAcdExecutorWorker *worker;
+        sigset_t mask, mask_old;
+        int r;
+
+        if (!n_threads || n_threads > N_ACD_EXECUTOR_MAX)
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        executor = malloc(sizeof(*executor) + n_threads * sizeof(*executor->workers));
+        if (!executor)
+                return -ENOMEM;
+
+        *executor = (NAcdExecutor)N_ACD_EXECUTOR_NULL(*executor);
+        pthread_mutex_init(&executor->lock, NULL);
+        pthread_cond_init(&executor->cond, NULL);
+
+        executor->fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (executor->fd_epoll < 0)
+                return -c_errno();
+
+        executor->fd_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (executor->fd_wake < 0)
+                return -c_errno();
+
+        r = epoll_ctl(executor->fd_epoll,
+                      EPOLL_CTL_ADD,
+                      executor->fd_wake,
+                      &(struct epoll_event){
+                              .events = EPOLLIN,
+                              .data.ptr = NULL,
+                      });
+        if (r < 0)
+                return -c_errno();
+
+        sigfillset(&mask);
+        pthread_sigmask(SIG_SETMASK, &mask, &mask_old);
+
+        for (size_t i = 0; i < n_threads; ++i) {
+                worker = &executor->workers[i];
+                *worker = (NAcdExecutorWorker){
+                        .executor = executor,
+                        .queue = C_LIST_INIT(worker->queue),
+                };
+
+                /* running workers steal from all queues up to n_workers */
+                pthread_mutex_lock(&executor->lock);
+                r = pthread_create(&worker->thread, NULL, n_acd_executor_thread, worker);
+                if (!r)
+                        ++executor->n_workers;
+                pthread_mutex_unlock(&executor->lock);
+
+                if (r)
+                        break;
+        }
+
+        pthread_sigmask(SIG_SETMASK, &mask_old, NULL);
+
+        if (r)
+                return -r;
+
+        *executorp = executor;
+        executor = NULL;
+        return 0;
+}
+
+/**
+ * n_acd_executor_free() - free an executor
+ * @executor:                   executor to operate on, or NULL
+ *
+ * This stops all worker threads of @executor, waiting for any running callback
+ * to return, and then removes all contexts that are still added, and frees the
+ * executor. If @executor is NULL, this is a no-op.
+ *
+ * This must not be called from a callback of the executor.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ NAcdExecutor *n_acd_executor_free(NAcdExecutor *executor) {
+        NAcd *acd, *t_acd;
+
+        if (!executor)
+                return NULL;
+
+        pthread_mutex_lock(&executor->lock);
+        executor->stop = true;
+        pthread_cond_broadcast(&executor->cond);
+        pthread_mutex_unlock(&executor->lock);
+
+        if (executor->fd_wake >= 0)
+                eventfd_write(executor->fd_wake, 1);
+
+        for (size_t i = 0; i < executor->n_workers; ++i)
+                pthread_join(executor->workers[i].thread, NULL);
+
+        c_list_for_each_entry_safe(acd, t_acd, &executor->acd_list, executor_link) {
+                epoll_ctl(executor->fd_epoll, EPOLL_CTL_DEL, acd->fd_epoll, NULL);
+                c_list_unlink(&acd->executor_queue_link);
+                n_acd_executor_detach(executor, acd);
+                n_acd_unref(acd);
+        }
+
+        c_close(executor->fd_wake);
+        c_close(executor->fd_epoll);
+        pthread_cond_destroy(&executor->cond);
+        pthread_mutex_destroy(&executor->lock);
+        free(executor);
+
+        return NULL;
+}
+
+/**
+ * n_acd_executor_add() - add a context to an executor
+ * @executor:                   executor to operate on
+ * @acd:                        context to add
+ * @fn:                         callback
+ * @userdata:                   userdata passed to @fn
+ *
+ * This adds the context @acd to @executor. The executor takes a reference to
+ * the context, and dispatches it on one of its workers whenever it is ready.
+ * After each dispatch, @fn is called on the same worker, with the return
+ * value of n_acd_dispatch() in @r. The callback must drain the event-queue of
+ * the context via n_acd_pop_event().
+ *
+ * A context is never dispatched on two workers at once, and its callback is
+ * the only place it may be used in while it is added. That includes starting
+ * and freeing probes, as well as popping events. Different contexts are
+ * dispatched in parallel, so contexts that share a filter cannot be added.
+ *
+ * If the dispatcher fails, the context is not dispatched again, and the
+ * callback should remove it.
+ *
+ * Return: 0 on success, N_ACD_E_INVALID_ARGUMENT if the context is already
+ *         added or uses a shared filter, negative error code on failure.
+ */
+_c_public_ int n_acd_executor_add(NAcdExecutor *executor, NAcd *acd, NAcdExecutorFn fn, void *userdata) {
+        int r;
+
+        if (!fn || acd->executor || (acd->filter && !acd->multi_interface))
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        pthread_mutex_lock(&executor->lock);
+
+        acd->executor = executor;
+        acd->executor_fn = fn;
+        acd->executor_userdata = userdata;
+        acd->executor_state = N_ACD_EXECUTOR_STATE_ARMED;
+
+        r = n_acd_executor_arm(executor, acd, EPOLL_CTL_ADD);
+        if (r) {
+                n_acd_executor_detach(executor, acd);
+                pthread_mutex_unlock(&executor->lock);
+                return r;
+        }
+
+        c_list_link_tail(&executor->acd_list, &acd->executor_link);
+        n_acd_ref(acd);
+
+        pthread_mutex_unlock(&executor->lock);
+        return 0;
+}
+
+/**
+ * n_acd_executor_remove() - remove a context from an executor
+ * @executor:                   executor to operate on
+ * @acd:                        context to remove
+ *
+ * This removes the context @acd from @executor, and releases the reference of
+ * the executor. If the context is not added to @executor, this is a no-op.
+ *
+ * If the context is being dispatched on a worker, this waits for its callback
+ * to return. Once this function returns, the caller owns the context again.
+ * As an exception, a callback may remove its own context, which is then
+ * released once the callback returns.
+ */
+_c_public_ void n_acd_executor_remove(NAcdExecutor *executor, NAcd *acd) {
+        uint64_t epoch;
+
+        pthread_mutex_lock(&executor->lock);
+
+        if (acd->executor != executor || acd->executor_removed) {
+                pthread_mutex_unlock(&executor->lock);
+                return;
+        }
+
+        acd->executor_removed = true;
+
+        if (n_acd_executor_current == acd) {
+                acd->executor_release = true;
+                pthread_mutex_unlock(&executor->lock);
+                return;
+        }
+
+        epoll_ctl(executor->fd_epoll, EPOLL_CTL_DEL, acd->fd_epoll, NULL);
+
+        /* a running poll might have reported the context already */
+        if (executor->polling) {
+                epoch = executor->poll_epoch;
+                eventfd_write(executor->fd_wake, 1);
+
+                while (executor->polling && executor->poll_epoch == epoch)
+                        pthread_cond_wait(&executor->cond, &executor->lock);
+        }
+
+        c_list_unlink(&acd->executor_queue_link);
+
+        while (acd->executor_state == N_ACD_EXECUTOR_STATE_RUNNING)
+                pthread_cond_wait(&executor->cond, &executor->lock);
+
+        n_acd_executor_detach(executor, acd);
+
+        pthread_mutex_unlock(&executor->lock);
+
+        n_acd_unref(acd);
+}
@@ -0,0 +1,333 @@
+/*
+ * IPv4 Address Conflict Detection
+ *
+ * This file implements the fanout object. A fanout owns one packet socket per
+ * shard, all joined into a single PACKET_FANOUT group on one interface. The
+ * kernel distributes ARP packets across the group by their address, so each
+ * shard only sees the packets for its own share of the addresses. Every shard
+ * is driven by its own context, which can be dispatched on its own thread.
+ */
+
+#include <assert.h>
+#include <c-stdaux.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <netinet/if_ether.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+
+/*
+ * The kernel hands the fanout program the packet starting at the ARP header,
+ * just like socket filters. The program hashes the sender address, or the
+ * target address for probes, and returns the index of the shard. The kernel
+ * then delivers the packet to the socket that joined the group as that
+ * index. n_acd_fanout_get_shard() is the userspace counterpart, and must be
+ * kept in sync.
+ *
+ * The offsets are only valid for received packets. The kernel runs the
+ * program on outgoing packets too, with the link-layer header still in front,
+ * but packet sockets bound to ETH_P_ARP, unlike ETH_P_ALL, are never handed
+ * outgoing packets. The program still checks the packet type, and steers
+ * anything outgoing to the first shard, rather than hashing the wrong bytes.
+ */
+#define N_ACD_FANOUT_HASH (UINT32_C(0x9e3779b1))
+
+static int n_acd_fanout_attach_drop(int fd) {
+        struct sock_filter drop[] = {
+                BPF_STMT(BPF_RET | BPF_K, 0),                                           /* return 0 */
+        };
+        struct sock_fprog fprog = {
+                .len = C_ARRAY_SIZE(drop),
+                .filter = drop,
+        };
+        int r;
+
+        r = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+        if (r < 0)
+                return -c_errno();
+
+        return 0;
+}
+
+static int n_acd_fanout_attach_demux(int fd, size_t n_shards) {
+        struct sock_filter demux[] = {
+                BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),        /* A = packet type */
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 0, 1),             /* if (A != outgoing) skip 1 */
+                BPF_STMT(BPF_RET | BPF_K, 0),                                           /* return 0 */
+                BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct ether_arp, arp_spa)), /* A = sender ip address */
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1),                           /* if (A != 0) skip 1 */
+                BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct ether_arp, arp_tpa)), /* A = target ip address */
+                BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, N_ACD_FANOUT_HASH),                 /* A *= N_ACD_FANOUT_HASH */
+                BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),                                /* A >>= 16 */
+                BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n_shards),                          /* A %= n_shards */
+                BPF_STMT(BPF_RET | BPF_A, 0),                                           /* return A */
+        };
+        struct sock_fprog fprog = {
+                .len = C_ARRAY_SIZE(demux),
+                .filter = demux,
+        };
+        int r;
+
+        r = setsockopt(fd, SOL_PACKET, PACKET_FANOUT_DATA, &fprog, sizeof(fprog));
+        if (r < 0)
+                return -c_errno();
+
+        return 0;
+}
+
+static int n_acd_fanout_socket_new(int *fdp, int ifindex) {
+        const struct sockaddr_ll address = {
+                .sll_family = AF_PACKET,
+                .sll_protocol = htobe16(ETH_P_ARP),
+                .sll_ifindex = ifindex,
+        };
+        _c_cleanup_(c_closep) int fd = -1;
+        int r;
+
+        fd = socket(PF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (fd < 0)
+                return -c_errno();
+
+        /* nothing is received until a context attaches its own filter */
+        r = n_acd_fanout_attach_drop(fd);
+        if (r)
+                return r;
+
+        r = bind(fd, (struct sockaddr *)&address, sizeof(address));
+        if (r < 0)
+                return -c_errno();
+
+        *fdp = fd;
+        fd = -1;
+        return 0;
+}
+
+/**
+ * n_acd_fanout_new() - create a new fanout
+ * @fanoutp:                    output argument for new fanout object
+ * @ifindex:                    interface to shard
+ * @n_shards:                   number of shards
+ *
+ * This creates a new fanout over the interface @ifindex, and returns it in
+ * @fanoutp. The addresses on the interface are split into @n_shards shards.
+ * Each shard is driven by its own context, selected via
+ * n_acd_config_set_fanout(), and each context only accepts probes for the
+ * addresses in its shard. n_acd_fanout_get_shard() tells which shard an
+ * address belongs to.
+ *
+ * The contexts of a fanout are independent of each other. Each has its own
+ * timer and event queue, and they may be dispatched on separate threads.
+ * Packets are distributed to them by the kernel.
+ *
+ * Return: 0 on success, N_ACD_E_INVALID_ARGUMENT if the interface or number
+ *         of shards is invalid, negative error code on failure.
+ */
+_c_public_ int n_acd_fanout_new(NAcdFanout **fanoutp, int ifindex, unsigned int n_shards) {
+        _c_cleanup_(n_acd_fanout_unrefp) NAcdFanout *fanout = NULL;
+        socklen_t n_arg;
+        int r, arg;
+
+        if (ifindex <= 0 || !n_shards || n_shards > N_ACD_FANOUT_MAX)
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        fanout = malloc(sizeof(*fanout) + n_shards * sizeof(*fanout->fds));
+        if (!fanout)
+                return -ENOMEM;
+
+        *fanout = (NAcdFanout)N_ACD_FANOUT_NULL(*fanout);
+        fanout->ifindex = ifindex;
+
+        /*
+         * The kernel assigns shard indices in the order sockets join the
+         * group, so all sockets are created up-front, in order. The first
+         * one asks for a unique group id, which the others then join.
+         */
+        for (size_t i = 0; i < n_shards; ++i) {
+                r = n_acd_fanout_socket_new(&fanout->fds[i], ifindex);
+                if (r)
+                        return r;
+
+                ++fanout->n_shards;
+
+                if (i)
+                        arg = fanout->id | (PACKET_FANOUT_CBPF << 16);
+                else
+                        arg = (PACKET_FANOUT_CBPF | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+
+                r = setsockopt(fanout->fds[i], SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg));
+                if (r < 0)
+                        return -c_errno();
+
+                if (!i) {
+                        n_arg = sizeof(arg);
+                        r = getsockopt(fanout->fds[i], SOL_PACKET, PACKET_FANOUT, &arg, &n_arg);
+                        if (r < 0)
+                                return -c_errno();
+
+                        fanout->id = arg & 0xffff;
+
+                        r = n_acd_fanout_attach_demux(fanout->fds[i], n_shards);
+                        if (r)
+                                return r;
+                }
+        }
+
+        *fanoutp = fanout;
+        fanout = NULL;
+        return 0;
+}
+
+static void n_acd_fanout_free_internal(NAcdFanout *fanout) {
+        if (!fanout)
+                return;
+
+        for (size_t i = 0; i < fanout->n_shards; ++i)
+                c_close(fanout->fds[i]);
+
+        free(fanout);
+}
+
+/**
+ * n_acd_fanout_ref() - acquire reference
+ * @fanout:                     fanout to operate on, or NULL
+ *
+ * This acquires a single reference to the fanout specified as @fanout. If
+ * @fanout is NULL, this is a no-op. Unlike other objects, references to a
+ * fanout may be acquired and released from any thread.
+ *
+ * Return: @fanout is returned.
+ */
+_c_public_ NAcdFanout *n_acd_fanout_ref(NAcdFanout *fanout) {
+        if (fanout)
+                atomic_fetch_add(&fanout->n_refs, 1);
+        return fanout;
+}
+
+/**
+ * n_acd_fanout_unref() - release reference
+ * @fanout:                     fanout to operate on, or NULL
+ *
+ * This releases a single reference to the fanout @fanout. If this is the last
+ * reference, the fanout is torn down and deallocated. Note that each context
+ * using the fanout holds a reference to it.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ NAcdFanout *n_acd_fanout_unref(NAcdFanout *fanout) {
+        if (fanout && atomic_fetch_sub(&fanout->n_refs, 1) == 1)
+                n_acd_fanout_free_internal(fanout);
+        return NULL;
+}
+
+/**
+ * n_acd_fanout_get_shard() - get shard of an address
+ * @fanout:                     fanout to operate on
+ * @ip:                         address to look up
+ *
+ * Return: The index of the shard that @ip belongs to.
+ */
+_c_public_ unsigned int n_acd_fanout_get_shard(NAcdFanout *fanout, struct in_addr ip) {
+        uint32_t hash = be32toh(ip.s_addr) * N_ACD_FANOUT_HASH;
+
+        return (hash >> 16) % fanout->n_shards;
+}
+
+/**
+ * n_acd_fanout_claim() - claim a shard
+ * @fanout:                     fanout to operate on
+ * @shard:                      index of the shard
+ *
+ * This marks @shard as taken by a context. Each shard can only be driven by a
+ * single context, since the filter one context attaches to the socket of the
+ * shard would replace the filter of the other. The shard must be released
+ * with n_acd_fanout_release() once the context is done with it.
+ *
+ * Return: 0 on success, N_ACD_E_INVALID_ARGUMENT if the shard is taken.
+ */
+int n_acd_fanout_claim(NAcdFanout *fanout, unsigned int shard) {
+        c_assert(shard < fanout->n_shards);
+
+        if (atomic_exchange(&fanout->taken[shard], true))
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        return 0;
+}
+
+/**
+ * n_acd_fanout_release() - release a shard
+ * @fanout:                     fanout to operate on
+ * @shard:                      index of the shard
+ *
+ * This releases a shard claimed with n_acd_fanout_claim(), so another context
+ * can drive it.
+ */
+void n_acd_fanout_release(NAcdFanout *fanout, unsigned int shard) {
+        c_assert(shard < fanout->n_shards);
+        c_assert(atomic_load(&fanout->taken[shard]));
+
+        atomic_store(&fanout->taken[shard], false);
+}
+
+/**
+ * n_acd_fanout_open() - open the socket of a shard
+ * @fanout:                     fanout to operate on
+ * @shard:                      index of the shard
+ * @fd_bpf_prog:                eBPF socket filter to attach, or -1
+ * @fdp:                        output argument for the socket
+ *
+ * This returns a new file-descriptor for the socket of @shard. The socket
+ * stays in the group when the file-descriptor is closed, and must be released
+ * with n_acd_fanout_close(), so it stops queuing packets.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_acd_fanout_open(NAcdFanout *fanout, unsigned int shard, int fd_bpf_prog, int *fdp) {
+        _c_cleanup_(c_closep) int fd = -1;
+        int r;
+
+        c_assert(shard < fanout->n_shards);
+
+        fd = fcntl(fanout->fds[shard], F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                return -c_errno();
+
+        if (fd_bpf_prog >= 0)
+                r = setsockopt(fd, SOL_SOCKET, SO_ATTACH_BPF, &fd_bpf_prog, sizeof(fd_bpf_prog));
+        else
+                r = setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &(int){ 0 }, sizeof(int));
+        if (r < 0)
+                return -c_errno();
+
+        /* drop anything left over from a previous owner of the shard */
+        while (recv(fd, NULL, 0, MSG_TRUNC) >= 0)
+                ;
+
+        *fdp = fd;
+        fd = -1;
+        return 0;
+}
+
+/**
+ * n_acd_fanout_close() - close the socket of a shard
+ * @fanout:                     fanout to operate on
+ * @fd:                         socket to close
+ *
+ * This closes a socket returned by n_acd_fanout_open(), and makes the shard
+ * drop all packets until it is opened again. Installing the drop filter is
+ * best-effort. If it fails, the shard keeps queuing packets for the old
+ * filter, which the next owner discards in n_acd_fanout_open().
+ */
+void n_acd_fanout_close(NAcdFanout *fanout, int fd) {
+        (void)n_acd_fanout_attach_drop(fd);
+        close(fd);
+}
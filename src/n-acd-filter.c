@@ -0,0 +1,389 @@
+/*
+ * IPv4 Address Conflict Detection
+ *
+ * This file implements the shared filter object. A shared filter owns one
+ * eBPF program and its maps, and attaches the program to the sockets of all
+ * contexts that use it. Hence, the program is verified once, rather than once
+ * per context.
+ */
+
+#include <assert.h>
+#include <c-list.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/if_ether.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+
+#define N_ACD_FILTER_MAP_MIN (64)
+#define N_ACD_FILTER_MACS_MIN (16)
+
+static const char *n_acd_filter_pin_names[] = { "prog", "addrs", "macs" };
+
+static int n_acd_filter_pin(NAcdFilter *filter, int fd_prog, int fd_map, int fd_macs) {
+        const int fds[] = { fd_prog, fd_map, fd_macs };
+        char *path;
+        int r;
+
+        if (!filter->pin_path || fd_prog < 0)
+                return 0;
+
+        /*
+         * Replace any previous pins. This is not atomic, so a concurrent
+         * n_acd_filter_new() on the same path might see an incomplete set of
+         * pins. It will then simply create new objects.
+         */
+        for (size_t i = 0; i < C_ARRAY_SIZE(fds); ++i) {
+                r = asprintf(&path, "%s/%s", filter->pin_path, n_acd_filter_pin_names[i]);
+                if (r < 0)
+                        return -ENOMEM;
+
+                r = unlink(path);
+                if (r < 0 && errno != ENOENT) {
+                        r = -c_errno();
+                        free(path);
+                        return r;
+                }
+
+                r = n_acd_bpf_obj_pin(fds[i], path);
+                free(path);
+                if (r)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int n_acd_filter_open_pinned(NAcdFilter *filter) {
+        _c_cleanup_(c_closep) int fd_prog = -1, fd_map = -1, fd_macs = -1;
+        int *fds[] = { &fd_prog, &fd_map, &fd_macs };
+        size_t max_map, max_macs;
+        char *path;
+        int r;
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(fds); ++i) {
+                r = asprintf(&path, "%s/%s", filter->pin_path, n_acd_filter_pin_names[i]);
+                if (r < 0)
+                        return -ENOMEM;
+
+                r = n_acd_bpf_obj_get(fds[i], path);
+                free(path);
+                if (r)
+                        return r;
+        }
+
+        r = n_acd_bpf_map_get_max_entries(fd_map, &max_map);
+        if (r)
+                return r;
+
+        r = n_acd_bpf_map_get_max_entries(fd_macs, &max_macs);
+        if (r)
+                return r;
+
+        /*
+         * The pinned maps still carry the entries of their previous owner.
+         * Flush them, we repopulate them as contexts and probes are added.
+         */
+        r = n_acd_bpf_map_flush(fd_map);
+        if (r)
+                return r;
+
+        r = n_acd_bpf_map_flush(fd_macs);
+        if (r)
+                return r;
+
+        filter->fd_bpf_prog = fd_prog;
+        filter->fd_bpf_map = fd_map;
+        filter->fd_bpf_macs = fd_macs;
+        filter->max_bpf_map = max_map;
+        filter->max_bpf_macs = max_macs;
+        fd_prog = -1;
+        fd_map = -1;
+        fd_macs = -1;
+        return 0;
+}
+
+static int n_acd_filter_rebuild(NAcdFilter *filter, size_t max_map, size_t max_macs) {
+        _c_cleanup_(c_closep) int fd_prog = -1, fd_map = -1, fd_macs = -1;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_bpf_shared_map_create(&fd_map, max_map);
+        if (r)
+                return r;
+
+        r = n_acd_bpf_mac_map_create(&fd_macs, max_macs);
+        if (r)
+                return r;
+
+        if (filter->fd_bpf_map >= 0) {
+                r = n_acd_bpf_map_copy(fd_map, filter->fd_bpf_map);
+                if (r)
+                        return r;
+        }
+
+        if (filter->fd_bpf_macs >= 0) {
+                r = n_acd_bpf_map_copy(fd_macs, filter->fd_bpf_macs);
+                if (r)
+                        return r;
+        }
+
+        r = n_acd_bpf_compile_shared(&fd_prog, fd_map, fd_macs);
+        if (r)
+                return r;
+
+        if (fd_prog >= 0) {
+                c_list_for_each_entry(acd, &filter->acd_list, filter_link) {
+                        if (acd->fd_socket < 0)
+                                continue;
+
+                        r = setsockopt(acd->fd_socket, SOL_SOCKET, SO_ATTACH_BPF, &fd_prog, sizeof(fd_prog));
+                        if (r)
+                                return -c_errno();
+                }
+        }
+
+        r = n_acd_filter_pin(filter, fd_prog, fd_map, fd_macs);
+        if (r)
+                return r;
+
+        c_close(filter->fd_bpf_prog);
+        c_close(filter->fd_bpf_map);
+        c_close(filter->fd_bpf_macs);
+        filter->fd_bpf_prog = fd_prog;
+        filter->fd_bpf_map = fd_map;
+        filter->fd_bpf_macs = fd_macs;
+        filter->max_bpf_map = max_map;
+        filter->max_bpf_macs = max_macs;
+        fd_prog = -1;
+        fd_map = -1;
+        fd_macs = -1;
+        return 0;
+}
+
+/**
+ * n_acd_filter_new() - create a new shared filter
+ * @filterp:                    output argument for new filter object
+ * @pin_path:                   bpffs directory to pin the filter in, or NULL
+ *
+ * This creates a new shared filter and returns it in @filterp. A shared filter
+ * can be passed to any number of contexts via n_acd_config_set_filter(). All
+ * those contexts then use the same kernel packet filter, rather than each
+ * compiling its own. This greatly reduces the setup cost of each context, as
+ * well as the locked memory used by them.
+ *
+ * If @pin_path is non-NULL, it must refer to an existing directory on a
+ * `bpffs` file-system. The filter is pinned in that directory, and if it was
+ * pinned there before (e.g., by a previous instance of the same process), the
+ * pinned objects are re-used, rather than compiled again. The pinned objects
+ * are owned by the filter, and a given path must not be used by multiple
+ * filters at the same time.
+ *
+ * A shared filter is not thread-safe. All contexts that use the same filter
+ * must be dispatched on the same thread.
+ *
+ * If the library was built without eBPF support, this still succeeds, but the
+ * contexts simply use no kernel packet filter at all.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+_c_public_ int n_acd_filter_new(NAcdFilter **filterp, const char *pin_path) {
+        _c_cleanup_(n_acd_filter_unrefp) NAcdFilter *filter = NULL;
+        int r;
+
+        filter = malloc(sizeof(*filter));
+        if (!filter)
+                return -ENOMEM;
+
+        *filter = (NAcdFilter)N_ACD_FILTER_NULL(*filter);
+
+        if (pin_path) {
+                filter->pin_path = strdup(pin_path);
+                if (!filter->pin_path)
+                        return -ENOMEM;
+
+                r = n_acd_filter_open_pinned(filter);
+                if (!r) {
+                        *filterp = filter;
+                        filter = NULL;
+                        return 0;
+                } else if (r != -ENOENT) {
+                        return r;
+                }
+        }
+
+        r = n_acd_filter_rebuild(filter, N_ACD_FILTER_MAP_MIN, N_ACD_FILTER_MACS_MIN);
+        if (r)
+                return r;
+
+        *filterp = filter;
+        filter = NULL;
+        return 0;
+}
+
+static void n_acd_filter_free_internal(NAcdFilter *filter) {
+        if (!filter)
+                return;
+
+        c_assert(c_list_is_empty(&filter->acd_list));
+
+        c_close(filter->fd_bpf_prog);
+        c_close(filter->fd_bpf_map);
+        c_close(filter->fd_bpf_macs);
+        free(filter->pin_path);
+        free(filter);
+}
+
+/**
+ * n_acd_filter_ref() - acquire reference
+ * @filter:                     filter to operate on, or NULL
+ *
+ * This acquires a single reference to the filter specified as @filter. If
+ * @filter is NULL, this is a no-op.
+ *
+ * Return: @filter is returned.
+ */
+_c_public_ NAcdFilter *n_acd_filter_ref(NAcdFilter *filter) {
+        if (filter)
+                ++filter->n_refs;
+        return filter;
+}
+
+/**
+ * n_acd_filter_unref() - release reference
+ * @filter:                     filter to operate on, or NULL
+ *
+ * This releases a single reference to the filter @filter. If this is the last
+ * reference, the filter is torn down and deallocated. Note that each context
+ * using the filter holds a reference to it. Pinned objects are never unpinned.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ NAcdFilter *n_acd_filter_unref(NAcdFilter *filter) {
+        if (filter && !--filter->n_refs)
+                n_acd_filter_free_internal(filter);
+        return NULL;
+}
+
+static NAcd *n_acd_filter_find_ifindex(NAcdFilter *filter, NAcd *acd) {
+        NAcd *other;
+
+        c_list_for_each_entry(other, &filter->acd_list, filter_link)
+                if (other != acd && other->ifindex == acd->ifindex)
+                        return other;
+
+        return NULL;
+}
+
+int n_acd_filter_add_mac(NAcdFilter *filter, int ifindex, const uint8_t *mac) {
+        int r;
+
+        if (filter->n_bpf_macs >= filter->max_bpf_macs) {
+                r = n_acd_filter_rebuild(filter, filter->max_bpf_map, 2 * filter->max_bpf_macs);
+                if (r)
+                        return r;
+        }
+
+        if (filter->fd_bpf_macs >= 0) {
+                r = n_acd_bpf_mac_map_set(filter->fd_bpf_macs, ifindex, (struct ether_addr *)mac);
+                if (r)
+                        return r;
+        }
+
+        ++filter->n_bpf_macs;
+        return 0;
+}
+
+void n_acd_filter_remove_mac(NAcdFilter *filter, int ifindex) {
+        int r;
+
+        if (filter->fd_bpf_macs >= 0) {
+                r = n_acd_bpf_mac_map_unset(filter->fd_bpf_macs, ifindex);
+                c_assert(r >= 0);
+        }
+
+        --filter->n_bpf_macs;
+}
+
+int n_acd_filter_link(NAcdFilter *filter, NAcd *acd) {
+        NAcd *other;
+        int r;
+
+        /*
+         * The hardware address is shared by all contexts on the same
+         * interface, so they must agree on it. Multi-interface contexts own
+         * their filter, and register the address of each interface
+         * themselves.
+         */
+        if (!acd->multi_interface) {
+                other = n_acd_filter_find_ifindex(filter, acd);
+                if (other) {
+                        if (memcmp(other->mac, acd->mac, ETH_ALEN))
+                                return N_ACD_E_INVALID_ARGUMENT;
+                } else {
+                        r = n_acd_filter_add_mac(filter, acd->ifindex, acd->mac);
+                        if (r)
+                                return r;
+                }
+        }
+
+        c_list_link_tail(&filter->acd_list, &acd->filter_link);
+        return 0;
+}
+
+void n_acd_filter_unlink(NAcdFilter *filter, NAcd *acd) {
+        if (!c_list_is_linked(&acd->filter_link))
+                return;
+
+        c_list_unlink(&acd->filter_link);
+
+        if (!acd->multi_interface && !n_acd_filter_find_ifindex(filter, acd))
+                n_acd_filter_remove_mac(filter, acd->ifindex);
+}
+
+int n_acd_filter_ensure_space(NAcdFilter *filter) {
+        if (filter->n_bpf_map < filter->max_bpf_map)
+                return 0;
+
+        return n_acd_filter_rebuild(filter, 2 * filter->max_bpf_map, filter->max_bpf_macs);
+}
+
+int n_acd_filter_add(NAcdFilter *filter, int ifindex, struct in_addr *ip) {
+        int r;
+
+        /*
+         * Each context only adds a given address once, but multiple contexts
+         * on the same interface might share it. The map counts references.
+         */
+        c_assert(filter->n_bpf_map < filter->max_bpf_map);
+
+        if (filter->fd_bpf_map < 0)
+                return 0;
+
+        r = n_acd_bpf_shared_map_ref(filter->fd_bpf_map, ifindex, ip);
+        if (r < 0)
+                return r;
+        else if (r == N_ACD_BPF_E_NEW)
+                ++filter->n_bpf_map;
+
+        return 0;
+}
+
+void n_acd_filter_remove(NAcdFilter *filter, int ifindex, struct in_addr *ip) {
+        int r;
+
+        if (filter->fd_bpf_map < 0)
+                return;
+
+        r = n_acd_bpf_shared_map_unref(filter->fd_bpf_map, ifindex, ip);
+        c_assert(r >= 0);
+        if (r == N_ACD_BPF_E_DELETED)
+                --filter->n_bpf_map;
+}
@@ -0,0 +1,286 @@
+/*
+ * IPv4 Address Conflict Detection
+ *
+ * This file implements validation of received ARP packets. The packet filter
+ * makes sure only valid packets reach us, but it is an optional optimization,
+ * so every packet is validated again in userspace. n_acd_packet_is_valid()
+ * validates a single packet. n_acd_packet_validate() validates a whole batch,
+ * and on x86 compares the fixed-size fields of each packet in one go, rather
+ * than field by field. With SSE2 this handles one packet per instruction, and
+ * with AVX2 two.
+ */
+
+#include <assert.h>
+#include <c-stdaux.h>
+#include <endian.h>
+#include <netinet/if_ether.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+
+#if defined(__SSE2__)
+#  include <immintrin.h>
+#  if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define N_ACD_PACKET_AVX2 1
+#  endif
+#endif
+
+/*
+ * The first 16 bytes of an ARP packet are compared against a pattern of the
+ * fixed header, the operation, and the hardware address of the interface.
+ * Those are the bits of the resulting byte-mask that cover each field. The
+ * remaining two bytes are the start of the sender protocol address, which is
+ * checked separately.
+ */
+#define N_ACD_PACKET_MASK_HDR (0x003fU)
+#define N_ACD_PACKET_MASK_OP (0x00c0U)
+#define N_ACD_PACKET_MASK_SHA (0x3f00U)
+
+bool n_acd_packet_is_valid(NAcdInterface *interface, void *packet, size_t n_packet) {
+        struct ether_arp *arp;
+
+        /*
+         * The eBPF filter will ensure that this function always returns true, however,
+         * this allows the eBPF filter to be an optional optimization which is necessary
+         * on older kernels.
+         *
+         * See comments in n-acd-bpf.c for details.
+         */
+
+        if (n_packet != sizeof(*arp))
+                return false;
+
+        arp = packet;
+
+        if (arp->arp_hrd != htobe16(ARPHRD_ETHER))
+                return false;
+
+        if (arp->arp_pro != htobe16(ETHERTYPE_IP))
+                return false;
+
+        if (arp->arp_hln != sizeof(struct ether_addr))
+                return false;
+
+        if (arp->arp_pln != sizeof(struct in_addr))
+                return false;
+
+        if (!memcmp(arp->arp_sha, interface->mac, sizeof(struct ether_addr)))
+                return false;
+
+        if (memcmp(arp->arp_spa, &((struct in_addr) { INADDR_ANY }), sizeof(struct in_addr))) {
+                if (arp->arp_op != htobe16(ARPOP_REQUEST) && arp->arp_op != htobe16(ARPOP_REPLY))
+                        return false;
+        } else if (arp->arp_op != htobe16(ARPOP_REQUEST)) {
+                return false;
+        }
+
+        return true;
+}
+
+static uint64_t n_acd_packet_validate_scalar(NAcdInterface **interfaces,
+                                             const struct ether_arp *packets,
+                                             const size_t *n_packets,
+                                             size_t n) {
+        uint64_t valid = 0;
+
+        for (size_t i = 0; i < n; ++i)
+                if (interfaces[i] && n_acd_packet_is_valid(interfaces[i], (void *)(packets + i), n_packets[i]))
+                        valid |= UINT64_C(1) << i;
+
+        return valid;
+}
+
+#if defined(__SSE2__)
+
+typedef struct NAcdPacketPattern {
+        NAcdInterface *interface;
+        __m128i request;
+        bool valid;
+} NAcdPacketPattern;
+
+static __m128i n_acd_packet_pattern(const uint8_t *mac, uint16_t op) {
+        struct {
+                struct arphdr header;
+                uint8_t sha[ETH_ALEN];
+                uint8_t padding[2];
+        } _c_packed_ pattern = {
+                .header = {
+                        .ar_hrd = htobe16(ARPHRD_ETHER),
+                        .ar_pro = htobe16(ETHERTYPE_IP),
+                        .ar_hln = ETH_ALEN,
+                        .ar_pln = sizeof(struct in_addr),
+                        .ar_op = htobe16(op),
+                },
+        };
+
+        static_assert(sizeof(pattern) == sizeof(__m128i), "Unexpected pattern size");
+
+        if (mac)
+                memcpy(pattern.sha, mac, ETH_ALEN);
+
+        return _mm_loadu_si128((const __m128i *)&pattern);
+}
+
+static __m128i n_acd_packet_pattern_get(NAcdPacketPattern *pattern, NAcdInterface *interface) {
+        /* consecutive packets are usually from the same interface */
+        if (!pattern->valid || pattern->interface != interface) {
+                pattern->interface = interface;
+                pattern->request = n_acd_packet_pattern(interface ? interface->mac : NULL, ARPOP_REQUEST);
+                pattern->valid = true;
+        }
+
+        return pattern->request;
+}
+
+static uint64_t n_acd_packet_verdict(NAcdInterface *interface,
+                                     const struct ether_arp *packet,
+                                     size_t n_packet,
+                                     unsigned int request,
+                                     unsigned int reply) {
+        uint32_t spa;
+
+        memcpy(&spa, packet->arp_spa, sizeof(spa));
+
+        /* see n_acd_packet_is_valid() */
+        return interface &&
+               n_packet == sizeof(*packet) &&
+               (request & N_ACD_PACKET_MASK_HDR) == N_ACD_PACKET_MASK_HDR &&
+               (request & N_ACD_PACKET_MASK_SHA) != N_ACD_PACKET_MASK_SHA &&
+               ((request & N_ACD_PACKET_MASK_OP) == N_ACD_PACKET_MASK_OP ||
+                (spa && (reply & N_ACD_PACKET_MASK_OP) == N_ACD_PACKET_MASK_OP));
+}
+
+static uint64_t n_acd_packet_validate_one(NAcdPacketPattern *pattern,
+                                          __m128i reply,
+                                          NAcdInterface *interface,
+                                          const struct ether_arp *packet,
+                                          size_t n_packet) {
+        __m128i v;
+        unsigned int m_request, m_reply;
+
+        v = _mm_loadu_si128((const __m128i *)packet);
+        m_request = _mm_movemask_epi8(_mm_cmpeq_epi8(v, n_acd_packet_pattern_get(pattern, interface)));
+        m_reply = _mm_movemask_epi8(_mm_cmpeq_epi8(v, reply));
+
+        return n_acd_packet_verdict(interface, packet, n_packet, m_request, m_reply);
+}
+
+static uint64_t n_acd_packet_validate_sse2(NAcdInterface **interfaces,
+                                           const struct ether_arp *packets,
+                                           const size_t *n_packets,
+                                           size_t n) {
+        NAcdPacketPattern pattern = {};
+        __m128i reply;
+        uint64_t valid = 0;
+
+        reply = n_acd_packet_pattern(NULL, ARPOP_REPLY);
+
+        for (size_t i = 0; i < n; ++i)
+                valid |= n_acd_packet_validate_one(&pattern, reply, interfaces[i], packets + i, n_packets[i]) << i;
+
+        return valid;
+}
+
+#endif
+
+#if defined(N_ACD_PACKET_AVX2)
+
+__attribute__((__target__("avx2")))
+static uint64_t n_acd_packet_validate_avx2(NAcdInterface **interfaces,
+                                           const struct ether_arp *packets,
+                                           const size_t *n_packets,
+                                           size_t n) {
+        NAcdPacketPattern pattern = {};
+        __m128i reply;
+        __m256i v, request, reply2;
+        uint32_t m_request, m_reply;
+        uint64_t valid = 0;
+        size_t i;
+
+        reply = n_acd_packet_pattern(NULL, ARPOP_REPLY);
+        reply2 = _mm256_broadcastsi128_si256(reply);
+
+        /* the two lanes hold two consecutive packets */
+        for (i = 0; i + 1 < n; i += 2) {
+                v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(packets + i))),
+                                            _mm_loadu_si128((const __m128i *)(packets + i + 1)),
+                                            1);
+                request = _mm256_castsi128_si256(n_acd_packet_pattern_get(&pattern, interfaces[i]));
+                request = _mm256_inserti128_si256(request, n_acd_packet_pattern_get(&pattern, interfaces[i + 1]), 1);
+
+                m_request = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, request));
+                m_reply = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, reply2));
+
+                valid |= n_acd_packet_verdict(interfaces[i],
+                                              packets + i,
+                                              n_packets[i],
+                                              m_request & 0xffff,
+                                              m_reply & 0xffff) << i;
+                valid |= n_acd_packet_verdict(interfaces[i + 1],
+                                              packets + i + 1,
+                                              n_packets[i + 1],
+                                              m_request >> 16,
+                                              m_reply >> 16) << (i + 1);
+        }
+
+        if (i < n)
+                valid |= n_acd_packet_validate_one(&pattern, reply, interfaces[i], packets + i, n_packets[i]) << i;
+
+        return valid;
+}
+
+#endif
+
+/**
+ * n_acd_packet_isa() - query best instruction set for packet validation
+ *
+ * Return: The best of N_ACD_PACKET_ISA_* supported by this build and CPU.
+ */
+unsigned int n_acd_packet_isa(void) {
+#if defined(N_ACD_PACKET_AVX2)
+        if (__builtin_cpu_supports("avx2"))
+                return N_ACD_PACKET_ISA_AVX2;
+#endif
+#if defined(__SSE2__)
+        return N_ACD_PACKET_ISA_SSE2;
+#else
+        return N_ACD_PACKET_ISA_SCALAR;
+#endif
+}
+
+/**
+ * n_acd_packet_validate() - validate a batch of packets
+ * @isa:                        instruction set to use
+ * @interfaces:                 receiving interface of each packet, or NULL
+ * @packets:                    packets to validate
+ * @n_packets:                  received length of each packet
+ * @n:                          number of packets, at most 64
+ *
+ * This validates each packet of a batch, just like n_acd_packet_is_valid().
+ * Packets without a receiving interface are invalid. The buffer of each
+ * packet must be a full struct ether_arp, regardless of its received length.
+ *
+ * @isa selects the implementation, and must be supported by the CPU, see
+ * n_acd_packet_isa(). If it was not built in, the next best is used.
+ *
+ * Return: A bitmask with bit i set if the i-th packet is valid.
+ */
+uint64_t n_acd_packet_validate(unsigned int isa,
+                               NAcdInterface **interfaces,
+                               const struct ether_arp *packets,
+                               const size_t *n_packets,
+                               size_t n) {
+        c_assert(n <= 64);
+
+#if defined(N_ACD_PACKET_AVX2)
+        if (isa >= N_ACD_PACKET_ISA_AVX2)
+                return n_acd_packet_validate_avx2(interfaces, packets, n_packets, n);
+#endif
+#if defined(__SSE2__)
+        if (isa >= N_ACD_PACKET_ISA_SSE2)
+                return n_acd_packet_validate_sse2(interfaces, packets, n_packets, n);
+#endif
+        return n_acd_packet_validate_scalar(interfaces, packets, n_packets, n);
+}
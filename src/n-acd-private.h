@@ -7,12 +7,17 @@
 #include <inttypes.h>
 #include <netinet/if_ether.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include "util/timer.h"
 #include "n-acd.h"
 
 typedef struct NAcdEventNode NAcdEventNode;
+typedef struct NAcdInterface NAcdInterface;
+typedef struct NAcdMemory NAcdMemory;
+typedef struct NAcdObservation NAcdObservation;
 
 /* This augments the error-codes with internal ones that are never exposed. */
 enum {
@@ -21,6 +26,76 @@ enum {
         N_ACD_E_DROPPED,
 };
 
+/* Instruction sets to validate packets with, in order of preference. */
+enum {
+        N_ACD_PACKET_ISA_SCALAR,
+        N_ACD_PACKET_ISA_SSE2,
+        N_ACD_PACKET_ISA_AVX2,
+        _N_ACD_PACKET_ISA_N,
+};
+
+/* Positive return codes of the eBPF map helpers. */
+enum {
+        _N_ACD_BPF_E_SUCCESS,
+
+        N_ACD_BPF_E_NEW,
+        N_ACD_BPF_E_DELETED,
+};
+
+/*
+ * These parameters and timing intervals are specified in RFC-5227. The
+ * original values are:
+ *
+ *     PROBE_NUM                                3
+ *     PROBE_WAIT                               1s
+ *     PROBE_MIN                                1s
+ *     PROBE_MAX                                3s
+ *     ANNOUNCE_NUM                             3
+ *     ANNOUNCE_WAIT                            2s
+ *     ANNOUNCE_INTERVAL                        2s
+ *     MAX_CONFLICTS                            10
+ *     RATE_LIMIT_INTERVAL                      60s
+ *     DEFEND_INTERVAL                          10s
+ *
+ * If we assume a best-case and worst-case scenario for non-conflicted runs, we
+ * end up with a runtime between 4s and 9s to finish the probe. Then it still
+ * takes a fixed 4s to finish the announcements.
+ *
+ * RFC 5227 section 1.1:
+ *     [...] (Note that the values listed here are fixed constants; they are
+ *     not intended to be modifiable by implementers, operators, or end users.
+ *     These constants are given symbolic names here to facilitate the writing
+ *     of future standards that may want to reference this document with
+ *     different values for these named constants; however, at the present time
+ *     no such future standards exist.) [...]
+ *
+ * Unfortunately, no-one ever stepped up to write a "future standard" to revise
+ * the timings. A 9s timeout for successful link setups is not acceptable today.
+ * Hence, we will just go forward and ignore the proposed values. On both
+ * wired and wireless local links round-trip latencies of below 3ms are common.
+ * We require the caller to set a timeout multiplier, where 1 corresponds to a
+ * total probe time between 0.5 ms and 1.0 ms. On modern networks a multiplier
+ * of about 100 should be a reasonable default. To comply with the RFC select a
+ * multiplier of 9000.
+ */
+#define N_ACD_RFC_PROBE_NUM                     (3)
+#define N_ACD_RFC_PROBE_WAIT_NSEC               (UINT64_C(111111)) /* 1/9 ms */
+#define N_ACD_RFC_PROBE_MIN_NSEC                (UINT64_C(111111)) /* 1/9 ms */
+#define N_ACD_RFC_PROBE_MAX_NSEC                (UINT64_C(333333)) /* 3/9 ms */
+#define N_ACD_RFC_ANNOUNCE_NUM                  (3)
+#define N_ACD_RFC_ANNOUNCE_WAIT_NSEC            (UINT64_C(222222)) /* 2/9 ms */
+#define N_ACD_RFC_ANNOUNCE_INTERVAL_NSEC        (UINT64_C(222222)) /* 2/9 ms */
+#define N_ACD_RFC_MAX_CONFLICTS                 (10)
+#define N_ACD_RFC_RATE_LIMIT_INTERVAL_NSEC      (UINT64_C(60000000000)) /* 60s */
+#define N_ACD_RFC_DEFEND_INTERVAL_NSEC          (UINT64_C(10000000000)) /* 10s */
+
+enum {
+        N_ACD_PACE_DEFEND,
+        N_ACD_PACE_ANNOUNCE,
+        N_ACD_PACE_PROBE,
+        _N_ACD_PACE_N,
+};
+
 enum {
         N_ACD_PROBE_STATE_PROBING,
         N_ACD_PROBE_STATE_CONFIGURING,
@@ -33,15 +108,51 @@ struct NAcdConfig {
         unsigned int transport;
         uint8_t mac[ETH_ALEN];
         size_t n_mac;
+        NAcdFilter *filter;
+        NAcdFanout *fanout;
+        unsigned int shard;
+        unsigned int xdp;
+        unsigned int busy_poll;
+        unsigned int rcvbuf;
+        uint64_t remember_msecs;
+        unsigned int observe_sample;
+        uint64_t observe_msecs;
+        uint64_t rate_limit_nsecs;
+        uint64_t adaptive_min_msecs;
+        uint64_t adaptive_max_msecs;
+        uint64_t pace_rate;
+        unsigned int pace_burst;
+        unsigned int retry_max;
+        uint64_t refresh_msecs;
+        bool xdp_socket;
+        bool lazy;
+        bool multi_interface;
 };
 
+/*
+ * Adaptive timeouts never go below N_ACD_ADAPTIVE_MIN by default, and stay at
+ * the upper bound until N_ACD_ADAPTIVE_SAMPLES round-trip times were measured.
+ */
+#define N_ACD_ADAPTIVE_MIN (UINT64_C(100))
+#define N_ACD_ADAPTIVE_SAMPLES (3U)
+
 #define N_ACD_CONFIG_NULL(_x) {                                                 \
                 .transport = _N_ACD_TRANSPORT_N,                                \
+                .rate_limit_nsecs = N_ACD_RFC_RATE_LIMIT_INTERVAL_NSEC,         \
+                .adaptive_min_msecs = N_ACD_ADAPTIVE_MIN,                       \
+                .adaptive_max_msecs = N_ACD_TIMEOUT_RFC5227,                    \
         }
 
 struct NAcdProbeConfig {
+        int ifindex;
         struct in_addr ip;
         uint64_t timeout_msecs;
+        NAcdTiming timing;
+        bool has_timing;
+        bool refresh;
+        bool auto_announce;
+        unsigned int auto_defend;
+        bool tentative;
 };
 
 #define N_ACD_PROBE_CONFIG_NULL(_x) {                                           \
@@ -61,40 +172,351 @@ struct NAcdEventNode {
                 .probe_link = C_LIST_INIT((_x).probe_link),                     \
         }
 
-struct NAcd {
+struct NAcdFilter {
         unsigned long n_refs;
+        char *pin_path;
+        CList acd_list;
+
+        int fd_bpf_prog;
+        int fd_bpf_map;
+        int fd_bpf_macs;
+        size_t n_bpf_map;
+        size_t max_bpf_map;
+        size_t n_bpf_macs;
+        size_t max_bpf_macs;
+};
+
+#define N_ACD_FILTER_NULL(_x) {                                                 \
+                .n_refs = 1,                                                    \
+                .acd_list = C_LIST_INIT((_x).acd_list),                         \
+                .fd_bpf_prog = -1,                                              \
+                .fd_bpf_map = -1,                                               \
+                .fd_bpf_macs = -1,                                              \
+        }
+
+#define N_ACD_FANOUT_MAX (256)
+
+struct NAcdFanout {
+        atomic_ulong n_refs;
+        int ifindex;
+        int id;
+        atomic_bool taken[N_ACD_FANOUT_MAX];
+        size_t n_shards;
+        int fds[];
+};
+
+#define N_ACD_FANOUT_NULL(_x) {                                                 \
+                .n_refs = 1,                                                    \
+        }
+
+enum {
+        N_ACD_SUBMISSION_STUB,
+        N_ACD_SUBMISSION_PROBE,
+        N_ACD_SUBMISSION_PROBE_FREE,
+        N_ACD_SUBMISSION_PROBE_ANNOUNCE,
+};
+
+typedef struct NAcdSubmission NAcdSubmission;
+
+struct NAcdSubmission {
+        _Atomic(NAcdSubmission *) next;
+        unsigned int type;
+};
+
+enum {
+        N_ACD_EXECUTOR_STATE_IDLE,
+        N_ACD_EXECUTOR_STATE_ARMED,
+        N_ACD_EXECUTOR_STATE_QUEUED,
+        N_ACD_EXECUTOR_STATE_RUNNING,
+};
+
+typedef struct NAcdExecutorWorker {
+        NAcdExecutor *executor;
+        pthread_t thread;
+        CList queue;
+} NAcdExecutorWorker;
+
+struct NAcdExecutor {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int fd_epoll;
+        int fd_wake;
+        CList acd_list;
+        uint64_t poll_epoch;
+        bool polling;
+        bool stop;
+        size_t n_workers;
+        NAcdExecutorWorker workers[];
+};
+
+#define N_ACD_EXECUTOR_MAX (256U)
+
+#define N_ACD_EXECUTOR_NULL(_x) {                                               \
+                .fd_epoll = -1,                                                 \
+                .fd_wake = -1,                                                  \
+                .acd_list = C_LIST_INIT((_x).acd_list),                         \
+        }
+
+struct NAcdInterface {
+        CRBNode acd_node;
+        int ifindex;
+        uint8_t mac[ETH_ALEN];
+        size_t n_probes;
+};
+
+#define N_ACD_INTERFACE_NULL(_x) {                                              \
+                .acd_node = C_RBNODE_INIT((_x).acd_node),                       \
+        }
+
+struct NAcdMemory {
+        CRBNode acd_node;
+        CList acd_link;
+        int ifindex;
+        struct in_addr ip;
+        uint8_t mac[ETH_ALEN];
+        uint64_t timestamp;
+};
+
+#define N_ACD_MEMORY_MAX (4096U)
+
+#define N_ACD_MEMORY_NULL(_x) {                                                 \
+                .acd_node = C_RBNODE_INIT((_x).acd_node),                       \
+                .acd_link = C_LIST_INIT((_x).acd_link),                         \
+        }
+
+/*
+ * Observed claims are kept in a set-associative table, indexed by a keyed hash
+ * of interface and address. Each set holds a few ways, and the least recently
+ * observed way of a set is replaced if the set is full. An unused way has the
+ * address INADDR_ANY, which is never claimed.
+ */
+struct NAcdObservation {
+        uint64_t timestamp;
+        struct in_addr ip;
+        int ifindex;
+        uint8_t mac[ETH_ALEN];
+        uint16_t n_conflicts;
+};
+
+#define N_ACD_OBSERVE_WAYS (4U)
+#define N_ACD_OBSERVE_SETS (256U)
+
+/* parking a frame more often than this falls back to the probe timeouts */
+#define N_ACD_RETRY_MAX (4U)
+
+/*
+ * Refreshing probes are kept in a ring, which turns by one probe per
+ * period/n, for n probes. With many probes, that turn is rounded up to
+ * N_ACD_REFRESH_TICK_NSEC, and the frames due at a tick are sent in batches of
+ * up to N_ACD_REFRESH_BATCH.
+ */
+#define N_ACD_REFRESH_TICK_NSEC (UINT64_C(1000000)) /* 1ms */
+#define N_ACD_REFRESH_BATCH (32U)
+
+typedef struct NAcdBpfXdpEvent {
+        uint32_t addr;
+        uint8_t sender[ETH_ALEN];
+        uint8_t defended;
+        uint8_t padding;
+} NAcdBpfXdpEvent;
+
+typedef struct NAcdBpfRing {
+        int fd;
+        size_t size;
+        void *consumer;
+        void *producer;
+} NAcdBpfRing;
+
+#define N_ACD_BPF_RING_NULL(_x) {                                               \
+                .fd = -1,                                                       \
+        }
+
+typedef struct NAcdBpfXskRing {
+        void *map;
+        size_t n_map;
+        uint32_t *producer;
+        uint32_t *consumer;
+        void *desc;
+} NAcdBpfXskRing;
+
+typedef struct NAcdBpfXsk {
+        int fd;
+        void *umem;
+        size_t n_umem;
+        NAcdBpfXskRing fill;
+        NAcdBpfXskRing rx;
+} NAcdBpfXsk;
+
+#define N_ACD_BPF_XSK_NULL(_x) {                                                \
+                .fd = -1,                                                       \
+        }
+
+struct NAcd {
+        atomic_ulong n_refs;
         unsigned int seed;
         int fd_epoll;
         int fd_socket;
+        CRBTree interface_tree;
         CRBTree ip_tree;
         CList event_list;
         Timer timer;
+        size_t n_probes;
+
+        /* verified addresses, least recently verified first */
+        uint64_t remember_nsecs;
+        CRBTree memory_tree;
+        CList memory_list;
+        size_t n_memories;
+
+        /* observed claims of other hosts */
+        unsigned int observe_sample;
+        uint64_t observe_nsecs;
+        uint32_t observe_key;
+        NAcdObservation *observations;
+
+        /* conflict rate-limit, times of the most recent conflicts */
+        uint64_t rate_limit_nsecs;
+        uint64_t conflicts[N_ACD_RFC_MAX_CONFLICTS];
+        uint64_t n_conflicts;
+        uint64_t n_throttled;
+        uint64_t throttle_next;
+
+        /* smoothed round-trip time, for adaptive timeouts */
+        uint64_t adaptive_min_msecs;
+        uint64_t adaptive_max_msecs;
+        uint64_t n_rtt;
+        uint64_t srtt;
+        uint64_t rttvar;
+
+        /* transmit pacer, a token bucket kept as theoretical arrival time */
+        uint64_t pace_interval;
+        uint64_t pace_burst_nsecs;
+        uint64_t pace_tat;
+        CList pace_queue[_N_ACD_PACE_N];
+        size_t n_pace_queue;
+        Timeout pace_timeout;
+        uint64_t max_pace_queue;
+        uint64_t n_pace_delay;
+        uint64_t total_pace_delay;
+        uint64_t max_pace_delay;
+
+        /* dropped frames, parked until the socket is writable */
+        unsigned int retry_max;
+        CList retry_list;
+        size_t n_retry;
+        bool retry_armed;
+
+        /* periodic announcements of announced addresses */
+        uint64_t refresh_nsecs;
+        CList refresh_list;
+        size_t n_refresh;
+        uint64_t refresh_last;
+        uint64_t refresh_due;
+        Timeout refresh_timeout;
+        uint64_t n_refreshed;
+        uint64_t n_refresh_dropped;
 
         /* BPF map */
         int fd_bpf_map;
+        int fd_bpf_bloom;
         size_t n_bpf_map;
+        size_t n_bpf_bloom;
         size_t max_bpf_map;
 
+        /* shared filter */
+        NAcdFilter *filter;
+        CList filter_link;
+
+        /* fanout */
+        NAcdFanout *fanout;
+        unsigned int shard;
+
+        /* XDP defender */
+        int fd_xdp_link;
+        int fd_xdp_map;
+        NAcdBpfRing xdp_ring;
+
+        /* AF_XDP receive path */
+        int fd_xsk_map;
+        NAcdBpfXsk xsk;
+
+        /* submission queue, pushed to by any thread */
+        int fd_submit;
+        atomic_bool submit_pending;
+        _Atomic(NAcdSubmission *) submit_tail;
+        NAcdSubmission *submit_head;
+        NAcdSubmission submit_stub;
+
+        /* executor, protected by the lock of the executor */
+        NAcdExecutor *executor;
+        NAcdExecutorFn executor_fn;
+        void *executor_userdata;
+        CList executor_link;
+        CList executor_queue_link;
+        unsigned int executor_state;
+        bool executor_removed;
+        bool executor_release;
+
         /* configuration */
         int ifindex;
         uint8_t mac[ETH_ALEN];
+        unsigned int xdp;
+        unsigned int busy_poll;
+        unsigned int rcvbuf;
+
+        /* receive timestamps */
+        uint64_t timestamp;
+        uint64_t n_queue_delay;
+        uint64_t total_queue_delay;
+        uint64_t max_queue_delay;
 
         /* flags */
+        bool multi_interface : 1;
+        bool xdp_socket : 1;
+        bool lazy : 1;
         bool preempted : 1;
+        bool bpf_inline : 1;
+        bool dispatching : 1;
 };
 
 #define N_ACD_NULL(_x) {                                                        \
                 .n_refs = 1,                                                    \
                 .fd_epoll = -1,                                                 \
                 .fd_socket = -1,                                                \
+                .interface_tree = C_RBTREE_INIT,                                \
                 .ip_tree = C_RBTREE_INIT,                                       \
                 .event_list = C_LIST_INIT((_x).event_list),                     \
                 .timer = TIMER_NULL((_x).timer),                                \
+                .memory_tree = C_RBTREE_INIT,                                   \
+                .memory_list = C_LIST_INIT((_x).memory_list),                   \
+                .pace_queue = {                                                 \
+                        C_LIST_INIT((_x).pace_queue[N_ACD_PACE_DEFEND]),        \
+                        C_LIST_INIT((_x).pace_queue[N_ACD_PACE_ANNOUNCE]),      \
+                        C_LIST_INIT((_x).pace_queue[N_ACD_PACE_PROBE]),         \
+                },                                                              \
+                .pace_timeout = TIMEOUT_INIT((_x).pace_timeout),                \
+                .retry_list = C_LIST_INIT((_x).retry_list),                     \
+                .refresh_list = C_LIST_INIT((_x).refresh_list),                 \
+                .refresh_timeout = TIMEOUT_INIT((_x).refresh_timeout),          \
                 .fd_bpf_map = -1,                                               \
+                .fd_bpf_bloom = -1,                                             \
+                .filter_link = C_LIST_INIT((_x).filter_link),                   \
+                .fd_xdp_link = -1,                                              \
+                .fd_xdp_map = -1,                                               \
+                .xdp_ring = N_ACD_BPF_RING_NULL((_x).xdp_ring),                 \
+                .fd_xsk_map = -1,                                               \
+                .xsk = N_ACD_BPF_XSK_NULL((_x).xsk),                            \
+                .fd_submit = -1,                                                \
+                .submit_tail = &(_x).submit_stub,                               \
+                .submit_head = &(_x).submit_stub,                               \
+                .submit_stub.type = N_ACD_SUBMISSION_STUB,                      \
+                .executor_link = C_LIST_INIT((_x).executor_link),               \
+                .executor_queue_link = C_LIST_INIT((_x).executor_queue_link),   \
         }
 
 struct NAcdProbe {
         NAcd *acd;
+        NAcdInterface *interface;
         CRBNode ip_node;
         CList event_list;
         Timeout timeout;
@@ -102,6 +524,12 @@ struct NAcdProbe {
         /* configuration */
         struct in_addr ip;
         uint64_t timeout_multiplier;
+        NAcdTiming timing;
+        bool has_timing;
+        bool refresh;
+        bool auto_announce;
+        unsigned int auto_defend;
+        bool tentative;
         void *userdata;
 
         /* state */
@@ -109,12 +537,43 @@ struct NAcdProbe {
         unsigned int n_iteration;
         unsigned int defend;
         uint64_t last_defend;
+        uint64_t last_probe;
+        uint64_t last_foreign_probe;
+        uint8_t foreign_prober[ETH_ALEN];
+        bool observed;
+        uint8_t observed_sender[ETH_ALEN];
+
+        /* transmit pacer */
+        CList pace_link;
+        unsigned int pace_class;
+        uint64_t pace_since;
+        bool pace_granted;
+
+        /* retry queue */
+        CList retry_link;
+        unsigned int n_retries;
+
+        /* refresh wheel */
+        CList refresh_link;
+
+        /* submissions */
+        NAcdSubmission submit_new;
+        NAcdSubmission submit_free;
+        NAcdSubmission submit_announce;
+        atomic_bool submit_announce_pending;
+        atomic_uint submit_defend;
 };
 
 #define N_ACD_PROBE_NULL(_x) {                                                  \
                 .ip_node = C_RBNODE_INIT((_x).ip_node),                         \
                 .event_list = C_LIST_INIT((_x).event_list),                     \
                 .timeout = TIMEOUT_INIT((_x).timeout),                          \
+                .pace_link = C_LIST_INIT((_x).pace_link),                       \
+                .retry_link = C_LIST_INIT((_x).retry_link),                     \
+                .refresh_link = C_LIST_INIT((_x).refresh_link),                 \
+                .submit_new.type = N_ACD_SUBMISSION_PROBE,                      \
+                .submit_free.type = N_ACD_SUBMISSION_PROBE_FREE,                \
+                .submit_announce.type = N_ACD_SUBMISSION_PROBE_ANNOUNCE,        \
                 .state = N_ACD_PROBE_STATE_PROBING,                             \
                 .defend = N_ACD_DEFEND_NEVER,                                   \
         }
@@ -126,25 +585,131 @@ NAcdEventNode *n_acd_event_node_free(NAcdEventNode *node);
 
 /* contexts */
 
-void n_acd_remember(NAcd *acd, uint64_t now, bool success);
+void n_acd_remember(NAcd *acd, NAcdInterface *interface, struct in_addr ip, uint64_t now, bool success);
+bool n_acd_recall(NAcd *acd, NAcdInterface *interface, struct in_addr ip, uint64_t now);
+void n_acd_observe(NAcd *acd, NAcdInterface *interface, struct in_addr ip, const uint8_t *mac, uint64_t now);
+NAcdObservation *n_acd_find_observation(NAcd *acd, NAcdInterface *interface, struct in_addr ip, uint64_t now);
+int n_acd_conflict(NAcd *acd, uint64_t now);
+uint64_t n_acd_throttle(NAcd *acd, uint64_t now);
+void n_acd_rtt_sample(NAcd *acd, uint64_t rtt);
+uint64_t n_acd_rtt_timeout(NAcd *acd);
+bool n_acd_pace(NAcd *acd, NAcdProbe *probe, unsigned int class);
+void n_acd_pace_dequeue(NAcd *acd, NAcdProbe *probe);
+bool n_acd_retry(NAcd *acd, NAcdProbe *probe);
+void n_acd_retry_dequeue(NAcd *acd, NAcdProbe *probe);
+void n_acd_refresh_link(NAcd *acd, NAcdProbe *probe);
+void n_acd_refresh_unlink(NAcd *acd, NAcdProbe *probe);
+int n_acd_activate(NAcd *acd);
+void n_acd_deactivate(NAcd *acd);
+NAcdInterface *n_acd_find_interface(NAcd *acd, int ifindex);
 int n_acd_raise(NAcd *acd, NAcdEventNode **nodep, unsigned int event);
-int n_acd_send(NAcd *acd, const struct in_addr *tpa, const struct in_addr *spa);
+int n_acd_send(NAcd *acd, NAcdInterface *interface, const struct in_addr *tpa, const struct in_addr *spa);
 int n_acd_ensure_bpf_map_space(NAcd *acd);
+int n_acd_add_bpf_map_entry(NAcd *acd, int ifindex, struct in_addr *ip);
+void n_acd_remove_bpf_map_entry(NAcd *acd, int ifindex, struct in_addr *ip);
+void n_acd_xdp_refresh(NAcd *acd, struct in_addr *ip);
+
+/* packets */
+
+bool n_acd_packet_is_valid(NAcdInterface *interface, void *packet, size_t n_packet);
+unsigned int n_acd_packet_isa(void);
+uint64_t n_acd_packet_validate(unsigned int isa,
+                               NAcdInterface **interfaces,
+                               const struct ether_arp *packets,
+                               const size_t *n_packets,
+                               size_t n);
+
+/* shared filters */
+
+int n_acd_filter_link(NAcdFilter *filter, NAcd *acd);
+void n_acd_filter_unlink(NAcdFilter *filter, NAcd *acd);
+int n_acd_filter_ensure_space(NAcdFilter *filter);
+int n_acd_filter_add_mac(NAcdFilter *filter, int ifindex, const uint8_t *mac);
+void n_acd_filter_remove_mac(NAcdFilter *filter, int ifindex);
+int n_acd_filter_add(NAcdFilter *filter, int ifindex, struct in_addr *ip);
+void n_acd_filter_remove(NAcdFilter *filter, int ifindex, struct in_addr *ip);
+
+/* fanouts */
+
+int n_acd_fanout_claim(NAcdFanout *fanout, unsigned int shard);
+void n_acd_fanout_release(NAcdFanout *fanout, unsigned int shard);
+int n_acd_fanout_open(NAcdFanout *fanout, unsigned int shard, int fd_bpf_prog, int *fdp);
+void n_acd_fanout_close(NAcdFanout *fanout, int fd);
+
+/* submissions */
+
+#define N_ACD_SUBMISSION_BATCH (128)
+
+int n_acd_dispatch_submit(NAcd *acd);
+void n_acd_submit_flush(NAcd *acd);
 
 /* probes */
 
+bool n_acd_probe_config_is_valid(NAcdProbeConfig *config);
 int n_acd_probe_new(NAcdProbe **probep, NAcd *acd, NAcdProbeConfig *config);
+int n_acd_probe_start(NAcdProbe *probe, NAcdInterface *interface);
+int n_acd_probe_fail(NAcdProbe *probe, int error);
+void n_acd_probe_destroy(NAcdProbe *probe);
 int n_acd_probe_raise(NAcdProbe *probe, NAcdEventNode **nodep, unsigned int event);
 int n_acd_probe_handle_timeout(NAcdProbe *probe);
 int n_acd_probe_handle_packet(NAcdProbe *probe, struct ether_arp *packet, bool hard_conflict);
+int n_acd_probe_handle_defended(NAcdProbe *probe, const uint8_t *sender, bool defended);
 
 /* eBPF */
 
+#define N_ACD_BPF_INLINE_MAX (8)
+#define N_ACD_BPF_BLOOM_MIN (65536)
+#define N_ACD_BPF_XDP_MAP_MAX (256)
+#define N_ACD_BPF_XDP_RING_SIZE (16384)
+
 int n_acd_bpf_map_create(int *mapfdp, size_t max_elements);
 int n_acd_bpf_map_add(int mapfd, struct in_addr *addr);
 int n_acd_bpf_map_remove(int mapfd, struct in_addr *addr);
 
-int n_acd_bpf_compile(int *progfdp, int mapfd, struct ether_addr *mac);
+int n_acd_bpf_bloom_create(int *bloomfdp, size_t max_elements);
+int n_acd_bpf_bloom_add(int bloomfd, struct in_addr *addr);
+
+int n_acd_bpf_probe_load_bytes(bool *supportedp);
+int n_acd_bpf_compile(int *progfdp,
+                      int mapfd,
+                      int bloomfd,
+                      const struct in_addr *addrs,
+                      size_t n_addrs,
+                      struct ether_addr *mac,
+                      unsigned int sample);
+int n_acd_bpf_compile_legacy(int *progfdp, int mapfd, struct ether_addr *mac);
+
+int n_acd_bpf_shared_map_create(int *mapfdp, size_t max_entries);
+int n_acd_bpf_shared_map_ref(int mapfd, int ifindex, struct in_addr *addr);
+int n_acd_bpf_shared_map_unref(int mapfd, int ifindex, struct in_addr *addr);
+int n_acd_bpf_mac_map_create(int *mapfdp, size_t max_entries);
+int n_acd_bpf_mac_map_set(int mapfd, int ifindex, struct ether_addr *mac);
+int n_acd_bpf_mac_map_unset(int mapfd, int ifindex);
+int n_acd_bpf_map_copy(int to_mapfd, int from_mapfd);
+int n_acd_bpf_map_flush(int mapfd);
+int n_acd_bpf_map_get_max_entries(int mapfd, size_t *max_entriesp);
+int n_acd_bpf_obj_pin(int fd, const char *path);
+int n_acd_bpf_obj_get(int *fdp, const char *path);
+int n_acd_bpf_compile_shared(int *progfdp, int mapfd, int macfd);
+
+int n_acd_bpf_xdp_map_create(int *mapfdp, size_t max_entries);
+int n_acd_bpf_xdp_map_set(int mapfd, struct in_addr *addr, uint64_t last_defend);
+int n_acd_bpf_xdp_map_unset(int mapfd, struct in_addr *addr);
+int n_acd_bpf_ring_init(NAcdBpfRing *ring, size_t size);
+void n_acd_bpf_ring_deinit(NAcdBpfRing *ring);
+int n_acd_bpf_ring_pop(NAcdBpfRing *ring, void *data, size_t *n_datap);
+int n_acd_bpf_compile_xdp(int *progfdp,
+                          int defendfd,
+                          int ringfd,
+                          int mapfd,
+                          int xskfd,
+                          struct ether_addr *mac);
+int n_acd_bpf_xdp_attach(int *linkfdp, int progfd, int ifindex, bool generic);
+int n_acd_bpf_xdp_update(int linkfd, int progfd);
+int n_acd_bpf_xsk_init(NAcdBpfXsk *xsk, int ifindex);
+void n_acd_bpf_xsk_deinit(NAcdBpfXsk *xsk);
+int n_acd_bpf_xsk_pop(NAcdBpfXsk *xsk, void *data, size_t *n_datap);
+int n_acd_bpf_xsk_map_create(int *mapfdp, NAcdBpfXsk *xsk);
 
 /* inline helpers */
 
@@ -152,3 +717,15 @@ static inline void n_acd_event_node_freep(NAcdEventNode **node) {
         if (*node)
                 n_acd_event_node_free(*node);
 }
+
+/*
+ * Probes are indexed by interface first, and address second. Single-interface
+ * contexts thus simply order their probes by address.
+ */
+static inline int n_acd_probe_compare(NAcdProbe *probe, int ifindex, uint32_t addr) {
+        if (ifindex != probe->interface->ifindex)
+                return ifindex < probe->interface->ifindex ? -1 : 1;
+        if (addr != probe->ip.s_addr)
+                return addr < probe->ip.s_addr ? -1 : 1;
+        return 0;
+}
@@ -23,53 +23,6 @@
 #include "n-acd.h"
 #include "n-acd-private.h"
 
-/*
- * These parameters and timing intervals are specified in RFC-5227. The
- * original values are:
- *
- *     PROBE_NUM                                3
- *     PROBE_WAIT                               1s
- *     PROBE_MIN                                1s
- *     PROBE_MAX                                3s
- *     ANNOUNCE_NUM                             3
- *     ANNOUNCE_WAIT                            2s
- *     ANNOUNCE_INTERVAL                        2s
- *     MAX_CONFLICTS                            10
- *     RATE_LIMIT_INTERVAL                      60s
- *     DEFEND_INTERVAL                          10s
- *
- * If we assume a best-case and worst-case scenario for non-conflicted runs, we
- * end up with a runtime between 4s and 9s to finish the probe. Then it still
- * takes a fixed 4s to finish the announcements.
- *
- * RFC 5227 section 1.1:
- *     [...] (Note that the values listed here are fixed constants; they are
- *     not intended to be modifiable by implementers, operators, or end users.
- *     These constants are given symbolic names here to facilitate the writing
- *     of future standards that may want to reference this document with
- *     different values for these named constants; however, at the present time
- *     no such future standards exist.) [...]
- *
- * Unfortunately, no-one ever stepped up to write a "future standard" to revise
- * the timings. A 9s timeout for successful link setups is not acceptable today.
- * Hence, we will just go forward and ignore the proposed values. On both
- * wired and wireless local links round-trip latencies of below 3ms are common.
- * We require the caller to set a timeout multiplier, where 1 corresponds to a
- * total probe time between 0.5 ms and 1.0 ms. On modern networks a multiplier
- * of about 100 should be a reasonable default. To comply with the RFC select a
- * multiplier of 9000.
- */
-#define N_ACD_RFC_PROBE_NUM                     (3)
-#define N_ACD_RFC_PROBE_WAIT_NSEC               (UINT64_C(111111)) /* 1/9 ms */
-#define N_ACD_RFC_PROBE_MIN_NSEC                (UINT64_C(111111)) /* 1/9 ms */
-#define N_ACD_RFC_PROBE_MAX_NSEC                (UINT64_C(333333)) /* 3/9 ms */
-#define N_ACD_RFC_ANNOUNCE_NUM                  (3)
-#define N_ACD_RFC_ANNOUNCE_WAIT_NSEC            (UINT64_C(222222)) /* 2/9 ms */
-#define N_ACD_RFC_ANNOUNCE_INTERVAL_NSEC        (UINT64_C(222222)) /* 2/9 ms */
-#define N_ACD_RFC_MAX_CONFLICTS                 (10)
-#define N_ACD_RFC_RATE_LIMIT_INTERVAL_NSEC      (UINT64_C(60000000000)) /* 60s */
-#define N_ACD_RFC_DEFEND_INTERVAL_NSEC          (UINT64_C(10000000000)) /* 10s */
-
 /**
  * n_acd_probe_config_new() - create probe configuration
  * @configp:                    output argument for new probe configuration
@@ -114,6 +67,24 @@ _c_public_ NAcdProbeConfig *n_acd_probe_config_free(NAcdProbeConfig *config) {
         return NULL;
 }
 
+/**
+ * n_acd_probe_config_set_ifindex() - set ifindex property
+ * @config:                     configuration to operate on
+ * @ifindex:                    ifindex to set
+ *
+ * This sets the ifindex property of the probe configuration. It selects the
+ * interface of a multi-interface context that a probe runs on. The interface
+ * must have been added to the context via n_acd_add_interface().
+ *
+ * On single-interface contexts, this must be left unset, or match the
+ * interface of the context.
+ *
+ * Default value is 0.
+ */
+_c_public_ void n_acd_probe_config_set_ifindex(NAcdProbeConfig *config, int ifindex) {
+        config->ifindex = ifindex;
+}
+
 /**
  * n_acd_probe_config_set_ip() - set ip property
  * @config:                     configuration to operate on
@@ -141,6 +112,10 @@ _c_public_ void n_acd_probe_config_set_ip(NAcdProbeConfig *config, struct in_add
  * If set to 0, conflict detection is skipped and the address is immediately
  * advertised and defended.
  *
+ * If set to `N_ACD_TIMEOUT_ADAPTIVE`, the timeout is derived from the measured
+ * round-trip time of the link when the probe starts, see
+ * n_acd_config_set_adaptive_timeout().
+ *
  * Depending on the transport used, the API user should select a suitable
  * timeout. Since `ACD` only operates on the link layer, timeouts in the
  * hundreds of milliseconds range should be more than enough for any modern
@@ -157,7 +132,127 @@ _c_public_ void n_acd_probe_config_set_timeout(NAcdProbeConfig *config, uint64_t
         config->timeout_msecs = msecs;
 }
 
-static void n_acd_probe_schedule(NAcdProbe *probe, uint64_t n_timeout, unsigned int n_jitter) {
+/**
+ * n_acd_probe_config_set_timing() - set timing property
+ * @config:                     configuration to operate on
+ * @timing:                     timing profile to set, or NULL
+ *
+ * This sets the individual timings of a conflict detection probe, rather than
+ * scaling the timings of RFC-5227 by the timeout. The profile gives the number
+ * of probes to send, the wait before the first probe, the minimum and maximum
+ * interval between probes, the wait after the last probe, as well as the number
+ * of announcements and their interval. All times are in nanoseconds. The
+ * profile is copied, so the caller may release it afterwards.
+ *
+ * Presets are provided as `N_ACD_TIMING_RFC5227`, `N_ACD_TIMING_FAST_LAN`, and
+ * `N_ACD_TIMING_DATACENTER`. The first uses the constants of RFC-5227
+ * verbatim, whereas a timeout of `N_ACD_TIMEOUT_RFC5227` keeps the longer
+ * maximum probe interval and the third announcement this implementation always
+ * used.
+ *
+ * If the profile sends no probes, conflict detection is skipped, just like
+ * with a timeout of 0. At least one announcement is always sent, and the
+ * minimum probe interval must not exceed the maximum, otherwise creating the
+ * probe fails.
+ *
+ * A timing profile overrides the timeout, including `N_ACD_TIMEOUT_ADAPTIVE`.
+ * If set to NULL, the timeout is used again.
+ *
+ * By default, no timing profile is set.
+ */
+_c_public_ void n_acd_probe_config_set_timing(NAcdProbeConfig *config, const NAcdTiming *timing) {
+        if (timing) {
+                config->timing = *timing;
+                config->has_timing = true;
+        } else {
+                config->timing = (NAcdTiming){};
+                config->has_timing = false;
+        }
+}
+
+/**
+ * n_acd_probe_config_set_refresh() - set refresh property
+ * @config:                     configuration to operate on
+ * @refresh:                    whether to refresh the address
+ *
+ * If set, the address is announced again periodically, once the probe sent
+ * its announcements, for as long as the probe is announced. The period is a
+ * property of the context, see n_acd_config_set_refresh(). Without one, this
+ * has no effect.
+ *
+ * By default, addresses are not refreshed.
+ */
+_c_public_ void n_acd_probe_config_set_refresh(NAcdProbeConfig *config, bool refresh) {
+        config->refresh = refresh;
+}
+
+/**
+ * n_acd_probe_config_set_auto_announce() - set auto-announce property
+ * @config:                     configuration to operate on
+ * @announce:                   whether to announce automatically
+ * @defend:                     defense policy
+ *
+ * If set, the probe announces the address on its own, as if
+ * n_acd_probe_announce() was called with @defend, right when it raises
+ * N_ACD_EVENT_READY. The first announcement is sent in the same dispatch,
+ * rather than after another round-trip through the event loop of the caller.
+ * N_ACD_EVENT_READY is still raised, but the caller must not call
+ * n_acd_probe_announce() in response.
+ *
+ * This is only suitable if the caller can serve ARP requests for the address
+ * as soon as it is ready, for instance because it is configured on the
+ * interface right away. @defend must be a valid defense policy, otherwise
+ * creating the probe fails.
+ *
+ * By default, addresses are not announced automatically.
+ */
+_c_public_ void n_acd_probe_config_set_auto_announce(NAcdProbeConfig *config, bool announce, unsigned int defend) {
+        config->auto_announce = announce;
+        config->auto_defend = defend;
+}
+
+/**
+ * n_acd_probe_config_set_tentative() - set tentative property
+ * @config:                     configuration to operate on
+ * @tentative:                  whether to report the address as tentative
+ *
+ * If set, the probe raises N_ACD_EVENT_TENTATIVE as soon as it sent its first
+ * probe, long before N_ACD_EVENT_READY. Much like optimistic duplicate address
+ * detection of IPv6, this allows callers that can tolerate it to start using
+ * the address early. Conflicts are still reported as N_ACD_EVENT_USED, and
+ * the caller must stop using the address right away if one is.
+ *
+ * If the probe sends no probes at all, because its timeout is 0, or because
+ * another host claimed the address recently, no N_ACD_EVENT_TENTATIVE is
+ * raised.
+ *
+ * By default, no N_ACD_EVENT_TENTATIVE is raised.
+ */
+_c_public_ void n_acd_probe_config_set_tentative(NAcdProbeConfig *config, bool tentative) {
+        config->tentative = tentative;
+}
+
+/**
+ * n_acd_probe_config_is_valid() - verify probe configuration
+ * @config:                     configuration to operate on
+ *
+ * This checks the defense policy and the timing profile of @config, if any,
+ * for consistency.
+ *
+ * Return: True if the configuration can be used, false if not.
+ */
+bool n_acd_probe_config_is_valid(NAcdProbeConfig *config) {
+        if (config->auto_announce && config->auto_defend >= _N_ACD_DEFEND_N)
+                return false;
+
+        if (!config->has_timing)
+                return true;
+
+        return config->timing.n_announces &&
+               config->timing.probe_min_nsecs <= config->timing.probe_max_nsecs;
+}
+
+static void n_acd_probe_schedule(NAcdProbe *probe, uint64_t n_timeout, uint64_t n_jitter) {
         uint64_t n_time;
 
         timer_now(&probe->acd->timer, &n_time);
@@ -181,6 +276,9 @@ static void n_acd_probe_schedule(NAcdProbe *probe, uint64_t n_timeout, unsigned
 
 static void n_acd_probe_unschedule(NAcdProbe *probe) {
         timeout_unschedule(&probe->timeout);
+        n_acd_pace_dequeue(probe->acd, probe);
+        n_acd_retry_dequeue(probe->acd, probe);
+        n_acd_refresh_unlink(probe->acd, probe);
 }
 
 static bool n_acd_probe_is_unique(NAcdProbe *probe) {
@@ -190,11 +288,11 @@ static bool n_acd_probe_is_unique(NAcdProbe *probe) {
                 return false;
 
         sibling = c_rbnode_entry(c_rbnode_next(&probe->ip_node), NAcdProbe, ip_node);
-        if (sibling && sibling->ip.s_addr == probe->ip.s_addr)
+        if (sibling && !n_acd_probe_compare(sibling, probe->interface->ifindex, probe->ip.s_addr))
                 return false;
 
         sibling = c_rbnode_entry(c_rbnode_prev(&probe->ip_node), NAcdProbe, ip_node);
-        if (sibling && sibling->ip.s_addr == probe->ip.s_addr)
+        if (sibling && !n_acd_probe_compare(sibling, probe->interface->ifindex, probe->ip.s_addr))
                 return false;
 
         return true;
@@ -212,10 +310,10 @@ static int n_acd_probe_link(NAcdProbe *probe) {
                 return r;
 
         /*
-         * Link entry into context, indexed by its IP. Note that we allow
-         * duplicates just fine. It is up to you to decide whether to avoid
-         * duplicates, if you don't want them. Duplicates on the same context
-         * do not conflict with each other, though.
+         * Link entry into context, indexed by its interface and IP. Note that
+         * we allow duplicates just fine. It is up to you to decide whether to
+         * avoid duplicates, if you don't want them. Duplicates on the same
+         * context do not conflict with each other, though.
          */
         {
                 CRBNode **slot, *parent;
@@ -226,7 +324,7 @@ static int n_acd_probe_link(NAcdProbe *probe) {
                 while (*slot) {
                         other = c_rbnode_entry(*slot, NAcdProbe, ip_node);
                         parent = *slot;
-                        if (probe->ip.s_addr < other->ip.s_addr)
+                        if (n_acd_probe_compare(other, probe->interface->ifindex, probe->ip.s_addr) < 0)
                                 slot = &(*slot)->left;
                         else
                                 slot = &(*slot)->right;
@@ -239,7 +337,7 @@ static int n_acd_probe_link(NAcdProbe *probe) {
          * Add the ip address to the map, if it is not already there.
          */
         if (n_acd_probe_is_unique(probe)) {
-                r = n_acd_bpf_map_add(probe->acd->fd_bpf_map, &probe->ip);
+                r = n_acd_add_bpf_map_entry(probe->acd, probe->interface->ifindex, &probe->ip);
                 if (r) {
                         /*
                          * Make sure the IP address is linked in userspace iff
@@ -248,32 +346,49 @@ static int n_acd_probe_link(NAcdProbe *probe) {
                         c_rbnode_unlink(&probe->ip_node);
                         return r;
                 }
-                ++probe->acd->n_bpf_map;
         }
 
+        /* a new probe must see all conflicts for its address itself */
+        n_acd_xdp_refresh(probe->acd, &probe->ip);
+
         return 0;
 }
 
 static void n_acd_probe_unlink(NAcdProbe *probe) {
-        int r;
+        bool unique;
 
         /*
          * If this is the only probe for a given IP, remove the IP from the
-         * kernel BPF map.
+         * kernel BPF map. This must be done after unlinking it, since the
+         * filter might be recompiled from the ip-tree.
          */
-        if (n_acd_probe_is_unique(probe)) {
-                r = n_acd_bpf_map_remove(probe->acd->fd_bpf_map, &probe->ip);
-                c_assert(r >= 0);
-                --probe->acd->n_bpf_map;
-        }
+        unique = n_acd_probe_is_unique(probe);
         c_rbnode_unlink(&probe->ip_node);
+        if (unique)
+                n_acd_remove_bpf_map_entry(probe->acd, probe->interface->ifindex, &probe->ip);
+
+        n_acd_xdp_refresh(probe->acd, &probe->ip);
 }
 
 int n_acd_probe_new(NAcdProbe **probep, NAcd *acd, NAcdProbeConfig *config) {
         _c_cleanup_(n_acd_probe_freep) NAcdProbe *probe = NULL;
+        NAcdInterface *interface;
         int r;
 
-        if (!config->ip.s_addr)
+        if (!config->ip.s_addr || !n_acd_probe_config_is_valid(config))
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        if (acd->multi_interface)
+                interface = n_acd_find_interface(acd, config->ifindex);
+        else if (!config->ifindex || config->ifindex == acd->ifindex)
+                interface = n_acd_find_interface(acd, acd->ifindex);
+        else
+                interface = NULL;
+        if (!interface)
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        /* the kernel delivers packets for other shards elsewhere */
+        if (acd->fanout && n_acd_fanout_get_shard(acd->fanout, config->ip) != acd->shard)
                 return N_ACD_E_INVALID_ARGUMENT;
 
         probe = malloc(sizeof(*probe));
@@ -303,8 +418,51 @@ int n_acd_probe_new(NAcdProbe **probep, NAcd *acd, NAcdProbeConfig *config) {
          * division here, we multiplier all our timeouts by 1000000 statically
          * at compile time. Therefore, we can use the user-provided timeout as
          * unmodified multiplier. No conversion necessary.
+         *
+         * An explicit timing profile replaces all of this, see
+         * n_acd_probe_start().
          */
         probe->timeout_multiplier = config->timeout_msecs;
+        probe->timing = config->timing;
+        probe->has_timing = config->has_timing;
+        probe->refresh = config->refresh;
+        probe->auto_announce = config->auto_announce;
+        probe->auto_defend = config->auto_defend;
+        probe->tentative = config->tentative;
+
+        r = n_acd_probe_start(probe, interface);
+        if (r)
+                return r;
+
+        *probep = probe;
+        probe = NULL;
+        return 0;
+}
+
+/**
+ * n_acd_probe_start() - start a new probe
+ * @probe:                      probe to operate on
+ * @interface:                  interface to run on
+ *
+ * This starts the probe @probe on @interface of its context. The address and
+ * timeout of the probe must be set. Once this was called, the probe must be
+ * released via n_acd_probe_free(), even if this failed.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_acd_probe_start(NAcdProbe *probe, NAcdInterface *interface) {
+        NAcdObservation *observation;
+        NAcd *acd = probe->acd;
+        uint64_t now;
+        int r;
+
+        probe->interface = interface;
+        ++interface->n_probes;
+        ++acd->n_probes;
+
+        r = n_acd_activate(acd);
+        if (r)
+                return r;
 
         r = n_acd_probe_link(probe);
         if (r)
@@ -317,22 +475,125 @@ int n_acd_probe_new(NAcdProbe **probep, NAcd *acd, NAcdProbeConfig *config) {
          * probes successfully and schedule the timer so we proceed with the
          * announcements. We must schedule a fake timer there, since we are not
          * allowed to advance the state machine outside of n_acd_dispatch().
+         * If another host claimed the address recently, we fail on the first
+         * timer, without sending anything. If the address was verified
+         * recently, we send only the last probe, and we send it right away.
+         * If too many conflicts happened recently, the first probe is delayed
+         * further, so probes do not start more often than the rate-limit.
          */
-        if (probe->timeout_multiplier) {
+        timer_now(&acd->timer, &now);
+        observation = n_acd_find_observation(acd, interface, probe->ip, now);
+
+        if (!probe->has_timing) {
+                uint64_t m;
+
+                if (probe->timeout_multiplier == N_ACD_TIMEOUT_ADAPTIVE)
+                        probe->timeout_multiplier = n_acd_rtt_timeout(acd);
+
+                /*
+                 * Without a timing profile, the probe timings are the ones of
+                 * the spec scaled by the timeout multiplier. Announcements
+                 * always follow the spec, regardless of the multiplier.
+                 */
+                m = probe->timeout_multiplier;
+                probe->timing = (NAcdTiming){
+                        .n_probes = m ? N_ACD_RFC_PROBE_NUM : 0,
+                        .probe_wait_nsecs = m * N_ACD_RFC_PROBE_WAIT_NSEC,
+                        .probe_min_nsecs = m * N_ACD_RFC_PROBE_MIN_NSEC,
+                        .probe_max_nsecs = m * N_ACD_RFC_PROBE_MAX_NSEC,
+                        .announce_wait_nsecs = m * N_ACD_RFC_ANNOUNCE_WAIT_NSEC,
+                        .n_announces = N_ACD_RFC_ANNOUNCE_NUM,
+                        .announce_interval_nsecs = N_ACD_TIMEOUT_RFC5227 * N_ACD_RFC_ANNOUNCE_INTERVAL_NSEC,
+                };
+        }
+
+        if (probe->timing.n_probes && observation) {
+                probe->observed = true;
+                memcpy(probe->observed_sender, observation->mac, ETH_ALEN);
+                n_acd_probe_schedule(probe, 0, 0);
+        } else if (probe->timing.n_probes && n_acd_recall(acd, interface, probe->ip, now)) {
+                probe->n_iteration = probe->timing.n_probes - 1;
+                n_acd_probe_schedule(probe, n_acd_throttle(acd, now), 0);
+        } else if (probe->timing.n_probes) {
                 probe->n_iteration = 0;
                 n_acd_probe_schedule(probe,
-                                     0,
-                                     probe->timeout_multiplier * N_ACD_RFC_PROBE_WAIT_NSEC);
+                                     n_acd_throttle(acd, now),
+                                     probe->timing.probe_wait_nsecs);
         } else {
-                probe->n_iteration = N_ACD_RFC_PROBE_NUM;
+                probe->n_iteration = 0;
                 n_acd_probe_schedule(probe, 0, 0);
         }
 
-        *probep = probe;
-        probe = NULL;
         return 0;
 }
 
+/**
+ * n_acd_probe_fail() - halt a probe that could not be started
+ * @probe:                      probe to operate on
+ * @error:                      error code returned by n_acd_probe_start()
+ *
+ * This halts @probe, and raises an N_ACD_EVENT_FAILED event carrying @error
+ * on it, so the failure is reported to the owner of the probe, rather than to
+ * whoever happens to dispatch the context.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_acd_probe_fail(NAcdProbe *probe, int error) {
+        NAcdEventNode *node;
+        int r;
+
+        n_acd_probe_unschedule(probe);
+        probe->state = N_ACD_PROBE_STATE_FAILED;
+
+        r = n_acd_probe_raise(probe, &node, N_ACD_EVENT_FAILED);
+        if (r)
+                return r;
+
+        node->event.failed.error = error;
+        return 0;
+}
+
+/**
+ * n_acd_probe_destroy() - destroy a probe without releasing its context
+ * @probe:                      probe to operate on
+ *
+ * This is n_acd_probe_free(), except that the reference @probe holds on its
+ * context is not released. This is used for probes that already handed over
+ * their reference, see n_acd_submit_probe_free(). The probe might not have
+ * been started yet.
+ */
+void n_acd_probe_destroy(NAcdProbe *probe) {
+        NAcdEventNode *node, *t_node;
+
+        c_list_for_each_entry_safe(node, t_node, &probe->event_list, probe_link)
+                n_acd_event_node_free(node);
+
+        if (probe->interface) {
+                /* the address was in use until now, so it is still verified */
+                if (probe->state == N_ACD_PROBE_STATE_ANNOUNCING) {
+                        uint64_t now;
+
+                        timer_now(&probe->acd->timer, &now);
+                        n_acd_remember(probe->acd, probe->interface, probe->ip, now, true);
+                }
+
+                n_acd_probe_unschedule(probe);
+                n_acd_probe_unlink(probe);
+
+                --probe->interface->n_probes;
+
+                /*
+                 * Lazy contexts release their kernel resources with the last
+                 * probe. During dispatch, n_acd_dispatch() does so once it is
+                 * done with the events that still refer to them.
+                 */
+                if (!--probe->acd->n_probes && probe->acd->lazy && !probe->acd->dispatching)
+                        n_acd_deactivate(probe->acd);
+        }
+
+        free(probe);
+}
+
 /**
  * n_acd_probe_free() - destroy a probe
  * @probe:                      probe to operate on, or NULL
@@ -348,18 +609,14 @@ int n_acd_probe_new(NAcdProbe **probep, NAcd *acd, NAcdProbeConfig *config) {
  * Return: NULL is returned.
  */
 _c_public_ NAcdProbe *n_acd_probe_free(NAcdProbe *probe) {
-        NAcdEventNode *node, *t_node;
+        NAcd *acd;
 
         if (!probe)
                 return NULL;
 
-        c_list_for_each_entry_safe(node, t_node, &probe->event_list, probe_link)
-                n_acd_event_node_free(node);
-
-        n_acd_probe_unschedule(probe);
-        n_acd_probe_unlink(probe);
-        probe->acd = n_acd_unref(probe->acd);
-        free(probe);
+        acd = probe->acd;
+        n_acd_probe_destroy(probe);
+        n_acd_unref(acd);
 
         return NULL;
 }
@@ -376,14 +633,23 @@ int n_acd_probe_raise(NAcdProbe *probe, NAcdEventNode **nodep, unsigned int even
         case N_ACD_EVENT_READY:
                 node->event.ready.probe = probe;
                 break;
+        case N_ACD_EVENT_TENTATIVE:
+                node->event.tentative.probe = probe;
+                break;
+        case N_ACD_EVENT_FAILED:
+                node->event.failed.probe = probe;
+                break;
         case N_ACD_EVENT_USED:
                 node->event.used.probe = probe;
+                node->event.used.timestamp = probe->acd->timestamp;
                 break;
         case N_ACD_EVENT_DEFENDED:
                 node->event.defended.probe = probe;
+                node->event.defended.timestamp = probe->acd->timestamp;
                 break;
         case N_ACD_EVENT_CONFLICT:
                 node->event.conflict.probe = probe;
+                node->event.conflict.timestamp = probe->acd->timestamp;
                 break;
         default:
                 c_assert(0);
@@ -398,27 +664,67 @@ int n_acd_probe_raise(NAcdProbe *probe, NAcdEventNode **nodep, unsigned int even
         return 0;
 }
 
+static void n_acd_probe_start_announcing(NAcdProbe *probe, unsigned int defend) {
+        probe->state = N_ACD_PROBE_STATE_ANNOUNCING;
+        probe->defend = defend;
+        probe->n_iteration = 0;
+
+        n_acd_xdp_refresh(probe->acd, &probe->ip);
+}
+
 int n_acd_probe_handle_timeout(NAcdProbe *probe) {
+        NAcdEventNode *node;
         int r;
 
         switch (probe->state) {
         case N_ACD_PROBE_STATE_PROBING:
                 /*
-                 * We are still PROBING. We send 3 probes with a random timeout
+                 * Another host claimed the address moments ago, so fail just
+                 * as if it answered our first probe.
+                 */
+                if (probe->observed) {
+                        uint64_t now;
+
+                        r = n_acd_probe_raise(probe, &node, N_ACD_EVENT_USED);
+                        if (r)
+                                return r;
+
+                        node->event.used.sender = node->sender;
+                        node->event.used.n_sender = ETH_ALEN;
+                        memcpy(node->sender, probe->observed_sender, ETH_ALEN);
+
+                        timer_now(&probe->acd->timer, &now);
+                        n_acd_remember(probe->acd, probe->interface, probe->ip, now, false);
+                        r = n_acd_conflict(probe->acd, now);
+                        if (r)
+                                return r;
+
+                        n_acd_probe_unlink(probe);
+                        probe->state = N_ACD_PROBE_STATE_FAILED;
+                        break;
+                }
+
+                /*
+                 * We are still PROBING. We send N probes with a random timeout
                  * scheduled between each. If, after a fixed timeout, we did
                  * not receive any conflict we consider the probing successful.
                  */
-                if (probe->n_iteration < N_ACD_RFC_PROBE_NUM) {
+                if (probe->n_iteration < probe->timing.n_probes) {
                         /*
-                         * We have not sent all 3 probes, yet. A timer fired,
+                         * We have not sent all N probes, yet. A timer fired,
                          * so we are ready to send the next probe. If this is
-                         * the third probe, schedule a timer for ANNOUNCE_WAIT
+                         * the last probe, schedule a timer for ANNOUNCE_WAIT
                          * to give other peers a chance to answer. If this is
                          * not the third probe, wait between PROBE_MIN and
                          * PROBE_MAX for the next probe.
+                         * If the pacer queued the probe, it runs this again
+                         * once the probe may be sent.
                          */
 
-                        r = n_acd_send(probe->acd, &probe->ip, NULL);
+                        if (!n_acd_pace(probe->acd, probe, N_ACD_PACE_PROBE))
+                                break;
+
+                        r = n_acd_send(probe->acd, probe->interface, &probe->ip, NULL);
                         if (r) {
                                 if (r != N_ACD_E_DROPPED)
                                         return r;
@@ -428,27 +734,42 @@ int n_acd_probe_handle_timeout(NAcdProbe *probe) {
                                  * never reached the network. Reasons are
                                  * manifold, and n_acd_send() raises events if
                                  * necessary.
-                                 * From a probe-perspective, we simply pretend
-                                 * we never sent the probe and schedule a
-                                 * timeout for the next probe, effectively
-                                 * doubling a single probe-interval.
+                                 * If the retry queue takes the probe, it runs
+                                 * this again once the socket is writable.
+                                 * Otherwise, we simply pretend we never sent
+                                 * the probe and schedule a timeout for the
+                                 * next probe, effectively doubling a single
+                                 * probe-interval.
                                  */
+                                if (n_acd_retry(probe->acd, probe))
+                                        break;
                         } else {
+                                /* the first probe is out, so others may notice us */
+                                if (probe->tentative && !probe->last_probe) {
+                                        r = n_acd_probe_raise(probe, NULL, N_ACD_EVENT_TENTATIVE);
+                                        if (r)
+                                                return r;
+                                }
+
                                 /* Successfully sent, so advance counter. */
                                 ++probe->n_iteration;
+                                probe->n_retries = 0;
+                                timer_now(&probe->acd->timer, &probe->last_probe);
                         }
 
-                        if (probe->n_iteration < N_ACD_RFC_PROBE_NUM)
+                        if (probe->n_iteration < probe->timing.n_probes)
                                 n_acd_probe_schedule(probe,
-                                                     probe->timeout_multiplier * N_ACD_RFC_PROBE_MIN_NSEC,
-                                                     probe->timeout_multiplier * (N_ACD_RFC_PROBE_MAX_NSEC - N_ACD_RFC_PROBE_MIN_NSEC));
+                                                     probe->timing.probe_min_nsecs,
+                                                     probe->timing.probe_max_nsecs - probe->timing.probe_min_nsecs);
                         else
                                 n_acd_probe_schedule(probe,
-                                                     probe->timeout_multiplier * N_ACD_RFC_ANNOUNCE_WAIT_NSEC,
+                                                     probe->timing.announce_wait_nsecs,
                                                      0);
                 } else {
+                        uint64_t now;
+
                         /*
-                         * All 3 probes succeeded and we waited enough to
+                         * All N probes succeeded and we waited enough to
                          * consider this address usable by now. Do not announce
                          * the address, yet. We must first give the caller a
                          * chance to configure the address (so they can answer
@@ -458,6 +779,19 @@ int n_acd_probe_handle_timeout(NAcdProbe *probe) {
                         if (r)
                                 return r;
 
+                        timer_now(&probe->acd->timer, &now);
+                        n_acd_remember(probe->acd, probe->interface, probe->ip, now, true);
+
+                        /*
+                         * Unless the caller told us upfront how to announce
+                         * the address. Then we are dispatching already, so
+                         * send the first announcement right away.
+                         */
+                        if (probe->auto_announce) {
+                                n_acd_probe_start_announcing(probe, probe->auto_defend);
+                                return n_acd_probe_handle_timeout(probe);
+                        }
+
                         probe->state = N_ACD_PROBE_STATE_CONFIGURING;
                 }
 
@@ -466,14 +800,18 @@ int n_acd_probe_handle_timeout(NAcdProbe *probe) {
         case N_ACD_PROBE_STATE_ANNOUNCING:
                 /*
                  * We are ANNOUNCING, meaning the caller configured the address
-                 * on the interface and is actively using it. We send 3
+                 * on the interface and is actively using it. We send N
                  * announcements out, in a short interval, and then just
                  * perform passive conflict detection.
-                 * Note that once all 3 announcements are sent, we no longer
-                 * schedule a timer, so this part should not trigger, anymore.
+                 * Note that once all N announcements are sent, we no longer
+                 * schedule a timer, so this part should not trigger, anymore,
+                 * except when the pacer releases a queued defense.
                  */
 
-                r = n_acd_send(probe->acd, &probe->ip, &probe->ip);
+                if (!n_acd_pace(probe->acd, probe, N_ACD_PACE_ANNOUNCE))
+                        break;
+
+                r = n_acd_send(probe->acd, probe->interface, &probe->ip, &probe->ip);
                 if (r) {
                         if (r != N_ACD_E_DROPPED)
                                 return r;
@@ -481,24 +819,28 @@ int n_acd_probe_handle_timeout(NAcdProbe *probe) {
                         /*
                          * See above in STATE_PROBING for details. We know the
                          * packet was never sent, so we simply try again after
-                         * extending the timer.
+                         * extending the timer, unless it was parked.
                          */
+                        if (n_acd_retry(probe->acd, probe))
+                                break;
                 } else {
                         /* Successfully sent, so advance counter. */
                         ++probe->n_iteration;
+                        probe->n_retries = 0;
                 }
 
-                if (probe->n_iteration < N_ACD_RFC_ANNOUNCE_NUM) {
+                if (probe->n_iteration < probe->timing.n_announces) {
                         /*
-                         * Announcements are always scheduled according to the
-                         * time-intervals specified in the spec. We always use
-                         * the RFC5227-mandated multiplier.
-                         * If you reconsider this, note that timeout_multiplier
-                         * might be 0 here.
+                         * Announcements are scheduled according to the timing
+                         * profile. Without one, this is the interval of the
+                         * spec, see n_acd_probe_start().
                          */
                         n_acd_probe_schedule(probe,
-                                             N_ACD_TIMEOUT_RFC5227 * N_ACD_RFC_ANNOUNCE_INTERVAL_NSEC,
+                                             probe->timing.announce_interval_nsecs,
                                              0);
+                } else {
+                        /* from now on, the refresh wheel takes over */
+                        n_acd_refresh_link(probe->acd, probe);
                 }
 
                 break;
@@ -532,7 +874,16 @@ int n_acd_probe_handle_packet(NAcdProbe *probe, struct ether_arp *packet, bool h
                  * the conflict and wait for further instructions. We do not
                  * react to this, until the caller tells us what to do, but we
                  * do stop sending further probes.
+                 *
+                 * If a host claimed the address within the shortest probe
+                 * interval after we sent a probe, it most likely answered that
+                 * probe, so take a sample of the round-trip time. Later
+                 * claims, like those during ANNOUNCE_WAIT, are not answers.
                  */
+                if (hard_conflict && probe->last_probe &&
+                    now - probe->last_probe <= probe->timing.probe_min_nsecs)
+                        n_acd_rtt_sample(probe->acd, now - probe->last_probe);
+
                 r = n_acd_probe_raise(probe, &node, N_ACD_EVENT_USED);
                 if (r)
                         return r;
@@ -541,6 +892,11 @@ int n_acd_probe_handle_packet(NAcdProbe *probe, struct ether_arp *packet, bool h
                 node->event.used.n_sender = ETH_ALEN;
                 memcpy(node->sender, packet->arp_sha, ETH_ALEN);
 
+                n_acd_remember(probe->acd, probe->interface, probe->ip, now, false);
+                r = n_acd_conflict(probe->acd, now);
+                if (r)
+                        return r;
+
                 n_acd_probe_unschedule(probe);
                 n_acd_probe_unlink(probe);
                 probe->state = N_ACD_PROBE_STATE_FAILED;
@@ -575,8 +931,24 @@ int n_acd_probe_handle_packet(NAcdProbe *probe, struct ether_arp *packet, bool h
                  */
                 bool conflict = false, rate_limited = false;
 
-                if (!hard_conflict)
+                /*
+                 * Someone else probing our address is answered by the kernel,
+                 * but if a third host defends it shortly after, that defense
+                 * answered the probe, which is a sample of the round-trip
+                 * time just like an answer to our own probes.
+                 */
+                if (!hard_conflict) {
+                        probe->last_foreign_probe = now;
+                        memcpy(probe->foreign_prober, packet->arp_sha, ETH_ALEN);
                         break;
+                }
+
+                if (probe->last_foreign_probe &&
+                    now - probe->last_foreign_probe <= probe->timing.probe_min_nsecs &&
+                    memcmp(probe->foreign_prober, packet->arp_sha, ETH_ALEN)) {
+                        n_acd_rtt_sample(probe->acd, now - probe->last_foreign_probe);
+                        probe->last_foreign_probe = 0;
+                }
 
                 rate_limited = now < probe->last_defend + N_ACD_RFC_DEFEND_INTERVAL_NSEC;
 
@@ -593,7 +965,13 @@ int n_acd_probe_handle_packet(NAcdProbe *probe, struct ether_arp *packet, bool h
                         /* fallthrough */
                 case N_ACD_DEFEND_ALWAYS:
                         if (!rate_limited) {
-                                r = n_acd_send(probe->acd, &probe->ip, &probe->ip);
+                                /* a queued or parked defense is as good as sent */
+                                if (n_acd_pace(probe->acd, probe, N_ACD_PACE_DEFEND))
+                                        r = n_acd_send(probe->acd, probe->interface, &probe->ip, &probe->ip);
+                                else
+                                        r = 0;
+                                if (r == N_ACD_E_DROPPED && n_acd_retry(probe->acd, probe))
+                                        r = 0;
                                 if (r) {
                                         if (r != N_ACD_E_DROPPED)
                                                 return r;
@@ -628,6 +1006,11 @@ int n_acd_probe_handle_packet(NAcdProbe *probe, struct ether_arp *packet, bool h
                         node->event.conflict.n_sender = ETH_ALEN;
                         memcpy(node->sender, packet->arp_sha, ETH_ALEN);
 
+                        n_acd_remember(probe->acd, probe->interface, probe->ip, now, false);
+                        r = n_acd_conflict(probe->acd, now);
+                        if (r)
+                                return r;
+
                         n_acd_probe_unschedule(probe);
                         n_acd_probe_unlink(probe);
                         probe->state = N_ACD_PROBE_STATE_FAILED;
@@ -649,6 +1032,34 @@ int n_acd_probe_handle_packet(NAcdProbe *probe, struct ether_arp *packet, bool h
         return 0;
 }
 
+/*
+ * The XDP program handled a conflict for the address of @probe. It sent a
+ * defense if @defended is true, otherwise it was rate-limited. Either way,
+ * the caller is told about it, just like for conflicts handled in userspace.
+ */
+int n_acd_probe_handle_defended(NAcdProbe *probe, const uint8_t *sender, bool defended) {
+        NAcdEventNode *node;
+        int r;
+
+        /* the record might predate a change of state or policy */
+        if (probe->state != N_ACD_PROBE_STATE_ANNOUNCING ||
+            probe->defend != N_ACD_DEFEND_ALWAYS)
+                return 0;
+
+        if (defended)
+                timer_now(&probe->acd->timer, &probe->last_defend);
+
+        r = n_acd_probe_raise(probe, &node, N_ACD_EVENT_DEFENDED);
+        if (r)
+                return r;
+
+        node->event.defended.sender = node->sender;
+        node->event.defended.n_sender = ETH_ALEN;
+        memcpy(node->sender, sender, ETH_ALEN);
+
+        return 0;
+}
+
 /**
  * n_acd_probe_set_userdata - set userdata
  * @probe:                      probe to operate on
@@ -690,17 +1101,22 @@ _c_public_ void n_acd_probe_get_userdata(NAcdProbe *probe, void **userdatap) {
  *
  * This must be called in response to an N_ACD_EVENT_READY event, and only
  * after the given address has been configured on the given network interface.
+ * It may be called again to restart the announcements, or to change the
+ * defense policy. Probes that announce automatically, see
+ * n_acd_probe_config_set_auto_announce(), and probes that failed must not be
+ * announced.
  *
  * Return: 0 on success, N_ACD_E_INVALID_ARGUMENT in case the defense policy
- *         is invalid, negative error code on failure.
+ *         is invalid, or the probe announces automatically or failed, negative
+ *         error code on failure.
  */
 _c_public_ int n_acd_probe_announce(NAcdProbe *probe, unsigned int defend) {
-        if (defend >= _N_ACD_DEFEND_N)
+        if (defend >= _N_ACD_DEFEND_N ||
+            probe->auto_announce ||
+            probe->state == N_ACD_PROBE_STATE_FAILED)
                 return N_ACD_E_INVALID_ARGUMENT;
 
-        probe->state = N_ACD_PROBE_STATE_ANNOUNCING;
-        probe->defend = defend;
-        probe->n_iteration = 0;
+        n_acd_probe_start_announcing(probe, defend);
 
         /*
          * We must schedule a fake-timeout, since we are not allowed to
@@ -0,0 +1,281 @@
+/*
+ * IPv4 Address Conflict Detection
+ *
+ * This file implements the submission queue of a context. Probes are owned by
+ * the thread that dispatches their context, but other threads can submit
+ * requests to start, announce, or free probes. Requests are pushed onto a
+ * lock-free multi-producer single-consumer queue, and an eventfd in the epoll
+ * set of the context wakes its owner, which applies them in batches in
+ * n_acd_dispatch().
+ *
+ * The queue is intrusive. Every probe embeds one node per request type, so
+ * submitting a request never allocates, and thus never fails. Failures to
+ * apply a request are reported as events on the affected probe.
+ *
+ * Like any probe, a submitted probe holds a reference to its context, until
+ * its destruction is submitted. A context can hence be torn down while
+ * destruction requests are still queued, in which case the teardown applies
+ * them.
+ */
+
+#include <assert.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+
+static void n_acd_submit_push(NAcd *acd, NAcdSubmission *submission) {
+        NAcdSubmission *prev;
+
+        atomic_store_explicit(&submission->next, NULL, memory_order_relaxed);
+        prev = atomic_exchange_explicit(&acd->submit_tail, submission, memory_order_acq_rel);
+        atomic_store_explicit(&prev->next, submission, memory_order_release);
+}
+
+static NAcdSubmission *n_acd_submit_pop(NAcd *acd) {
+        NAcdSubmission *head = acd->submit_head, *next;
+
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+        if (head == &acd->submit_stub) {
+                if (!next)
+                        return NULL;
+
+                acd->submit_head = next;
+                head = next;
+                next = atomic_load_explicit(&head->next, memory_order_acquire);
+        }
+
+        if (next) {
+                acd->submit_head = next;
+                return head;
+        }
+
+        /*
+         * The head is the last node, unless a producer already swapped the
+         * tail and did not link it yet. In that case, the producer signals
+         * the eventfd once it is done, so we simply retry then.
+         */
+        if (head != atomic_load_explicit(&acd->submit_tail, memory_order_acquire))
+                return NULL;
+
+        n_acd_submit_push(acd, &acd->submit_stub);
+
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+        if (next) {
+                acd->submit_head = next;
+                return head;
+        }
+
+        return NULL;
+}
+
+static void n_acd_submit(NAcd *acd, NAcdSubmission *submission) {
+        n_acd_submit_push(acd, submission);
+
+        /* only the first request of a batch wakes up the owner */
+        if (!atomic_exchange(&acd->submit_pending, true))
+                eventfd_write(acd->fd_submit, 1);
+}
+
+static int n_acd_submit_apply(NAcd *acd, NAcdSubmission *submission) {
+        NAcdProbe *probe;
+        int r;
+
+        switch (submission->type) {
+        case N_ACD_SUBMISSION_PROBE:
+                probe = c_container_of(submission, NAcdProbe, submit_new);
+                r = n_acd_probe_start(probe, n_acd_find_interface(acd, acd->ifindex));
+                if (r)
+                        return n_acd_probe_fail(probe, r);
+                return 0;
+        case N_ACD_SUBMISSION_PROBE_FREE:
+                probe = c_container_of(submission, NAcdProbe, submit_free);
+                n_acd_probe_destroy(probe);
+                return 0;
+        case N_ACD_SUBMISSION_PROBE_ANNOUNCE:
+                probe = c_container_of(submission, NAcdProbe, submit_announce);
+                atomic_store(&probe->submit_announce_pending, false);
+
+                /*
+                 * A probe that failed already reported so, and there is no
+                 * caller to refuse the submission for an auto-announce
+                 * probe to, so both are ignored.
+                 */
+                if (probe->auto_announce || probe->state == N_ACD_PROBE_STATE_FAILED)
+                        return 0;
+
+                return n_acd_probe_announce(probe, atomic_load(&probe->submit_defend));
+        default:
+                c_assert(0);
+                return 0;
+        }
+}
+
+int n_acd_dispatch_submit(NAcd *acd) {
+        NAcdSubmission *submission;
+        eventfd_t value;
+        int r;
+
+        eventfd_read(acd->fd_submit, &value);
+        atomic_store(&acd->submit_pending, false);
+
+        for (size_t i = 0; i < N_ACD_SUBMISSION_BATCH; ++i) {
+                submission = n_acd_submit_pop(acd);
+                if (!submission)
+                        return 0;
+
+                r = n_acd_submit_apply(acd, submission);
+                if (r)
+                        break;
+        }
+
+        /* the eventfd was drained, so wake ourselves up for the rest */
+        atomic_store(&acd->submit_pending, true);
+        eventfd_write(acd->fd_submit, 1);
+        if (r)
+                return r;
+
+        acd->preempted = true;
+        return 0;
+}
+
+/**
+ * n_acd_submit_flush() - drop all pending requests
+ * @acd:                        context to operate on
+ *
+ * This is called when the last reference to @acd is dropped. By then, no
+ * other thread can submit requests anymore, and only probes whose destruction
+ * was submitted can be left in the queue, since all others keep the context
+ * alive. They are destroyed, all other requests are dropped.
+ */
+void n_acd_submit_flush(NAcd *acd) {
+        NAcdSubmission *submission;
+        NAcdProbe *probe;
+
+        while ((submission = n_acd_submit_pop(acd))) {
+                if (submission->type == N_ACD_SUBMISSION_PROBE_FREE) {
+                        probe = c_container_of(submission, NAcdProbe, submit_free);
+                        n_acd_probe_destroy(probe);
+                }
+        }
+}
+
+/**
+ * n_acd_submit_probe() - submit a new probe
+ * @acd:                        context object to operate on
+ * @probep:                     output argument for new probe
+ * @config:                     probe configuration
+ * @userdata:                   userdata pointer of the new probe
+ *
+ * This creates a new probe on the context @acd, just like n_acd_probe(), but
+ * may be called from any thread. The probe is returned in @probep right away,
+ * but only started by the next call to n_acd_dispatch() on the thread that
+ * owns the context. Events of the probe carry @userdata as userdata.
+ *
+ * The probe can be announced and freed via n_acd_submit_probe_announce() and
+ * n_acd_submit_probe_free(). Once started, it may also be used directly from
+ * the thread that owns the context, like any other probe. A probe must not be
+ * freed directly while any submission for it is pending.
+ *
+ * This is not supported on multi-interface contexts, since their interfaces
+ * are owned by the dispatching thread.
+ *
+ * Return: 0 on success, N_ACD_E_INVALID_ARGUMENT on invalid configuration
+ *         parameters, negative error code on failure.
+ */
+_c_public_ int n_acd_submit_probe(NAcd *acd, NAcdProbe **probep, NAcdProbeConfig *config, void *userdata) {
+        NAcdProbe *probe;
+
+        /*
+         * Only look at fields that never change after creation. Note that
+         * multi-interface contexts have no ifindex.
+         */
+        if (!config->ip.s_addr ||
+            !n_acd_probe_config_is_valid(config) ||
+            !acd->ifindex ||
+            (config->ifindex && config->ifindex != acd->ifindex))
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        if (acd->fanout && n_acd_fanout_get_shard(acd->fanout, config->ip) != acd->shard)
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        probe = malloc(sizeof(*probe));
+        if (!probe)
+                return -ENOMEM;
+
+        *probe = (NAcdProbe)N_ACD_PROBE_NULL(*probe);
+        probe->acd = n_acd_ref(acd);
+        probe->ip = config->ip;
+        probe->userdata = userdata;
+
+        /* see n_acd_probe_new() */
+        probe->timeout_multiplier = config->timeout_msecs;
+        probe->timing = config->timing;
+        probe->has_timing = config->has_timing;
+        probe->refresh = config->refresh;
+        probe->auto_announce = config->auto_announce;
+        probe->auto_defend = config->auto_defend;
+        probe->tentative = config->tentative;
+
+        n_acd_submit(acd, &probe->submit_new);
+
+        *probep = probe;
+        return 0;
+}
+
+/**
+ * n_acd_submit_probe_free() - submit destruction of a probe
+ * @probe:                      probe to operate on, or NULL
+ *
+ * This destroys the probe @probe, just like n_acd_probe_free(), but may be
+ * called from any thread. The probe is freed by the next call to
+ * n_acd_dispatch() on the thread that owns the context, and its events are
+ * reported until then. The caller must not use @probe anymore.
+ *
+ * The probe releases its reference to the context right away. If that was the
+ * last one, the probe is freed along with the context.
+ *
+ * If @probe is NULL, this is a no-op.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ NAcdProbe *n_acd_submit_probe_free(NAcdProbe *probe) {
+        NAcd *acd;
+
+        if (probe) {
+                acd = probe->acd;
+                n_acd_submit(acd, &probe->submit_free);
+                n_acd_unref(acd);
+        }
+
+        return NULL;
+}
+
+/**
+ * n_acd_submit_probe_announce() - submit announcement of a probe
+ * @probe:                      probe to operate on
+ * @defend:                     defense policy
+ *
+ * This announces the address of @probe, just like n_acd_probe_announce(),
+ * but may be called from any thread. The announcement is made by the next
+ * call to n_acd_dispatch() on the thread that owns the context. If this is
+ * called again before then, only the last policy is applied. If the probe
+ * announces automatically, or failed by then, the submission is ignored.
+ *
+ * Return: 0 on success, N_ACD_E_INVALID_ARGUMENT in case the defense policy
+ *         is invalid.
+ */
+_c_public_ int n_acd_submit_probe_announce(NAcdProbe *probe, unsigned int defend) {
+        if (defend >= _N_ACD_DEFEND_N)
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        atomic_store(&probe->submit_defend, defend);
+        if (!atomic_exchange(&probe->submit_announce_pending, true))
+                n_acd_submit(probe->acd, &probe->submit_announce);
+
+        return 0;
+}
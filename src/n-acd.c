@@ -20,7 +20,8 @@
  * The main context object of `n-acd` is the `NAcd` structure. It is a passive
  * ref-counted context object which drives `ACD` probes running on it. A
  * context is specific to a linux network device and transport. If multiple
- * network devices are used, then separate `NAcd` contexts must be deployed.
+ * network devices are used, then either separate `NAcd` contexts must be
+ * deployed, or a single multi-interface context that serves all of them.
  *
  * The `NAcdProbe` object drives a single `ACD` state-machine. A probe is
  * created on an `NAcd` context by providing an address to probe for. The probe
@@ -62,8 +63,10 @@
 #include <string.h>
 #include <sys/auxv.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "n-acd.h"
 #include "n-acd-private.h"
@@ -71,6 +74,9 @@
 enum {
         N_ACD_EPOLL_TIMER,
         N_ACD_EPOLL_SOCKET,
+        N_ACD_EPOLL_XDP,
+        N_ACD_EPOLL_XSK,
+        N_ACD_EPOLL_SUBMIT,
 };
 
 static int n_acd_get_random(unsigned int *random) {
@@ -109,11 +115,11 @@ static int n_acd_get_random(unsigned int *random) {
         return 0;
 }
 
-static int n_acd_socket_new(int *fdp, int fd_bpf_prog, NAcdConfig *config) {
+static int n_acd_socket_new(int *fdp, int fd_bpf_prog, int ifindex) {
         const struct sockaddr_ll address = {
                 .sll_family = AF_PACKET,
                 .sll_protocol = htobe16(ETH_P_ARP),
-                .sll_ifindex = config->ifindex,
+                .sll_ifindex = ifindex,
                 .sll_halen = ETH_ALEN,
                 .sll_addr = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
         };
@@ -149,6 +155,27 @@ error:
         return r;
 }
 
+static int n_acd_socket_set_rcvbuf(int fd, unsigned int bytes) {
+        int r;
+
+        if (bytes > INT_MAX)
+                bytes = INT_MAX;
+
+        r = setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &(int){ bytes }, sizeof(int));
+        if (r < 0 && errno == EPERM)
+                r = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(int){ bytes }, sizeof(int));
+        if (r < 0)
+                return -c_errno();
+
+        return 0;
+}
+
+static void n_acd_socket_set_busy_poll(int fd, unsigned int usecs) {
+        /* busy polling only lowers latency, so it is best-effort */
+        (void)setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &(int){ usecs }, sizeof(int));
+        (void)setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &(int){ 1 }, sizeof(int));
+}
+
 /**
  * n_acd_config_new() - create configuration object
  * @configp:                    output argument for new configuration
@@ -249,6 +276,333 @@ _c_public_ void n_acd_config_set_mac(NAcdConfig *config, const uint8_t *mac, siz
         memcpy(config->mac, mac, n_mac > ETH_ALEN ? ETH_ALEN : n_mac);
 }
 
+/**
+ * n_acd_config_set_filter() - set shared filter property
+ * @config:                     configuration to operate on
+ * @filter:                     shared filter to use, or NULL
+ *
+ * This specifies the shared filter to use. If non-NULL, the context created
+ * from @config uses @filter as kernel packet filter, rather than compiling its
+ * own. See n_acd_filter_new() for details. By default, no shared filter is
+ * used.
+ *
+ * The configuration only stores a pointer to @filter, it must be retained by
+ * the caller as long as @config is used. The context created from @config
+ * acquires its own reference.
+ */
+_c_public_ void n_acd_config_set_filter(NAcdConfig *config, NAcdFilter *filter) {
+        config->filter = filter;
+}
+
+/**
+ * n_acd_config_set_lazy() - set lazy mode property
+ * @config:                     configuration to operate on
+ * @lazy:                       whether to use lazy mode
+ *
+ * This selects whether the context defers all kernel resources until the first
+ * probe is created, and releases them again once the last probe is freed. This
+ * greatly reduces the cost of contexts that never (or rarely) run probes. The
+ * epoll-fd returned by n_acd_get_fd() is always created eagerly, and stays the
+ * same for the lifetime of the context.
+ *
+ * By default, lazy mode is disabled.
+ */
+_c_public_ void n_acd_config_set_lazy(NAcdConfig *config, bool lazy) {
+        config->lazy = lazy;
+}
+
+/**
+ * n_acd_config_set_xdp() - set XDP defender property
+ * @config:                     configuration to operate on
+ * @xdp:                        XDP mode to use
+ *
+ * This selects whether the context attaches an XDP program to the interface,
+ * which defends announced addresses right in the driver. It covers addresses
+ * whose probes are announced with N_ACD_DEFEND_ALWAYS, and answers conflicts
+ * for them without waking up the caller, respecting the usual rate-limit. The
+ * N_ACD_EVENT_DEFENDED events are still raised, though.
+ *
+ * @xdp must be one of N_ACD_XDP_NONE, N_ACD_XDP_GENERIC (which works on any
+ * interface), or N_ACD_XDP_NATIVE (which requires driver support). The XDP
+ * program is best-effort: if it cannot be attached (e.g., because the kernel
+ * lacks support, or another program is attached to the interface already),
+ * the context silently defends all addresses itself.
+ *
+ * By default, N_ACD_XDP_NONE is used.
+ */
+_c_public_ void n_acd_config_set_xdp(NAcdConfig *config, unsigned int xdp) {
+        config->xdp = xdp;
+}
+
+/**
+ * n_acd_config_set_xdp_socket() - set AF_XDP receive property
+ * @config:                     configuration to operate on
+ * @xdp_socket:                 whether to receive via an AF_XDP socket
+ *
+ * This selects whether the XDP program (see n_acd_config_set_xdp()) steers the
+ * packets relevant to the context into an AF_XDP socket, rather than letting
+ * them pass to the packet socket. This avoids allocating a socket buffer for
+ * each packet, which matters on links with a high rate of ARP traffic.
+ *
+ * Only packets on the first receive queue of the interface are steered, the
+ * packet socket still receives packets from all other queues. Like the XDP
+ * program itself, this is best-effort, and it is not available on contexts
+ * using a shared filter.
+ *
+ * By default, the AF_XDP socket is disabled.
+ */
+_c_public_ void n_acd_config_set_xdp_socket(NAcdConfig *config, bool xdp_socket) {
+        config->xdp_socket = xdp_socket;
+}
+
+/**
+ * n_acd_config_set_multi_interface() - set multi-interface property
+ * @config:                     configuration to operate on
+ * @multi_interface:            whether to serve multiple interfaces
+ *
+ * This sets the multi-interface property of the configuration object. A
+ * multi-interface context is not bound to a single network interface. Instead,
+ * it receives on all interfaces through a single packet socket, and any number
+ * of interfaces can be added to it via n_acd_add_interface(). Probes then
+ * select their interface via n_acd_probe_config_set_ifindex(). Regardless of
+ * the number of interfaces, the context uses a single socket, timer, epoll-fd
+ * and packet filter.
+ *
+ * A multi-interface context must not set the ifindex or hardware address
+ * properties, and cannot be combined with a shared filter or XDP.
+ *
+ * Default value is false.
+ */
+_c_public_ void n_acd_config_set_multi_interface(NAcdConfig *config, bool multi_interface) {
+        config->multi_interface = multi_interface;
+}
+
+/**
+ * n_acd_config_set_busy_poll() - set busy-poll property
+ * @config:                     configuration to operate on
+ * @usecs:                      busy-poll timeout in microseconds, or 0
+ *
+ * This selects the low-latency mode. If @usecs is non-zero, the receive
+ * sockets of the context are put into busy-poll mode (SO_BUSY_POLL and
+ * SO_PREFER_BUSY_POLL), so the kernel polls the device for up to @usecs
+ * rather than waiting for interrupts. This is best-effort, and silently
+ * ignored if not permitted or not supported. It is meant to be combined with
+ * n_acd_dispatch_spin() and small probe timeouts.
+ *
+ * By default, busy polling is disabled.
+ */
+_c_public_ void n_acd_config_set_busy_poll(NAcdConfig *config, unsigned int usecs) {
+        config->busy_poll = usecs;
+}
+
+/**
+ * n_acd_config_set_rcvbuf() - set receive-buffer property
+ * @config:                     configuration to operate on
+ * @bytes:                      size of the receive buffer in bytes, or 0
+ *
+ * This sets the size of the receive buffer of the packet socket of the
+ * context. If @bytes is non-zero, SO_RCVBUFFORCE is used to set it, so the
+ * limit in net.core.rmem_max is bypassed if the caller has CAP_NET_ADMIN.
+ * Otherwise, SO_RCVBUF is used, which is capped by that limit. Note that the
+ * kernel doubles the value to account for its bookkeeping overhead.
+ *
+ * If the receive buffer overflows, packets are dropped, and the context
+ * reports N_ACD_EVENT_OVERRUN. A larger buffer makes this less likely when
+ * the context is dispatched with delay, or when a lot of traffic is seen.
+ *
+ * By default, the system default size is used.
+ */
+_c_public_ void n_acd_config_set_rcvbuf(NAcdConfig *config, unsigned int bytes) {
+        config->rcvbuf = bytes;
+}
+
+/**
+ * n_acd_config_set_remember() - set remember property
+ * @config:                     configuration to operate on
+ * @msecs:                      freshness window in milliseconds, or 0
+ *
+ * This makes the context remember the addresses it recently verified. An
+ * address is verified when its probe reports N_ACD_EVENT_READY, and stays
+ * verified while the address is announced and defended, until the probe is
+ * freed. A conflict makes the context forget the address immediately.
+ *
+ * If a new probe is created for an address that was verified on the same
+ * interface, with the same hardware address, within the last @msecs, only a
+ * single probe is sent, right away, rather than the full probe sequence. This
+ * speeds up re-acquiring addresses after a link flap, while still detecting a
+ * host that took an address over in the meantime.
+ *
+ * By default, nothing is remembered.
+ */
+_c_public_ void n_acd_config_set_remember(NAcdConfig *config, uint64_t msecs) {
+        config->remember_msecs = msecs;
+}
+
+/**
+ * n_acd_config_set_observe() - set observe property
+ * @config:                     configuration to operate on
+ * @sample:                     sampling rate of unrelated claims, or 0
+ * @msecs:                      freshness window in milliseconds
+ *
+ * This makes the context passively observe which hosts claim which addresses.
+ * A claim is any ARP request or reply with a sender address set. The context
+ * keeps a table of the most recent claims, bounded in size, and replaces the
+ * least recently observed claims if it runs full. The table also counts how
+ * often the claimant of an address changed, see n_acd_get_observation().
+ *
+ * If a new probe is created for an address that another host claimed on the
+ * same interface within the last @msecs, the probe reports N_ACD_EVENT_USED
+ * right away, without sending any probes.
+ *
+ * Claims for addresses that are probed are always observed. Of the claims
+ * for any other address, the packet filter passes only one in @sample on
+ * average, to bound the overhead on busy networks. This is only supported by
+ * private packet filters on recent kernels. Without that, either no or all
+ * of those claims are observed.
+ *
+ * By default, nothing is observed. A @sample of 0 disables observation.
+ */
+_c_public_ void n_acd_config_set_observe(NAcdConfig *config, unsigned int sample, uint64_t msecs) {
+        config->observe_sample = sample;
+        config->observe_msecs = msecs;
+}
+
+/**
+ * n_acd_config_set_rate_limit() - set rate-limit property
+ * @config:                     configuration to operate on
+ * @msecs:                      rate-limit interval in milliseconds, or 0
+ *
+ * This sets the RATE_LIMIT_INTERVAL of RFC-5227. Every probe that reports
+ * N_ACD_EVENT_USED and every announced address that reports
+ * N_ACD_EVENT_CONFLICT counts as a conflict. Once MAX_CONFLICTS (10) conflicts
+ * happened within @msecs, the context reports N_ACD_EVENT_THROTTLED, and
+ * delays new probes, such that at most one probe starts per @msecs. This
+ * lasts until fewer than MAX_CONFLICTS conflicts happened within the last
+ * @msecs. See n_acd_get_throttle() to query the current state.
+ *
+ * By default, this is 60s, as suggested by RFC-5227. A value of 0 disables
+ * the rate-limit.
+ */
+_c_public_ void n_acd_config_set_rate_limit(NAcdConfig *config, uint64_t msecs) {
+        config->rate_limit_nsecs = msecs * UINT64_C(1000000);
+}
+
+/**
+ * n_acd_config_set_adaptive_timeout() - set adaptive timeout bounds
+ * @config:                     configuration to operate on
+ * @min_msecs:                  lower bound in milliseconds
+ * @max_msecs:                  upper bound in milliseconds
+ *
+ * Probes with a timeout of N_ACD_TIMEOUT_ADAPTIVE derive their timeout from
+ * the round-trip time of the link, rather than using a fixed value. The
+ * context takes a sample whenever a host claims an address shortly after we
+ * probed it, and whenever a host defends an address shortly after someone
+ * else probed it. Claims arriving later than the shortest probe interval are
+ * not taken as answers. The context keeps a smoothed estimate of the
+ * round-trip time and its variance, much like TCP does. A new adaptive probe
+ * then uses the shortest timeout whose probe interval still covers the
+ * estimated round-trip time, plus four times its variance. That timeout is
+ * clamped to [@min_msecs, @max_msecs]. Until a handful of samples were taken,
+ * @max_msecs is used.
+ *
+ * @min_msecs must be non-zero, and must not be greater than @max_msecs.
+ *
+ * By default, the bounds are 100ms and N_ACD_TIMEOUT_RFC5227.
+ */
+_c_public_ void n_acd_config_set_adaptive_timeout(NAcdConfig *config, uint64_t min_msecs, uint64_t max_msecs) {
+        config->adaptive_min_msecs = min_msecs;
+        config->adaptive_max_msecs = max_msecs;
+}
+
+/**
+ * n_acd_config_set_pacing() - set transmit pacing property
+ * @config:                     configuration to operate on
+ * @rate:                       frames per second, or 0
+ * @burst:                      frames that may be sent back-to-back
+ *
+ * This paces all frames a context sends with a token bucket. The bucket holds
+ * up to @burst tokens and refills at @rate tokens per second. Each probe,
+ * announcement, and defense takes one token. If none is left, the frame is
+ * queued on the context and released once a token is available again, with
+ * defenses before announcements, and announcements before probes. The probe
+ * that queued a frame does not advance until its frame is released, so
+ * delayed frames shift the remaining sequence, rather than getting lost in a
+ * full device queue. Refreshes come last, see n_acd_config_set_refresh(), and
+ * are postponed rather than queued. See n_acd_get_pacing() for statistics.
+ *
+ * @rate must not exceed one frame per nanosecond, and @burst must be non-zero
+ * if @rate is.
+ *
+ * By default, this is 0, and frames are sent without pacing.
+ */
+_c_public_ void n_acd_config_set_pacing(NAcdConfig *config, uint64_t rate, unsigned int burst) {
+        config->pace_rate = rate;
+        config->pace_burst = burst;
+}
+
+/**
+ * n_acd_config_set_retry() - set retry queue property
+ * @config:                     configuration to operate on
+ * @n_frames:                   maximum number of parked frames, or 0
+ *
+ * If the kernel refuses to queue an outgoing frame, because the socket or the
+ * device queue is full, the frame is lost. By default, the probe that sent it
+ * simply tries again on its next timeout, which delays its whole sequence by
+ * an interval. With a retry queue, up to @n_frames such frames are parked on
+ * the context instead, and sent again as soon as the socket polls writable.
+ * A frame that keeps getting dropped, or that finds the queue full, falls back
+ * to the default behavior.
+ *
+ * By default, this is 0, and no frames are parked.
+ */
+_c_public_ void n_acd_config_set_retry(NAcdConfig *config, unsigned int n_frames) {
+        config->retry_max = n_frames;
+}
+
+/**
+ * n_acd_config_set_refresh() - set refresh period property
+ * @config:                     configuration to operate on
+ * @msecs:                      refresh period in milliseconds, or 0
+ *
+ * Once a probe sent its announcements, nothing is sent for its address
+ * anymore, unless it has to be defended. Switches might age out their entries
+ * for the hardware address in the meantime, and flood traffic to it. Probes
+ * that ask for it, see n_acd_probe_config_set_refresh(), are announced again
+ * every @msecs, for as long as they are announced. The context spreads them
+ * evenly over the period, one at a time, unless there are so many that
+ * several are due each millisecond. Those are then sent in small batches, so
+ * the refresh traffic stays flat. Refreshes take transmit tokens like any other
+ * frame, but only if no other frame is waiting for one, see
+ * n_acd_config_set_pacing(). See n_acd_get_refresh() for statistics.
+ *
+ * By default, this is 0, and no address is refreshed.
+ */
+_c_public_ void n_acd_config_set_refresh(NAcdConfig *config, uint64_t msecs) {
+        config->refresh_msecs = msecs;
+}
+
+/**
+ * n_acd_config_set_fanout() - set fanout property
+ * @config:                     configuration to operate on
+ * @fanout:                     fanout to use, or NULL
+ * @shard:                      index of the shard to drive
+ *
+ * This selects the fanout and shard to use. If @fanout is non-NULL, the
+ * context created from @config receives packets through the socket of shard
+ * @shard of @fanout, rather than opening its own, and only accepts probes for
+ * addresses in that shard. See n_acd_fanout_new() for details. The ifindex
+ * property must match the interface of @fanout. By default, no fanout is
+ * used.
+ *
+ * The configuration only stores a pointer to @fanout, it must be retained by
+ * the caller as long as @config is used. The context created from @config
+ * acquires its own reference.
+ */
+_c_public_ void n_acd_config_set_fanout(NAcdConfig *config, NAcdFanout *fanout, unsigned int shard) {
+        config->fanout = fanout;
+        config->shard = shard;
+}
+
 int n_acd_event_node_new(NAcdEventNode **nodep) {
         NAcdEventNode *node;
 
@@ -273,153 +627,1616 @@ NAcdEventNode *n_acd_event_node_free(NAcdEventNode *node) {
         return NULL;
 }
 
+static int n_acd_attach_bpf(NAcd *acd, int fd_map, int fd_bloom) {
+        _c_cleanup_(c_closep) int fd_prog = -1;
+        struct in_addr addrs[N_ACD_BPF_INLINE_MAX];
+        NAcdProbe *probe, *prev = NULL;
+        size_t n_addrs = 0;
+        bool is_inline;
+        int r;
+
+        /*
+         * Compile the filter for the current set of addresses. If the set is
+         * tiny, the addresses are compiled into the program, rather than
+         * looked up in the map. The ip-tree allows duplicates, so skip over
+         * them.
+         */
+        is_inline = acd->n_bpf_map <= N_ACD_BPF_INLINE_MAX;
+        if (is_inline) {
+                c_rbtree_for_each_entry(probe, &acd->ip_tree, ip_node) {
+                        if (prev && prev->ip.s_addr == probe->ip.s_addr)
+                                continue;
+
+                        c_assert(n_addrs < N_ACD_BPF_INLINE_MAX);
+                        addrs[n_addrs++] = probe->ip;
+                        prev = probe;
+                }
+        }
+
+        r = n_acd_bpf_compile(&fd_prog,
+                              fd_map,
+                              fd_bloom,
+                              is_inline ? addrs : NULL,
+                              n_addrs,
+                              (struct ether_addr*) acd->mac,
+                              acd->observe_sample);
+        if (r)
+                return r;
+
+        if (fd_prog >= 0) {
+                r = setsockopt(acd->fd_socket, SOL_SOCKET, SO_ATTACH_BPF, &fd_prog, sizeof(fd_prog));
+                if (r)
+                        return -c_errno();
+        }
+
+        acd->bpf_inline = is_inline;
+        return 0;
+}
+
+static void n_acd_xdp_update(NAcd *acd, int fd_map) {
+        _c_cleanup_(c_closep) int fd_prog = -1;
+        int r;
+
+        /*
+         * Only the AF_XDP steering depends on the address map. If replacing
+         * the program fails, the old one keeps steering packets for the old
+         * set of addresses. Anything it misses still reaches the packet
+         * socket, and anything stale is filtered in userspace.
+         */
+        if (acd->fd_xsk_map < 0)
+                return;
+
+        r = n_acd_bpf_compile_xdp(&fd_prog,
+                                  acd->fd_xdp_map,
+                                  acd->xdp_ring.fd,
+                                  fd_map,
+                                  acd->fd_xsk_map,
+                                  (struct ether_addr*) acd->mac);
+        if (r)
+                return;
+
+        (void)n_acd_bpf_xdp_update(acd->fd_xdp_link, fd_prog);
+}
+
+static int n_acd_refresh_bpf(NAcd *acd) {
+        /*
+         * The program only depends on the actual set of addresses if it is
+         * compiled inline, or if it should be from now on.
+         */
+        if (!acd->bpf_inline && acd->n_bpf_map > N_ACD_BPF_INLINE_MAX)
+                return 0;
+
+        return n_acd_attach_bpf(acd, acd->fd_bpf_map, acd->fd_bpf_bloom);
+}
+
 int n_acd_ensure_bpf_map_space(NAcd *acd) {
-        NAcdProbe *probe;
-        _c_cleanup_(c_closep) int fd_map = -1, fd_prog = -1;
+        NAcdProbe *probe, *prev = NULL;
+        _c_cleanup_(c_closep) int fd_map = -1, fd_bloom = -1;
         size_t  max_map;
         int r;
 
-        if (acd->n_bpf_map < acd->max_bpf_map)
-                return 0;
+        if (acd->filter)
+                return n_acd_filter_ensure_space(acd->filter);
+
+        if (acd->n_bpf_map < acd->max_bpf_map) {
+                /*
+                 * Entries cannot be removed from bloom filters. Once it
+                 * contains as many entries (including stale ones) as it was
+                 * sized for, rebuild everything at the same size.
+                 */
+                if (acd->fd_bpf_bloom < 0 || acd->n_bpf_bloom < acd->max_bpf_map)
+                        return 0;
 
-        max_map = 2 * acd->max_bpf_map;
+                max_map = acd->max_bpf_map;
+        } else {
+                max_map = 2 * acd->max_bpf_map;
+        }
 
         r = n_acd_bpf_map_create(&fd_map, max_map);
         if (r)
                 return r;
 
+        if (max_map >= N_ACD_BPF_BLOOM_MIN) {
+                /*
+                 * Large sets get a bloom filter as prefilter. Kernels before
+                 * linux-5.16 do not support bloom filters, in which case we
+                 * simply do without.
+                 */
+                r = n_acd_bpf_bloom_create(&fd_bloom, max_map);
+                if (r && r != -EINVAL)
+                        return r;
+        }
+
         c_rbtree_for_each_entry(probe, &acd->ip_tree, ip_node) {
+                if (prev && prev->ip.s_addr == probe->ip.s_addr)
+                        continue;
+
+                prev = probe;
+
                 r = n_acd_bpf_map_add(fd_map, &probe->ip);
                 if (r)
                         return r;
+
+                if (fd_bloom >= 0) {
+                        r = n_acd_bpf_bloom_add(fd_bloom, &probe->ip);
+                        if (r)
+                                return r;
+                }
         }
 
-        r = n_acd_bpf_compile(&fd_prog, fd_map, (struct ether_addr*) acd->mac);
+        r = n_acd_attach_bpf(acd, fd_map, fd_bloom);
         if (r)
                 return r;
 
-        if (fd_prog >= 0) {
-                r = setsockopt(acd->fd_socket, SOL_SOCKET, SO_ATTACH_BPF, &fd_prog, sizeof(fd_prog));
-                if (r)
-                        return -c_errno();
-        }
+        n_acd_xdp_update(acd, fd_map);
 
         if (acd->fd_bpf_map >= 0)
                 close(acd->fd_bpf_map);
         acd->fd_bpf_map = fd_map;
         fd_map = -1;
+
+        if (acd->fd_bpf_bloom >= 0)
+                close(acd->fd_bpf_bloom);
+        acd->fd_bpf_bloom = fd_bloom;
+        fd_bloom = -1;
+
         acd->max_bpf_map = max_map;
+        acd->n_bpf_bloom = acd->n_bpf_map;
         return 0;
 }
 
-/**
- * n_acd_new() - create a new ACD context
- * @acdp:                       output argument for new context object
- * @config:                     configuration parameters
- *
- * Create a new ACD context and return it in @acdp. The configuration @config
- * must be initialized by the caller and must specify a valid network
- * interface, transport mechanism, as well as hardware address compatible with
- * the selected transport. The configuration is copied into the context. The
- * @config object thus does not have to be retained by the caller.
- *
- * Return: 0 on success, negative error code on failure.
- */
-_c_public_ int n_acd_new(NAcd **acdp, NAcdConfig *config) {
-        _c_cleanup_(n_acd_unrefp) NAcd *acd = NULL;
-        _c_cleanup_(c_closep) int fd_bpf_prog = -1;
-        struct epoll_event eevent;
+int n_acd_add_bpf_map_entry(NAcd *acd, int ifindex, struct in_addr *ip) {
         int r;
 
-        if (config->ifindex <= 0 ||
-            config->transport != N_ACD_TRANSPORT_ETHERNET ||
-            config->n_mac != ETH_ALEN ||
-            !memcmp(config->mac, (uint8_t[ETH_ALEN]){ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }, ETH_ALEN))
-                return N_ACD_E_INVALID_ARGUMENT;
-
-        acd = malloc(sizeof(*acd));
-        if (!acd)
-                return -ENOMEM;
+        /*
+         * The caller must have linked the address into the ip-tree already,
+         * and made sure there is space in the map.
+         */
+        if (acd->filter)
+                return n_acd_filter_add(acd->filter, ifindex, ip);
 
-        *acd = (NAcd)N_ACD_NULL(*acd);
-        acd->ifindex = config->ifindex;
-        memcpy(acd->mac, config->mac, ETH_ALEN);
+        c_assert(acd->n_bpf_map < acd->max_bpf_map);
 
-        r = n_acd_get_random(&acd->seed);
+        r = n_acd_bpf_map_add(acd->fd_bpf_map, ip);
         if (r)
                 return r;
 
-        acd->fd_epoll = epoll_create1(EPOLL_CLOEXEC);
-        if (acd->fd_epoll < 0)
-                return -c_errno();
+        ++acd->n_bpf_map;
 
-        r = timer_init(&acd->timer);
-        if (r < 0)
-                return r;
+        if (acd->fd_bpf_bloom >= 0) {
+                r = n_acd_bpf_bloom_add(acd->fd_bpf_bloom, ip);
+                if (r)
+                        goto error;
 
-        acd->max_bpf_map = 8;
+                ++acd->n_bpf_bloom;
+        }
 
-        r = n_acd_bpf_map_create(&acd->fd_bpf_map, acd->max_bpf_map);
+        r = n_acd_refresh_bpf(acd);
         if (r)
-                return r;
+                goto error;
+
+        return 0;
+
+error:
+        /* a possible stale bloom filter entry is harmless */
+        n_acd_bpf_map_remove(acd->fd_bpf_map, ip);
+        --acd->n_bpf_map;
+        return r;
+}
+
+void n_acd_remove_bpf_map_entry(NAcd *acd, int ifindex, struct in_addr *ip) {
+        int r;
+
+        /*
+         * The caller must have unlinked the address from the ip-tree
+         * already. The address stays in the bloom filter, if any, until it
+         * is rebuilt.
+         */
+        if (acd->filter) {
+                n_acd_filter_remove(acd->filter, ifindex, ip);
+                return;
+        }
 
-        r = n_acd_bpf_compile(&fd_bpf_prog, acd->fd_bpf_map, (struct ether_addr*) acd->mac);
+        r = n_acd_bpf_map_remove(acd->fd_bpf_map, ip);
+        c_assert(r >= 0);
+        --acd->n_bpf_map;
+
+        /*
+         * If recompiling an inline filter fails, the old filter stays in
+         * place. It is a superset of the new one, and userspace filters
+         * all packets again, anyway. The next change will retry.
+         */
+        (void)n_acd_refresh_bpf(acd);
+}
+
+static int n_acd_xsk_setup(NAcd *acd) {
+        struct epoll_event eevent;
+        int r;
+
+        r = n_acd_bpf_xsk_init(&acd->xsk, acd->ifindex);
         if (r)
                 return r;
 
-        r = n_acd_socket_new(&acd->fd_socket, fd_bpf_prog, config);
+        if (acd->busy_poll)
+                n_acd_socket_set_busy_poll(acd->xsk.fd, acd->busy_poll);
+
+        r = n_acd_bpf_xsk_map_create(&acd->fd_xsk_map, &acd->xsk);
         if (r)
                 return r;
 
         eevent = (struct epoll_event){
                 .events = EPOLLIN,
-                .data.u32 = N_ACD_EPOLL_TIMER,
+                .data.u32 = N_ACD_EPOLL_XSK,
         };
-        r = epoll_ctl(acd->fd_epoll, EPOLL_CTL_ADD, acd->timer.fd, &eevent);
+        r = epoll_ctl(acd->fd_epoll, EPOLL_CTL_ADD, acd->xsk.fd, &eevent);
         if (r < 0)
                 return -c_errno();
 
-        eevent = (struct epoll_event){
-                .events = EPOLLIN,
-                .data.u32 = N_ACD_EPOLL_SOCKET,
-        };
-        r = epoll_ctl(acd->fd_epoll, EPOLL_CTL_ADD, acd->fd_socket, &eevent);
+        return 0;
+}
+
+static void n_acd_xsk_teardown(NAcd *acd) {
+        if (acd->xsk.fd >= 0) {
+                c_assert(acd->fd_epoll >= 0);
+                epoll_ctl(acd->fd_epoll, EPOLL_CTL_DEL, acd->xsk.fd, NULL);
+                n_acd_bpf_xsk_deinit(&acd->xsk);
+        }
+
+        if (acd->fd_xsk_map >= 0) {
+                close(acd->fd_xsk_map);
+                acd->fd_xsk_map = -1;
+        }
+}
+
+static void n_acd_xdp_teardown(NAcd *acd) {
+        n_acd_xsk_teardown(acd);
+
+        if (acd->xdp_ring.fd >= 0) {
+                c_assert(acd->fd_epoll >= 0);
+                epoll_ctl(acd->fd_epoll, EPOLL_CTL_DEL, acd->xdp_ring.fd, NULL);
+                n_acd_bpf_ring_deinit(&acd->xdp_ring);
+        }
+
+        if (acd->fd_xdp_link >= 0) {
+                close(acd->fd_xdp_link);
+                acd->fd_xdp_link = -1;
+        }
+
+        if (acd->fd_xdp_map >= 0) {
+                close(acd->fd_xdp_map);
+                acd->fd_xdp_map = -1;
+        }
+}
+
+static int n_acd_xdp_setup(NAcd *acd) {
+        _c_cleanup_(c_closep) int fd_prog = -1;
+        struct epoll_event eevent;
+        int r;
+
+        r = n_acd_bpf_xdp_map_create(&acd->fd_xdp_map, N_ACD_BPF_XDP_MAP_MAX);
+        if (r)
+                return r;
+
+        r = n_acd_bpf_ring_init(&acd->xdp_ring, N_ACD_BPF_XDP_RING_SIZE);
+        if (r)
+                return r;
+
+        /*
+         * The AF_XDP socket is optional on top of the defender. It needs the
+         * address map of the context, which shared filters do not have.
+         */
+        if (acd->xdp_socket && acd->fd_bpf_map >= 0) {
+                r = n_acd_xsk_setup(acd);
+                if (r)
+                        n_acd_xsk_teardown(acd);
+        }
+
+        r = n_acd_bpf_compile_xdp(&fd_prog,
+                                  acd->fd_xdp_map,
+                                  acd->xdp_ring.fd,
+                                  acd->fd_bpf_map,
+                                  acd->fd_xsk_map,
+                                  (struct ether_addr*) acd->mac);
+        if (r)
+                return r;
+
+        r = n_acd_bpf_xdp_attach(&acd->fd_xdp_link,
+                                 fd_prog,
+                                 acd->ifindex,
+                                 acd->xdp == N_ACD_XDP_GENERIC);
+        if (r)
+                return r;
+
+        eevent = (struct epoll_event){
+                .events = EPOLLIN,
+                .data.u32 = N_ACD_EPOLL_XDP,
+        };
+        r = epoll_ctl(acd->fd_epoll, EPOLL_CTL_ADD, acd->xdp_ring.fd, &eevent);
         if (r < 0)
                 return -c_errno();
 
-        *acdp = acd;
-        acd = NULL;
         return 0;
 }
 
-static void n_acd_free_internal(NAcd *acd) {
-        NAcdEventNode *node, *t_node;
+static NAcdProbe *n_acd_find_probe(NAcd *acd, int ifindex, uint32_t addr) {
+        NAcdProbe *probe;
+        CRBNode *node;
+        int c;
+
+        /* Find top-most node that matches @ifindex and @addr. */
+        node = acd->ip_tree.root;
+        while (node) {
+                probe = c_rbnode_entry(node, NAcdProbe, ip_node);
+                c = n_acd_probe_compare(probe, ifindex, addr);
+                if (c < 0)
+                        node = node->left;
+                else if (c > 0)
+                        node = node->right;
+                else
+                        break;
+        }
+
+        if (!node)
+                return NULL;
+
+        /* Forward to left-most child that still matches. */
+        while (node->left && !n_acd_probe_compare(c_rbnode_entry(node->left,
+                                                                 NAcdProbe,
+                                                                 ip_node),
+                                                  ifindex,
+                                                  addr))
+                node = node->left;
+
+        return c_rbnode_entry(node, NAcdProbe, ip_node);
+}
+
+/**
+ * n_acd_find_interface() - find interface of a context
+ * @acd:                        context to operate on
+ * @ifindex:                    interface index to look up
+ *
+ * Return: The interface with index @ifindex, or NULL if @acd does not serve
+ *         it.
+ */
+NAcdInterface *n_acd_find_interface(NAcd *acd, int ifindex) {
+        NAcdInterface *interface;
+        CRBNode *node;
+
+        node = acd->interface_tree.root;
+        while (node) {
+                interface = c_rbnode_entry(node, NAcdInterface, acd_node);
+                if (ifindex < interface->ifindex)
+                        node = node->left;
+                else if (ifindex > interface->ifindex)
+                        node = node->right;
+                else
+                        return interface;
+        }
+
+        return NULL;
+}
+
+static int n_acd_interface_new(NAcd *acd, int ifindex, const uint8_t *mac) {
+        NAcdInterface *interface, *other;
+        CRBNode **slot, *parent;
+
+        interface = malloc(sizeof(*interface));
+        if (!interface)
+                return -ENOMEM;
+
+        *interface = (NAcdInterface)N_ACD_INTERFACE_NULL(*interface);
+        interface->ifindex = ifindex;
+        memcpy(interface->mac, mac, ETH_ALEN);
+
+        slot = &acd->interface_tree.root;
+        parent = NULL;
+        while (*slot) {
+                other = c_rbnode_entry(*slot, NAcdInterface, acd_node);
+                parent = *slot;
+                if (ifindex < other->ifindex)
+                        slot = &(*slot)->left;
+                else
+                        slot = &(*slot)->right;
+        }
+
+        c_rbtree_add(&acd->interface_tree, parent, slot, &interface->acd_node);
+        return 0;
+}
+
+static void n_acd_interface_free(NAcd *acd, NAcdInterface *interface) {
+        c_assert(!interface->n_probes);
+
+        c_rbnode_unlink(&interface->acd_node);
+        free(interface);
+}
+
+static int n_acd_memory_compare(NAcdMemory *memory, int ifindex, struct in_addr ip) {
+        if (ifindex < memory->ifindex)
+                return -1;
+        else if (ifindex > memory->ifindex)
+                return 1;
+        else if (ip.s_addr < memory->ip.s_addr)
+                return -1;
+        else if (ip.s_addr > memory->ip.s_addr)
+                return 1;
+        else
+                return 0;
+}
+
+static NAcdMemory *n_acd_memory_find(NAcd *acd, int ifindex, struct in_addr ip) {
+        NAcdMemory *memory;
+        CRBNode *node;
+        int r;
+
+        node = acd->memory_tree.root;
+        while (node) {
+                memory = c_rbnode_entry(node, NAcdMemory, acd_node);
+                r = n_acd_memory_compare(memory, ifindex, ip);
+                if (r < 0)
+                        node = node->left;
+                else if (r > 0)
+                        node = node->right;
+                else
+                        return memory;
+        }
+
+        return NULL;
+}
+
+static NAcdMemory *n_acd_memory_new(NAcd *acd, int ifindex, struct in_addr ip) {
+        NAcdMemory *memory, *other;
+        CRBNode **slot, *parent;
+
+        memory = malloc(sizeof(*memory));
+        if (!memory)
+                return NULL;
+
+        *memory = (NAcdMemory)N_ACD_MEMORY_NULL(*memory);
+        memory->ifindex = ifindex;
+        memory->ip = ip;
+
+        slot = &acd->memory_tree.root;
+        parent = NULL;
+        while (*slot) {
+                other = c_rbnode_entry(*slot, NAcdMemory, acd_node);
+                parent = *slot;
+                if (n_acd_memory_compare(other, ifindex, ip) < 0)
+                        slot = &(*slot)->left;
+                else
+                        slot = &(*slot)->right;
+        }
+
+        c_rbtree_add(&acd->memory_tree, parent, slot, &memory->acd_node);
+        c_list_link_tail(&acd->memory_list, &memory->acd_link);
+        ++acd->n_memories;
+        return memory;
+}
+
+static void n_acd_memory_free(NAcd *acd, NAcdMemory *memory) {
+        c_rbnode_unlink(&memory->acd_node);
+        c_list_unlink(&memory->acd_link);
+        --acd->n_memories;
+        free(memory);
+}
+
+/**
+ * n_acd_remember() - remember the outcome of a probe
+ * @acd:                        context to operate on
+ * @interface:                  interface the address was probed on
+ * @ip:                         address that was probed
+ * @now:                        current time
+ * @success:                    whether the address is verified
+ *
+ * If @success is true, this records @ip as verified on @interface at @now,
+ * otherwise, it forgets about @ip. Addresses that were not verified within
+ * the configured window are forgotten as well, and so is the least recently
+ * verified address, if there are too many.
+ *
+ * This is best-effort. If memory cannot be allocated, the address is simply
+ * not remembered.
+ */
+void n_acd_remember(NAcd *acd, NAcdInterface *interface, struct in_addr ip, uint64_t now, bool success) {
+        NAcdMemory *memory, *t_memory;
+
+        if (!acd->remember_nsecs)
+                return;
+
+        c_list_for_each_entry_safe(memory, t_memory, &acd->memory_list, acd_link) {
+                if (now - memory->timestamp < acd->remember_nsecs)
+                        break;
+
+                n_acd_memory_free(acd, memory);
+        }
+
+        memory = n_acd_memory_find(acd, interface->ifindex, ip);
+        if (!success) {
+                if (memory)
+                        n_acd_memory_free(acd, memory);
+                return;
+        }
+
+        if (!memory) {
+                if (acd->n_memories >= N_ACD_MEMORY_MAX)
+                        n_acd_memory_free(acd, c_list_first_entry(&acd->memory_list, NAcdMemory, acd_link));
+
+                memory = n_acd_memory_new(acd, interface->ifindex, ip);
+                if (!memory)
+                        return;
+        }
+
+        memcpy(memory->mac, interface->mac, ETH_ALEN);
+        memory->timestamp = now;
+
+        /* keep the list ordered by time of verification */
+        c_list_unlink(&memory->acd_link);
+        c_list_link_tail(&acd->memory_list, &memory->acd_link);
+}
+
+/**
+ * n_acd_recall() - check whether an address was verified recently
+ * @acd:                        context to operate on
+ * @interface:                  interface to check
+ * @ip:                         address to check
+ * @now:                        current time
+ *
+ * Return: True if @ip was verified on @interface, with its current hardware
+ *         address, within the configured window, false otherwise.
+ */
+bool n_acd_recall(NAcd *acd, NAcdInterface *interface, struct in_addr ip, uint64_t now) {
+        NAcdMemory *memory;
+
+        if (!acd->remember_nsecs)
+                return false;
+
+        memory = n_acd_memory_find(acd, interface->ifindex, ip);
+
+        return memory &&
+               now - memory->timestamp < acd->remember_nsecs &&
+               !memcmp(memory->mac, interface->mac, ETH_ALEN);
+}
+
+static NAcdObservation *n_acd_observation_set(NAcd *acd, int ifindex, struct in_addr ip) {
+        uint32_t hash;
+
+        /* multiplicative hash, keyed per context to spread adversarial input */
+        hash = ((uint32_t)ifindex * UINT32_C(0x85ebca6b)) ^ ip.s_addr ^ acd->observe_key;
+        hash *= UINT32_C(0x9e3779b1);
+
+        return acd->observations + (hash >> 24) % N_ACD_OBSERVE_SETS * N_ACD_OBSERVE_WAYS;
+}
+
+/**
+ * n_acd_observe() - record a claim of another host
+ * @acd:                        context to operate on
+ * @interface:                  interface the claim was received on
+ * @ip:                         claimed address
+ * @mac:                        hardware address of the claimant
+ * @now:                        current time
+ *
+ * This records that the host with hardware address @mac claimed @ip on
+ * @interface at @now. If another host claimed the address before, this counts
+ * as a conflict. If the table has no room for the claim, the least recently
+ * observed claim of its set is replaced.
+ */
+void n_acd_observe(NAcd *acd, NAcdInterface *interface, struct in_addr ip, const uint8_t *mac, uint64_t now) {
+        NAcdObservation *set, *observation = NULL;
+
+        if (!acd->observations)
+                return;
+
+        set = n_acd_observation_set(acd, interface->ifindex, ip);
+
+        for (size_t i = 0; i < N_ACD_OBSERVE_WAYS; ++i) {
+                if (set[i].ip.s_addr == ip.s_addr && set[i].ifindex == interface->ifindex) {
+                        observation = set + i;
+                        break;
+                }
+
+                if (!observation || set[i].timestamp < observation->timestamp)
+                        observation = set + i;
+        }
+
+        if (observation->ip.s_addr != ip.s_addr || observation->ifindex != interface->ifindex) {
+                *observation = (NAcdObservation){
+                        .ip = ip,
+                        .ifindex = interface->ifindex,
+                };
+        } else if (memcmp(observation->mac, mac, ETH_ALEN) && observation->n_conflicts < UINT16_MAX) {
+                ++observation->n_conflicts;
+        }
+
+        memcpy(observation->mac, mac, ETH_ALEN);
+        observation->timestamp = now;
+}
+
+/**
+ * n_acd_find_observation() - look up a recent claim of another host
+ * @acd:                        context to operate on
+ * @interface:                  interface to check
+ * @ip:                         address to check
+ * @now:                        current time
+ *
+ * Return: The claim of @ip on @interface if it was observed within the
+ *         configured window, NULL otherwise.
+ */
+NAcdObservation *n_acd_find_observation(NAcd *acd, NAcdInterface *interface, struct in_addr ip, uint64_t now) {
+        NAcdObservation *set;
+
+        if (!acd->observations)
+                return NULL;
+
+        set = n_acd_observation_set(acd, interface->ifindex, ip);
+
+        for (size_t i = 0; i < N_ACD_OBSERVE_WAYS; ++i)
+                if (set[i].ip.s_addr == ip.s_addr &&
+                    set[i].ifindex == interface->ifindex &&
+                    now - set[i].timestamp < acd->observe_nsecs)
+                        return set + i;
+
+        return NULL;
+}
+
+static bool n_acd_is_throttled(NAcd *acd, uint64_t now) {
+        /* the oldest of the last MAX_CONFLICTS conflicts is the next to be overwritten */
+        return acd->rate_limit_nsecs &&
+               acd->n_conflicts >= N_ACD_RFC_MAX_CONFLICTS &&
+               now - acd->conflicts[acd->n_conflicts % N_ACD_RFC_MAX_CONFLICTS] < acd->rate_limit_nsecs;
+}
+
+/**
+ * n_acd_conflict() - record a conflict
+ * @acd:                        context to operate on
+ * @now:                        current time
+ *
+ * This records that a probe reported USED or CONFLICT at @now. If this makes
+ * the context hit the rate-limit, N_ACD_EVENT_THROTTLED is raised.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_acd_conflict(NAcd *acd, uint64_t now) {
+        NAcdEventNode *node;
+        bool throttled;
+        int r;
+
+        throttled = n_acd_is_throttled(acd, now);
+        acd->conflicts[acd->n_conflicts++ % N_ACD_RFC_MAX_CONFLICTS] = now;
+
+        if (throttled || !n_acd_is_throttled(acd, now))
+                return 0;
+
+        r = n_acd_raise(acd, &node, N_ACD_EVENT_THROTTLED);
+        if (r)
+                return r;
+
+        node->event.throttled.n_conflicts = acd->n_conflicts;
+        return 0;
+}
+
+/**
+ * n_acd_throttle() - pace a new probe
+ * @acd:                        context to operate on
+ * @now:                        current time
+ *
+ * This must be called when a probe is about to start sending probes. If the
+ * context is rate-limited, this reserves the next free slot for the probe,
+ * so no two probes start within the rate-limit interval.
+ *
+ * Return: The time in nanoseconds the probe must wait before it starts.
+ */
+uint64_t n_acd_throttle(NAcd *acd, uint64_t now) {
+        uint64_t delay = 0;
+
+        if (!n_acd_is_throttled(acd, now))
+                return 0;
+
+        if (acd->throttle_next > now) {
+                delay = acd->throttle_next - now;
+                ++acd->n_throttled;
+        }
+
+        acd->throttle_next = now + delay + acd->rate_limit_nsecs;
+        return delay;
+}
+
+/**
+ * n_acd_rtt_sample() - update the round-trip time estimate
+ * @acd:                        context to operate on
+ * @rtt:                        measured round-trip time in nanoseconds
+ *
+ * This feeds a sample into the smoothed round-trip time and its variance, with
+ * the gains of RFC-6298.
+ */
+void n_acd_rtt_sample(NAcd *acd, uint64_t rtt) {
+        uint64_t delta;
+
+        if (!acd->n_rtt++) {
+                acd->srtt = rtt;
+                acd->rttvar = rtt / 2;
+                return;
+        }
+
+        delta = acd->srtt > rtt ? acd->srtt - rtt : rtt - acd->srtt;
+        acd->rttvar = (3 * acd->rttvar + delta) / 4;
+        acd->srtt = (7 * acd->srtt + rtt) / 8;
+}
+
+/**
+ * n_acd_rtt_timeout() - compute an adaptive timeout
+ * @acd:                        context to operate on
+ *
+ * Return: The timeout multiplier for a new adaptive probe.
+ */
+uint64_t n_acd_rtt_timeout(NAcd *acd) {
+        uint64_t rto, msecs;
+
+        /* a single fast reply says little about the link */
+        if (acd->n_rtt < N_ACD_ADAPTIVE_SAMPLES)
+                return acd->adaptive_max_msecs;
+
+        /*
+         * PROBE_MIN is the shortest interval, and must cover the RTO, so
+         * answers are still taken as samples, see n_acd_probe_handle_packet().
+         */
+        rto = acd->srtt + 4 * acd->rttvar;
+        msecs = (rto + N_ACD_RFC_PROBE_MIN_NSEC - 1) / N_ACD_RFC_PROBE_MIN_NSEC;
+
+        return c_min(c_max(msecs, acd->adaptive_min_msecs), acd->adaptive_max_msecs);
+}
+
+/*
+ * The token bucket is kept as the time at which it would be full again, if
+ * nothing else was sent. A frame conforms, if that is no more than @burst - 1
+ * intervals in the future, and then pushes that time out by another interval.
+ */
+static uint64_t n_acd_pace_next(NAcd *acd) {
+        return acd->pace_tat > acd->pace_burst_nsecs ? acd->pace_tat - acd->pace_burst_nsecs : 0;
+}
+
+static void n_acd_pace_take(NAcd *acd, uint64_t now) {
+        acd->pace_tat = c_max(acd->pace_tat, now) + acd->pace_interval;
+}
+
+/*
+ * Take up to @n tokens at once, for frames that are sent right away or not at
+ * all, rather than queued. Those never overtake a queued frame.
+ */
+static size_t n_acd_pace_take_n(NAcd *acd, uint64_t now, size_t n) {
+        size_t i;
+
+        if (!acd->pace_interval)
+                return n;
+        if (acd->n_pace_queue)
+                return 0;
+
+        for (i = 0; i < n && now >= n_acd_pace_next(acd); ++i)
+                n_acd_pace_take(acd, now);
+
+        return i;
+}
+
+/**
+ * n_acd_pace() - take a transmit token
+ * @acd:                        context to operate on
+ * @probe:                      probe about to send a frame
+ * @class:                      priority of the frame
+ *
+ * This must be called right before @probe sends a frame. If pacing is
+ * disabled, or a token is available and no other frame is waiting, the token
+ * is taken and the frame may be sent. Otherwise, @probe is queued and the
+ * caller must not advance its state. Once a token is available, the pacer
+ * runs n_acd_probe_handle_timeout() on the probe again, and this then grants
+ * the frame.
+ *
+ * A probe has at most one frame queued. A defense upgrades a queued
+ * announcement, since both are the same frame.
+ *
+ * Return: True if the frame may be sent, false if it was queued.
+ */
+bool n_acd_pace(NAcd *acd, NAcdProbe *probe, unsigned int class) {
+        uint64_t now;
+
+        /* a parked frame is still pending, see n_acd_retry() */
+        if (c_list_is_linked(&probe->retry_link))
+                return false;
+
+        if (!acd->pace_interval)
+                return true;
+
+        if (probe->pace_granted) {
+                probe->pace_granted = false;
+                return true;
+        }
+
+        if (c_list_is_linked(&probe->pace_link)) {
+                if (class < probe->pace_class) {
+                        c_list_unlink(&probe->pace_link);
+                        c_list_link_tail(&acd->pace_queue[class], &probe->pace_link);
+                        probe->pace_class = class;
+                }
+                return false;
+        }
+
+        timer_now(&acd->timer, &now);
+
+        if (!acd->n_pace_queue && now >= n_acd_pace_next(acd)) {
+                n_acd_pace_take(acd, now);
+                return true;
+        }
+
+        c_list_link_tail(&acd->pace_queue[class], &probe->pace_link);
+        probe->pace_class = class;
+        probe->pace_since = now;
+
+        if (++acd->n_pace_queue > acd->max_pace_queue)
+                acd->max_pace_queue = acd->n_pace_queue;
+
+        timeout_schedule(&acd->pace_timeout, &acd->timer, c_max(n_acd_pace_next(acd), now));
+        return false;
+}
+
+/**
+ * n_acd_pace_dequeue() - drop a queued frame
+ * @acd:                        context to operate on
+ * @probe:                      probe to operate on
+ *
+ * This drops the queued frame of @probe, if any. This must be called
+ * whenever the probe stops, so it is never released afterwards.
+ */
+void n_acd_pace_dequeue(NAcd *acd, NAcdProbe *probe) {
+        probe->pace_granted = false;
+
+        if (!c_list_is_linked(&probe->pace_link))
+                return;
+
+        c_list_unlink(&probe->pace_link);
+        if (!--acd->n_pace_queue)
+                timeout_unschedule(&acd->pace_timeout);
+}
+
+static int n_acd_retry_arm(NAcd *acd, bool arm) {
+        struct epoll_event eevent = {
+                .events = arm ? EPOLLIN | EPOLLOUT : EPOLLIN,
+                .data.u32 = N_ACD_EPOLL_SOCKET,
+        };
+        int r;
+
+        if (acd->retry_armed == arm)
+                return 0;
+
+        r = epoll_ctl(acd->fd_epoll, EPOLL_CTL_MOD, acd->fd_socket, &eevent);
+        if (r < 0)
+                return -c_errno();
+
+        acd->retry_armed = arm;
+        return 0;
+}
+
+/**
+ * n_acd_retry() - park a dropped frame
+ * @acd:                        context to operate on
+ * @probe:                      probe whose frame was dropped
+ *
+ * This must be called when n_acd_send() dropped a frame of @probe. If the
+ * retry queue has room, and the frame was not parked too often already, the
+ * probe is parked and the socket is polled for EPOLLOUT. Once it is writable,
+ * n_acd_probe_handle_timeout() runs on the probe again, to send the frame
+ * again, and the caller must not advance the state of the probe until then.
+ *
+ * Return: True if the frame was parked, false if the caller must handle the
+ *         drop itself.
+ */
+bool n_acd_retry(NAcd *acd, NAcdProbe *probe) {
+        if (!acd->retry_max ||
+            acd->n_retry >= acd->retry_max ||
+            probe->n_retries >= N_ACD_RETRY_MAX ||
+            n_acd_retry_arm(acd, true)) {
+                probe->n_retries = 0;
+                return false;
+        }
+
+        ++probe->n_retries;
+        ++acd->n_retry;
+        c_list_link_tail(&acd->retry_list, &probe->retry_link);
+        return true;
+}
+
+/**
+ * n_acd_retry_dequeue() - drop a parked frame
+ * @acd:                        context to operate on
+ * @probe:                      probe to operate on
+ *
+ * This drops the parked frame of @probe, if any. This must be called
+ * whenever the probe stops, so it is never sent afterwards.
+ */
+void n_acd_retry_dequeue(NAcd *acd, NAcdProbe *probe) {
+        if (!c_list_is_linked(&probe->retry_link))
+                return;
+
+        c_list_unlink(&probe->retry_link);
+        if (!--acd->n_retry)
+                (void)n_acd_retry_arm(acd, false);
+}
+
+static int n_acd_retry_flush(NAcd *acd) {
+        NAcdProbe *probe;
+        size_t n;
+        int r;
+
+        /* frames parked again while flushing wait for the next wake-up */
+        for (n = acd->n_retry; n; --n) {
+                probe = c_list_first_entry(&acd->retry_list, NAcdProbe, retry_link);
+                n_acd_retry_dequeue(acd, probe);
+
+                /* the frame already took its token */
+                probe->pace_granted = true;
+                r = n_acd_probe_handle_timeout(probe);
+                probe->pace_granted = false;
+                if (r)
+                        return r;
+        }
+
+        return 0;
+}
+
+/**
+ * n_acd_frame_init() - build an outgoing frame
+ * @interface:                  interface to send on
+ * @tpa:                        target address
+ * @spa:                        sender address, or NULL for a probe
+ * @addressp:                   output argument for the link-layer address
+ * @arpp:                       output argument for the frame
+ *
+ * This builds a broadcast ARP request, which is a probe if @spa is NULL, and
+ * an announcement otherwise.
+ */
+static void n_acd_frame_init(NAcdInterface *interface,
+                             const struct in_addr *tpa,
+                             const struct in_addr *spa,
+                             struct sockaddr_ll *addressp,
+                             struct ether_arp *arpp) {
+        *addressp = (struct sockaddr_ll){
+                .sll_family = AF_PACKET,
+                .sll_protocol = htobe16(ETH_P_ARP),
+                .sll_ifindex = interface->ifindex,
+                .sll_halen = ETH_ALEN,
+                .sll_addr = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+        };
+        *arpp = (struct ether_arp){
+                .ea_hdr = {
+                        .ar_hrd = htobe16(ARPHRD_ETHER),
+                        .ar_pro = htobe16(ETHERTYPE_IP),
+                        .ar_hln = sizeof(interface->mac),
+                        .ar_pln = sizeof(uint32_t),
+                        .ar_op = htobe16(ARPOP_REQUEST),
+                },
+        };
+
+        memcpy(arpp->arp_sha, interface->mac, sizeof(interface->mac));
+        memcpy(arpp->arp_tpa, &tpa->s_addr, sizeof(uint32_t));
+
+        if (spa)
+                memcpy(arpp->arp_spa, &spa->s_addr, sizeof(spa->s_addr));
+}
+
+/*
+ * The ring turns by one probe per period/n, but never faster than one tick per
+ * N_ACD_REFRESH_TICK_NSEC, so a tick sends more than one frame only if there
+ * are more probes than ticks in a period.
+ */
+static uint64_t n_acd_refresh_interval(NAcd *acd) {
+        return c_max(acd->refresh_nsecs / acd->n_refresh, N_ACD_REFRESH_TICK_NSEC);
+}
+
+static void n_acd_refresh_schedule(NAcd *acd, uint64_t now) {
+        timeout_schedule(&acd->refresh_timeout, &acd->timer, now + n_acd_refresh_interval(acd));
+}
+
+/*
+ * Every probe is due once per period, so n probes are due at a rate of n per
+ * period. This accounts for the time since the last call at the current rate,
+ * in nanoseconds times probes, so no fraction is lost between ticks. This must
+ * be called whenever the number of probes changes.
+ */
+static void n_acd_refresh_accrue(NAcd *acd, uint64_t now) {
+        acd->refresh_due += (now - acd->refresh_last) * acd->n_refresh;
+        acd->refresh_due = c_min(acd->refresh_due, acd->n_refresh * acd->refresh_nsecs);
+        acd->refresh_last = now;
+}
+
+/**
+ * n_acd_refresh_link() - start refreshing an announced address
+ * @acd:                        context to operate on
+ * @probe:                      probe to operate on
+ *
+ * This links @probe into the refresh ring, if the probe asked for it, and the
+ * context has a refresh period. The probe is linked last, so it is refreshed
+ * about one period from now. This is a no-op if the probe is linked already.
+ */
+void n_acd_refresh_link(NAcd *acd, NAcdProbe *probe) {
+        uint64_t now;
+
+        if (!probe->refresh || !acd->refresh_nsecs || c_list_is_linked(&probe->refresh_link))
+                return;
+
+        timer_now(&acd->timer, &now);
+        n_acd_refresh_accrue(acd, now);
+
+        c_list_link_tail(&acd->refresh_list, &probe->refresh_link);
+        ++acd->n_refresh;
+
+        /* more probes turn the ring faster */
+        if (!acd->refresh_timeout.timer ||
+            acd->refresh_timeout.timeout > now + n_acd_refresh_interval(acd))
+                n_acd_refresh_schedule(acd, now);
+}
+
+/**
+ * n_acd_refresh_unlink() - stop refreshing an address
+ * @acd:                        context to operate on
+ * @probe:                      probe to operate on
+ *
+ * This unlinks @probe from the refresh ring, if linked. The ring stops
+ * turning with the last probe.
+ */
+void n_acd_refresh_unlink(NAcd *acd, NAcdProbe *probe) {
+        uint64_t now;
+
+        if (!c_list_is_linked(&probe->refresh_link))
+                return;
+
+        timer_now(&acd->timer, &now);
+        n_acd_refresh_accrue(acd, now);
+
+        c_list_unlink(&probe->refresh_link);
+        if (!--acd->n_refresh) {
+                timeout_unschedule(&acd->refresh_timeout);
+                acd->refresh_due = 0;
+        }
+}
+
+static int n_acd_refresh_tick(NAcd *acd, uint64_t now) {
+        struct sockaddr_ll addresses[N_ACD_REFRESH_BATCH];
+        struct ether_arp frames[N_ACD_REFRESH_BATCH];
+        struct mmsghdr msgs[N_ACD_REFRESH_BATCH];
+        struct iovec iovecs[N_ACD_REFRESH_BATCH];
+        NAcdProbe *probe;
+        size_t n_due, n;
+        int r;
+
+        /*
+         * If the pacer held frames back, they are sent on the next tick, but
+         * never more than one round of the ring.
+         */
+        n_acd_refresh_accrue(acd, now);
+
+        n_due = n_acd_pace_take_n(acd, now, acd->refresh_due / acd->refresh_nsecs);
+        acd->refresh_due -= n_due * acd->refresh_nsecs;
+
+        while (n_due) {
+                for (n = 0; n < c_min(n_due, (size_t)N_ACD_REFRESH_BATCH); ++n) {
+                        probe = c_list_first_entry(&acd->refresh_list, NAcdProbe, refresh_link);
+
+                        /* turn the ring */
+                        c_list_unlink(&probe->refresh_link);
+                        c_list_link_tail(&acd->refresh_list, &probe->refresh_link);
+
+                        n_acd_frame_init(probe->interface, &probe->ip, &probe->ip, addresses + n, frames + n);
+                        iovecs[n] = (struct iovec){
+                                .iov_base = frames + n,
+                                .iov_len = sizeof(frames[n]),
+                        };
+                        msgs[n] = (struct mmsghdr){
+                                .msg_hdr = {
+                                        .msg_name = addresses + n,
+                                        .msg_namelen = sizeof(addresses[n]),
+                                        .msg_iov = iovecs + n,
+                                        .msg_iovlen = 1,
+                                },
+                        };
+                }
+
+                /*
+                 * Refreshing is best-effort. Whatever the kernel does not
+                 * take is dropped, and sent again in the next period. Only
+                 * unexpected errors are propagated, just like n_acd_send()
+                 * does.
+                 */
+                r = sendmmsg(acd->fd_socket, msgs, n, MSG_NOSIGNAL);
+                if (r < 0) {
+                        if (errno != EAGAIN && errno != ENOBUFS && errno != ENETDOWN && errno != ENXIO)
+                                return -c_errno();
+
+                        r = 0;
+                }
+
+                acd->n_refreshed += r;
+                acd->n_refresh_dropped += n - r;
+                n_due -= n;
+        }
+
+        n_acd_refresh_schedule(acd, now);
+        return 0;
+}
+
+static int n_acd_pace_release(NAcd *acd, uint64_t now) {
+        NAcdProbe *probe;
+        uint64_t delay;
+        int r;
 
-        if (!acd)
+        while (acd->n_pace_queue && now >= n_acd_pace_next(acd)) {
+                for (size_t i = 0; i < _N_ACD_PACE_N; ++i)
+                        if ((probe = c_list_first_entry(&acd->pace_queue[i], NAcdProbe, pace_link)))
+                                break;
+
+                n_acd_pace_dequeue(acd, probe);
+                n_acd_pace_take(acd, now);
+
+                delay = now - probe->pace_since;
+                ++acd->n_pace_delay;
+                acd->total_pace_delay += delay;
+                if (delay > acd->max_pace_delay)
+                        acd->max_pace_delay = delay;
+
+                probe->pace_granted = true;
+                r = n_acd_probe_handle_timeout(probe);
+                probe->pace_granted = false;
+                if (r)
+                        return r;
+        }
+
+        if (acd->n_pace_queue)
+                timeout_schedule(&acd->pace_timeout, &acd->timer, n_acd_pace_next(acd));
+
+        return 0;
+}
+
+/**
+ * n_acd_xdp_refresh() - update the XDP defender for an address
+ * @acd:                        context to operate on
+ * @ip:                         address whose probes changed
+ *
+ * The XDP program defends an address iff all probes for it are announcing
+ * and always defend it. Any other probe needs to see the conflicting packets
+ * itself. This must be called whenever a probe for @ip is linked, unlinked,
+ * or changes its state or policy.
+ *
+ * This is best-effort. If the address cannot be added to the XDP map, the
+ * context simply keeps defending it in userspace.
+ */
+void n_acd_xdp_refresh(NAcd *acd, struct in_addr *ip) {
+        uint64_t now, now_xdp, last_defend = 0;
+        bool defend = false;
+        NAcdProbe *probe;
+        CRBNode *node;
+        int r;
+
+        if (acd->fd_xdp_map < 0)
                 return;
 
-        c_list_for_each_entry_safe(node, t_node, &acd->event_list, acd_link)
-                n_acd_event_node_free(node);
+        probe = n_acd_find_probe(acd, acd->ifindex, ip->s_addr);
+        if (probe) {
+                defend = true;
+                node = &probe->ip_node;
+
+                do {
+                        probe = c_rbnode_entry(node, NAcdProbe, ip_node);
+                        if (probe->state != N_ACD_PROBE_STATE_ANNOUNCING ||
+                            probe->defend != N_ACD_DEFEND_ALWAYS)
+                                defend = false;
+                        else if (probe->last_defend > last_defend)
+                                last_defend = probe->last_defend;
+
+                        node = c_rbnode_next(node);
+                } while (node && !n_acd_probe_compare(c_rbnode_entry(node, NAcdProbe, ip_node),
+                                                      acd->ifindex,
+                                                      ip->s_addr));
+        }
+
+        if (!defend) {
+                (void)n_acd_bpf_xdp_map_unset(acd->fd_xdp_map, ip);
+                return;
+        }
+
+        /*
+         * The XDP program measures time on CLOCK_MONOTONIC, which might
+         * differ from the clock of our timer. Carry over the time of the last
+         * defense, so the rate-limit is kept.
+         */
+        if (last_defend) {
+                struct timespec ts;
+
+                timer_now(&acd->timer, &now);
+                r = clock_gettime(CLOCK_MONOTONIC, &ts);
+                c_assert(r >= 0);
+                now_xdp = ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+
+                if (now - last_defend < now_xdp)
+                        last_defend = now_xdp - (now - last_defend);
+                else
+                        last_defend = 0;
+        }
+
+        (void)n_acd_bpf_xdp_map_set(acd->fd_xdp_map, ip, last_defend);
+}
+
+static int n_acd_open_socket(NAcd *acd, int fd_bpf_prog) {
+        if (acd->fanout)
+                return n_acd_fanout_open(acd->fanout, acd->shard, fd_bpf_prog, &acd->fd_socket);
+
+        return n_acd_socket_new(&acd->fd_socket, fd_bpf_prog, acd->ifindex);
+}
+
+/**
+ * n_acd_activate() - acquire kernel resources
+ * @acd:                        context to operate on
+ *
+ * This creates the timer, the packet socket and its filter, and registers them
+ * with the epoll-fd of @acd. If @acd is already active, this is a no-op.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_acd_activate(NAcd *acd) {
+        _c_cleanup_(c_closep) int fd_bpf_prog = -1;
+        struct epoll_event eevent;
+        int r;
+
+        if (acd->fd_socket >= 0)
+                return 0;
+
+        r = timer_init(&acd->timer);
+        if (r < 0)
+                goto error;
+
+        if (acd->multi_interface) {
+                NAcdInterface *interface;
+
+                /*
+                 * A multi-interface context uses a private filter, which
+                 * matches on the interface as well as the address, and
+                 * knows the hardware address of each interface. Its socket
+                 * is not bound to any interface.
+                 */
+                r = n_acd_filter_new(&acd->filter, NULL);
+                if (r)
+                        goto error;
+
+                r = n_acd_filter_link(acd->filter, acd);
+                if (r)
+                        goto error;
+
+                c_rbtree_for_each_entry(interface, &acd->interface_tree, acd_node) {
+                        r = n_acd_filter_add_mac(acd->filter, interface->ifindex, interface->mac);
+                        if (r)
+                                goto error;
+                }
+
+                r = n_acd_socket_new(&acd->fd_socket, acd->filter->fd_bpf_prog, 0);
+                if (r)
+                        goto error;
+        } else if (acd->filter) {
+                r = n_acd_filter_link(acd->filter, acd);
+                if (r)
+                        goto error;
+
+                r = n_acd_open_socket(acd, acd->filter->fd_bpf_prog);
+                if (r)
+                        goto error;
+        } else {
+                acd->max_bpf_map = 8;
+
+                r = n_acd_bpf_map_create(&acd->fd_bpf_map, acd->max_bpf_map);
+                if (r)
+                        goto error;
+
+                r = n_acd_bpf_compile(&fd_bpf_prog,
+                                      acd->fd_bpf_map,
+                                      -1,
+                                      (struct in_addr[1]){},
+                                      0,
+                                      (struct ether_addr*) acd->mac,
+                                      acd->observe_sample);
+                if (r)
+                        goto error;
+
+                acd->bpf_inline = true;
+
+                r = n_acd_open_socket(acd, fd_bpf_prog);
+                if (r)
+                        goto error;
+        }
+
+        if (acd->busy_poll)
+                n_acd_socket_set_busy_poll(acd->fd_socket, acd->busy_poll);
+
+        if (acd->rcvbuf) {
+                r = n_acd_socket_set_rcvbuf(acd->fd_socket, acd->rcvbuf);
+                if (r)
+                        goto error;
+        }
+
+        /* have the kernel tell us when it received each packet */
+        r = setsockopt(acd->fd_socket, SOL_SOCKET, SO_TIMESTAMPNS, &(int){ 1 }, sizeof(int));
+        if (r < 0) {
+                r = -c_errno();
+                goto error;
+        }
+
+        eevent = (struct epoll_event){
+                .events = EPOLLIN,
+                .data.u32 = N_ACD_EPOLL_TIMER,
+        };
+        r = epoll_ctl(acd->fd_epoll, EPOLL_CTL_ADD, acd->timer.fd, &eevent);
+        if (r < 0) {
+                r = -c_errno();
+                goto error;
+        }
+
+        eevent = (struct epoll_event){
+                .events = EPOLLIN,
+                .data.u32 = N_ACD_EPOLL_SOCKET,
+        };
+        r = epoll_ctl(acd->fd_epoll, EPOLL_CTL_ADD, acd->fd_socket, &eevent);
+        if (r < 0) {
+                r = -c_errno();
+                goto error;
+        }
+
+        /*
+         * The XDP defender is an optional optimization. If it cannot be set
+         * up, all addresses are defended via the packet socket.
+         */
+        if (acd->xdp != N_ACD_XDP_NONE) {
+                r = n_acd_xdp_setup(acd);
+                if (r)
+                        n_acd_xdp_teardown(acd);
+        }
+
+        return 0;
+
+error:
+        n_acd_deactivate(acd);
+        return r;
+}
 
+/**
+ * n_acd_deactivate() - release kernel resources
+ * @acd:                        context to operate on
+ *
+ * This releases everything acquired by n_acd_activate(), leaving only the
+ * epoll-fd behind. The context must not have any linked probes. If @acd is
+ * not active, this is a no-op.
+ */
+void n_acd_deactivate(NAcd *acd) {
         c_assert(c_rbtree_is_empty(&acd->ip_tree));
 
+        n_acd_xdp_teardown(acd);
+
         if (acd->fd_socket >= 0) {
                 c_assert(acd->fd_epoll >= 0);
                 epoll_ctl(acd->fd_epoll, EPOLL_CTL_DEL, acd->fd_socket, NULL);
-                close(acd->fd_socket);
+                if (acd->fanout)
+                        n_acd_fanout_close(acd->fanout, acd->fd_socket);
+                else
+                        close(acd->fd_socket);
                 acd->fd_socket = -1;
         }
 
+        if (acd->filter) {
+                n_acd_filter_unlink(acd->filter, acd);
+
+                /* the filter of a multi-interface context is private */
+                if (acd->multi_interface)
+                        acd->filter = n_acd_filter_unref(acd->filter);
+        }
+
+        if (acd->fd_bpf_bloom >= 0) {
+                close(acd->fd_bpf_bloom);
+                acd->fd_bpf_bloom = -1;
+        }
+
         if (acd->fd_bpf_map >= 0) {
                 close(acd->fd_bpf_map);
                 acd->fd_bpf_map = -1;
         }
 
+        acd->n_bpf_map = 0;
+        acd->n_bpf_bloom = 0;
+        acd->max_bpf_map = 0;
+        acd->bpf_inline = false;
+
         if (acd->timer.fd >= 0) {
                 c_assert(acd->fd_epoll >= 0);
                 epoll_ctl(acd->fd_epoll, EPOLL_CTL_DEL, acd->timer.fd, NULL);
                 timer_deinit(&acd->timer);
         }
+}
+
+/**
+ * n_acd_new() - create a new ACD context
+ * @acdp:                       output argument for new context object
+ * @config:                     configuration parameters
+ *
+ * Create a new ACD context and return it in @acdp. The configuration @config
+ * must be initialized by the caller and must specify a valid network
+ * interface, transport mechanism, as well as hardware address compatible with
+ * the selected transport. The configuration is copied into the context. The
+ * @config object thus does not have to be retained by the caller.
+ *
+ * If @config specifies a shared filter, the context uses it and acquires a
+ * reference to it. All contexts that share a filter on the same interface must
+ * use the same hardware address, otherwise N_ACD_E_INVALID_ARGUMENT is
+ * returned.
+ *
+ * If @config selects an XDP mode, the XDP program is attached together with
+ * the packet socket. Failure to attach it is not an error.
+ *
+ * If @config selects lazy mode, only the epoll-fd and the eventfd of the
+ * submission queue are created here. All other kernel resources are deferred
+ * to the first probe, and thus so is the verification of a shared filter.
+ *
+ * If @config selects a multi-interface context, it must not specify a network
+ * interface or hardware address. The context starts out without any
+ * interfaces, they are added via n_acd_add_interface().
+ *
+ * If @config specifies a fanout, the context drives the selected shard of it,
+ * and acquires a reference to it. It must be on the same interface, and cannot
+ * be combined with a multi-interface context or XDP. Each shard can only be
+ * driven by one context at a time, N_ACD_E_INVALID_ARGUMENT is returned if
+ * another context already drives it.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+_c_public_ int n_acd_new(NAcd **acdp, NAcdConfig *config) {
+        _c_cleanup_(n_acd_unrefp) NAcd *acd = NULL;
+        int r;
+
+        if (config->transport != N_ACD_TRANSPORT_ETHERNET ||
+            config->xdp >= _N_ACD_XDP_N ||
+            !config->adaptive_min_msecs ||
+            config->adaptive_min_msecs > config->adaptive_max_msecs ||
+            config->pace_rate > UINT64_C(1000000000) ||
+            (config->pace_rate && !config->pace_burst))
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        if (config->fanout) {
+                if (config->fanout->ifindex != config->ifindex ||
+                    config->shard >= config->fanout->n_shards ||
+                    config->multi_interface ||
+                    config->xdp != N_ACD_XDP_NONE ||
+                    config->xdp_socket)
+                        return N_ACD_E_INVALID_ARGUMENT;
+        }
+
+        if (config->multi_interface) {
+                if (config->ifindex ||
+                    config->n_mac ||
+                    config->filter ||
+                    config->xdp != N_ACD_XDP_NONE ||
+                    config->xdp_socket)
+                        return N_ACD_E_INVALID_ARGUMENT;
+        } else {
+                if (config->ifindex <= 0 ||
+                    config->n_mac != ETH_ALEN ||
+                    !memcmp(config->mac, (uint8_t[ETH_ALEN]){ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }, ETH_ALEN))
+                        return N_ACD_E_INVALID_ARGUMENT;
+        }
+
+        acd = malloc(sizeof(*acd));
+        if (!acd)
+                return -ENOMEM;
+
+        *acd = (NAcd)N_ACD_NULL(*acd);
+        acd->ifindex = config->ifindex;
+        memcpy(acd->mac, config->mac, ETH_ALEN);
+        acd->filter = n_acd_filter_ref(config->filter);
+        acd->xdp = config->xdp;
+        acd->busy_poll = config->busy_poll;
+        acd->rcvbuf = config->rcvbuf;
+        acd->remember_nsecs = config->remember_msecs * UINT64_C(1000000);
+        acd->observe_sample = config->observe_sample;
+        acd->observe_nsecs = config->observe_msecs * UINT64_C(1000000);
+        acd->rate_limit_nsecs = config->rate_limit_nsecs;
+        acd->adaptive_min_msecs = config->adaptive_min_msecs;
+        acd->adaptive_max_msecs = config->adaptive_max_msecs;
+        if (config->pace_rate) {
+                acd->pace_interval = UINT64_C(1000000000) / config->pace_rate;
+                acd->pace_burst_nsecs = (config->pace_burst - 1) * acd->pace_interval;
+        }
+        acd->retry_max = config->retry_max;
+        acd->refresh_nsecs = config->refresh_msecs * UINT64_C(1000000);
+        acd->multi_interface = config->multi_interface;
+        acd->xdp_socket = config->xdp_socket;
+        acd->lazy = config->lazy;
+
+        if (config->fanout) {
+                r = n_acd_fanout_claim(config->fanout, config->shard);
+                if (r)
+                        return r;
+
+                acd->fanout = n_acd_fanout_ref(config->fanout);
+                acd->shard = config->shard;
+        }
+
+        r = n_acd_get_random(&acd->seed);
+        if (r)
+                return r;
+
+        if (acd->observe_sample) {
+                acd->observe_key = rand_r(&acd->seed);
+                acd->observations = calloc(N_ACD_OBSERVE_SETS * N_ACD_OBSERVE_WAYS, sizeof(*acd->observations));
+                if (!acd->observations)
+                        return -ENOMEM;
+        }
+
+        /* a single-interface context serves exactly its configured interface */
+        if (!acd->multi_interface) {
+                r = n_acd_interface_new(acd, acd->ifindex, acd->mac);
+                if (r)
+                        return r;
+        }
+
+        acd->fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (acd->fd_epoll < 0)
+                return -c_errno();
+
+        acd->fd_submit = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (acd->fd_submit < 0)
+                return -c_errno();
+
+        r = epoll_ctl(acd->fd_epoll,
+                      EPOLL_CTL_ADD,
+                      acd->fd_submit,
+                      &(struct epoll_event){
+                              .events = EPOLLIN,
+                              .data.u32 = N_ACD_EPOLL_SUBMIT,
+                      });
+        if (r < 0)
+                return -c_errno();
+
+        if (!acd->lazy) {
+                r = n_acd_activate(acd);
+                if (r)
+                        return r;
+        }
+
+        *acdp = acd;
+        acd = NULL;
+        return 0;
+}
+
+static void n_acd_free_internal(NAcd *acd) {
+        NAcdEventNode *node, *t_node;
+        NAcdInterface *interface;
+        NAcdMemory *memory;
+
+        if (!acd)
+                return;
+
+        n_acd_submit_flush(acd);
+
+        c_list_for_each_entry_safe(node, t_node, &acd->event_list, acd_link)
+                n_acd_event_node_free(node);
+
+        n_acd_deactivate(acd);
+        acd->filter = n_acd_filter_unref(acd->filter);
+        if (acd->fanout) {
+                n_acd_fanout_release(acd->fanout, acd->shard);
+                acd->fanout = n_acd_fanout_unref(acd->fanout);
+        }
+
+        while ((memory = c_list_first_entry(&acd->memory_list, NAcdMemory, acd_link)))
+                n_acd_memory_free(acd, memory);
+
+        free(acd->observations);
+        acd->observations = NULL;
+
+        while ((interface = c_rbnode_entry(c_rbtree_first(&acd->interface_tree), NAcdInterface, acd_node)))
+                n_acd_interface_free(acd, interface);
+
+        if (acd->fd_submit >= 0) {
+                close(acd->fd_submit);
+                acd->fd_submit = -1;
+        }
 
         if (acd->fd_epoll >= 0) {
                 close(acd->fd_epoll);
@@ -434,13 +2251,14 @@ static void n_acd_free_internal(NAcd *acd) {
  * @acd:                        context to operate on, or NULL
  *
  * This acquires a single reference to the context specified as @acd. If @acd
- * is NULL, this is a no-op.
+ * is NULL, this is a no-op. References to a context may be acquired and
+ * released from any thread.
  *
  * Return: @acd is returned.
  */
 _c_public_ NAcd *n_acd_ref(NAcd *acd) {
         if (acd)
-                ++acd->n_refs;
+                atomic_fetch_add(&acd->n_refs, 1);
         return acd;
 }
 
@@ -454,7 +2272,7 @@ _c_public_ NAcd *n_acd_ref(NAcd *acd) {
  * Return: NULL is returned.
  */
 _c_public_ NAcd *n_acd_unref(NAcd *acd) {
-        if (acd && !--acd->n_refs)
+        if (acd && atomic_fetch_sub(&acd->n_refs, 1) == 1)
                 n_acd_free_internal(acd);
         return NULL;
 }
@@ -475,31 +2293,37 @@ int n_acd_raise(NAcd *acd, NAcdEventNode **nodep, unsigned int event) {
         return 0;
 }
 
-int n_acd_send(NAcd *acd, const struct in_addr *tpa, const struct in_addr *spa) {
-        struct sockaddr_ll address = {
-                .sll_family = AF_PACKET,
-                .sll_protocol = htobe16(ETH_P_ARP),
-                .sll_ifindex = acd->ifindex,
-                .sll_halen = ETH_ALEN,
-                .sll_addr = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
-        };
-        struct ether_arp arp = {
-                .ea_hdr = {
-                        .ar_hrd = htobe16(ARPHRD_ETHER),
-                        .ar_pro = htobe16(ETHERTYPE_IP),
-                        .ar_hln = sizeof(acd->mac),
-                        .ar_pln = sizeof(uint32_t),
-                        .ar_op = htobe16(ARPOP_REQUEST),
-                },
-        };
-        ssize_t l;
+static int n_acd_raise_down(NAcd *acd, int ifindex) {
+        NAcdEventNode *node;
         int r;
 
-        memcpy(arp.arp_sha, acd->mac, sizeof(acd->mac));
-        memcpy(arp.arp_tpa, &tpa->s_addr, sizeof(uint32_t));
+        r = n_acd_raise(acd, &node, N_ACD_EVENT_DOWN);
+        if (r)
+                return r;
 
-        if (spa)
-                memcpy(arp.arp_spa, &spa->s_addr, sizeof(spa->s_addr));
+        node->event.down.ifindex = ifindex;
+        return 0;
+}
+
+static int n_acd_raise_overrun(NAcd *acd, uint64_t n_dropped) {
+        NAcdEventNode *node;
+        int r;
+
+        r = n_acd_raise(acd, &node, N_ACD_EVENT_OVERRUN);
+        if (r)
+                return r;
+
+        node->event.overrun.n_dropped = n_dropped;
+        return 0;
+}
+
+int n_acd_send(NAcd *acd, NAcdInterface *interface, const struct in_addr *tpa, const struct in_addr *spa) {
+        struct sockaddr_ll address;
+        struct ether_arp arp;
+        ssize_t l;
+        int r;
+
+        n_acd_frame_init(interface, tpa, spa, &address, &arp);
 
         l = sendto(acd->fd_socket,
                    &arp,
@@ -528,7 +2352,7 @@ int n_acd_send(NAcd *acd, const struct in_addr *tpa, const struct in_addr *spa)
                          * treat this as success.
                          */
 
-                        r = n_acd_raise(acd, NULL, N_ACD_EVENT_DOWN);
+                        r = n_acd_raise_down(acd, interface->ifindex);
                         if (r)
                                 return r;
 
@@ -604,8 +2428,14 @@ static int n_acd_handle_timeout(NAcd *acd) {
                         break;
                 }
 
-                probe = (void *)timeout - offsetof(NAcdProbe, timeout);
-                r = n_acd_probe_handle_timeout(probe);
+                if (timeout == &acd->pace_timeout) {
+                        r = n_acd_pace_release(acd, now);
+                } else if (timeout == &acd->refresh_timeout) {
+                        r = n_acd_refresh_tick(acd, now);
+                } else {
+                        probe = (void *)timeout - offsetof(NAcdProbe, timeout);
+                        r = n_acd_probe_handle_timeout(probe);
+                }
                 if (r)
                         return r;
         }
@@ -613,11 +2443,12 @@ static int n_acd_handle_timeout(NAcd *acd) {
         return 0;
 }
 
-static int n_acd_handle_packet(NAcd *acd, struct ether_arp *packet) {
+static int n_acd_handle_packet(NAcd *acd, NAcdInterface *interface, struct ether_arp *packet) {
         bool hard_conflict;
         NAcdProbe *probe;
         uint32_t addr;
         CRBNode *node;
+        uint64_t now;
         int r;
 
         /*
@@ -642,9 +2473,9 @@ static int n_acd_handle_packet(NAcd *acd, struct ether_arp *packet) {
          * can bail out early if neither is the case.
          *
          * Lastly, we perform a lookup in our probe-set to check whether the
-         * address actually matches, so we can let these probes dispatch the
-         * message. Note that we allow duplicate probes, so we need to dispatch
-         * each matching probe, not just one.
+         * address actually matches on the receiving interface, so we can let
+         * these probes dispatch the message. Note that we allow duplicate
+         * probes, so we need to dispatch each matching probe, not just one.
          */
 
         if (memcmp(packet->arp_spa, (uint8_t[4]){ }, sizeof(packet->arp_spa))) {
@@ -660,16 +2491,10 @@ static int n_acd_handle_packet(NAcd *acd, struct ether_arp *packet) {
                 return -EIO;
         }
 
-        /* Find top-most node that matches @addr. */
-        node = acd->ip_tree.root;
-        while (node) {
-                probe = c_rbnode_entry(node, NAcdProbe, ip_node);
-                if (addr < probe->ip.s_addr)
-                        node = node->left;
-                else if (addr > probe->ip.s_addr)
-                        node = node->right;
-                else
-                        break;
+        /* if observing, record every claim, even for addresses we do not probe */
+        if (hard_conflict && acd->observations) {
+                timer_now(&acd->timer, &now);
+                n_acd_observe(acd, interface, (struct in_addr){ addr }, packet->arp_sha, now);
         }
 
         /*
@@ -677,16 +2502,12 @@ static int n_acd_handle_packet(NAcd *acd, struct ether_arp *packet) {
          * the kernel queued the packet and passed the BPF filter, but we
          * modified the set before dequeuing the message.
          */
-        if (!node)
+        probe = n_acd_find_probe(acd, interface->ifindex, addr);
+        if (!probe)
                 return 0;
 
-        /* Forward to left-most child that still matches @addr. */
-        while (node->left && addr == c_rbnode_entry(node->left,
-                                                    NAcdProbe,
-                                                    ip_node)->ip.s_addr)
-                node = node->left;
-
         /* Iterate all matching entries in-order. */
+        node = &probe->ip_node;
         do {
                 probe = c_rbnode_entry(node, NAcdProbe, ip_node);
 
@@ -695,9 +2516,9 @@ static int n_acd_handle_packet(NAcd *acd, struct ether_arp *packet) {
                         return r;
 
                 node = c_rbnode_next(node);
-        } while (node && addr == c_rbnode_entry(node,
-                                                NAcdProbe,
-                                                ip_node)->ip.s_addr);
+        } while (node && !n_acd_probe_compare(c_rbnode_entry(node, NAcdProbe, ip_node),
+                                              interface->ifindex,
+                                              addr));
 
         return 0;
 }
@@ -735,45 +2556,49 @@ static int n_acd_dispatch_timer(NAcd *acd, struct epoll_event *event) {
         return 0;
 }
 
-static bool n_acd_packet_is_valid(NAcd *acd, void *packet, size_t n_packet) {
-        struct ether_arp *arp;
+static uint64_t n_acd_packet_timestamp(struct msghdr *msg) {
+        struct cmsghdr *cmsg;
+        struct timespec ts;
 
-        /*
-         * The eBPF filter will ensure that this function always returns true, however,
-         * this allows the eBPF filter to be an optional optimization which is necessary
-         * on older kernels.
-         *
-         * See comments in n-acd-bpf.c for details.
-         */
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+                }
+        }
 
-        if (n_packet != sizeof(*arp))
-                return false;
+        return 0;
+}
 
-        arp = packet;
+static void n_acd_account_queue_delay(NAcd *acd, uint64_t now, uint64_t timestamp) {
+        uint64_t delay;
 
-        if (arp->arp_hrd != htobe16(ARPHRD_ETHER))
-                return false;
+        if (!timestamp)
+                return;
 
-        if (arp->arp_pro != htobe16(ETHERTYPE_IP))
-                return false;
+        /* the wall-clock might have been set backwards in between */
+        delay = now > timestamp ? now - timestamp : 0;
 
-        if (arp->arp_hln != sizeof(struct ether_addr))
-                return false;
+        ++acd->n_queue_delay;
+        acd->total_queue_delay += delay;
+        if (delay > acd->max_queue_delay)
+                acd->max_queue_delay = delay;
+}
 
-        if (arp->arp_pln != sizeof(struct in_addr))
-                return false;
+static int n_acd_check_overrun(NAcd *acd) {
+        struct tpacket_stats stats;
+        socklen_t n_stats = sizeof(stats);
+        int r;
 
-        if (!memcmp(arp->arp_sha, acd->mac, sizeof(struct ether_addr)))
-                return false;
+        /* reading the statistics resets them, so each drop is reported once */
+        r = getsockopt(acd->fd_socket, SOL_PACKET, PACKET_STATISTICS, &stats, &n_stats);
+        if (r < 0)
+                return -c_errno();
 
-        if (memcmp(arp->arp_spa, &((struct in_addr) { INADDR_ANY }), sizeof(struct in_addr))) {
-                if (arp->arp_op != htobe16(ARPOP_REQUEST) && arp->arp_op != htobe16(ARPOP_REPLY))
-                        return false;
-        } else if (arp->arp_op != htobe16(ARPOP_REQUEST)) {
-                return false;
-        }
+        if (!stats.tp_drops)
+                return 0;
 
-        return true;
+        return n_acd_raise_overrun(acd, stats.tp_drops);
 }
 
 static int n_acd_dispatch_socket(NAcd *acd, struct epoll_event *event) {
@@ -781,6 +2606,15 @@ static int n_acd_dispatch_socket(NAcd *acd, struct epoll_event *event) {
         struct mmsghdr msgs[n_batch];
         struct iovec iovecs[n_batch];
         struct ether_arp data[n_batch];
+        struct sockaddr_ll addrs[n_batch];
+        union {
+                struct cmsghdr cmsg;
+                uint8_t buffer[CMSG_SPACE(sizeof(struct timespec))];
+        } controls[n_batch];
+        NAcdInterface *interfaces[n_batch];
+        size_t n_data[n_batch];
+        struct timespec ts;
+        uint64_t now, valid;
         size_t i;
         int r, n;
 
@@ -788,11 +2622,22 @@ static int n_acd_dispatch_socket(NAcd *acd, struct epoll_event *event) {
                 iovecs[i].iov_base = data + i;
                 iovecs[i].iov_len = sizeof(data[i]);
                 msgs[i].msg_hdr = (struct msghdr){
+                        .msg_name = addrs + i,
+                        .msg_namelen = sizeof(addrs[i]),
                         .msg_iov = iovecs + i,
                         .msg_iovlen = 1,
+                        .msg_control = controls + i,
+                        .msg_controllen = sizeof(controls[i]),
                 };
         }
 
+        /* EPOLLOUT is only polled for while frames are parked */
+        if (event->events & EPOLLOUT) {
+                r = n_acd_retry_flush(acd);
+                if (r)
+                        return r;
+        }
+
         /*
          * We always directly call into recvmmsg(2), regardless which EPOLL*
          * event is signalled. On sockets, the recv(2)-family of syscalls does
@@ -811,9 +2656,10 @@ static int n_acd_dispatch_socket(NAcd *acd, struct epoll_event *event) {
                          * Usually, the caller should tear down all probes when
                          * an interface goes down, but we leave it up to the
                          * caller to decide what to do. We propagate the code
-                         * and continue.
+                         * and continue. Only bound sockets get this, so this
+                         * is never a multi-interface context.
                          */
-                        return n_acd_raise(acd, NULL, N_ACD_EVENT_DOWN);
+                        return n_acd_raise_down(acd, acd->ifindex);
                 } else if (errno == EAGAIN) {
                         /*
                          * There is no more data queued and we did not get
@@ -855,19 +2701,139 @@ static int n_acd_dispatch_socket(NAcd *acd, struct epoll_event *event) {
                 acd->preempted = true;
         }
 
+        /*
+         * Packets are only dropped if the receive queue is full, in which
+         * case we always get some. Hence, there is no need to look at the
+         * statistics on wake-ups without data. The event is queued before
+         * any event caused by the packets, since the drops preceded them.
+         */
+        if (n > 0) {
+                r = n_acd_check_overrun(acd);
+                if (r)
+                        return r;
+        }
+
+        /* the kernel stamps packets with the wall-clock */
+        r = clock_gettime(CLOCK_REALTIME, &ts);
+        c_assert(r >= 0);
+        now = ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+
+        /*
+         * Demultiplex on the receiving interface. The interface might have
+         * been removed since the packet was queued, in which case the packet
+         * is considered invalid. Then validate the whole batch at once.
+         */
+        for (i = 0; (ssize_t)i < n; ++i) {
+                interfaces[i] = n_acd_find_interface(acd, addrs[i].sll_ifindex);
+                n_data[i] = msgs[i].msg_len;
+        }
+
+        valid = n_acd_packet_validate(n_acd_packet_isa(), interfaces, data, n_data, n);
+
         for (i = 0; (ssize_t)i < n; ++i) {
-                if (!n_acd_packet_is_valid(acd, data + i, msgs[i].msg_len))
+                acd->timestamp = n_acd_packet_timestamp(&msgs[i].msg_hdr);
+                n_acd_account_queue_delay(acd, now, acd->timestamp);
+
+                if (!(valid & (UINT64_C(1) << i)))
                         continue;
+
                 /*
                  * Handle the packet. Bail out if something went wrong. Note
                  * that this must be fatal errors, since we discard all other
                  * packets that follow.
                  */
-                r = n_acd_handle_packet(acd, data + i);
+                r = n_acd_handle_packet(acd, interfaces[i], data + i);
+                if (r)
+                        break;
+        }
+
+        /* packets from other receive paths carry no timestamp */
+        acd->timestamp = 0;
+        return r;
+}
+
+static int n_acd_dispatch_xdp(NAcd *acd, struct epoll_event *event) {
+        const size_t n_batch = 8;
+        NAcdBpfXdpEvent record;
+        NAcdProbe *probe;
+        CRBNode *node;
+        size_t i, n;
+        int r;
+
+        if (event->events & (EPOLLHUP | EPOLLERR))
+                return -EIO;
+
+        /*
+         * Each record tells us about a conflict the XDP program handled on our
+         * behalf. Like with the socket, we handle a limited batch, and mark
+         * the context as preempted if there might be more.
+         */
+        for (i = 0; i < n_batch; ++i) {
+                n = sizeof(record);
+                r = n_acd_bpf_ring_pop(&acd->xdp_ring, &record, &n);
+                if (r)
+                        return r;
+                else if (!n)
+                        return 0;
+                else if (n != sizeof(record))
+                        continue;
+
+                /*
+                 * The probe might have been freed or changed since the record
+                 * was queued, in which case the record is stale.
+                 */
+                probe = n_acd_find_probe(acd, acd->ifindex, record.addr);
+                if (!probe)
+                        continue;
+
+                node = &probe->ip_node;
+                do {
+                        probe = c_rbnode_entry(node, NAcdProbe, ip_node);
+
+                        r = n_acd_probe_handle_defended(probe, record.sender, record.defended);
+                        if (r)
+                                return r;
+
+                        node = c_rbnode_next(node);
+                } while (node && !n_acd_probe_compare(c_rbnode_entry(node, NAcdProbe, ip_node),
+                                                      acd->ifindex,
+                                                      record.addr));
+        }
+
+        acd->preempted = true;
+        return 0;
+}
+
+static int n_acd_dispatch_xsk(NAcd *acd, struct epoll_event *event) {
+        const size_t n_batch = 8;
+        NAcdInterface *interface;
+        struct ether_arp data;
+        size_t i, n;
+        int r;
+
+        if (event->events & (EPOLLHUP | EPOLLERR))
+                return -EIO;
+
+        interface = n_acd_find_interface(acd, acd->ifindex);
+
+        /* handle a limited batch, just like the packet socket */
+        for (i = 0; i < n_batch; ++i) {
+                n = sizeof(data);
+                r = n_acd_bpf_xsk_pop(&acd->xsk, &data, &n);
+                if (r)
+                        return r;
+                else if (!n)
+                        return 0;
+
+                if (!n_acd_packet_is_valid(interface, &data, n))
+                        continue;
+
+                r = n_acd_handle_packet(acd, interface, &data);
                 if (r)
                         return r;
         }
 
+        acd->preempted = true;
         return 0;
 }
 
@@ -893,7 +2859,7 @@ static int n_acd_dispatch_socket(NAcd *acd, struct epoll_event *event) {
  *         on failure.
  */
 _c_public_ int n_acd_dispatch(NAcd *acd) {
-        struct epoll_event events[2];
+        struct epoll_event events[4];
         int n, i, r = 0;
 
         n = epoll_wait(acd->fd_epoll, events, sizeof(events) / sizeof(*events), 0);
@@ -903,6 +2869,7 @@ _c_public_ int n_acd_dispatch(NAcd *acd) {
         }
 
         acd->preempted = false;
+        acd->dispatching = true;
 
         for (i = 0; i < n; ++i) {
                 switch (events[i].data.u32) {
@@ -912,6 +2879,15 @@ _c_public_ int n_acd_dispatch(NAcd *acd) {
                 case N_ACD_EPOLL_SOCKET:
                         r = n_acd_dispatch_socket(acd, events + i);
                         break;
+                case N_ACD_EPOLL_XDP:
+                        r = n_acd_dispatch_xdp(acd, events + i);
+                        break;
+                case N_ACD_EPOLL_XSK:
+                        r = n_acd_dispatch_xsk(acd, events + i);
+                        break;
+                case N_ACD_EPOLL_SUBMIT:
+                        r = n_acd_dispatch_submit(acd);
+                        break;
                 default:
                         c_assert(0);
                         r = 0;
@@ -919,12 +2895,63 @@ _c_public_ int n_acd_dispatch(NAcd *acd) {
                 }
 
                 if (r)
-                        return r;
+                        break;
         }
 
+        acd->dispatching = false;
+
+        /* a submitted free may have dropped the last probe, see n_acd_probe_destroy() */
+        if (acd->lazy && !acd->n_probes)
+                n_acd_deactivate(acd);
+
+        if (r)
+                return r;
+
         return acd->preempted ? N_ACD_E_PREEMPTED : 0;
 }
 
+/**
+ * n_acd_dispatch_spin() - dispatch context, spinning until events are queued
+ * @acd:                        context object to operate on
+ * @usecs:                      spin budget in microseconds
+ *
+ * This is a variant of n_acd_dispatch() for the low-latency mode (see
+ * n_acd_config_set_busy_poll()). Rather than returning when there is nothing
+ * to dispatch, it keeps dispatching until at least one event is queued, or
+ * until @usecs elapsed. This trades CPU time for the latency of sleeping in
+ * the kernel and being woken up again. The caller must drain the event-queue
+ * afterwards, just like with n_acd_dispatch().
+ *
+ * Return: 0 on success, N_ACD_E_PREEMPTED on preemption, negative error code
+ *         on failure.
+ */
+_c_public_ int n_acd_dispatch_spin(NAcd *acd, uint64_t usecs) {
+        NAcdEventNode *node;
+        struct timespec ts;
+        uint64_t now, deadline = 0;
+        int r;
+
+        for (;;) {
+                r = n_acd_dispatch(acd);
+                if (r)
+                        return r;
+
+                /* events are appended, so only the last one can be unpopped */
+                node = c_list_last_entry(&acd->event_list, NAcdEventNode, acd_link);
+                if (node && !node->is_public)
+                        return 0;
+
+                r = clock_gettime(CLOCK_MONOTONIC, &ts);
+                c_assert(r >= 0);
+
+                now = ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+                if (!deadline)
+                        deadline = now + usecs * UINT64_C(1000);
+                else if (now >= deadline)
+                        return 0;
+        }
+}
+
 /**
  * n_acd_pop_event() - get the next pending event
  * @acd:                        context object to operate on
@@ -964,9 +2991,12 @@ _c_public_ int n_acd_dispatch(NAcd *acd) {
  *                          it (according to the configured policy). The
  *                          probe halted, the caller must stop using
  *                          the address immediately, and should free the probe.
+ *
  *  * N_ACD_EVENT_DOWN:     The specified network interface was put down. The
- *                          user is recommended to free *ALL* probes and
- *                          recreate them as soon as the interface is up again.
+ *                          index of the interface is provided in the event.
+ *                          The user is recommended to free *ALL* probes on it
+ *                          and recreate them as soon as the interface is up
+ *                          again.
  *                          Note that this event is purely informational. The
  *                          probes will continue running, but all packets will
  *                          be blackholed, and no network packets are received,
@@ -974,6 +3004,33 @@ _c_public_ int n_acd_dispatch(NAcd *acd) {
  *                          operational perspective, the legitimacy of the ACD
  *                          probes is lost and the user better re-probes all
  *                          addresses.
+ *  * N_ACD_EVENT_OVERRUN:  The receive queue of the packet socket overflowed,
+ *                          and the number of packets the kernel dropped is
+ *                          provided in the event. Any of them might have
+ *                          been a conflict, so, much like with
+ *                          N_ACD_EVENT_DOWN, the user better re-probes
+ *                          addresses that are still probing. See
+ *                          n_acd_config_set_rcvbuf() to make this less
+ *                          likely.
+ *  * N_ACD_EVENT_THROTTLED: Too many conflicts were seen in a short time, so
+ *                          new probes are rate-limited. The total number of
+ *                          conflicts is provided in the event. See
+ *                          n_acd_config_set_rate_limit() for details.
+ *  * N_ACD_EVENT_TENTATIVE: A probe sent its first probe, and the caller
+ *                          asked to be told about it. The address may be
+ *                          used optimistically, until either
+ *                          N_ACD_EVENT_READY or N_ACD_EVENT_USED is raised.
+ *                          See n_acd_probe_config_set_tentative().
+ *  * N_ACD_EVENT_FAILED:   A probe submitted via n_acd_submit_probe() could
+ *                          not be started. The error code, as n_acd_probe()
+ *                          would have returned it, is provided in the event.
+ *                          The probe is halted, and should be freed by the
+ *                          caller.
+ *
+ * The N_ACD_EVENT_USED, N_ACD_EVENT_DEFENDED and N_ACD_EVENT_CONFLICT events
+ * carry the time the kernel received the packet that triggered them, in
+ * nanoseconds of CLOCK_REALTIME. It is 0 if the packet was not received via
+ * the packet socket, e.g., if it was handled by the XDP defender.
  *
  * Returns: 0 on success, negative error code on failure. The popped event is
  *          returned in @eventp. If no event is pending, NULL is placed in
@@ -998,6 +3055,145 @@ _c_public_ int n_acd_pop_event(NAcd *acd, NAcdEvent **eventp) {
         return 0;
 }
 
+/**
+ * n_acd_get_queue_delay() - get queueing delay statistics
+ * @acd:                        context object to operate on
+ * @n_packetsp:                 output argument for number of packets
+ * @total_nsecsp:               output argument for total delay
+ * @max_nsecsp:                 output argument for maximum delay
+ *
+ * This returns statistics on the time packets spent queued on the packet
+ * socket, between being received by the kernel and being handled by
+ * n_acd_dispatch(). It returns the number of packets received on the socket
+ * since the context was created, as well as the sum and the maximum of their
+ * delays, in nanoseconds. A growing delay means the context is not dispatched
+ * quickly enough.
+ */
+_c_public_ void n_acd_get_queue_delay(NAcd *acd, uint64_t *n_packetsp, uint64_t *total_nsecsp, uint64_t *max_nsecsp) {
+        *n_packetsp = acd->n_queue_delay;
+        *total_nsecsp = acd->total_queue_delay;
+        *max_nsecsp = acd->max_queue_delay;
+}
+
+/**
+ * n_acd_get_throttle() - get conflict rate-limit state
+ * @acd:                        context object to operate on
+ * @activep:                    output argument for whether probes are throttled
+ * @n_conflictsp:               output argument for number of conflicts
+ * @n_throttledp:               output argument for number of delayed probes
+ *
+ * This returns whether new probes are currently rate-limited, see
+ * n_acd_config_set_rate_limit(). It also returns the number of conflicts seen
+ * since the context was created, as well as the number of probes that were
+ * delayed due to the rate-limit.
+ */
+_c_public_ void n_acd_get_throttle(NAcd *acd, bool *activep, uint64_t *n_conflictsp, uint64_t *n_throttledp) {
+        uint64_t now;
+
+        timer_now(&acd->timer, &now);
+
+        *activep = n_acd_is_throttled(acd, now);
+        *n_conflictsp = acd->n_conflicts;
+        *n_throttledp = acd->n_throttled;
+}
+
+/**
+ * n_acd_get_rtt() - get round-trip time estimate
+ * @acd:                        context object to operate on
+ * @n_samplesp:                 output argument for number of samples
+ * @srtt_nsecsp:                output argument for smoothed round-trip time
+ * @rttvar_nsecsp:              output argument for round-trip time variance
+ *
+ * This returns the estimate adaptive timeouts are derived from, see
+ * n_acd_config_set_adaptive_timeout(). Both values are in nanoseconds, and
+ * are 0 if no sample was taken, yet.
+ */
+_c_public_ void n_acd_get_rtt(NAcd *acd, uint64_t *n_samplesp, uint64_t *srtt_nsecsp, uint64_t *rttvar_nsecsp) {
+        *n_samplesp = acd->n_rtt;
+        *srtt_nsecsp = acd->srtt;
+        *rttvar_nsecsp = acd->rttvar;
+}
+
+/**
+ * n_acd_get_observation() - get observed claims of an address
+ * @acd:                        context object to operate on
+ * @ifindex:                    interface index, or 0
+ * @ip:                         address to look up
+ * @observedp:                  output argument for whether it was claimed
+ * @n_conflictsp:               output argument for number of conflicts
+ *
+ * This looks up the claims another host made for @ip on the interface with
+ * index @ifindex, see n_acd_config_set_observe(). An @ifindex of 0 selects the
+ * interface of the context. It returns whether the address was claimed within
+ * the configured window, and how often the claimant changed since the address
+ * was first observed. The latter is 0 if the address was not claimed.
+ *
+ * Return: 0 on success, N_ACD_E_INVALID_ARGUMENT if @acd does not serve the
+ *         interface.
+ */
+_c_public_ int n_acd_get_observation(NAcd *acd, int ifindex, struct in_addr ip, bool *observedp, uint64_t *n_conflictsp) {
+        NAcdObservation *observation;
+        NAcdInterface *interface;
+        uint64_t now;
+
+        interface = n_acd_find_interface(acd, ifindex ? ifindex : acd->ifindex);
+        if (!interface)
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        timer_now(&acd->timer, &now);
+        observation = n_acd_find_observation(acd, interface, ip, now);
+
+        *observedp = !!observation;
+        *n_conflictsp = observation ? observation->n_conflicts : 0;
+        return 0;
+}
+
+/**
+ * n_acd_get_pacing() - get transmit pacer statistics
+ * @acd:                        context object to operate on
+ * @n_queuedp:                  output argument for number of queued frames
+ * @max_queuedp:                output argument for maximum queue depth
+ * @n_delayedp:                 output argument for number of delayed frames
+ * @total_nsecsp:               output argument for total pacing delay
+ * @max_nsecsp:                 output argument for maximum pacing delay
+ *
+ * This returns the state of the transmit pacer, see
+ * n_acd_config_set_pacing(). It returns the number of frames currently
+ * queued, and the deepest the queue has been since the context was created.
+ * It also returns the number of frames that were delayed, as well as the sum
+ * and the maximum of their delays, in nanoseconds.
+ */
+_c_public_ void n_acd_get_pacing(NAcd *acd,
+                                 uint64_t *n_queuedp,
+                                 uint64_t *max_queuedp,
+                                 uint64_t *n_delayedp,
+                                 uint64_t *total_nsecsp,
+                                 uint64_t *max_nsecsp) {
+        *n_queuedp = acd->n_pace_queue;
+        *max_queuedp = acd->max_pace_queue;
+        *n_delayedp = acd->n_pace_delay;
+        *total_nsecsp = acd->total_pace_delay;
+        *max_nsecsp = acd->max_pace_delay;
+}
+
+/**
+ * n_acd_get_refresh() - get refresh statistics
+ * @acd:                        context object to operate on
+ * @n_addressesp:               output argument for number of refreshed addresses
+ * @n_sentp:                    output argument for number of sent refreshes
+ * @n_droppedp:                 output argument for number of dropped refreshes
+ *
+ * This returns the state of periodic refreshing, see
+ * n_acd_config_set_refresh(). It returns the number of addresses currently
+ * refreshed, as well as the number of refreshes the kernel took and the number
+ * it dropped since the context was created.
+ */
+_c_public_ void n_acd_get_refresh(NAcd *acd, uint64_t *n_addressesp, uint64_t *n_sentp, uint64_t *n_droppedp) {
+        *n_addressesp = acd->n_refresh;
+        *n_sentp = acd->n_refreshed;
+        *n_droppedp = acd->n_refresh_dropped;
+}
+
 /**
  * n_acd_probe() - start new probe
  * @acd:                        context object to operate on
@@ -1017,7 +3213,12 @@ _c_public_ int n_acd_pop_event(NAcd *acd, NAcdEvent **eventp) {
  * Probes are rather lightweight objects. They do not create any
  * file-descriptors or other kernel objects. Probes always re-use the
  * infrastructure provided by the context object @acd. This allows running many
- * probes simultaneously without exhausting resources.
+ * probes simultaneously without exhausting resources. The only exception is
+ * the first probe on a context in lazy mode, which makes the context acquire
+ * its kernel resources.
+ *
+ * On a context that drives a shard of a fanout, the address must belong to
+ * that shard, see n_acd_fanout_get_shard().
  *
  * Return: 0 on success, N_ACD_E_INVALID_ARGUMENT on invalid configuration
  *         parameters, negative error code on failure.
@@ -1025,3 +3226,76 @@ _c_public_ int n_acd_pop_event(NAcd *acd, NAcdEvent **eventp) {
 _c_public_ int n_acd_probe(NAcd *acd, NAcdProbe **probep, NAcdProbeConfig *config) {
         return n_acd_probe_new(probep, acd, config);
 }
+
+/**
+ * n_acd_add_interface() - add interface to a multi-interface context
+ * @acd:                        context object to operate on
+ * @ifindex:                    interface index to add
+ * @mac:                        hardware address of the interface
+ * @n_mac:                      length of the hardware address
+ *
+ * This adds the network interface @ifindex with the hardware address @mac to
+ * the multi-interface context @acd. Probes can then be started on the
+ * interface by selecting it via n_acd_probe_config_set_ifindex(). The packet
+ * socket of @acd is shared by all its interfaces, hence adding an interface
+ * creates no kernel resources other than an entry in the packet filter.
+ *
+ * Return: 0 on success, N_ACD_E_INVALID_ARGUMENT if @acd is not a
+ *         multi-interface context, if the interface was already added, or if
+ *         the hardware address is invalid, negative error code on failure.
+ */
+_c_public_ int n_acd_add_interface(NAcd *acd, int ifindex, const uint8_t *mac, size_t n_mac) {
+        NAcdInterface *interface;
+        int r;
+
+        if (!acd->multi_interface ||
+            ifindex <= 0 ||
+            n_mac != ETH_ALEN ||
+            !memcmp(mac, (uint8_t[ETH_ALEN]){ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }, ETH_ALEN) ||
+            n_acd_find_interface(acd, ifindex))
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        r = n_acd_interface_new(acd, ifindex, mac);
+        if (r)
+                return r;
+
+        if (acd->filter) {
+                r = n_acd_filter_add_mac(acd->filter, ifindex, mac);
+                if (r) {
+                        interface = n_acd_find_interface(acd, ifindex);
+                        n_acd_interface_free(acd, interface);
+                        return r;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * n_acd_remove_interface() - remove interface from a multi-interface context
+ * @acd:                        context object to operate on
+ * @ifindex:                    interface index to remove
+ *
+ * This removes the network interface @ifindex from the multi-interface
+ * context @acd. All probes on the interface must have been freed before.
+ *
+ * Return: 0 on success, N_ACD_E_INVALID_ARGUMENT if @acd is not a
+ *         multi-interface context, if the interface is unknown, or if it is
+ *         still used by a probe.
+ */
+_c_public_ int n_acd_remove_interface(NAcd *acd, int ifindex) {
+        NAcdInterface *interface;
+
+        if (!acd->multi_interface)
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        interface = n_acd_find_interface(acd, ifindex);
+        if (!interface || interface->n_probes)
+                return N_ACD_E_INVALID_ARGUMENT;
+
+        if (acd->filter)
+                n_acd_filter_remove_mac(acd->filter, ifindex);
+
+        n_acd_interface_free(acd, interface);
+        return 0;
+}
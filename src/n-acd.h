@@ -20,10 +20,50 @@ extern "C" {
 typedef struct NAcd NAcd;
 typedef struct NAcdConfig NAcdConfig;
 typedef struct NAcdEvent NAcdEvent;
+typedef struct NAcdExecutor NAcdExecutor;
+typedef struct NAcdFanout NAcdFanout;
+typedef struct NAcdFilter NAcdFilter;
 typedef struct NAcdProbe NAcdProbe;
 typedef struct NAcdProbeConfig NAcdProbeConfig;
+typedef struct NAcdTiming NAcdTiming;
+
+typedef void (*NAcdExecutorFn) (NAcd *acd, int r, void *userdata);
 
 #define N_ACD_TIMEOUT_RFC5227 (UINT64_C(9000))
+#define N_ACD_TIMEOUT_ADAPTIVE (UINT64_MAX)
+
+/* the constants of RFC-5227 section 1.1, see n_acd_probe_config_set_timing() */
+#define N_ACD_TIMING_RFC5227 {                                                  \
+                .n_probes = 3,                                                  \
+                .probe_wait_nsecs = UINT64_C(1000000000),                       \
+                .probe_min_nsecs = UINT64_C(1000000000),                        \
+                .probe_max_nsecs = UINT64_C(2000000000),                        \
+                .announce_wait_nsecs = UINT64_C(2000000000),                    \
+                .n_announces = 2,                                               \
+                .announce_interval_nsecs = UINT64_C(2000000000),                \
+        }
+
+/* switched LANs and Wi-Fi, round-trip times of a few milliseconds */
+#define N_ACD_TIMING_FAST_LAN {                                                 \
+                .n_probes = 3,                                                  \
+                .probe_wait_nsecs = UINT64_C(10000000),                         \
+                .probe_min_nsecs = UINT64_C(10000000),                          \
+                .probe_max_nsecs = UINT64_C(30000000),                          \
+                .announce_wait_nsecs = UINT64_C(20000000),                      \
+                .n_announces = 3,                                               \
+                .announce_interval_nsecs = UINT64_C(20000000),                  \
+        }
+
+/* datacenter fabrics, round-trip times well below a millisecond */
+#define N_ACD_TIMING_DATACENTER {                                               \
+                .n_probes = 2,                                                  \
+                .probe_wait_nsecs = UINT64_C(500000),                           \
+                .probe_min_nsecs = UINT64_C(500000),                            \
+                .probe_max_nsecs = UINT64_C(1000000),                           \
+                .announce_wait_nsecs = UINT64_C(1000000),                       \
+                .n_announces = 2,                                               \
+                .announce_interval_nsecs = UINT64_C(1000000),                   \
+        }
 
 enum {
         _N_ACD_E_SUCCESS,
@@ -39,12 +79,23 @@ enum {
         _N_ACD_TRANSPORT_N,
 };
 
+enum {
+        N_ACD_XDP_NONE,
+        N_ACD_XDP_GENERIC,
+        N_ACD_XDP_NATIVE,
+        _N_ACD_XDP_N,
+};
+
 enum {
         N_ACD_EVENT_READY,
         N_ACD_EVENT_USED,
         N_ACD_EVENT_DEFENDED,
         N_ACD_EVENT_CONFLICT,
         N_ACD_EVENT_DOWN,
+        N_ACD_EVENT_OVERRUN,
+        N_ACD_EVENT_THROTTLED,
+        N_ACD_EVENT_TENTATIVE,
+        N_ACD_EVENT_FAILED,
         _N_ACD_EVENT_N,
 };
 
@@ -55,18 +106,40 @@ enum {
         _N_ACD_DEFEND_N,
 };
 
+struct NAcdTiming {
+        unsigned int n_probes;
+        uint64_t probe_wait_nsecs;
+        uint64_t probe_min_nsecs;
+        uint64_t probe_max_nsecs;
+        uint64_t announce_wait_nsecs;
+        unsigned int n_announces;
+        uint64_t announce_interval_nsecs;
+};
+
 struct NAcdEvent {
         unsigned int event;
         union {
                 struct {
                         NAcdProbe *probe;
-                } ready;
+                } ready, tentative;
                 struct {
+                        int ifindex;
                 } down;
+                struct {
+                        uint64_t n_dropped;
+                } overrun;
+                struct {
+                        uint64_t n_conflicts;
+                } throttled;
+                struct {
+                        NAcdProbe *probe;
+                        int error;
+                } failed;
                 struct {
                         NAcdProbe *probe;
                         uint8_t *sender;
                         size_t n_sender;
+                        uint64_t timestamp;
                 } used, defended, conflict;
         };
 };
@@ -79,12 +152,54 @@ NAcdConfig *n_acd_config_free(NAcdConfig *config);
 void n_acd_config_set_ifindex(NAcdConfig *config, int ifindex);
 void n_acd_config_set_transport(NAcdConfig *config, unsigned int transport);
 void n_acd_config_set_mac(NAcdConfig *config, const uint8_t *mac, size_t n_mac);
+void n_acd_config_set_filter(NAcdConfig *config, NAcdFilter *filter);
+void n_acd_config_set_lazy(NAcdConfig *config, bool lazy);
+void n_acd_config_set_xdp(NAcdConfig *config, unsigned int xdp);
+void n_acd_config_set_xdp_socket(NAcdConfig *config, bool xdp_socket);
+void n_acd_config_set_multi_interface(NAcdConfig *config, bool multi_interface);
+void n_acd_config_set_busy_poll(NAcdConfig *config, unsigned int usecs);
+void n_acd_config_set_rcvbuf(NAcdConfig *config, unsigned int bytes);
+void n_acd_config_set_remember(NAcdConfig *config, uint64_t msecs);
+void n_acd_config_set_observe(NAcdConfig *config, unsigned int sample, uint64_t msecs);
+void n_acd_config_set_rate_limit(NAcdConfig *config, uint64_t msecs);
+void n_acd_config_set_adaptive_timeout(NAcdConfig *config, uint64_t min_msecs, uint64_t max_msecs);
+void n_acd_config_set_pacing(NAcdConfig *config, uint64_t rate, unsigned int burst);
+void n_acd_config_set_retry(NAcdConfig *config, unsigned int n_frames);
+void n_acd_config_set_refresh(NAcdConfig *config, uint64_t msecs);
+void n_acd_config_set_fanout(NAcdConfig *config, NAcdFanout *fanout, unsigned int shard);
 
 int n_acd_probe_config_new(NAcdProbeConfig **configp);
 NAcdProbeConfig *n_acd_probe_config_free(NAcdProbeConfig *config);
 
+void n_acd_probe_config_set_ifindex(NAcdProbeConfig *config, int ifindex);
 void n_acd_probe_config_set_ip(NAcdProbeConfig *config, struct in_addr ip);
 void n_acd_probe_config_set_timeout(NAcdProbeConfig *config, uint64_t msecs);
+void n_acd_probe_config_set_timing(NAcdProbeConfig *config, const NAcdTiming *timing);
+void n_acd_probe_config_set_refresh(NAcdProbeConfig *config, bool refresh);
+void n_acd_probe_config_set_auto_announce(NAcdProbeConfig *config, bool announce, unsigned int defend);
+void n_acd_probe_config_set_tentative(NAcdProbeConfig *config, bool tentative);
+
+/* shared filters */
+
+int n_acd_filter_new(NAcdFilter **filterp, const char *pin_path);
+NAcdFilter *n_acd_filter_ref(NAcdFilter *filter);
+NAcdFilter *n_acd_filter_unref(NAcdFilter *filter);
+
+/* fanouts */
+
+int n_acd_fanout_new(NAcdFanout **fanoutp, int ifindex, unsigned int n_shards);
+NAcdFanout *n_acd_fanout_ref(NAcdFanout *fanout);
+NAcdFanout *n_acd_fanout_unref(NAcdFanout *fanout);
+
+unsigned int n_acd_fanout_get_shard(NAcdFanout *fanout, struct in_addr ip);
+
+/* executors */
+
+int n_acd_executor_new(NAcdExecutor **executorp, unsigned int n_threads);
+NAcdExecutor *n_acd_executor_free(NAcdExecutor *executor);
+
+int n_acd_executor_add(NAcdExecutor *executor, NAcd *acd, NAcdExecutorFn fn, void *userdata);
+void n_acd_executor_remove(NAcdExecutor *executor, NAcd *acd);
 
 /* contexts */
 
@@ -94,9 +209,20 @@ NAcd *n_acd_unref(NAcd *acd);
 
 void n_acd_get_fd(NAcd *acd, int *fdp);
 int n_acd_dispatch(NAcd *acd);
+int n_acd_dispatch_spin(NAcd *acd, uint64_t usecs);
 int n_acd_pop_event(NAcd *acd, NAcdEvent **eventp);
+void n_acd_get_queue_delay(NAcd *acd, uint64_t *n_packetsp, uint64_t *total_nsecsp, uint64_t *max_nsecsp);
+void n_acd_get_throttle(NAcd *acd, bool *activep, uint64_t *n_conflictsp, uint64_t *n_throttledp);
+void n_acd_get_rtt(NAcd *acd, uint64_t *n_samplesp, uint64_t *srtt_nsecsp, uint64_t *rttvar_nsecsp);
+int n_acd_get_observation(NAcd *acd, int ifindex, struct in_addr ip, bool *observedp, uint64_t *n_conflictsp);
+void n_acd_get_pacing(NAcd *acd, uint64_t *n_queuedp, uint64_t *max_queuedp, uint64_t *n_delayedp, uint64_t *total_nsecsp, uint64_t *max_nsecsp);
+void n_acd_get_refresh(NAcd *acd, uint64_t *n_addressesp, uint64_t *n_sentp, uint64_t *n_droppedp);
 
 int n_acd_probe(NAcd *acd, NAcdProbe **probep, NAcdProbeConfig *config);
+int n_acd_submit_probe(NAcd *acd, NAcdProbe **probep, NAcdProbeConfig *config, void *userdata);
+
+int n_acd_add_interface(NAcd *acd, int ifindex, const uint8_t *mac, size_t n_mac);
+int n_acd_remove_interface(NAcd *acd, int ifindex);
 
 /* probes */
 
@@ -107,6 +233,9 @@ void n_acd_probe_get_userdata(NAcdProbe *probe, void **userdatap);
 
 int n_acd_probe_announce(NAcdProbe *probe, unsigned int defend);
 
+NAcdProbe *n_acd_submit_probe_free(NAcdProbe *probe);
+int n_acd_submit_probe_announce(NAcdProbe *probe, unsigned int defend);
+
 /* inline helpers */
 
 static inline void n_acd_config_freep(NAcdConfig **config) {
@@ -127,6 +256,33 @@ static inline void n_acd_probe_config_freev(NAcdProbeConfig *config) {
         n_acd_probe_config_free(config);
 }
 
+static inline void n_acd_filter_unrefp(NAcdFilter **filter) {
+        if (*filter)
+                n_acd_filter_unref(*filter);
+}
+
+static inline void n_acd_filter_unrefv(NAcdFilter *filter) {
+        n_acd_filter_unref(filter);
+}
+
+static inline void n_acd_fanout_unrefp(NAcdFanout **fanout) {
+        if (*fanout)
+                n_acd_fanout_unref(*fanout);
+}
+
+static inline void n_acd_fanout_unrefv(NAcdFanout *fanout) {
+        n_acd_fanout_unref(fanout);
+}
+
+static inline void n_acd_executor_freep(NAcdExecutor **executor) {
+        if (*executor)
+                n_acd_executor_free(*executor);
+}
+
+static inline void n_acd_executor_freev(NAcdExecutor *executor) {
+        n_acd_executor_free(executor);
+}
+
 static inline void n_acd_unrefp(NAcd **acd) {
         if (*acd)
                 n_acd_unref(*acd);
@@ -0,0 +1,243 @@
+/*
+ * Test adaptive probe timeouts
+ *
+ * Run a context on one end of a veth link, and probe an address configured on
+ * the other end, so the kernel answers the probe. Each answer must yield a
+ * sample of the round-trip time, but adaptive probes must stick to the upper
+ * bound until enough samples were taken. A following adaptive probe must then
+ * be much faster than the configured upper bound, but not faster than the
+ * lower bound.
+ *
+ * Then announce an address, and let the other end probe it and defend it from
+ * another host. This must yield a sample, too, unless the defense comes from
+ * the prober itself.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <linux/if_packet.h>
+#include <netinet/if_ether.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+#define TEST_ADAPTIVE_MIN (20)
+#define TEST_ADAPTIVE_MAX (2000)
+
+typedef struct TestAdaptiveFrame {
+        struct ether_header eth;
+        struct ether_arp arp;
+} _c_packed_ TestAdaptiveFrame;
+
+static void test_adaptive_send(int fd, const uint8_t *mac, const struct in_addr *spa, struct in_addr tpa) {
+        TestAdaptiveFrame frame;
+        int r;
+
+        frame = (TestAdaptiveFrame){
+                .eth = {
+                        .ether_dhost = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+                        .ether_type = htobe16(ETHERTYPE_ARP),
+                },
+                .arp = {
+                        .ea_hdr = {
+                                .ar_hrd = htobe16(ARPHRD_ETHER),
+                                .ar_pro = htobe16(ETHERTYPE_IP),
+                                .ar_hln = ETH_ALEN,
+                                .ar_pln = sizeof(struct in_addr),
+                                .ar_op = htobe16(ARPOP_REQUEST),
+                        },
+                },
+        };
+        memcpy(frame.eth.ether_shost, mac, ETH_ALEN);
+        memcpy(frame.arp.arp_sha, mac, ETH_ALEN);
+        if (spa)
+                memcpy(frame.arp.arp_spa, spa, sizeof(*spa));
+        memcpy(frame.arp.arp_tpa, &tpa, sizeof(tpa));
+
+        r = send(fd, &frame, sizeof(frame), 0);
+        c_assert(r == (ssize_t)sizeof(frame));
+}
+
+static void test_adaptive_exchange(int ifindex, const uint8_t *prober, const uint8_t *defender, struct in_addr ip) {
+        int r, fd;
+
+        fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htobe16(ETH_P_ARP));
+        c_assert(fd >= 0);
+
+        r = bind(fd,
+                 (struct sockaddr *)&(struct sockaddr_ll){
+                        .sll_family = AF_PACKET,
+                        .sll_protocol = htobe16(ETH_P_ARP),
+                        .sll_ifindex = ifindex,
+                 },
+                 sizeof(struct sockaddr_ll));
+        c_assert(!r);
+
+        /* a probe, right away followed by a defense */
+        test_adaptive_send(fd, prober, NULL, ip);
+        test_adaptive_send(fd, defender, &ip, ip);
+
+        close(fd);
+}
+
+static uint64_t test_adaptive_probe(NAcd *acd, struct in_addr ip, unsigned int expected) {
+        NAcdProbeConfig *probe_config;
+        NAcdProbe *probe;
+        NAcdEvent *event;
+        uint64_t ts;
+        int r;
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, N_ACD_TIMEOUT_ADAPTIVE);
+
+        ts = test_now();
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        event = test_wait_event(acd);
+
+        ts = test_now() - ts;
+
+        c_assert(event->event == expected);
+        n_acd_probe_free(probe);
+
+        return ts;
+}
+
+static NAcd *test_adaptive_new(int ifindex, struct ether_addr *mac) {
+        NAcdConfig *config;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+
+        /* the lower bound must not exceed the upper one */
+        n_acd_config_set_adaptive_timeout(config, TEST_ADAPTIVE_MAX + 1, TEST_ADAPTIVE_MAX);
+        r = n_acd_new(&acd, config);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        n_acd_config_set_adaptive_timeout(config, TEST_ADAPTIVE_MIN, TEST_ADAPTIVE_MAX);
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        return acd;
+}
+
+static void test_adaptive(int ifindex, struct ether_addr *mac) {
+        struct in_addr ip1 = { htobe32((10 << 24) | (9 << 8) | 1) };
+        struct in_addr ip2 = { htobe32((10 << 24) | (9 << 8) | 2) };
+        /* the shortest full sequence: two PROBE_MIN and the ANNOUNCE_WAIT */
+        uint64_t full = 2 * N_ACD_RFC_PROBE_MIN_NSEC + N_ACD_RFC_ANNOUNCE_WAIT_NSEC;
+        uint64_t n_samples, srtt, rttvar, ts;
+        NAcd *acd;
+
+        acd = test_adaptive_new(ifindex, mac);
+
+        n_acd_get_rtt(acd, &n_samples, &srtt, &rttvar);
+        c_assert(!n_samples);
+
+        /* the peer answers each probe, which yields a sample each */
+        test_add_child_ip(&ip1);
+        for (unsigned int i = 0; i < N_ACD_ADAPTIVE_SAMPLES; ++i) {
+                /* a few fast answers must not lower the timeout, yet */
+                c_assert(n_acd_rtt_timeout(acd) == TEST_ADAPTIVE_MAX);
+
+                test_adaptive_probe(acd, ip1, N_ACD_EVENT_USED);
+
+                n_acd_get_rtt(acd, &n_samples, &srtt, &rttvar);
+                c_assert(n_samples == i + 1);
+        }
+        test_del_child_ip(&ip1);
+
+        c_assert(srtt > 0 && srtt < TEST_ADAPTIVE_MIN * UINT64_C(1000000));
+
+        /* the round-trip time on veth is tiny, so the lower bound applies */
+        c_assert(n_acd_rtt_timeout(acd) == TEST_ADAPTIVE_MIN);
+        ts = test_adaptive_probe(acd, ip2, N_ACD_EVENT_READY);
+        c_assert(ts >= TEST_ADAPTIVE_MIN * full);
+        c_assert(ts < TEST_ADAPTIVE_MAX * full);
+
+        n_acd_unref(acd);
+}
+
+static void test_adaptive_defense(int ifindex1, struct ether_addr *mac1, int ifindex2) {
+        struct in_addr ip = { htobe32((10 << 24) | (9 << 8) | 3) };
+        uint8_t prober[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 0x01 };
+        uint8_t defender[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 0x02 };
+        uint64_t n_samples, srtt, rttvar;
+        NAcdProbeConfig *probe_config;
+        NAcdProbe *probe;
+        NAcdEvent *event;
+        NAcd *acd;
+        int r;
+
+        acd = test_adaptive_new(ifindex1, mac1);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, TEST_ADAPTIVE_MIN);
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        event = test_wait_event(acd);
+        c_assert(event->event == N_ACD_EVENT_READY);
+
+        r = n_acd_probe_announce(probe, N_ACD_DEFEND_ALWAYS);
+        c_assert(!r);
+
+        /* a prober claiming the address itself did not answer anything */
+        test_adaptive_exchange(ifindex2, prober, prober, ip);
+
+        event = test_wait_event(acd);
+        c_assert(event->event == N_ACD_EVENT_DEFENDED);
+
+        n_acd_get_rtt(acd, &n_samples, &srtt, &rttvar);
+        c_assert(!n_samples);
+
+        /* but a defense by another host answered the probe */
+        test_adaptive_exchange(ifindex2, prober, defender, ip);
+
+        event = test_wait_event(acd);
+        c_assert(event->event == N_ACD_EVENT_DEFENDED);
+
+        n_acd_get_rtt(acd, &n_samples, &srtt, &rttvar);
+        c_assert(n_samples == 1);
+        c_assert(srtt > 0 && srtt < TEST_ADAPTIVE_MIN * N_ACD_RFC_PROBE_MIN_NSEC);
+
+        n_acd_probe_free(probe);
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_adaptive(ifindex1, &mac1);
+        test_adaptive_defense(ifindex1, &mac1, ifindex2);
+
+        return 0;
+}
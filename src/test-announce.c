@@ -0,0 +1,178 @@
+/*
+ * Test automatic announcements
+ *
+ * Run a context on one end of a veth link, and probe an address that is
+ * announced automatically. By the time the probe reports it is ready, it must
+ * be announcing with the configured defense policy, and its first announcement
+ * must have been sent in the same dispatch, as seen from the other end of the
+ * link. An invalid defense policy must be refused, and so must announcing a
+ * probe that announces automatically, or that failed. Other probes may be
+ * announced again.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <linux/if_packet.h>
+#include <netinet/if_ether.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+static int test_announce_capture(int ifindex) {
+        int r, fd;
+
+        fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, htobe16(ETH_P_ARP));
+        c_assert(fd >= 0);
+
+        r = bind(fd,
+                 (struct sockaddr *)&(struct sockaddr_ll){
+                        .sll_family = AF_PACKET,
+                        .sll_protocol = htobe16(ETH_P_ARP),
+                        .sll_ifindex = ifindex,
+                 },
+                 sizeof(struct sockaddr_ll));
+        c_assert(!r);
+
+        return fd;
+}
+
+static void test_announce(int ifindex1, struct ether_addr *mac1, int ifindex2) {
+        struct in_addr ip = { htobe32((10 << 24) | (13 << 8) | 1) };
+        NAcdTiming timing = N_ACD_TIMING_FAST_LAN;
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        NAcdEvent *event = NULL;
+        NAcdProbe *probe;
+        struct ether_arp arp;
+        NAcd *acd;
+        int r, fd, fd_capture;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex1);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac1->ether_addr_octet, sizeof(mac1->ether_addr_octet));
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timing(probe_config, &timing);
+
+        /* invalid policies are refused */
+        n_acd_probe_config_set_auto_announce(probe_config, true, _N_ACD_DEFEND_N);
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        n_acd_probe_config_set_auto_announce(probe_config, true, N_ACD_DEFEND_ALWAYS);
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        fd_capture = test_announce_capture(ifindex2);
+        n_acd_get_fd(acd, &fd);
+
+        while (!event) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+                r = poll(&pfd, 1, -1);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+
+                r = n_acd_pop_event(acd, &event);
+                c_assert(!r);
+        }
+
+        c_assert(event->event == N_ACD_EVENT_READY);
+        c_assert(probe->state == N_ACD_PROBE_STATE_ANNOUNCING);
+        c_assert(probe->defend == N_ACD_DEFEND_ALWAYS);
+
+        /* it announces on its own, so announcing it again is refused */
+        r = n_acd_probe_announce(probe, N_ACD_DEFEND_NEVER);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+        c_assert(probe->defend == N_ACD_DEFEND_ALWAYS);
+
+        /* without dispatching again, the announcement must show up */
+        for (;;) {
+                struct pollfd pfd = { .fd = fd_capture, .events = POLLIN };
+
+                r = poll(&pfd, 1, timing.announce_interval_nsecs / UINT64_C(2000000));
+                c_assert(r == 1);
+
+                r = recv(fd_capture, &arp, sizeof(arp), 0);
+                c_assert(r == sizeof(arp));
+
+                if (!memcmp(arp.arp_spa, &ip, sizeof(ip)))
+                        break;
+
+                /* skip the probes */
+                c_assert(!memcmp(arp.arp_spa, (uint8_t[4]){ }, sizeof(arp.arp_spa)));
+        }
+
+        close(fd_capture);
+        n_acd_probe_free(probe);
+
+        /* a manual probe may be announced again, with another policy */
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timing(probe_config, &timing);
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        event = test_wait_event(acd);
+        c_assert(event->event == N_ACD_EVENT_READY);
+
+        r = n_acd_probe_announce(probe, N_ACD_DEFEND_NEVER);
+        c_assert(!r);
+        r = n_acd_probe_announce(probe, N_ACD_DEFEND_ONCE);
+        c_assert(!r);
+        c_assert(probe->defend == N_ACD_DEFEND_ONCE);
+
+        n_acd_probe_free(probe);
+
+        /* but a failed one may not */
+        test_add_child_ip(&ip);
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        event = test_wait_event(acd);
+        c_assert(event->event == N_ACD_EVENT_USED);
+
+        r = n_acd_probe_announce(probe, N_ACD_DEFEND_NEVER);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        test_del_child_ip(&ip);
+
+        n_acd_probe_free(probe);
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_announce(ifindex1, &mac1, ifindex2);
+
+        return 0;
+}
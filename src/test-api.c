@@ -19,11 +19,20 @@ static void test_api_constants(void) {
         assert(1 + N_ACD_TRANSPORT_ETHERNET);
         assert(1 + _N_ACD_TRANSPORT_N);
 
+        assert(1 + N_ACD_XDP_NONE);
+        assert(1 + N_ACD_XDP_GENERIC);
+        assert(1 + N_ACD_XDP_NATIVE);
+        assert(1 + _N_ACD_XDP_N);
+
         assert(1 + N_ACD_EVENT_READY);
         assert(1 + N_ACD_EVENT_USED);
         assert(1 + N_ACD_EVENT_DEFENDED);
         assert(1 + N_ACD_EVENT_CONFLICT);
         assert(1 + N_ACD_EVENT_DOWN);
+        assert(1 + N_ACD_EVENT_OVERRUN);
+        assert(1 + N_ACD_EVENT_THROTTLED);
+        assert(1 + N_ACD_EVENT_TENTATIVE);
+        assert(1 + N_ACD_EVENT_FAILED);
         assert(1 + _N_ACD_EVENT_N);
 
         assert(1 + N_ACD_DEFEND_NEVER);
@@ -35,6 +44,10 @@ static void test_api_constants(void) {
 static void test_api_types(void) {
         assert(sizeof(NAcdEvent*));
         assert(sizeof(NAcdConfig*));
+        assert(sizeof(NAcdExecutor*));
+        assert(sizeof(NAcdExecutorFn));
+        assert(sizeof(NAcdFanout*));
+        assert(sizeof(NAcdFilter*));
         assert(sizeof(NAcdProbeConfig*));
         assert(sizeof(NAcd*));
         assert(sizeof(NAcdProbe*));
@@ -47,28 +60,80 @@ static void test_api_functions(void) {
                 (void *)n_acd_config_set_ifindex,
                 (void *)n_acd_config_set_transport,
                 (void *)n_acd_config_set_mac,
+                (void *)n_acd_config_set_filter,
+                (void *)n_acd_config_set_lazy,
+                (void *)n_acd_config_set_xdp,
+                (void *)n_acd_config_set_xdp_socket,
+                (void *)n_acd_config_set_multi_interface,
+                (void *)n_acd_config_set_fanout,
+                (void *)n_acd_config_set_busy_poll,
+                (void *)n_acd_config_set_rcvbuf,
+                (void *)n_acd_config_set_remember,
+                (void *)n_acd_config_set_observe,
+                (void *)n_acd_config_set_rate_limit,
+                (void *)n_acd_config_set_adaptive_timeout,
+                (void *)n_acd_config_set_pacing,
+                (void *)n_acd_config_set_retry,
+                (void *)n_acd_config_set_refresh,
                 (void *)n_acd_probe_config_new,
                 (void *)n_acd_probe_config_free,
+                (void *)n_acd_probe_config_set_ifindex,
                 (void *)n_acd_probe_config_set_ip,
                 (void *)n_acd_probe_config_set_timeout,
+                (void *)n_acd_probe_config_set_timing,
+                (void *)n_acd_probe_config_set_refresh,
+                (void *)n_acd_probe_config_set_auto_announce,
+                (void *)n_acd_probe_config_set_tentative,
+
+                (void *)n_acd_filter_new,
+                (void *)n_acd_filter_ref,
+                (void *)n_acd_filter_unref,
+
+                (void *)n_acd_fanout_new,
+                (void *)n_acd_fanout_ref,
+                (void *)n_acd_fanout_unref,
+                (void *)n_acd_fanout_get_shard,
+
+                (void *)n_acd_executor_new,
+                (void *)n_acd_executor_free,
+                (void *)n_acd_executor_add,
+                (void *)n_acd_executor_remove,
 
                 (void *)n_acd_new,
                 (void *)n_acd_ref,
                 (void *)n_acd_unref,
                 (void *)n_acd_get_fd,
                 (void *)n_acd_dispatch,
+                (void *)n_acd_dispatch_spin,
                 (void *)n_acd_pop_event,
+                (void *)n_acd_get_queue_delay,
+                (void *)n_acd_get_throttle,
+                (void *)n_acd_get_rtt,
+                (void *)n_acd_get_observation,
+                (void *)n_acd_get_pacing,
+                (void *)n_acd_get_refresh,
                 (void *)n_acd_probe,
+                (void *)n_acd_submit_probe,
+                (void *)n_acd_add_interface,
+                (void *)n_acd_remove_interface,
 
                 (void *)n_acd_probe_free,
                 (void *)n_acd_probe_set_userdata,
                 (void *)n_acd_probe_get_userdata,
                 (void *)n_acd_probe_announce,
+                (void *)n_acd_submit_probe_free,
+                (void *)n_acd_submit_probe_announce,
 
                 (void *)n_acd_config_freep,
                 (void *)n_acd_config_freev,
                 (void *)n_acd_probe_config_freep,
                 (void *)n_acd_probe_config_freev,
+                (void *)n_acd_filter_unrefp,
+                (void *)n_acd_filter_unrefv,
+                (void *)n_acd_fanout_unrefp,
+                (void *)n_acd_fanout_unrefv,
+                (void *)n_acd_executor_freep,
+                (void *)n_acd_executor_freev,
                 (void *)n_acd_unrefp,
                 (void *)n_acd_unrefv,
                 (void *)n_acd_probe_freep,
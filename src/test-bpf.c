@@ -13,7 +13,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/mount.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include "n-acd.h"
 #include "n-acd-private.h"
@@ -92,7 +94,7 @@ static void verify_failure(struct ether_arp *packet, int out_fd, int in_fd) {
         c_assert(errno == EAGAIN);
 }
 
-static void test_filter(void) {
+static void test_filter(int (*compile)(int *, int, struct ether_addr *)) {
         uint8_t buf[sizeof(struct ether_arp) + 1] = {};
         struct ether_addr mac1 = { { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 } };
         struct ether_addr mac2 = { { 0x01, 0x02, 0x03, 0x04, 0x05, 0x07 } };
@@ -105,7 +107,7 @@ static void test_filter(void) {
         r = n_acd_bpf_map_create(&mapfd, 1);
         c_assert(r >= 0);
 
-        r = n_acd_bpf_compile(&progfd, mapfd, &mac1);
+        r = compile(&progfd, mapfd, &mac1);
         c_assert(r >= 0);
         c_assert(progfd >= 0);
 
@@ -216,11 +218,419 @@ static void test_filter(void) {
         close(mapfd);
 }
 
+static int test_compile_map(int *progfdp, int mapfd, struct ether_addr *mac) {
+        return n_acd_bpf_compile(progfdp, mapfd, -1, NULL, 0, mac, 0);
+}
+
+static int verify_verdict(uint8_t *packet, size_t n_packet, int out_fd, int in_fd) {
+        uint8_t buf[sizeof(struct ether_arp) + 1];
+        int r;
+
+        r = send(out_fd, packet, n_packet, 0);
+        c_assert(r == (ssize_t)n_packet);
+
+        r = recv(in_fd, buf, sizeof(buf), 0);
+        if (r < 0) {
+                c_assert(errno == EAGAIN);
+                return -1;
+        }
+
+        return r;
+}
+
+static void test_equivalence(void) {
+        /* mac2 has the multicast bit set, testing sign-extension of immediates */
+        struct ether_addr macs[] = {
+                { { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 } },
+                { { 0x81, 0x82, 0x83, 0x84, 0x85, 0x86 } },
+                { { 0x01, 0x02, 0x03, 0x04, 0x05, 0x07 } },
+                { { 0x81, 0x82, 0x83, 0x84, 0x05, 0x06 } },
+        };
+        struct in_addr ips[] = {
+                { 0 },
+                { htobe32((10 << 24) | 1) },
+                { htobe32((10 << 24) | 2) },
+                { htobe32((192 << 24) | (168 << 16) | 1) },
+                { htobe32((10 << 24) | (1 << 16)) },
+                { htobe32((192 << 24) | (168 << 16) | (1 << 8) | 1) },
+        };
+        uint16_t ops[] = { 0, ARPOP_REQUEST, ARPOP_REPLY, ARPOP_RREQUEST, ARPOP_NAK };
+        size_t lengths[] = { sizeof(struct ether_arp) - 1, sizeof(struct ether_arp), sizeof(struct ether_arp) + 1 };
+        struct in_addr watched[] = { ips[1], ips[3] };
+        uint8_t buf[sizeof(struct ether_arp) + 1] = {};
+        struct ether_arp *packet = (struct ether_arp *)buf;
+        int r, mapfd = -1, bloomfd = -1, sharedfd = -1, macfd = -1, progfd[5] = { -1, -1, -1, -1, -1 }, pair[5][2];
+        size_t n_accepted = 0;
+
+        r = n_acd_bpf_map_create(&mapfd, 8);
+        c_assert(r >= 0);
+
+        /* unix sockets have no interface, so the shared filter sees index 0 */
+        r = n_acd_bpf_shared_map_create(&sharedfd, 8);
+        c_assert(r >= 0);
+        r = n_acd_bpf_mac_map_create(&macfd, 8);
+        c_assert(r >= 0);
+
+        /* bloom filters are not supported before linux-5.16 */
+        r = n_acd_bpf_bloom_create(&bloomfd, 8);
+        c_assert(r >= 0 || r == -EINVAL);
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(watched); ++i) {
+                r = n_acd_bpf_map_add(mapfd, &watched[i]);
+                c_assert(r >= 0);
+
+                r = n_acd_bpf_shared_map_ref(sharedfd, 0, &watched[i]);
+                c_assert(r == N_ACD_BPF_E_NEW);
+
+                if (bloomfd >= 0) {
+                        r = n_acd_bpf_bloom_add(bloomfd, &watched[i]);
+                        c_assert(r >= 0);
+                }
+        }
+
+        /* a stale bloom filter entry must not change the verdict */
+        if (bloomfd >= 0) {
+                r = n_acd_bpf_bloom_add(bloomfd, &ips[5]);
+                c_assert(r >= 0);
+        }
+
+        for (size_t own = 0; own < 2; ++own) {
+                r = n_acd_bpf_compile_legacy(&progfd[0], mapfd, &macs[own]);
+                c_assert(r >= 0);
+                r = n_acd_bpf_compile(&progfd[1], mapfd, -1, NULL, 0, &macs[own], 0);
+                c_assert(r >= 0);
+                r = n_acd_bpf_compile(&progfd[2], mapfd, bloomfd, NULL, 0, &macs[own], 0);
+                c_assert(r >= 0);
+                r = n_acd_bpf_compile(&progfd[3], mapfd, -1, watched, C_ARRAY_SIZE(watched), &macs[own], 0);
+                c_assert(r >= 0);
+                r = n_acd_bpf_mac_map_set(macfd, 0, &macs[own]);
+                c_assert(r >= 0);
+                r = n_acd_bpf_compile_shared(&progfd[4], sharedfd, macfd);
+                c_assert(r >= 0);
+
+                for (size_t i = 0; i < C_ARRAY_SIZE(progfd); ++i) {
+                        r = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, pair[i]);
+                        c_assert(r >= 0);
+
+                        r = setsockopt(pair[i][1], SOL_SOCKET, SO_ATTACH_BPF, &progfd[i], sizeof(progfd[i]));
+                        c_assert(r >= 0);
+                }
+
+                /*
+                 * Run the cartesian product of sender hardware address,
+                 * sender and target protocol address, operation, header
+                 * corruption and packet length through all program variants
+                 * and verify they always agree on the verdict.
+                 */
+                for (size_t i_mac = 0; i_mac < C_ARRAY_SIZE(macs); ++i_mac) {
+                        for (size_t i_spa = 0; i_spa < C_ARRAY_SIZE(ips); ++i_spa) {
+                                for (size_t i_tpa = 0; i_tpa < C_ARRAY_SIZE(ips); ++i_tpa) {
+                                        for (size_t i_op = 0; i_op < C_ARRAY_SIZE(ops); ++i_op) {
+                                                for (size_t i_hdr = 0; i_hdr < 5; ++i_hdr) {
+                                                        for (size_t i_len = 0; i_len < C_ARRAY_SIZE(lengths); ++i_len) {
+                                                                int verdict[C_ARRAY_SIZE(progfd)];
+
+                                                                *packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ops[i_op], &macs[i_mac], &ips[i_spa], &ips[i_tpa]);
+                                                                switch (i_hdr) {
+                                                                case 1:
+                                                                        packet->arp_hrd ^= htobe16(0x0100);
+                                                                        break;
+                                                                case 2:
+                                                                        packet->arp_pro ^= htobe16(0x0001);
+                                                                        break;
+                                                                case 3:
+                                                                        packet->arp_hln += 1;
+                                                                        break;
+                                                                case 4:
+                                                                        packet->arp_pln -= 1;
+                                                                        break;
+                                                                }
+
+                                                                for (size_t i = 0; i < C_ARRAY_SIZE(progfd); ++i) {
+                                                                        verdict[i] = verify_verdict(buf, lengths[i_len], pair[i][0], pair[i][1]);
+                                                                        c_assert(verdict[i] == verdict[0]);
+                                                                }
+
+                                                                if (verdict[0] >= 0)
+                                                                        ++n_accepted;
+                                                        }
+                                                }
+                                        }
+                                }
+                        }
+                }
+
+                for (size_t i = 0; i < C_ARRAY_SIZE(progfd); ++i) {
+                        close(pair[i][0]);
+                        close(pair[i][1]);
+                        close(progfd[i]);
+                }
+        }
+
+        /* make sure the test actually covered both verdicts */
+        c_assert(n_accepted > 0);
+
+        if (bloomfd >= 0)
+                close(bloomfd);
+        close(macfd);
+        close(sharedfd);
+        close(mapfd);
+}
+
+static void test_shared(void) {
+        struct ether_addr mac = { { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 } };
+        struct ether_addr mac_peer = { { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 } };
+        struct in_addr ip = { htobe32((10 << 24) | 1) };
+        struct in_addr ip_other = { htobe32((10 << 24) | 2) };
+        struct ether_arp packet = ETHER_ARP_PACKET_INIT(ARPOP_REPLY, &mac_peer, &ip, &ip_other);
+        int r, mapfd, macfd, progfd, pair[2];
+        size_t max_entries;
+
+        r = n_acd_bpf_shared_map_create(&mapfd, 8);
+        c_assert(r >= 0);
+        r = n_acd_bpf_mac_map_create(&macfd, 8);
+        c_assert(r >= 0);
+        r = n_acd_bpf_compile_shared(&progfd, mapfd, macfd);
+        c_assert(r >= 0);
+
+        r = n_acd_bpf_map_get_max_entries(mapfd, &max_entries);
+        c_assert(r >= 0);
+        c_assert(max_entries == 8);
+
+        r = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, pair);
+        c_assert(r >= 0);
+        r = setsockopt(pair[1], SOL_SOCKET, SO_ATTACH_BPF, &progfd, sizeof(progfd));
+        c_assert(r >= 0);
+
+        /* addresses are reference counted per interface */
+        r = n_acd_bpf_shared_map_ref(mapfd, 0, &ip);
+        c_assert(r == N_ACD_BPF_E_NEW);
+        r = n_acd_bpf_shared_map_ref(mapfd, 0, &ip);
+        c_assert(r == 0);
+        r = n_acd_bpf_shared_map_ref(mapfd, 1, &ip);
+        c_assert(r == N_ACD_BPF_E_NEW);
+        r = n_acd_bpf_shared_map_unref(mapfd, 1, &ip);
+        c_assert(r == N_ACD_BPF_E_DELETED);
+
+        /* without a hardware address for the interface, everything is dropped */
+        verify_failure(&packet, pair[0], pair[1]);
+
+        r = n_acd_bpf_mac_map_set(macfd, 0, &mac);
+        c_assert(r >= 0);
+        verify_success(&packet, pair[0], pair[1]);
+
+        r = n_acd_bpf_shared_map_unref(mapfd, 0, &ip);
+        c_assert(r == 0);
+        verify_success(&packet, pair[0], pair[1]);
+
+        r = n_acd_bpf_shared_map_unref(mapfd, 0, &ip);
+        c_assert(r == N_ACD_BPF_E_DELETED);
+        verify_failure(&packet, pair[0], pair[1]);
+
+        /* flushed maps must drop everything again */
+        r = n_acd_bpf_shared_map_ref(mapfd, 0, &ip);
+        c_assert(r == N_ACD_BPF_E_NEW);
+        verify_success(&packet, pair[0], pair[1]);
+        r = n_acd_bpf_map_flush(macfd);
+        c_assert(r >= 0);
+        verify_failure(&packet, pair[0], pair[1]);
+
+        close(pair[1]);
+        close(pair[0]);
+        close(progfd);
+        close(macfd);
+        close(mapfd);
+}
+
+static void test_sample(void) {
+        struct ether_addr mac1 = { { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 } };
+        struct ether_addr mac2 = { { 0x01, 0x02, 0x03, 0x04, 0x05, 0x07 } };
+        struct in_addr ip0 = { 0 };
+        struct in_addr ip1 = { 1 };
+        struct in_addr ip2 = { 2 };
+        struct ether_arp packet;
+        int r, mapfd = -1, progfd = -1, pair[2];
+        size_t n_passed = 0;
+
+        r = n_acd_bpf_map_create(&mapfd, 1);
+        c_assert(r >= 0);
+
+        r = n_acd_bpf_map_add(mapfd, &ip1);
+        c_assert(r >= 0);
+
+        r = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, pair);
+        c_assert(r >= 0);
+
+        /* with a sample rate of 1, all claims pass, but nothing else does */
+        r = n_acd_bpf_compile(&progfd, mapfd, -1, NULL, 0, &mac1, 1);
+        c_assert(r >= 0);
+        c_assert(progfd >= 0);
+
+        r = setsockopt(pair[1], SOL_SOCKET, SO_ATTACH_BPF, &progfd, sizeof(progfd));
+        c_assert(r >= 0);
+
+        packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_REQUEST, &mac2, &ip2, &ip2);
+        verify_success(&packet, pair[0], pair[1]);
+
+        packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_REPLY, &mac2, &ip2, &ip1);
+        verify_success(&packet, pair[0], pair[1]);
+
+        packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_REQUEST, &mac1, &ip2, &ip2);
+        verify_failure(&packet, pair[0], pair[1]);
+
+        packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_NAK, &mac2, &ip2, &ip2);
+        verify_failure(&packet, pair[0], pair[1]);
+
+        packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_REQUEST, &mac2, &ip0, &ip2);
+        verify_failure(&packet, pair[0], pair[1]);
+
+        /* a probe for a watched address still passes */
+        packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_REQUEST, &mac2, &ip0, &ip1);
+        verify_success(&packet, pair[0], pair[1]);
+
+        close(progfd);
+
+        /* with a higher sample rate, only some unrelated claims pass */
+        r = n_acd_bpf_compile(&progfd, mapfd, -1, NULL, 0, &mac1, 4);
+        c_assert(r >= 0);
+        c_assert(progfd >= 0);
+
+        r = setsockopt(pair[1], SOL_SOCKET, SO_ATTACH_BPF, &progfd, sizeof(progfd));
+        c_assert(r >= 0);
+
+        for (size_t i = 0; i < 256; ++i) {
+                packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_REQUEST, &mac2, &ip2, &ip2);
+                if (verify_verdict((uint8_t *)&packet, sizeof(packet), pair[0], pair[1]) >= 0)
+                        ++n_passed;
+
+                /* claims of watched addresses always pass */
+                packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_REQUEST, &mac2, &ip1, &ip2);
+                verify_success(&packet, pair[0], pair[1]);
+        }
+
+        c_assert(n_passed > 0 && n_passed < 256);
+
+        close(progfd);
+
+        /* sampling must not depend on any address being inlined */
+        r = n_acd_bpf_compile(&progfd, mapfd, -1, (struct in_addr[1]){}, 0, &mac1, 1);
+        c_assert(r >= 0);
+        c_assert(progfd >= 0);
+
+        r = setsockopt(pair[1], SOL_SOCKET, SO_ATTACH_BPF, &progfd, sizeof(progfd));
+        c_assert(r >= 0);
+
+        packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_REQUEST, &mac2, &ip2, &ip2);
+        verify_success(&packet, pair[0], pair[1]);
+
+        packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_REQUEST, &mac2, &ip0, &ip1);
+        verify_failure(&packet, pair[0], pair[1]);
+
+        close(pair[0]);
+        close(pair[1]);
+        close(progfd);
+        close(mapfd);
+}
+
+static void test_empty(void) {
+        struct ether_addr mac1 = { { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 } };
+        struct ether_addr mac2 = { { 0x01, 0x02, 0x03, 0x04, 0x05, 0x07 } };
+        struct in_addr ip0 = { 0 };
+        struct in_addr ip1 = { 1 };
+        struct ether_arp packet;
+        int r, mapfd = -1, progfd = -1, pair[2];
+        bool supported;
+
+        r = n_acd_bpf_probe_load_bytes(&supported);
+        c_assert(!r);
+        if (!supported) {
+                fprintf(stderr, "No bpf_skb_load_bytes(), skipping inline tests\n");
+                return;
+        }
+
+        r = n_acd_bpf_map_create(&mapfd, 1);
+        c_assert(r >= 0);
+
+        /* the map is only consulted if the legacy program was loaded */
+        r = n_acd_bpf_map_add(mapfd, &ip1);
+        c_assert(r >= 0);
+
+        r = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, pair);
+        c_assert(r >= 0);
+
+        /* an empty context compiles an inline program without any address */
+        r = n_acd_bpf_compile(&progfd, mapfd, -1, (struct in_addr[1]){}, 0, &mac1, 0);
+        c_assert(r >= 0);
+        c_assert(progfd >= 0);
+
+        r = setsockopt(pair[1], SOL_SOCKET, SO_ATTACH_BPF, &progfd, sizeof(progfd));
+        c_assert(r >= 0);
+
+        packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_REQUEST, &mac2, &ip0, &ip1);
+        verify_failure(&packet, pair[0], pair[1]);
+
+        packet = (struct ether_arp)ETHER_ARP_PACKET_INIT(ARPOP_REPLY, &mac2, &ip1, &ip1);
+        verify_failure(&packet, pair[0], pair[1]);
+
+        close(pair[0]);
+        close(pair[1]);
+        close(progfd);
+        close(mapfd);
+}
+
+static void test_pin(void) {
+        char dir[] = "/tmp/n-acd-test-XXXXXX", *path;
+        NAcdFilter *filter;
+        struct stat st[2];
+        int r;
+
+        c_assert(mkdtemp(dir));
+
+        r = mount("bpf", dir, "bpf", 0, NULL);
+        if (r < 0) {
+                /* bpffs cannot be mounted in unprivileged user namespaces */
+                c_assert(errno == EPERM);
+                fprintf(stderr, "Cannot mount bpffs, skipping pin tests\n");
+                rmdir(dir);
+                return;
+        }
+
+        r = asprintf(&path, "%s/prog", dir);
+        c_assert(r >= 0);
+
+        r = n_acd_filter_new(&filter, dir);
+        c_assert(!r);
+        r = stat(path, &st[0]);
+        c_assert(!r);
+        n_acd_filter_unref(filter);
+
+        /* a second filter must re-use the pinned program */
+        r = n_acd_filter_new(&filter, dir);
+        c_assert(!r);
+        c_assert(filter->fd_bpf_prog >= 0);
+        c_assert(filter->max_bpf_map > 0);
+        r = stat(path, &st[1]);
+        c_assert(!r);
+        c_assert(st[0].st_ino == st[1].st_ino);
+        n_acd_filter_unref(filter);
+
+        free(path);
+        r = umount(dir);
+        c_assert(!r);
+        rmdir(dir);
+}
+
 int main(int argc, char **argv) {
         test_setup();
 
         test_map();
-        test_filter();
+        test_filter(test_compile_map);
+        test_filter(n_acd_bpf_compile_legacy);
+        test_equivalence();
+        test_empty();
+        test_shared();
+        test_sample();
+        test_pin();
 
         return 0;
 }
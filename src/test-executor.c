@@ -0,0 +1,209 @@
+/*
+ * Test dispatching contexts on an executor
+ *
+ * Run N contexts on one end of a veth link, each probing for its own address,
+ * and preconfigure every other address on the other end of the link. All
+ * contexts are dispatched by an executor with fewer workers than contexts.
+ * Each probe must see the answer for its own address, and no context must
+ * ever be dispatched on two workers at once.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include "n-acd.h"
+#include "test.h"
+
+#define TEST_EXECUTOR_N_THREADS (4)
+#define TEST_EXECUTOR_N_CONTEXTS (32)
+
+typedef struct TestExecutorContext {
+        NAcdExecutor *executor;
+        NAcd *acd;
+        NAcdProbe *probe;
+        atomic_bool busy;
+        unsigned int event;
+        int fd_done;
+} TestExecutorContext;
+
+static atomic_uint test_executor_n_done;
+
+static void test_executor_fn(NAcd *acd, int r, void *userdata) {
+        TestExecutorContext *context = userdata;
+        NAcdEvent *event;
+        bool busy;
+
+        busy = atomic_exchange(&context->busy, true);
+        c_assert(!busy);
+        c_assert(acd == context->acd);
+        c_assert(!r || r == N_ACD_E_PREEMPTED);
+
+        for (;;) {
+                r = n_acd_pop_event(acd, &event);
+                c_assert(!r);
+                if (!event)
+                        break;
+
+                c_assert(event->event == N_ACD_EVENT_READY || event->event == N_ACD_EVENT_USED);
+                c_assert(context->probe && event->ready.probe == context->probe);
+
+                /* the probe is done, release it and the context from here */
+                context->event = event->event;
+                context->probe = n_acd_probe_free(context->probe);
+                n_acd_executor_remove(context->executor, acd);
+
+                if (atomic_fetch_add(&test_executor_n_done, 1) + 1 == TEST_EXECUTOR_N_CONTEXTS)
+                        eventfd_write(context->fd_done, 1);
+        }
+
+        atomic_store(&context->busy, false);
+}
+
+static void test_executor_context_new(TestExecutorContext *context,
+                                      NAcdExecutor *executor,
+                                      int ifindex,
+                                      struct ether_addr *mac,
+                                      struct in_addr ip,
+                                      uint64_t timeout,
+                                      int fd_done) {
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        int r;
+
+        *context = (TestExecutorContext){
+                .executor = executor,
+                .event = _N_ACD_EVENT_N,
+                .fd_done = fd_done,
+        };
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+
+        r = n_acd_new(&context->acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, timeout);
+
+        r = n_acd_probe(context->acd, &context->probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+}
+
+static void test_executor_config(int ifindex, struct ether_addr *mac) {
+        TestExecutorContext contexts[TEST_EXECUTOR_N_CONTEXTS];
+        NAcdExecutor *executor;
+        int r;
+
+        r = n_acd_executor_new(&executor, 0);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        r = n_acd_executor_new(&executor, TEST_EXECUTOR_N_THREADS);
+        c_assert(!r);
+
+        /* slow probes, which are still running when they are removed */
+        for (size_t i = 0; i < TEST_EXECUTOR_N_CONTEXTS; ++i) {
+                test_executor_context_new(&contexts[i],
+                                          executor,
+                                          ifindex,
+                                          mac,
+                                          (struct in_addr){ htobe32((10 << 24) | (2 << 8) | i) },
+                                          N_ACD_TIMEOUT_RFC5227,
+                                          -1);
+
+                r = n_acd_executor_add(executor, contexts[i].acd, test_executor_fn, &contexts[i]);
+                c_assert(!r);
+                r = n_acd_executor_add(executor, contexts[i].acd, test_executor_fn, &contexts[i]);
+                c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+        }
+
+        /* remove half the contexts from here, and leave the rest to free */
+        for (size_t i = 0; i < TEST_EXECUTOR_N_CONTEXTS; i += 2) {
+                n_acd_executor_remove(executor, contexts[i].acd);
+                n_acd_executor_remove(executor, contexts[i].acd);
+        }
+
+        n_acd_executor_free(executor);
+
+        for (size_t i = 0; i < TEST_EXECUTOR_N_CONTEXTS; ++i) {
+                c_assert(!atomic_load(&contexts[i].busy));
+                c_assert(contexts[i].event == _N_ACD_EVENT_N);
+                n_acd_probe_free(contexts[i].probe);
+                n_acd_unref(contexts[i].acd);
+        }
+}
+
+static void test_executor(int ifindex, struct ether_addr *mac) {
+        TestExecutorContext contexts[TEST_EXECUTOR_N_CONTEXTS];
+        NAcdExecutor *executor;
+        eventfd_t value;
+        int r, fd_done;
+
+        fd_done = eventfd(0, EFD_CLOEXEC);
+        c_assert(fd_done >= 0);
+
+        r = n_acd_executor_new(&executor, TEST_EXECUTOR_N_THREADS);
+        c_assert(!r);
+
+        for (size_t i = 0; i < TEST_EXECUTOR_N_CONTEXTS; ++i) {
+                struct in_addr ip = { htobe32((10 << 24) | (1 << 8) | i) };
+
+                if (i % 2)
+                        test_add_child_ip(&ip);
+
+                test_executor_context_new(&contexts[i], executor, ifindex, mac, ip, 1024, fd_done);
+        }
+
+        for (size_t i = 0; i < TEST_EXECUTOR_N_CONTEXTS; ++i) {
+                r = n_acd_executor_add(executor, contexts[i].acd, test_executor_fn, &contexts[i]);
+                c_assert(!r);
+        }
+
+        r = eventfd_read(fd_done, &value);
+        c_assert(!r);
+
+        n_acd_executor_free(executor);
+
+        /* in reverse, so the secondary addresses go before the primary */
+        for (size_t i = TEST_EXECUTOR_N_CONTEXTS; i-- > 0; ) {
+                struct in_addr ip = { htobe32((10 << 24) | (1 << 8) | i) };
+
+                c_assert(!contexts[i].probe);
+                if (i % 2) {
+                        c_assert(contexts[i].event == N_ACD_EVENT_USED);
+                        test_del_child_ip(&ip);
+                } else {
+                        c_assert(contexts[i].event == N_ACD_EVENT_READY);
+                }
+
+                n_acd_unref(contexts[i].acd);
+        }
+
+        close(fd_done);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_executor_config(ifindex1, &mac1);
+        test_executor(ifindex1, &mac1);
+
+        return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * Test sharding an interface via a fanout
+ *
+ * Run one context per shard of a fanout on one end of a veth link. Probe for
+ * N addresses, each on the context of its shard, and preconfigure every other
+ * address on the other end of the link. Each probe must see exactly the
+ * answer for its own address, which the kernel must have delivered to the
+ * socket of its shard.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <stdlib.h>
+#include "n-acd.h"
+#include "test.h"
+
+#define TEST_FANOUT_N_SHARDS (4)
+#define TEST_FANOUT_N_PROBES (16)
+
+static void test_fanout(int ifindex, struct ether_addr *mac) {
+        NAcd *acds[TEST_FANOUT_N_SHARDS];
+        NAcdProbe *probes[TEST_FANOUT_N_PROBES];
+        size_t n_used[TEST_FANOUT_N_SHARDS] = {};
+        unsigned int shards = 0;
+        NAcdProbeConfig *probe_config;
+        NAcdFanout *fanout;
+        NAcdConfig *config;
+        size_t n_running = 0;
+        int r;
+
+        r = n_acd_fanout_new(&fanout, ifindex, TEST_FANOUT_N_SHARDS);
+        c_assert(!r);
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+
+        n_acd_config_set_fanout(config, fanout, TEST_FANOUT_N_SHARDS);
+        r = n_acd_new(&acds[0], config);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        for (size_t i = 0; i < TEST_FANOUT_N_SHARDS; ++i) {
+                n_acd_config_set_fanout(config, fanout, i);
+                r = n_acd_new(&acds[i], config);
+                c_assert(!r);
+        }
+
+        /* a shard can only be driven by one context at a time */
+        n_acd_config_set_fanout(config, fanout, 0);
+        r = n_acd_new(&acds[0], config);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        n_acd_unref(acds[0]);
+        r = n_acd_new(&acds[0], config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_timeout(probe_config, 1024);
+
+        for (size_t i = 0; i < TEST_FANOUT_N_PROBES; ++i) {
+                struct in_addr ip = { htobe32((10 << 24) | (i + 1)) };
+                unsigned int shard;
+
+                shard = n_acd_fanout_get_shard(fanout, ip);
+                c_assert(shard < TEST_FANOUT_N_SHARDS);
+                shards |= 1U << shard;
+
+                if (i % 2) {
+                        test_add_child_ip(&ip);
+                        ++n_used[shard];
+                }
+
+                n_acd_probe_config_set_ip(probe_config, ip);
+
+                /* probes are only accepted by the context of their shard */
+                r = n_acd_probe(acds[(shard + 1) % TEST_FANOUT_N_SHARDS], &probes[i], probe_config);
+                c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+                r = n_acd_probe(acds[shard], &probes[i], probe_config);
+                c_assert(!r);
+
+                n_acd_probe_set_userdata(probes[i], (void *)i);
+                ++n_running;
+        }
+
+        n_acd_probe_config_free(probe_config);
+
+        /* the addresses must actually be spread across the shards */
+        c_assert(shards & (shards - 1));
+
+        while (n_running > 0) {
+                struct pollfd pfds[TEST_FANOUT_N_SHARDS];
+
+                for (size_t i = 0; i < TEST_FANOUT_N_SHARDS; ++i) {
+                        pfds[i] = (struct pollfd){ .events = POLLIN };
+                        n_acd_get_fd(acds[i], &pfds[i].fd);
+                }
+
+                r = poll(pfds, TEST_FANOUT_N_SHARDS, -1);
+                c_assert(r >= 0);
+
+                for (size_t i = 0; i < TEST_FANOUT_N_SHARDS; ++i) {
+                        NAcdEvent *event;
+                        void *userdata;
+
+                        if (!(pfds[i].revents & POLLIN))
+                                continue;
+
+                        r = n_acd_dispatch(acds[i]);
+                        c_assert(!r || r == N_ACD_E_PREEMPTED);
+
+                        for (;;) {
+                                r = n_acd_pop_event(acds[i], &event);
+                                c_assert(!r);
+                                if (!event)
+                                        break;
+
+                                switch (event->event) {
+                                case N_ACD_EVENT_USED:
+                                        n_acd_probe_get_userdata(event->used.probe, &userdata);
+                                        c_assert((size_t)userdata % 2);
+                                        c_assert(n_used[i]--);
+                                        break;
+                                case N_ACD_EVENT_READY:
+                                        n_acd_probe_get_userdata(event->ready.probe, &userdata);
+                                        c_assert(!((size_t)userdata % 2));
+                                        break;
+                                default:
+                                        c_assert(0);
+                                        abort();
+                                }
+
+                                --n_running;
+                        }
+                }
+        }
+
+        for (size_t i = 0; i < TEST_FANOUT_N_SHARDS; ++i)
+                c_assert(!n_used[i]);
+
+        for (size_t i = 0; i < TEST_FANOUT_N_PROBES; ++i) {
+                struct in_addr ip = { htobe32((10 << 24) | (i + 1)) };
+
+                n_acd_probe_free(probes[i]);
+                if (i % 2)
+                        test_del_child_ip(&ip);
+        }
+
+        for (size_t i = 0; i < TEST_FANOUT_N_SHARDS; ++i)
+                n_acd_unref(acds[i]);
+
+        n_acd_fanout_unref(fanout);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac;
+        int ifindex;
+
+        test_setup();
+
+        test_veth_new(&ifindex, &mac, NULL, NULL);
+        test_fanout(ifindex, &mac);
+
+        return 0;
+}
@@ -3,6 +3,9 @@
  * This runs the ACD engine on the loopback device, effectively testing the BPF
  * filter of ACD to discard its own packets. This might happen on
  * non-spanning-tree networks, or on networks that echo packets.
+ *
+ * In lazy mode, the probe is run twice, so the context releases and then
+ * re-acquires its kernel resources in between.
  */
 
 #undef NDEBUG
@@ -10,7 +13,7 @@
 #include <stdlib.h>
 #include "test.h"
 
-static void test_loopback(int ifindex, uint8_t *mac, size_t n_mac) {
+static void test_loopback(int ifindex, uint8_t *mac, size_t n_mac, bool lazy) {
         NAcdConfig *config;
         NAcd *acd;
         struct pollfd pfds;
@@ -22,13 +25,14 @@ static void test_loopback(int ifindex, uint8_t *mac, size_t n_mac) {
         n_acd_config_set_ifindex(config, ifindex);
         n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
         n_acd_config_set_mac(config, mac, n_mac);
+        n_acd_config_set_lazy(config, lazy);
 
         r = n_acd_new(&acd, config);
         c_assert(!r);
 
         n_acd_config_free(config);
 
-        {
+        for (unsigned int i = 0; i < (lazy ? 2 : 1); ++i) {
                 NAcdProbeConfig *probe_config;
                 NAcdProbe *probe;
                 struct in_addr ip = { htobe32((192 << 24) | (168 << 16) | (1 << 0)) };
@@ -76,7 +80,8 @@ int main(int argc, char **argv) {
         test_setup();
 
         test_loopback_up(&ifindex, &mac);
-        test_loopback(ifindex, mac.ether_addr_octet, sizeof(mac.ether_addr_octet));
+        test_loopback(ifindex, mac.ether_addr_octet, sizeof(mac.ether_addr_octet), false);
+        test_loopback(ifindex, mac.ether_addr_octet, sizeof(mac.ether_addr_octet), true);
 
         return 0;
 }
@@ -0,0 +1,196 @@
+/*
+ * Test a multi-interface context
+ *
+ * Create two veth links, and run a single multi-interface context on one end
+ * of both. Preconfigure an address on the other end of the first link only,
+ * then probe for it on both interfaces. The probe on the first interface must
+ * fail, and the one on the second interface must succeed, even though both
+ * share the packet socket of the context.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <stdlib.h>
+#include "n-acd.h"
+#include "test.h"
+
+static void test_multi_veth_new(int *parent_indexp,
+                                struct ether_addr *parent_macp,
+                                int *child_indexp,
+                                struct ether_addr *child_macp) {
+        int r;
+
+        /* a second link, next to the one of test_veth_new() */
+        r = system("ip link add veth2 type veth peer name veth3");
+        c_assert(r == 0);
+        r = system("ip link set veth2 up");
+        c_assert(r == 0);
+        r = system("ip link set veth3 up");
+        c_assert(r == 0);
+
+        /* all links share a namespace, so make veth3 only answer for itself */
+        r = system("echo 1 > /proc/sys/net/ipv4/conf/veth3/arp_ignore");
+        c_assert(r == 0);
+
+        test_if_query("veth2", parent_indexp, parent_macp);
+        test_if_query("veth3", child_indexp, child_macp);
+}
+
+static void test_multi_config(int ifindex, struct ether_addr *mac) {
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        NAcdProbe *probe;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_multi_interface(config, true);
+
+        /* multi-interface contexts are not bound to an interface */
+        n_acd_config_set_ifindex(config, ifindex);
+        r = n_acd_new(&acd, config);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+        n_acd_config_set_ifindex(config, 0);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, (struct in_addr){ htobe32((10 << 24) | 1) });
+        n_acd_probe_config_set_ifindex(probe_config, ifindex);
+
+        /* the interface must be added before it can be probed on */
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        r = n_acd_add_interface(acd, ifindex, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+        c_assert(!r);
+        r = n_acd_add_interface(acd, ifindex, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        /* the interface must not be removed while in use */
+        r = n_acd_remove_interface(acd, ifindex);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        n_acd_probe_free(probe);
+
+        r = n_acd_remove_interface(acd, ifindex);
+        c_assert(!r);
+        r = n_acd_remove_interface(acd, ifindex);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        n_acd_probe_config_free(probe_config);
+        n_acd_unref(acd);
+}
+
+static void test_multi(int ifindex1, struct ether_addr *mac1, int ifindex2, struct ether_addr *mac2) {
+        struct in_addr ip = { htobe32((10 << 24) | 2) };
+        NAcdProbeConfig *probe_config;
+        NAcdProbe *probe1, *probe2;
+        NAcdConfig *config;
+        bool done1 = false, done2 = false;
+        NAcd *acd;
+        int r, fd;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_multi_interface(config, true);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_add_interface(acd, ifindex1, mac1->ether_addr_octet, sizeof(mac1->ether_addr_octet));
+        c_assert(!r);
+        r = n_acd_add_interface(acd, ifindex2, mac2->ether_addr_octet, sizeof(mac2->ether_addr_octet));
+        c_assert(!r);
+
+        /* the address is only in use behind the first interface */
+        test_add_child_ip(&ip);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, 1024);
+
+        n_acd_probe_config_set_ifindex(probe_config, ifindex1);
+        r = n_acd_probe(acd, &probe1, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ifindex(probe_config, ifindex2);
+        r = n_acd_probe(acd, &probe2, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        n_acd_get_fd(acd, &fd);
+
+        while (!done1 || !done2) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+                NAcdEvent *event;
+
+                r = poll(&pfd, 1, -1);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r || r == N_ACD_E_PREEMPTED);
+
+                for (;;) {
+                        r = n_acd_pop_event(acd, &event);
+                        c_assert(!r);
+                        if (!event)
+                                break;
+
+                        switch (event->event) {
+                        case N_ACD_EVENT_USED:
+                                c_assert(event->used.probe == probe1);
+                                c_assert(!done1);
+                                done1 = true;
+                                break;
+                        case N_ACD_EVENT_READY:
+                                c_assert(event->ready.probe == probe2);
+                                c_assert(!done2);
+                                done2 = true;
+                                break;
+                        default:
+                                c_assert(0);
+                                abort();
+                        }
+                }
+        }
+
+        n_acd_probe_free(probe2);
+        n_acd_probe_free(probe1);
+        n_acd_unref(acd);
+
+        test_del_child_ip(&ip);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2, mac3, mac4;
+        int ifindex1, ifindex2, ifindex3, ifindex4;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+        test_multi_veth_new(&ifindex3, &mac3, &ifindex4, &mac4);
+
+        test_multi_config(ifindex1, &mac1);
+        test_multi(ifindex1, &mac1, ifindex3, &mac3);
+
+        return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Test passive observation of claims
+ *
+ * Run an observing context on one end of a veth link, and claim an address
+ * from the other end, which the context does not probe. A probe for that
+ * address must then fail right away, naming the claimant, while a probe for
+ * any other address must still succeed. A claim by yet another host must
+ * replace the first one, and be counted as conflict.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <linux/if_packet.h>
+#include <netinet/if_ether.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+typedef struct TestObserveFrame {
+        struct ether_header eth;
+        struct ether_arp arp;
+} _c_packed_ TestObserveFrame;
+
+static void test_observe_claim(int ifindex, const uint8_t *mac, struct in_addr ip) {
+        TestObserveFrame frame;
+        int r, fd;
+
+        fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htobe16(ETH_P_ARP));
+        c_assert(fd >= 0);
+
+        r = bind(fd,
+                 (struct sockaddr *)&(struct sockaddr_ll){
+                        .sll_family = AF_PACKET,
+                        .sll_protocol = htobe16(ETH_P_ARP),
+                        .sll_ifindex = ifindex,
+                 },
+                 sizeof(struct sockaddr_ll));
+        c_assert(!r);
+
+        frame = (TestObserveFrame){
+                .eth = {
+                        .ether_dhost = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+                        .ether_type = htobe16(ETHERTYPE_ARP),
+                },
+                .arp = {
+                        .ea_hdr = {
+                                .ar_hrd = htobe16(ARPHRD_ETHER),
+                                .ar_pro = htobe16(ETHERTYPE_IP),
+                                .ar_hln = ETH_ALEN,
+                                .ar_pln = sizeof(struct in_addr),
+                                .ar_op = htobe16(ARPOP_REQUEST),
+                        },
+                },
+        };
+        memcpy(frame.eth.ether_shost, mac, ETH_ALEN);
+        memcpy(frame.arp.arp_sha, mac, ETH_ALEN);
+        memcpy(frame.arp.arp_spa, &ip, sizeof(ip));
+        memcpy(frame.arp.arp_tpa, &ip, sizeof(ip));
+
+        r = send(fd, &frame, sizeof(frame), 0);
+        c_assert(r == (ssize_t)sizeof(frame));
+
+        close(fd);
+}
+
+static NAcdObservation *test_observe_wait(NAcd *acd, int ifindex, struct in_addr ip, const uint8_t *mac) {
+        NAcdObservation *observation = NULL;
+        NAcdInterface *interface;
+        uint64_t now;
+        int r, fd;
+
+        n_acd_get_fd(acd, &fd);
+        interface = n_acd_find_interface(acd, ifindex);
+        c_assert(interface);
+
+        while (!observation || memcmp(observation->mac, mac, ETH_ALEN)) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+                r = poll(&pfd, 1, 1000);
+                c_assert(r == 1);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+
+                timer_now(&acd->timer, &now);
+                observation = n_acd_find_observation(acd, interface, ip, now);
+        }
+
+        return observation;
+}
+
+static NAcdEvent *test_observe_probe(NAcd *acd, NAcdProbe **probep, struct in_addr ip, uint64_t timeout) {
+        NAcdProbeConfig *probe_config;
+        NAcdEvent *event = NULL;
+        int r, fd;
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, timeout);
+
+        r = n_acd_probe(acd, probep, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        n_acd_get_fd(acd, &fd);
+
+        while (!event) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+                r = poll(&pfd, 1, -1);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+
+                r = n_acd_pop_event(acd, &event);
+                c_assert(!r);
+        }
+
+        return event;
+}
+
+static void test_observe(int ifindex1, struct ether_addr *mac1, int ifindex2, struct ether_addr *mac2) {
+        struct in_addr ip1 = { htobe32((10 << 24) | (7 << 8) | 1) };
+        struct in_addr ip2 = { htobe32((10 << 24) | (7 << 8) | 2) };
+        uint8_t mac3[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x07, 0x03 };
+        uint64_t n_conflicts;
+        NAcdConfig *config;
+        NAcdProbe *probe;
+        NAcdEvent *event;
+        bool observed;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex1);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac1->ether_addr_octet, sizeof(mac1->ether_addr_octet));
+        n_acd_config_set_observe(config, 1, 60 * 1000);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        /* a claim of an address nobody probes is observed */
+        test_observe_claim(ifindex2, mac2->ether_addr_octet, ip1);
+        test_observe_wait(acd, ifindex1, ip1, mac2->ether_addr_octet);
+
+        r = n_acd_get_observation(acd, 0, ip1, &observed, &n_conflicts);
+        c_assert(!r);
+        c_assert(observed && !n_conflicts);
+
+        r = n_acd_get_observation(acd, ifindex1, ip2, &observed, &n_conflicts);
+        c_assert(!r);
+        c_assert(!observed && !n_conflicts);
+
+        r = n_acd_get_observation(acd, ifindex2, ip1, &observed, &n_conflicts);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        /* probing it fails without waiting for the probe sequence */
+        event = test_observe_probe(acd, &probe, ip1, N_ACD_TIMEOUT_RFC5227);
+        c_assert(event->event == N_ACD_EVENT_USED);
+        c_assert(event->used.n_sender == ETH_ALEN);
+        c_assert(!memcmp(event->used.sender, mac2->ether_addr_octet, ETH_ALEN));
+        n_acd_probe_free(probe);
+
+        /* any other address is unaffected */
+        event = test_observe_probe(acd, &probe, ip2, 100);
+        c_assert(event->event == N_ACD_EVENT_READY);
+        n_acd_probe_free(probe);
+
+        /* another host claiming the address is a conflict, and is named */
+        test_observe_claim(ifindex2, mac3, ip1);
+        test_observe_wait(acd, ifindex1, ip1, mac3);
+
+        r = n_acd_get_observation(acd, ifindex1, ip1, &observed, &n_conflicts);
+        c_assert(!r);
+        c_assert(observed && n_conflicts == 1);
+
+        event = test_observe_probe(acd, &probe, ip1, N_ACD_TIMEOUT_RFC5227);
+        c_assert(event->event == N_ACD_EVENT_USED);
+        c_assert(!memcmp(event->used.sender, mac3, ETH_ALEN));
+        n_acd_probe_free(probe);
+
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_observe(ifindex1, &mac1, ifindex2, &mac2);
+
+        return 0;
+}
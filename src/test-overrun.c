@@ -0,0 +1,164 @@
+/*
+ * Test socket overrun detection
+ *
+ * Run a context with a tiny receive buffer on one end of a veth link, and
+ * flood it with ARP probes for the probed address from the other end, without
+ * dispatching it. Most of them must be dropped by the kernel, and the context
+ * must report that once it is dispatched, but only once.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <linux/if_packet.h>
+#include <netinet/if_ether.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-acd.h"
+#include "test.h"
+
+#define TEST_OVERRUN_N (256)
+
+typedef struct TestOverrunFrame {
+        struct ether_header eth;
+        struct ether_arp arp;
+} _c_packed_ TestOverrunFrame;
+
+static void test_overrun_flood(int ifindex, struct ether_addr *mac, struct in_addr ip, size_t n) {
+        TestOverrunFrame frame;
+        int r, fd;
+
+        fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htobe16(ETH_P_ARP));
+        c_assert(fd >= 0);
+
+        r = bind(fd,
+                 (struct sockaddr *)&(struct sockaddr_ll){
+                        .sll_family = AF_PACKET,
+                        .sll_protocol = htobe16(ETH_P_ARP),
+                        .sll_ifindex = ifindex,
+                 },
+                 sizeof(struct sockaddr_ll));
+        c_assert(!r);
+
+        frame = (TestOverrunFrame){
+                .eth = {
+                        .ether_dhost = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+                        .ether_type = htobe16(ETHERTYPE_ARP),
+                },
+                .arp = {
+                        .ea_hdr = {
+                                .ar_hrd = htobe16(ARPHRD_ETHER),
+                                .ar_pro = htobe16(ETHERTYPE_IP),
+                                .ar_hln = ETH_ALEN,
+                                .ar_pln = sizeof(struct in_addr),
+                                .ar_op = htobe16(ARPOP_REQUEST),
+                        },
+                },
+        };
+        memcpy(frame.eth.ether_shost, mac->ether_addr_octet, ETH_ALEN);
+        memcpy(frame.arp.arp_sha, mac->ether_addr_octet, ETH_ALEN);
+        memcpy(frame.arp.arp_tpa, &ip, sizeof(ip));
+
+        for (size_t i = 0; i < n; ++i) {
+                r = send(fd, &frame, sizeof(frame), 0);
+                c_assert(r == (ssize_t)sizeof(frame));
+        }
+
+        close(fd);
+}
+
+static uint64_t test_overrun_drain(NAcd *acd) {
+        NAcdEvent *event;
+        uint64_t n_dropped = 0;
+        int r, fd;
+
+        n_acd_get_fd(acd, &fd);
+
+        for (;;) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+                r = poll(&pfd, 1, 0);
+                c_assert(r >= 0);
+                if (!r)
+                        break;
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r || r == N_ACD_E_PREEMPTED);
+
+                for (;;) {
+                        r = n_acd_pop_event(acd, &event);
+                        c_assert(!r);
+                        if (!event)
+                                break;
+
+                        if (event->event == N_ACD_EVENT_OVERRUN) {
+                                c_assert(event->overrun.n_dropped > 0);
+                                n_dropped += event->overrun.n_dropped;
+                        } else {
+                                c_assert(event->event == N_ACD_EVENT_USED);
+                        }
+                }
+        }
+
+        return n_dropped;
+}
+
+static void test_overrun(int ifindex1, struct ether_addr *mac1, int ifindex2, struct ether_addr *mac2) {
+        struct in_addr ip = { htobe32((10 << 24) | (5 << 8) | 1) };
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        NAcdProbe *probe;
+        uint64_t n_dropped;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex1);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac1->ether_addr_octet, sizeof(mac1->ether_addr_octet));
+        n_acd_config_set_rcvbuf(config, 1);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, N_ACD_TIMEOUT_RFC5227);
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        test_overrun_flood(ifindex2, mac2, ip, TEST_OVERRUN_N);
+
+        n_dropped = test_overrun_drain(acd);
+        c_assert(n_dropped > 0 && n_dropped < TEST_OVERRUN_N);
+
+        /* the drops were reported, so a packet that fits must not repeat it */
+        test_overrun_flood(ifindex2, mac2, ip, 1);
+
+        n_dropped = test_overrun_drain(acd);
+        c_assert(!n_dropped);
+
+        n_acd_probe_free(probe);
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_overrun(ifindex1, &mac1, ifindex2, &mac2);
+
+        return 0;
+}
@@ -0,0 +1,344 @@
+/*
+ * Test transmit pacing
+ *
+ * Run a pacing context on one end of a veth link, and start many probes at
+ * once, each sending a single probe. The pacer must spread their frames at
+ * the configured rate, after the initial burst, and every probe must still
+ * succeed. A context with an invalid pacing configuration must be refused.
+ *
+ * Then queue probes, announcements, and defenses on a paced context, and
+ * watch the frames on the other end of the link. Defenses must go out before
+ * announcements, and announcements before probes, regardless of the order
+ * they were queued in. A defense of an address whose announcement is already
+ * queued must take over that frame.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <linux/if_packet.h>
+#include <netinet/if_ether.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+#define TEST_PACE_RATE (200)
+#define TEST_PACE_BURST (4)
+#define TEST_PACE_N (16)
+#define TEST_PACE_SLOW (5)
+
+typedef struct TestPaceFrame {
+        struct ether_header eth;
+        struct ether_arp arp;
+} _c_packed_ TestPaceFrame;
+
+static void test_pace_config(NAcdConfig **configp, int ifindex, struct ether_addr *mac) {
+        NAcdConfig *config;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+
+        *configp = config;
+}
+
+static void test_pace(int ifindex, struct ether_addr *mac) {
+        NAcdTiming timing = {
+                .n_probes = 1,
+                .probe_wait_nsecs = 1,
+                .probe_min_nsecs = 0,
+                .probe_max_nsecs = 0,
+                .announce_wait_nsecs = UINT64_C(1000000),
+                .n_announces = 1,
+                .announce_interval_nsecs = 0,
+        };
+        uint64_t n_queued, max_queued, n_delayed, total_nsecs, max_nsecs, ts;
+        NAcdProbe *probes[TEST_PACE_N] = {};
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        NAcdEvent *event;
+        size_t n_ready = 0;
+        NAcd *acd;
+        int r, fd;
+
+        test_pace_config(&config, ifindex, mac);
+
+        n_acd_config_set_pacing(config, TEST_PACE_RATE, 0);
+        r = n_acd_new(&acd, config);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        n_acd_config_set_pacing(config, TEST_PACE_RATE, TEST_PACE_BURST);
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_timing(probe_config, &timing);
+
+        ts = test_now();
+
+        for (size_t i = 0; i < TEST_PACE_N; ++i) {
+                n_acd_probe_config_set_ip(probe_config, (struct in_addr){ htobe32((10 << 24) | (10 << 8) | (i + 1)) });
+
+                r = n_acd_probe(acd, &probes[i], probe_config);
+                c_assert(!r);
+        }
+
+        n_acd_probe_config_free(probe_config);
+
+        n_acd_get_fd(acd, &fd);
+
+        while (n_ready < TEST_PACE_N) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+                r = poll(&pfd, 1, -1);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+
+                for (;;) {
+                        r = n_acd_pop_event(acd, &event);
+                        c_assert(!r);
+
+                        if (!event)
+                                break;
+
+                        c_assert(event->event == N_ACD_EVENT_READY);
+                        ++n_ready;
+                }
+        }
+
+        /* all but the burst waited for a token, one interval apart */
+        ts = test_now() - ts;
+        c_assert(ts >= (TEST_PACE_N - TEST_PACE_BURST) * (UINT64_C(1000000000) / TEST_PACE_RATE));
+
+        n_acd_get_pacing(acd, &n_queued, &max_queued, &n_delayed, &total_nsecs, &max_nsecs);
+        c_assert(!n_queued);
+        c_assert(max_queued == TEST_PACE_N - TEST_PACE_BURST);
+        c_assert(n_delayed == TEST_PACE_N - TEST_PACE_BURST);
+        c_assert(max_nsecs >= (TEST_PACE_N - TEST_PACE_BURST - 1) * (UINT64_C(1000000000) / TEST_PACE_RATE));
+        c_assert(total_nsecs >= max_nsecs);
+
+        for (size_t i = 0; i < TEST_PACE_N; ++i)
+                n_acd_probe_free(probes[i]);
+
+        n_acd_unref(acd);
+}
+
+static int test_pace_socket(int ifindex) {
+        int r, fd;
+
+        fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, htobe16(ETH_P_ARP));
+        c_assert(fd >= 0);
+
+        r = bind(fd,
+                 (struct sockaddr *)&(struct sockaddr_ll){
+                        .sll_family = AF_PACKET,
+                        .sll_protocol = htobe16(ETH_P_ARP),
+                        .sll_ifindex = ifindex,
+                 },
+                 sizeof(struct sockaddr_ll));
+        c_assert(!r);
+
+        return fd;
+}
+
+static void test_pace_claim(int fd, const uint8_t *mac, struct in_addr ip) {
+        TestPaceFrame frame;
+        int r;
+
+        frame = (TestPaceFrame){
+                .eth = {
+                        .ether_dhost = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+                        .ether_type = htobe16(ETHERTYPE_ARP),
+                },
+                .arp = {
+                        .ea_hdr = {
+                                .ar_hrd = htobe16(ARPHRD_ETHER),
+                                .ar_pro = htobe16(ETHERTYPE_IP),
+                                .ar_hln = ETH_ALEN,
+                                .ar_pln = sizeof(struct in_addr),
+                                .ar_op = htobe16(ARPOP_REQUEST),
+                        },
+                },
+        };
+        memcpy(frame.eth.ether_shost, mac, ETH_ALEN);
+        memcpy(frame.arp.arp_sha, mac, ETH_ALEN);
+        memcpy(frame.arp.arp_spa, &ip, sizeof(ip));
+        memcpy(frame.arp.arp_tpa, &ip, sizeof(ip));
+
+        r = send(fd, &frame, sizeof(frame), 0);
+        c_assert(r == (ssize_t)sizeof(frame));
+}
+
+/* dispatch @acd until the peer saw @n more frames from @mac, returning their sender IPs */
+static void test_pace_watch(NAcd *acd, int fd, const struct ether_addr *mac, uint32_t *spas, size_t n) {
+        TestPaceFrame frame;
+        size_t i = 0;
+        ssize_t l;
+        int r;
+
+        while (i < n) {
+                struct pollfd pfds[2] = {
+                        { .events = POLLIN },
+                        { .fd = fd, .events = POLLIN },
+                };
+
+                n_acd_get_fd(acd, &pfds[0].fd);
+                r = poll(pfds, 2, -1);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+
+                while (i < n && (l = recv(fd, &frame, sizeof(frame), 0)) >= 0) {
+                        if (l == (ssize_t)sizeof(frame) &&
+                            !memcmp(frame.arp.arp_sha, mac->ether_addr_octet, ETH_ALEN))
+                                memcpy(&spas[i++], frame.arp.arp_spa, sizeof(*spas));
+                }
+        }
+}
+
+/* dispatch @acd until it has @n frames queued */
+static void test_pace_queue(NAcd *acd, uint64_t n) {
+        uint64_t n_queued, max_queued, n_delayed, total_nsecs, max_nsecs;
+        int r;
+
+        for (;;) {
+                struct pollfd pfd = { .events = POLLIN };
+
+                n_acd_get_pacing(acd, &n_queued, &max_queued, &n_delayed, &total_nsecs, &max_nsecs);
+                if (n_queued == n)
+                        break;
+
+                n_acd_get_fd(acd, &pfd.fd);
+                r = poll(&pfd, 1, -1);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+        }
+}
+
+static void test_pace_priority(int ifindex, struct ether_addr *mac, int peer) {
+        NAcdTiming announce = {
+                .n_probes = 0,
+                .n_announces = 1,
+        };
+        NAcdTiming probe = {
+                .n_probes = 1,
+                .probe_wait_nsecs = 1,
+                .announce_wait_nsecs = UINT64_C(1000000),
+                .n_announces = 1,
+        };
+        uint8_t claimant[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 0x01 };
+        struct in_addr ips[3];
+        NAcdProbe *announces[3], *probes[4];
+        NAcdProbeConfig *probe_config;
+        uint32_t spas[8];
+        NAcdConfig *config;
+        NAcdEvent *event;
+        NAcd *acd;
+        int r, fd;
+
+        /* a single token, which refills slowly enough to queue everything */
+        test_pace_config(&config, ifindex, mac);
+        n_acd_config_set_pacing(config, TEST_PACE_SLOW, 1);
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+        n_acd_config_free(config);
+
+        fd = test_pace_socket(peer);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_timing(probe_config, &announce);
+        for (size_t i = 0; i < 3; ++i) {
+                ips[i] = (struct in_addr){ htobe32((10 << 24) | (11 << 8) | (i + 1)) };
+                n_acd_probe_config_set_ip(probe_config, ips[i]);
+
+                r = n_acd_probe(acd, &announces[i], probe_config);
+                c_assert(!r);
+
+                event = test_wait_event(acd);
+                c_assert(event->event == N_ACD_EVENT_READY);
+        }
+
+        /* the first announcement takes the token */
+        r = n_acd_probe_announce(announces[0], N_ACD_DEFEND_ALWAYS);
+        c_assert(!r);
+        test_pace_watch(acd, fd, mac, spas, 1);
+        c_assert(spas[0] == ips[0].s_addr);
+
+        /* probes queue first, then two announcements */
+        n_acd_probe_config_set_timing(probe_config, &probe);
+        for (size_t i = 0; i < 4; ++i) {
+                n_acd_probe_config_set_ip(probe_config, (struct in_addr){ htobe32((10 << 24) | (11 << 8) | (i + 16)) });
+
+                r = n_acd_probe(acd, &probes[i], probe_config);
+                c_assert(!r);
+        }
+        test_pace_queue(acd, 4);
+
+        r = n_acd_probe_announce(announces[1], N_ACD_DEFEND_ALWAYS);
+        c_assert(!r);
+        test_pace_queue(acd, 5);
+
+        r = n_acd_probe_announce(announces[2], N_ACD_DEFEND_ALWAYS);
+        c_assert(!r);
+        test_pace_queue(acd, 6);
+
+        n_acd_probe_config_free(probe_config);
+
+        /*
+         * Claim the announced address, which queues a defense, and the last
+         * one, whose queued announcement must turn into the defense.
+         */
+        test_pace_claim(fd, claimant, ips[0]);
+        test_pace_claim(fd, claimant, ips[2]);
+
+        for (size_t i = 0; i < 2; ++i) {
+                event = test_wait_event(acd);
+                c_assert(event->event == N_ACD_EVENT_DEFENDED);
+        }
+
+        /* defenses in order, then the announcement, then the probes */
+        test_pace_watch(acd, fd, mac, spas + 1, 7);
+        c_assert(spas[1] == ips[0].s_addr);
+        c_assert(spas[2] == ips[2].s_addr);
+        c_assert(spas[3] == ips[1].s_addr);
+        for (size_t i = 4; i < 8; ++i)
+                c_assert(!spas[i]);
+
+        for (size_t i = 0; i < 4; ++i)
+                n_acd_probe_free(probes[i]);
+        for (size_t i = 0; i < 3; ++i)
+                n_acd_probe_free(announces[i]);
+
+        close(fd);
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_pace(ifindex1, &mac1);
+        test_pace_priority(ifindex1, &mac1, ifindex2);
+
+        return 0;
+}
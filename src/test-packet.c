@@ -0,0 +1,114 @@
+/*
+ * Test batch validation of ARP packets
+ *
+ * Generate packets with every combination of sender, operation, length and
+ * broken header field, received on different interfaces, and validate them
+ * in batches with each instruction set the CPU supports. The verdicts must
+ * match n_acd_packet_is_valid() on each packet.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <netinet/if_ether.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+
+/* odd, so the last pair of a batch is incomplete */
+#define TEST_PACKET_BATCH (61)
+
+static void test_packet_batch(NAcdInterface **interfaces,
+                              const struct ether_arp *packets,
+                              const size_t *n_packets,
+                              size_t n) {
+        uint64_t valid, expected = 0;
+
+        for (size_t i = 0; i < n; ++i)
+                if (interfaces[i] && n_acd_packet_is_valid(interfaces[i], (void *)(packets + i), n_packets[i]))
+                        expected |= UINT64_C(1) << i;
+
+        for (unsigned int isa = 0; isa <= n_acd_packet_isa(); ++isa) {
+                valid = n_acd_packet_validate(isa, interfaces, packets, n_packets, n);
+                c_assert(valid == expected);
+        }
+}
+
+static void test_packet(void) {
+        NAcdInterface interface1 = {
+                .mac = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 },
+        };
+        NAcdInterface interface2 = {
+                .mac = { 0x81, 0x82, 0x83, 0x84, 0x85, 0x86 },
+        };
+        NAcdInterface *interfaces[] = { &interface1, &interface2, NULL };
+        struct ether_addr senders[] = {
+                { { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 } },
+                { { 0x81, 0x82, 0x83, 0x84, 0x85, 0x86 } },
+                { { 0x01, 0x02, 0x03, 0x04, 0x05, 0x07 } },
+                { { 0x41, 0x02, 0x03, 0x04, 0x05, 0x06 } },
+        };
+        struct in_addr spas[] = {
+                { 0 },
+                { htobe32((10 << 24) | 1) },
+                { htobe32(1) },
+        };
+        uint16_t ops[] = { 0, ARPOP_REQUEST, ARPOP_REPLY, ARPOP_RREQUEST, 0x0101, 0x0201 };
+        size_t lengths[] = { sizeof(struct ether_arp) - 1, sizeof(struct ether_arp) };
+        NAcdInterface *batch_interfaces[TEST_PACKET_BATCH];
+        struct ether_arp batch[TEST_PACKET_BATCH];
+        size_t batch_lengths[TEST_PACKET_BATCH];
+        size_t n = 0, n_valid = 0;
+
+        for (size_t i_if = 0; i_if < C_ARRAY_SIZE(interfaces); ++i_if)
+        for (size_t i_sender = 0; i_sender < C_ARRAY_SIZE(senders); ++i_sender)
+        for (size_t i_spa = 0; i_spa < C_ARRAY_SIZE(spas); ++i_spa)
+        for (size_t i_op = 0; i_op < C_ARRAY_SIZE(ops); ++i_op)
+        for (size_t i_length = 0; i_length < C_ARRAY_SIZE(lengths); ++i_length)
+        for (size_t i_broken = 0; i_broken <= sizeof(struct arphdr) - 2; ++i_broken) {
+                struct ether_arp *packet = batch + n;
+
+                *packet = (struct ether_arp){
+                        .ea_hdr = {
+                                .ar_hrd = htobe16(ARPHRD_ETHER),
+                                .ar_pro = htobe16(ETHERTYPE_IP),
+                                .ar_hln = ETH_ALEN,
+                                .ar_pln = sizeof(struct in_addr),
+                                .ar_op = htobe16(ops[i_op]),
+                        },
+                        .arp_tpa = { 10, 0, 0, 2 },
+                };
+                memcpy(packet->arp_sha, &senders[i_sender], ETH_ALEN);
+                memcpy(packet->arp_spa, &spas[i_spa], sizeof(struct in_addr));
+
+                /* break one of the fixed header bytes, or none */
+                if (i_broken < sizeof(struct arphdr) - 2)
+                        ((uint8_t *)packet)[i_broken] ^= 0x10;
+
+                batch_interfaces[n] = interfaces[i_if];
+                batch_lengths[n] = lengths[i_length];
+
+                if (batch_interfaces[n] && n_acd_packet_is_valid(batch_interfaces[n], packet, batch_lengths[n]))
+                        ++n_valid;
+
+                if (++n == TEST_PACKET_BATCH) {
+                        test_packet_batch(batch_interfaces, batch, batch_lengths, n);
+                        n = 0;
+                }
+        }
+
+        test_packet_batch(batch_interfaces, batch, batch_lengths, n);
+
+        /* make sure not all packets were invalid */
+        c_assert(n_valid > 0);
+
+        /* an empty batch is valid, too */
+        test_packet_batch(batch_interfaces, batch, batch_lengths, 0);
+}
+
+int main(int argc, char **argv) {
+        test_packet();
+
+        return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Test periodic refreshing of announced addresses
+ *
+ * Run a refreshing context on one end of a veth link, and announce a set of
+ * addresses. Each must be announced again once per period, as seen from the
+ * other end of the link. On a paced context, refreshes must not exceed the
+ * rate of the pacer.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <linux/if_packet.h>
+#include <netinet/if_ether.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-acd.h"
+#include "test.h"
+
+#define TEST_REFRESH_PERIOD (100)
+#define TEST_REFRESH_PERIODS (5)
+#define TEST_REFRESH_N (128)
+#define TEST_REFRESH_RATE (500)
+#define TEST_REFRESH_BURST (4)
+
+static int test_refresh_capture(int ifindex) {
+        int r, fd;
+
+        fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, htobe16(ETH_P_ARP));
+        c_assert(fd >= 0);
+
+        r = bind(fd,
+                 (struct sockaddr *)&(struct sockaddr_ll){
+                        .sll_family = AF_PACKET,
+                        .sll_protocol = htobe16(ETH_P_ARP),
+                        .sll_ifindex = ifindex,
+                 },
+                 sizeof(struct sockaddr_ll));
+        c_assert(!r);
+
+        r = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(int){ 1 << 20 }, sizeof(int));
+        c_assert(!r);
+
+        return fd;
+}
+
+static size_t test_refresh_count(int fd, struct in_addr ip) {
+        struct ether_arp arp;
+        size_t n = 0;
+        ssize_t l;
+
+        while ((l = recv(fd, &arp, sizeof(arp), 0)) >= 0)
+                if (l == sizeof(arp) && !memcmp(arp.arp_spa, &ip, sizeof(ip)))
+                        ++n;
+
+        c_assert(errno == EAGAIN);
+        return n;
+}
+
+static void test_refresh(int ifindex1, struct ether_addr *mac1, int ifindex2, bool pace) {
+        NAcdTiming timing = {
+                .n_announces = 1,
+        };
+        uint64_t n_addresses, n_sent, n_sent_before, n_dropped, ts;
+        NAcdProbe *probes[TEST_REFRESH_N];
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        NAcdEvent *event;
+        size_t n_ready = 0, n;
+        uint64_t deadline;
+        NAcd *acd;
+        int r, fd, fd_capture;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex1);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac1->ether_addr_octet, sizeof(mac1->ether_addr_octet));
+        n_acd_config_set_refresh(config, TEST_REFRESH_PERIOD);
+        if (pace)
+                n_acd_config_set_pacing(config, TEST_REFRESH_RATE, TEST_REFRESH_BURST);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_timing(probe_config, &timing);
+        n_acd_probe_config_set_refresh(probe_config, true);
+
+        for (size_t i = 0; i < TEST_REFRESH_N; ++i) {
+                n_acd_probe_config_set_ip(probe_config, (struct in_addr){ htobe32((10 << 24) | (12 << 8) | (i + 1)) });
+
+                r = n_acd_probe(acd, &probes[i], probe_config);
+                c_assert(!r);
+        }
+
+        n_acd_probe_config_free(probe_config);
+
+        n_acd_get_fd(acd, &fd);
+
+        /* announce each address once it is ready, until all are refreshed */
+        for (;;) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+                n_acd_get_refresh(acd, &n_addresses, &n_sent, &n_dropped);
+                if (n_addresses == TEST_REFRESH_N)
+                        break;
+
+                r = poll(&pfd, 1, -1);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+
+                for (;;) {
+                        r = n_acd_pop_event(acd, &event);
+                        c_assert(!r);
+
+                        if (!event)
+                                break;
+
+                        c_assert(event->event == N_ACD_EVENT_READY);
+                        ++n_ready;
+
+                        r = n_acd_probe_announce(event->ready.probe, N_ACD_DEFEND_NEVER);
+                        c_assert(!r);
+                }
+        }
+
+        c_assert(n_ready == TEST_REFRESH_N);
+
+        fd_capture = test_refresh_capture(ifindex2);
+        n_acd_get_refresh(acd, &n_addresses, &n_sent_before, &n_dropped);
+        ts = test_now();
+        deadline = ts + TEST_REFRESH_PERIODS * TEST_REFRESH_PERIOD * UINT64_C(1000000);
+
+        while (test_now() < deadline) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+                r = poll(&pfd, 1, TEST_REFRESH_PERIOD / 10);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+        }
+
+        ts = test_now() - ts;
+        n_acd_get_refresh(acd, &n_addresses, &n_sent, &n_dropped);
+        n_sent -= n_sent_before;
+        n = test_refresh_count(fd_capture, (struct in_addr){ htobe32((10 << 24) | (12 << 8) | 1) });
+
+        if (pace) {
+                /* the refreshes did not exceed the rate of the pacer */
+                c_assert(n_sent > 0);
+                c_assert(n_sent <= TEST_REFRESH_BURST + ts * TEST_REFRESH_RATE / UINT64_C(1000000000) + 1);
+        } else {
+                /* each address is announced once per period */
+                c_assert(n >= TEST_REFRESH_PERIODS - 1 && n <= TEST_REFRESH_PERIODS + 1);
+                c_assert(n_sent >= (TEST_REFRESH_PERIODS - 1) * TEST_REFRESH_N);
+        }
+
+        close(fd_capture);
+
+        /* the ring stops with the last probe */
+        for (size_t i = 0; i < TEST_REFRESH_N; ++i)
+                n_acd_probe_free(probes[i]);
+
+        n_acd_get_refresh(acd, &n_addresses, &n_sent, &n_dropped);
+        c_assert(!n_addresses);
+
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_refresh(ifindex1, &mac1, ifindex2, false);
+        test_refresh(ifindex1, &mac1, ifindex2, true);
+
+        return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Test remembering verified addresses
+ *
+ * Run a context that remembers verified addresses on one end of a veth link.
+ * Probing an address that was just verified and announced must take a single
+ * probe, and thus less time than the shortest possible full probe sequence.
+ * If another host took the address over in the meantime, that single probe
+ * must still detect it, and the address must be forgotten, so the next probe
+ * runs the full sequence again.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <stdlib.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+#define TEST_REMEMBER_TIMEOUT (900)
+
+static uint64_t test_remember_probe(NAcd *acd, struct in_addr ip, unsigned int expected) {
+        NAcdProbeConfig *probe_config;
+        NAcdProbe *probe;
+        NAcdEvent *event = NULL;
+        uint64_t ts;
+        int r, fd;
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, TEST_REMEMBER_TIMEOUT);
+
+        n_acd_get_fd(acd, &fd);
+        ts = test_now();
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        while (!event) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+                r = poll(&pfd, 1, -1);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+
+                r = n_acd_pop_event(acd, &event);
+                c_assert(!r);
+        }
+
+        ts = test_now() - ts;
+
+        c_assert(event->event == expected);
+
+        /* hold the address for a moment, so it counts as verified */
+        if (expected == N_ACD_EVENT_READY) {
+                r = n_acd_probe_announce(probe, N_ACD_DEFEND_NEVER);
+                c_assert(!r);
+        }
+
+        n_acd_probe_free(probe);
+
+        return ts;
+}
+
+static void test_remember(int ifindex, struct ether_addr *mac) {
+        struct in_addr ip = { htobe32((10 << 24) | (6 << 8) | 1) };
+        /* the shortest full sequence: two PROBE_MIN and the ANNOUNCE_WAIT */
+        uint64_t full = TEST_REMEMBER_TIMEOUT * (2 * N_ACD_RFC_PROBE_MIN_NSEC + N_ACD_RFC_ANNOUNCE_WAIT_NSEC);
+        NAcdConfig *config;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+        n_acd_config_set_remember(config, 60 * 1000);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        /* nothing is known, yet, so this is the full sequence */
+        c_assert(test_remember_probe(acd, ip, N_ACD_EVENT_READY) >= full);
+
+        /* the address was just verified, so this is a single probe */
+        c_assert(test_remember_probe(acd, ip, N_ACD_EVENT_READY) < full);
+
+        /* the single probe must detect the address was taken over */
+        test_add_child_ip(&ip);
+        c_assert(test_remember_probe(acd, ip, N_ACD_EVENT_USED) < full);
+        test_del_child_ip(&ip);
+
+        /* after the conflict, nothing is known anymore */
+        c_assert(test_remember_probe(acd, ip, N_ACD_EVENT_READY) >= full);
+
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_remember(ifindex1, &mac1);
+
+        return 0;
+}
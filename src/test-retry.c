@@ -0,0 +1,109 @@
+/*
+ * Test the retry queue for dropped frames
+ *
+ * Run a context with a retry queue on one end of a veth link, and pretend the
+ * first frame of a probe was dropped, by parking it right away. The probe must
+ * then be sent as soon as the socket is writable, rather than after its
+ * initial wait, and the socket must no longer be polled for EPOLLOUT once the
+ * queue drained. A full queue must refuse further frames.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <stdlib.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+static void test_retry(int ifindex, struct ether_addr *mac) {
+        struct in_addr ip1 = { htobe32((10 << 24) | (11 << 8) | 1) };
+        struct in_addr ip2 = { htobe32((10 << 24) | (11 << 8) | 2) };
+        NAcdTiming timing = {
+                .n_probes = 1,
+                .probe_wait_nsecs = UINT64_C(10000000000),
+                .announce_wait_nsecs = UINT64_C(1000000),
+                .n_announces = 1,
+        };
+        NAcdProbeConfig *probe_config;
+        NAcdProbe *probe1, *probe2;
+        NAcdEvent *event = NULL;
+        NAcdConfig *config;
+        uint64_t ts;
+        NAcd *acd;
+        int r, fd;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+        n_acd_config_set_retry(config, 1);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_timing(probe_config, &timing);
+
+        n_acd_probe_config_set_ip(probe_config, ip1);
+        r = n_acd_probe(acd, &probe1, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip2);
+        r = n_acd_probe(acd, &probe2, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        /* park the first probe as if it was dropped, the queue is then full */
+        ts = test_now();
+        timeout_unschedule(&probe1->timeout);
+        c_assert(n_acd_retry(acd, probe1));
+        c_assert(acd->retry_armed);
+        c_assert(!n_acd_retry(acd, probe2));
+
+        n_acd_get_fd(acd, &fd);
+
+        while (!event) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+                r = poll(&pfd, 1, -1);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+
+                r = n_acd_pop_event(acd, &event);
+                c_assert(!r);
+        }
+
+        /* the parked probe went out right away, the other one still waits */
+        c_assert(event->event == N_ACD_EVENT_READY);
+        c_assert(event->ready.probe == probe1);
+        c_assert(test_now() - ts < timing.probe_wait_nsecs / 2);
+        c_assert(!acd->n_retry);
+        c_assert(!acd->retry_armed);
+
+        n_acd_probe_free(probe2);
+        n_acd_probe_free(probe1);
+
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_retry(ifindex1, &mac1);
+
+        return 0;
+}
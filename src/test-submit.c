@@ -0,0 +1,363 @@
+/*
+ * Test submitting probes from other threads
+ *
+ * Run a context on one end of a veth link, and preconfigure every other
+ * address on the other end. Several threads submit probes for those addresses
+ * to the context, while the main thread dispatches it. Once their probes
+ * completed, the threads submit announcements for the free addresses, and
+ * then free all their probes. Each probe must see the answer for its own
+ * address, and all probes must be gone in the end.
+ *
+ * Furthermore, verify that a probe that cannot be started fails on its own,
+ * that pending submissions do not keep a context alive, and that a submitted
+ * free of the last probe of a lazy context does not break the dispatch that
+ * applies it.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+#define TEST_SUBMIT_N_THREADS (4)
+#define TEST_SUBMIT_N_PROBES (8)
+
+typedef struct TestSubmitProbe {
+        NAcdProbe *probe;
+        atomic_uint event;
+} TestSubmitProbe;
+
+typedef struct TestSubmitThread {
+        pthread_t thread;
+        NAcd *acd;
+        size_t index;
+        TestSubmitProbe probes[TEST_SUBMIT_N_PROBES];
+} TestSubmitThread;
+
+static atomic_uint test_submit_n_done;
+
+static struct in_addr test_submit_ip(size_t thread, size_t probe) {
+        return (struct in_addr){ htobe32((10 << 24) | (3 << 8) | (thread * TEST_SUBMIT_N_PROBES + probe + 1)) };
+}
+
+static void *test_submit_thread(void *userdata) {
+        TestSubmitThread *thread = userdata;
+        NAcdProbeConfig *probe_config;
+        unsigned int event;
+        int r;
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_timeout(probe_config, 1024);
+
+        for (size_t i = 0; i < TEST_SUBMIT_N_PROBES; ++i) {
+                atomic_store(&thread->probes[i].event, _N_ACD_EVENT_N);
+                n_acd_probe_config_set_ip(probe_config, test_submit_ip(thread->index, i));
+
+                r = n_acd_submit_probe(thread->acd, &thread->probes[i].probe, probe_config, &thread->probes[i]);
+                c_assert(!r);
+        }
+
+        n_acd_probe_config_free(probe_config);
+
+        for (size_t i = 0; i < TEST_SUBMIT_N_PROBES; ++i) {
+                while ((event = atomic_load(&thread->probes[i].event)) == _N_ACD_EVENT_N)
+                        sched_yield();
+
+                if (i % 2) {
+                        c_assert(event == N_ACD_EVENT_USED);
+                } else {
+                        c_assert(event == N_ACD_EVENT_READY);
+                        r = n_acd_submit_probe_announce(thread->probes[i].probe, _N_ACD_DEFEND_N);
+                        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+                        r = n_acd_submit_probe_announce(thread->probes[i].probe, N_ACD_DEFEND_NEVER);
+                        c_assert(!r);
+                }
+        }
+
+        for (size_t i = 0; i < TEST_SUBMIT_N_PROBES; ++i)
+                thread->probes[i].probe = n_acd_submit_probe_free(thread->probes[i].probe);
+
+        atomic_fetch_add(&test_submit_n_done, 1);
+        return NULL;
+}
+
+static void test_submit(int ifindex, struct ether_addr *mac) {
+        TestSubmitThread threads[TEST_SUBMIT_N_THREADS];
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        NAcdProbe *probe;
+        NAcd *acd;
+        int r, fd;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+        /* half of the probes conflict, by design, do not rate-limit them */
+        n_acd_config_set_rate_limit(config, 0);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        r = n_acd_submit_probe(acd, &probe, probe_config, NULL);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        n_acd_probe_config_free(probe_config);
+
+        for (size_t i = 0; i < TEST_SUBMIT_N_THREADS; ++i) {
+                for (size_t j = 1; j < TEST_SUBMIT_N_PROBES; j += 2) {
+                        struct in_addr ip = test_submit_ip(i, j);
+
+                        test_add_child_ip(&ip);
+                }
+        }
+
+        for (size_t i = 0; i < TEST_SUBMIT_N_THREADS; ++i) {
+                threads[i] = (TestSubmitThread){
+                        .acd = acd,
+                        .index = i,
+                };
+
+                r = pthread_create(&threads[i].thread, NULL, test_submit_thread, &threads[i]);
+                c_assert(!r);
+        }
+
+        n_acd_get_fd(acd, &fd);
+
+        while (atomic_load(&test_submit_n_done) < TEST_SUBMIT_N_THREADS || acd->n_probes) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+                TestSubmitProbe *submit_probe;
+                NAcdEvent *event;
+
+                r = poll(&pfd, 1, 100);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r || r == N_ACD_E_PREEMPTED);
+
+                for (;;) {
+                        r = n_acd_pop_event(acd, &event);
+                        c_assert(!r);
+                        if (!event)
+                                break;
+
+                        c_assert(event->event == N_ACD_EVENT_READY || event->event == N_ACD_EVENT_USED);
+
+                        n_acd_probe_get_userdata(event->ready.probe, (void **)&submit_probe);
+                        c_assert(atomic_load(&submit_probe->event) == _N_ACD_EVENT_N);
+                        atomic_store(&submit_probe->event, event->event);
+                }
+        }
+
+        for (size_t i = 0; i < TEST_SUBMIT_N_THREADS; ++i) {
+                r = pthread_join(threads[i].thread, NULL);
+                c_assert(!r);
+        }
+
+        n_acd_unref(acd);
+
+        /* in reverse, so the secondary addresses go before the primary */
+        for (size_t i = TEST_SUBMIT_N_THREADS; i-- > 0; ) {
+                for (size_t j = TEST_SUBMIT_N_PROBES; j-- > 0; ) {
+                        struct in_addr ip = test_submit_ip(i, j);
+
+                        if (j % 2)
+                                test_del_child_ip(&ip);
+                }
+        }
+}
+
+static void test_submit_failed(struct ether_addr *mac) {
+        NAcdProbeConfig *probe_config;
+        NAcdProbe *probes[2];
+        NAcdConfig *config;
+        NAcdEvent *event;
+        size_t n_failed = 0;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        /* a lazy context only fails to open its socket with the first probe */
+        n_acd_config_set_ifindex(config, 0x7fffffff);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+        n_acd_config_set_lazy(config, true);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, test_submit_ip(0, 0));
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(probes); ++i) {
+                r = n_acd_submit_probe(acd, &probes[i], probe_config, NULL);
+                c_assert(!r);
+        }
+
+        n_acd_probe_config_free(probe_config);
+
+        /* announcing a failed probe must be a no-op */
+        r = n_acd_submit_probe_announce(probes[0], N_ACD_DEFEND_NEVER);
+        c_assert(!r);
+
+        r = n_acd_dispatch(acd);
+        c_assert(!r);
+
+        for (;;) {
+                r = n_acd_pop_event(acd, &event);
+                c_assert(!r);
+                if (!event)
+                        break;
+
+                c_assert(event->event == N_ACD_EVENT_FAILED);
+                c_assert(event->failed.probe == probes[n_failed]);
+                c_assert(event->failed.error < 0);
+                ++n_failed;
+        }
+
+        c_assert(n_failed == C_ARRAY_SIZE(probes));
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(probes); ++i)
+                n_acd_probe_free(probes[i]);
+
+        c_assert(!acd->n_probes);
+        n_acd_unref(acd);
+}
+
+static void test_submit_teardown(int ifindex, struct ether_addr *mac) {
+        NAcdProbeConfig *probe_config;
+        NAcdProbe *probes[2];
+        NAcdConfig *config;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, test_submit_ip(0, 0));
+
+        /* the first probe is started, the second one never is */
+        r = n_acd_submit_probe(acd, &probes[0], probe_config, NULL);
+        c_assert(!r);
+
+        r = n_acd_dispatch(acd);
+        c_assert(!r);
+        c_assert(acd->n_probes == 1);
+
+        r = n_acd_submit_probe(acd, &probes[1], probe_config, NULL);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        /* submitted destructions release the context right away */
+        c_assert(atomic_load(&acd->n_refs) == 3);
+        n_acd_submit_probe_free(probes[0]);
+        n_acd_submit_probe_free(probes[1]);
+        c_assert(atomic_load(&acd->n_refs) == 1);
+
+        /* the teardown frees both probes, without ever dispatching */
+        n_acd_unref(acd);
+}
+
+static void test_submit_lazy(int ifindex, struct ether_addr *mac) {
+        NAcdTiming timing = N_ACD_TIMING_FAST_LAN;
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        NAcdProbe *probe;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+        n_acd_config_set_lazy(config, true);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        timing.probe_wait_nsecs = UINT64_C(50000000);
+        n_acd_probe_config_set_ip(probe_config, test_submit_ip(0, 0));
+        n_acd_probe_config_set_timing(probe_config, &timing);
+
+        for (size_t i = 0; i < 2; ++i) {
+                r = n_acd_submit_probe(acd, &probe, probe_config, NULL);
+                c_assert(!r);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+                c_assert(acd->n_probes == 1);
+                c_assert(acd->fd_socket >= 0);
+
+                /*
+                 * Let the timer of the probe expire after its free was
+                 * submitted, so both are dispatched in the same batch, and
+                 * the timer comes after the free.
+                 */
+                n_acd_submit_probe_free(probe);
+                usleep(2 * timing.probe_wait_nsecs / 1000);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+                c_assert(!acd->n_probes);
+                c_assert(acd->fd_socket < 0);
+        }
+
+        n_acd_probe_config_free(probe_config);
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_submit(ifindex1, &mac1);
+        test_submit_failed(&mac1);
+        test_submit_teardown(ifindex1, &mac1);
+        test_submit_lazy(ifindex1, &mac1);
+
+        return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Test tentative notifications
+ *
+ * Run a context on one end of a veth link, and probe addresses that ask to
+ * be reported as tentative. A free address must be reported as tentative
+ * right after its first probe, well before it is ready. A used address must
+ * still be reported as used afterwards. Probes that did not ask for it must
+ * not be reported as tentative.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <stdlib.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+static NAcdProbe *test_tentative_probe(NAcd *acd, struct in_addr ip, const NAcdTiming *timing, bool tentative) {
+        NAcdProbeConfig *probe_config;
+        NAcdProbe *probe;
+        int r;
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timing(probe_config, timing);
+        n_acd_probe_config_set_tentative(probe_config, tentative);
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        return probe;
+}
+
+static void test_tentative(int ifindex, struct ether_addr *mac) {
+        struct in_addr ip = { htobe32((10 << 24) | (14 << 8) | 1) };
+        NAcdTiming timing = N_ACD_TIMING_FAST_LAN;
+        uint64_t ts_tentative, ts_ready;
+        NAcdConfig *config;
+        NAcdProbe *probe;
+        NAcdEvent *event;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        /* a free address is tentative after the first probe, then ready */
+        probe = test_tentative_probe(acd, ip, &timing, true);
+
+        event = test_wait_event(acd);
+        c_assert(event->event == N_ACD_EVENT_TENTATIVE);
+        c_assert(event->tentative.probe == probe);
+        ts_tentative = test_now();
+
+        event = test_wait_event(acd);
+        c_assert(event->event == N_ACD_EVENT_READY);
+        ts_ready = test_now();
+
+        /* the remaining probes and ANNOUNCE_WAIT passed in between */
+        c_assert(ts_ready - ts_tentative >= (timing.n_probes - 1) * timing.probe_min_nsecs + timing.announce_wait_nsecs);
+
+        n_acd_probe_free(probe);
+
+        /* a used address is tentative, until the owner answers */
+        test_add_child_ip(&ip);
+
+        probe = test_tentative_probe(acd, ip, &timing, true);
+
+        event = test_wait_event(acd);
+        c_assert(event->event == N_ACD_EVENT_TENTATIVE);
+
+        event = test_wait_event(acd);
+        c_assert(event->event == N_ACD_EVENT_USED);
+
+        n_acd_probe_free(probe);
+
+        test_del_child_ip(&ip);
+
+        /* nothing is tentative, unless asked for */
+        probe = test_tentative_probe(acd, ip, &timing, false);
+
+        event = test_wait_event(acd);
+        c_assert(event->event == N_ACD_EVENT_READY);
+
+        n_acd_probe_free(probe);
+
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_tentative(ifindex1, &mac1);
+
+        return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Test the conflict rate-limit
+ *
+ * Run a context on one end of a veth link, and probe an address configured
+ * on the other end until the context hits the rate-limit. It must report that
+ * once, and from then on start at most one probe per rate-limit interval. Once
+ * the conflicts are older than the interval, the rate-limit must be lifted.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <stdlib.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+#define TEST_THROTTLE_INTERVAL (500)
+#define TEST_THROTTLE_TIMEOUT (10)
+
+static NAcdProbe *test_throttle_probe(NAcd *acd, struct in_addr ip) {
+        NAcdProbeConfig *probe_config;
+        NAcdProbe *probe;
+        int r;
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, TEST_THROTTLE_TIMEOUT);
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        return probe;
+}
+
+static NAcdEvent *test_throttle_wait(NAcd *acd, size_t *n_throttledp) {
+        NAcdEvent *event;
+
+        while ((event = test_wait_event(acd))->event == N_ACD_EVENT_THROTTLED) {
+                c_assert(event->throttled.n_conflicts == N_ACD_RFC_MAX_CONFLICTS);
+                ++*n_throttledp;
+        }
+
+        return event;
+}
+
+static void test_throttle(int ifindex, struct ether_addr *mac) {
+        struct in_addr ip_used = { htobe32((10 << 24) | (8 << 8) | 1) };
+        struct in_addr ip1 = { htobe32((10 << 24) | (8 << 8) | 2) };
+        struct in_addr ip2 = { htobe32((10 << 24) | (8 << 8) | 3) };
+        uint64_t ts, ts1 = 0, ts2 = 0, n_conflicts, n_delayed;
+        NAcdProbe *probe, *probe1, *probe2;
+        size_t n_throttled = 0;
+        NAcdConfig *config;
+        NAcdEvent *event;
+        bool active;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+        n_acd_config_set_rate_limit(config, TEST_THROTTLE_INTERVAL);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        /* retry a used address in a tight loop, until the limit is hit */
+        test_add_child_ip(&ip_used);
+
+        for (size_t i = 0; i < N_ACD_RFC_MAX_CONFLICTS; ++i) {
+                n_acd_get_throttle(acd, &active, &n_conflicts, &n_delayed);
+                c_assert(!active);
+                c_assert(n_conflicts == i);
+
+                probe = test_throttle_probe(acd, ip_used);
+                event = test_throttle_wait(acd, &n_throttled);
+                c_assert(event->event == N_ACD_EVENT_USED);
+                n_acd_probe_free(probe);
+        }
+
+        test_del_child_ip(&ip_used);
+
+        /* the event might still be queued */
+        c_assert(!n_acd_pop_event(acd, &event));
+        if (event && event->event == N_ACD_EVENT_THROTTLED)
+                ++n_throttled;
+
+        c_assert(n_throttled == 1);
+
+        n_acd_get_throttle(acd, &active, &n_conflicts, &n_delayed);
+        c_assert(active);
+        c_assert(n_conflicts == N_ACD_RFC_MAX_CONFLICTS);
+        c_assert(!n_delayed);
+
+        /* the first new probe starts right away, the second one is delayed */
+        ts = test_now();
+        probe1 = test_throttle_probe(acd, ip1);
+        probe2 = test_throttle_probe(acd, ip2);
+
+        while (!ts1 || !ts2) {
+                event = test_throttle_wait(acd, &n_throttled);
+                c_assert(event->event == N_ACD_EVENT_READY);
+
+                if (event->ready.probe == probe1)
+                        ts1 = test_now() - ts;
+                else if (event->ready.probe == probe2)
+                        ts2 = test_now() - ts;
+        }
+
+        c_assert(ts1 < TEST_THROTTLE_INTERVAL * UINT64_C(1000000));
+        c_assert(ts2 >= TEST_THROTTLE_INTERVAL * UINT64_C(1000000));
+
+        n_acd_get_throttle(acd, &active, &n_conflicts, &n_delayed);
+        c_assert(n_delayed == 1);
+        c_assert(n_throttled == 1);
+
+        n_acd_probe_free(probe2);
+        n_acd_probe_free(probe1);
+
+        /* the conflicts are older than the interval by now */
+        n_acd_get_throttle(acd, &active, &n_conflicts, &n_delayed);
+        c_assert(!active);
+
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_throttle(ifindex1, &mac1);
+
+        return 0;
+}
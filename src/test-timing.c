@@ -0,0 +1,208 @@
+/*
+ * Test probe timing profiles
+ *
+ * Run a context on one end of a veth link, and probe and announce an address
+ * with a timing profile. The whole sequence must follow the profile, rather
+ * than the spec, and finish within a fraction of the spec-mandated time. A
+ * used address must still be detected, and an inconsistent profile must be
+ * refused. The announcements are counted on the other end of the link.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <linux/if_packet.h>
+#include <netinet/if_ether.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-acd.h"
+#include "test.h"
+
+/* scheduling latency we tolerate on top of the profile */
+#define TEST_TIMING_SLACK (UINT64_C(100000000))
+
+static int test_timing_listen(int ifindex) {
+        int r, fd;
+
+        fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, htobe16(ETH_P_ARP));
+        c_assert(fd >= 0);
+
+        r = bind(fd,
+                 (struct sockaddr *)&(struct sockaddr_ll){
+                        .sll_family = AF_PACKET,
+                        .sll_protocol = htobe16(ETH_P_ARP),
+                        .sll_ifindex = ifindex,
+                 },
+                 sizeof(struct sockaddr_ll));
+        c_assert(!r);
+
+        return fd;
+}
+
+static unsigned int test_timing_count(int fd, struct in_addr ip) {
+        unsigned int n = 0;
+        struct {
+                struct ether_header eth;
+                struct ether_arp arp;
+        } _c_packed_ frame;
+        ssize_t l;
+
+        while ((l = recv(fd, &frame, sizeof(frame), 0)) >= 0) {
+                if (l == (ssize_t)sizeof(frame) &&
+                    !memcmp(frame.arp.arp_spa, &ip, sizeof(ip)) &&
+                    !memcmp(frame.arp.arp_tpa, &ip, sizeof(ip)))
+                        ++n;
+        }
+        c_assert(errno == EAGAIN);
+
+        return n;
+}
+
+static void test_timing_probe(NAcd *acd, int peer, struct in_addr ip, const NAcdTiming *timing, unsigned int expected) {
+        NAcdProbeConfig *probe_config;
+        NAcdProbe *probe;
+        NAcdEvent *event;
+        uint64_t ts, min, max;
+        unsigned int n = 0;
+        int r, fd;
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timing(probe_config, timing);
+
+        ts = test_now();
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        event = test_wait_event(acd);
+        c_assert(event->event == expected);
+
+        if (expected == N_ACD_EVENT_READY) {
+                /* the initial wait and all probe intervals are jittered */
+                min = (timing->n_probes - 1) * timing->probe_min_nsecs +
+                      timing->announce_wait_nsecs;
+                max = timing->probe_wait_nsecs +
+                      (timing->n_probes - 1) * timing->probe_max_nsecs +
+                      timing->announce_wait_nsecs;
+
+                ts = test_now() - ts;
+                c_assert(ts >= min);
+                c_assert(ts < max + TEST_TIMING_SLACK);
+
+                /* the announcements follow the profile, too */
+                fd = test_timing_listen(peer);
+                ts = test_now();
+
+                r = n_acd_probe_announce(probe, N_ACD_DEFEND_NEVER);
+                c_assert(!r);
+
+                while (n < timing->n_announces) {
+                        struct pollfd pfds[2] = {
+                                { .events = POLLIN },
+                                { .fd = fd, .events = POLLIN },
+                        };
+
+                        n_acd_get_fd(acd, &pfds[0].fd);
+                        r = poll(pfds, 2, -1);
+                        c_assert(r >= 0);
+
+                        r = n_acd_dispatch(acd);
+                        c_assert(!r);
+
+                        n += test_timing_count(fd, ip);
+                }
+
+                ts = test_now() - ts;
+                c_assert(n == timing->n_announces);
+                c_assert(ts >= (timing->n_announces - 1) * timing->announce_interval_nsecs);
+                c_assert(ts < (timing->n_announces - 1) * timing->announce_interval_nsecs + TEST_TIMING_SLACK);
+
+                close(fd);
+        }
+
+        n_acd_probe_free(probe);
+}
+
+static void test_timing(int ifindex, struct ether_addr *mac, int peer) {
+        struct in_addr ip = { htobe32((10 << 24) | (9 << 8) | 1) };
+        NAcdTiming rfc = N_ACD_TIMING_RFC5227;
+        NAcdTiming fast = N_ACD_TIMING_FAST_LAN;
+        NAcdTiming dc = N_ACD_TIMING_DATACENTER;
+        NAcdTiming invalid = N_ACD_TIMING_FAST_LAN;
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        NAcdProbe *probe;
+        NAcd *acd;
+        int r;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac->ether_addr_octet, sizeof(mac->ether_addr_octet));
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        /* the spec preset is the spec, see RFC-5227 section 1.1 */
+        c_assert(rfc.probe_max_nsecs == UINT64_C(2000000000));
+        c_assert(rfc.n_announces == 2);
+
+        /* both presets finish within milliseconds */
+        test_timing_probe(acd, peer, ip, &fast, N_ACD_EVENT_READY);
+        test_timing_probe(acd, peer, ip, &dc, N_ACD_EVENT_READY);
+
+        /* a short profile still detects a used address */
+        test_add_child_ip(&ip);
+        test_timing_probe(acd, peer, ip, &fast, N_ACD_EVENT_USED);
+        test_del_child_ip(&ip);
+
+        /* inconsistent profiles are refused */
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+
+        invalid.probe_min_nsecs = invalid.probe_max_nsecs + 1;
+        n_acd_probe_config_set_timing(probe_config, &invalid);
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        invalid = (NAcdTiming)N_ACD_TIMING_FAST_LAN;
+        invalid.n_announces = 0;
+        n_acd_probe_config_set_timing(probe_config, &invalid);
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(r == N_ACD_E_INVALID_ARGUMENT);
+
+        /* resetting the profile falls back to the timeout */
+        n_acd_probe_config_set_timing(probe_config, NULL);
+        n_acd_probe_config_set_timeout(probe_config, 0);
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+        c_assert(test_wait_event(acd)->event == N_ACD_EVENT_READY);
+        n_acd_probe_free(probe);
+
+        n_acd_probe_config_free(probe_config);
+
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+
+        test_timing(ifindex1, &mac1, ifindex2);
+
+        return 0;
+}
@@ -13,6 +13,8 @@
  *
  * Make sure to keep N fairly high as the protocol is probabilistic, and we also
  * want to verify that resizing the internal maps works correctly.
+ *
+ * Every other run, both contexts share a single filter.
  */
 
 #undef NDEBUG
@@ -29,12 +31,14 @@ typedef enum {
 } TestAcdState;
 
 static void test_veth(int ifindex1, uint8_t *mac1, size_t n_mac1,
-                      int ifindex2, uint8_t *mac2, size_t n_mac2) {
+                      int ifindex2, uint8_t *mac2, size_t n_mac2,
+                      NAcdFilter *filter) {
         NAcdConfig *config;
         NAcd *acd1, *acd2;
         NAcdProbe *probes1[TEST_ACD_N_PROBES];
         NAcdProbe *probes2[TEST_ACD_N_PROBES];
         unsigned long state1, state2;
+        uint64_t n_packets, total_delay, max_delay;
         size_t n_running = 0;
         int r;
 
@@ -42,6 +46,7 @@ static void test_veth(int ifindex1, uint8_t *mac1, size_t n_mac1,
         c_assert(!r);
 
         n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_filter(config, filter);
 
         n_acd_config_set_ifindex(config, ifindex1);
         n_acd_config_set_mac(config, mac1, n_mac1);
@@ -138,6 +143,7 @@ static void test_veth(int ifindex1, uint8_t *mac1, size_t n_mac1,
 
                                                         break;
                                                 case N_ACD_EVENT_USED:
+                                                        c_assert(event->used.timestamp);
                                                         n_acd_probe_get_userdata(event->used.probe, (void**)&state1);
                                                         c_assert(state1 == TEST_ACD_STATE_UNKNOWN);
                                                         state1 = TEST_ACD_STATE_USED;
@@ -172,6 +178,7 @@ static void test_veth(int ifindex1, uint8_t *mac1, size_t n_mac1,
 
                                                         break;
                                                 case N_ACD_EVENT_USED:
+                                                        c_assert(event->used.timestamp);
                                                         n_acd_probe_get_userdata(event->used.probe, (void**)&state2);
                                                         c_assert(state2 == TEST_ACD_STATE_UNKNOWN);
                                                         state2 = TEST_ACD_STATE_USED;
@@ -218,6 +225,11 @@ static void test_veth(int ifindex1, uint8_t *mac1, size_t n_mac1,
                         }
                         n_acd_probe_free(probes1[i]);
                 }
+
+                /* every conflict was detected via a received packet */
+                n_acd_get_queue_delay(acd1, &n_packets, &total_delay, &max_delay);
+                c_assert(n_packets > 0);
+                c_assert(max_delay <= total_delay);
         }
 
         n_acd_unref(acd2);
@@ -226,15 +238,22 @@ static void test_veth(int ifindex1, uint8_t *mac1, size_t n_mac1,
 
 int main(int argc, char **argv) {
         struct ether_addr mac1, mac2;
-        int ifindex1, ifindex2;
+        int r, ifindex1, ifindex2;
+        NAcdFilter *filter;
 
         test_setup();
 
+        r = n_acd_filter_new(&filter, NULL);
+        c_assert(!r);
+
         test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
         for (unsigned int i = 0; i < 8; ++i) {
                 test_veth(ifindex1, mac1.ether_addr_octet, sizeof(mac1.ether_addr_octet),
-                          ifindex2, mac2.ether_addr_octet, sizeof(mac2.ether_addr_octet));
+                          ifindex2, mac2.ether_addr_octet, sizeof(mac2.ether_addr_octet),
+                          (i % 2) ? filter : NULL);
         }
 
+        n_acd_filter_unref(filter);
+
         return 0;
 }
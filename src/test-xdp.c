@@ -0,0 +1,286 @@
+/*
+ * Test the XDP defender
+ *
+ * Run an ACD context with the XDP defender in generic mode on one end of a veth
+ * link, and announce an address with N_ACD_DEFEND_ALWAYS. Then inject
+ * conflicting packets from the other end of the link.
+ *
+ * The first conflict must be answered by the XDP program. We verify this by
+ * padding the conflicting frame with a marker: the XDP program rewrites the
+ * frame in place, so the defense carries the marker, unlike any packet sent by
+ * the context itself. The second conflict is rate-limited, and must not be
+ * answered. Either way, N_ACD_EVENT_DEFENDED must be raised.
+ *
+ * Then run a probe with the AF_XDP socket enabled, and make the packet socket
+ * drop everything. A conflicting packet must still be seen by the probe.
+ */
+
+#undef NDEBUG
+#include <c-stdaux.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <netinet/if_ether.h>
+#include <stdlib.h>
+#include "n-acd.h"
+#include "n-acd-private.h"
+#include "test.h"
+
+#define TEST_XDP_MARKER (0xa5)
+
+typedef struct TestXdpFrame {
+        struct ether_header eth;
+        struct ether_arp arp;
+        uint8_t padding[18];
+} _c_packed_ TestXdpFrame;
+
+static int test_xdp_wait_event(NAcd *acd, int timeout) {
+        NAcdEvent *event;
+        struct pollfd pfd;
+        int r, fd;
+
+        n_acd_get_fd(acd, &fd);
+
+        for (;;) {
+                pfd = (struct pollfd){ .fd = fd, .events = POLLIN };
+                r = poll(&pfd, 1, timeout);
+                c_assert(r >= 0);
+                if (!r)
+                        return -1;
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r || r == N_ACD_E_PREEMPTED);
+
+                r = n_acd_pop_event(acd, &event);
+                c_assert(!r);
+                if (event)
+                        return event->event;
+        }
+}
+
+static bool test_xdp_recv(int fd, TestXdpFrame *frame, size_t *n_framep, int timeout) {
+        struct sockaddr_ll sa;
+        socklen_t n_sa;
+        struct pollfd pfd;
+        ssize_t l;
+        int r;
+
+        /* skip our own outgoing packets */
+        do {
+                pfd = (struct pollfd){ .fd = fd, .events = POLLIN };
+                r = poll(&pfd, 1, timeout);
+                c_assert(r >= 0);
+                if (!r)
+                        return false;
+
+                n_sa = sizeof(sa);
+                l = recvfrom(fd, frame, sizeof(*frame), 0, (struct sockaddr *)&sa, &n_sa);
+                c_assert(l >= 0);
+        } while (sa.sll_pkttype == PACKET_OUTGOING);
+
+        *n_framep = l;
+        return true;
+}
+
+static int test_xdp_socket_new(int ifindex) {
+        int r, fd;
+
+        fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htobe16(ETH_P_ARP));
+        c_assert(fd >= 0);
+
+        r = bind(fd,
+                 (struct sockaddr *)&(struct sockaddr_ll){
+                        .sll_family = AF_PACKET,
+                        .sll_protocol = htobe16(ETH_P_ARP),
+                        .sll_ifindex = ifindex,
+                 },
+                 sizeof(struct sockaddr_ll));
+        c_assert(!r);
+
+        return fd;
+}
+
+static void test_xdp_frame(TestXdpFrame *frame, struct ether_addr *sha, struct in_addr *ip) {
+        *frame = (TestXdpFrame){
+                .eth = {
+                        .ether_dhost = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+                        .ether_type = htobe16(ETHERTYPE_ARP),
+                },
+                .arp = {
+                        .ea_hdr = {
+                                .ar_hrd = htobe16(ARPHRD_ETHER),
+                                .ar_pro = htobe16(ETHERTYPE_IP),
+                                .ar_hln = ETH_ALEN,
+                                .ar_pln = sizeof(struct in_addr),
+                                .ar_op = htobe16(ARPOP_REPLY),
+                        },
+                },
+        };
+        memset(frame->padding, TEST_XDP_MARKER, sizeof(frame->padding));
+        memcpy(frame->eth.ether_shost, sha->ether_addr_octet, ETH_ALEN);
+        memcpy(frame->arp.arp_sha, sha->ether_addr_octet, ETH_ALEN);
+        memcpy(frame->arp.arp_spa, ip, sizeof(*ip));
+        memcpy(frame->arp.arp_tpa, ip, sizeof(*ip));
+}
+
+static void test_xdp(int ifindex1, struct ether_addr *mac1, int ifindex2, struct ether_addr *mac2) {
+        struct in_addr ip = { htobe32((10 << 24) | 1) };
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        NAcdProbe *probe;
+        NAcd *acd;
+        TestXdpFrame frame;
+        size_t n_frame;
+        int r, fd;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex1);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac1->ether_addr_octet, sizeof(mac1->ether_addr_octet));
+        n_acd_config_set_xdp(config, N_ACD_XDP_GENERIC);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        if (acd->fd_xdp_link < 0) {
+                fprintf(stderr, "XDP not supported, skipping\n");
+                n_acd_unref(acd);
+                return;
+        }
+
+        fd = test_xdp_socket_new(ifindex2);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, 0);
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        r = test_xdp_wait_event(acd, -1);
+        c_assert(r == N_ACD_EVENT_READY);
+
+        r = n_acd_probe_announce(probe, N_ACD_DEFEND_ALWAYS);
+        c_assert(!r);
+
+        /* let the announcements go out, and drop them */
+        r = test_xdp_wait_event(acd, 100);
+        c_assert(r == -1);
+        while (test_xdp_recv(fd, &frame, &n_frame, 0))
+                ;
+
+        test_xdp_frame(&frame, mac2, &ip);
+
+        for (unsigned int i = 0; i < 2; ++i) {
+                TestXdpFrame defense;
+                NAcdEvent *event;
+
+                r = send(fd, &frame, sizeof(frame), 0);
+                c_assert(r == (ssize_t)sizeof(frame));
+
+                r = test_xdp_wait_event(acd, -1);
+                c_assert(r == N_ACD_EVENT_DEFENDED);
+
+                if (!i) {
+                        /* the conflict is turned into a defense in-place */
+                        c_assert(test_xdp_recv(fd, &defense, &n_frame, -1));
+                        c_assert(n_frame == sizeof(defense));
+                        c_assert(!memcmp(defense.eth.ether_shost, mac1->ether_addr_octet, ETH_ALEN));
+                        c_assert(!memcmp(defense.arp.arp_sha, mac1->ether_addr_octet, ETH_ALEN));
+                        c_assert(!memcmp(defense.arp.arp_spa, &ip, sizeof(ip)));
+                        c_assert(!memcmp(defense.arp.arp_tpa, &ip, sizeof(ip)));
+                        c_assert(defense.arp.ea_hdr.ar_op == htobe16(ARPOP_REQUEST));
+                        c_assert(defense.padding[sizeof(defense.padding) - 1] == TEST_XDP_MARKER);
+                } else {
+                        /* the second conflict is rate-limited */
+                        c_assert(!test_xdp_recv(fd, &defense, &n_frame, 100));
+                }
+
+                r = n_acd_pop_event(acd, &event);
+                c_assert(!r && !event);
+        }
+
+        n_acd_probe_free(probe);
+        close(fd);
+        n_acd_unref(acd);
+}
+
+static void test_xdp_socket(int ifindex1, struct ether_addr *mac1, int ifindex2, struct ether_addr *mac2) {
+        struct in_addr ip = { htobe32((10 << 24) | 2) };
+        struct sock_filter drop[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+        struct sock_fprog fprog = { .len = C_ARRAY_SIZE(drop), .filter = drop };
+        NAcdProbeConfig *probe_config;
+        NAcdConfig *config;
+        NAcdProbe *probe;
+        NAcd *acd;
+        TestXdpFrame frame;
+        int r, fd;
+
+        r = n_acd_config_new(&config);
+        c_assert(!r);
+
+        n_acd_config_set_ifindex(config, ifindex1);
+        n_acd_config_set_transport(config, N_ACD_TRANSPORT_ETHERNET);
+        n_acd_config_set_mac(config, mac1->ether_addr_octet, sizeof(mac1->ether_addr_octet));
+        n_acd_config_set_xdp(config, N_ACD_XDP_GENERIC);
+        n_acd_config_set_xdp_socket(config, true);
+
+        r = n_acd_new(&acd, config);
+        c_assert(!r);
+
+        n_acd_config_free(config);
+
+        if (acd->xsk.fd < 0) {
+                fprintf(stderr, "AF_XDP not supported, skipping\n");
+                n_acd_unref(acd);
+                return;
+        }
+
+        fd = test_xdp_socket_new(ifindex2);
+
+        r = n_acd_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_set_ip(probe_config, ip);
+        n_acd_probe_config_set_timeout(probe_config, 1024);
+
+        r = n_acd_probe(acd, &probe, probe_config);
+        c_assert(!r);
+
+        n_acd_probe_config_free(probe_config);
+
+        /* the packet socket no longer sees anything, only the AF_XDP socket does */
+        r = setsockopt(acd->fd_socket, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+        c_assert(!r);
+
+        test_xdp_frame(&frame, mac2, &ip);
+        r = send(fd, &frame, sizeof(frame), 0);
+        c_assert(r == (ssize_t)sizeof(frame));
+
+        r = test_xdp_wait_event(acd, -1);
+        c_assert(r == N_ACD_EVENT_USED);
+
+        n_acd_probe_free(probe);
+        close(fd);
+        n_acd_unref(acd);
+}
+
+int main(int argc, char **argv) {
+        struct ether_addr mac1, mac2;
+        int ifindex1, ifindex2;
+
+        test_setup();
+
+        test_veth_new(&ifindex1, &mac1, &ifindex2, &mac2);
+        test_xdp(ifindex1, &mac1, ifindex2, &mac2);
+        test_xdp_socket(ifindex1, &mac1, ifindex2, &mac2);
+
+        return 0;
+}
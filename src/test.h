@@ -28,9 +28,43 @@
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "n-acd.h"
 
+static inline uint64_t test_now(void) {
+        struct timespec ts;
+        int r;
+
+        r = clock_gettime(CLOCK_MONOTONIC, &ts);
+        c_assert(r >= 0);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static inline NAcdEvent *test_wait_event(NAcd *acd) {
+        NAcdEvent *event = NULL;
+        int r, fd;
+
+        n_acd_get_fd(acd, &fd);
+
+        for (;;) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+                r = n_acd_pop_event(acd, &event);
+                c_assert(!r);
+
+                if (event)
+                        return event;
+
+                r = poll(&pfd, 1, -1);
+                c_assert(r >= 0);
+
+                r = n_acd_dispatch(acd);
+                c_assert(!r);
+        }
+}
+
 static inline void test_add_child_ip(const struct in_addr *addr) {
         char *p;
         int r;
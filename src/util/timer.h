@@ -27,6 +27,7 @@ struct Timer {
 
 #define TIMER_NULL(_x) {                                                        \
                 .fd = -1,                                                       \
+                .clock = CLOCK_BOOTTIME,                                        \
                 .tree = C_RBTREE_INIT,                                          \
         }
 